@@ -120,8 +120,20 @@ typedef struct Strings_ {
 Nodes         nodes(IrArena*, size_t count, const Node*[]);
 Strings     strings(IrArena*, size_t count, const char*[]);
 
+/// Copies and re-interns the whole list: building a list of n nodes with it costs O(n^2) and leaves every intermediate
+/// list in the arena. Fine for one-off additions, use a NodesBuilder in loops: past 64 nodes it warns, once per arena.
 Nodes append_nodes(IrArena*, Nodes, const Node*);
 
+/// Accumulates nodes in scratch memory and interns the list only once, when finished.
+typedef struct NodesBuilder_ NodesBuilder;
+
+NodesBuilder* begin_nodes(IrArena*);
+void add_node(NodesBuilder*, const Node*);
+void add_nodes(NodesBuilder*, Nodes);
+size_t nodes_builder_count(NodesBuilder*);
+/// Interns the accumulated list in the arena and frees the builder
+Nodes finish_nodes(NodesBuilder*);
+
 String string_sized(IrArena* arena, size_t size, const char* start);
 String string(IrArena* arena, const char* start);
 String format_string(IrArena* arena, const char* str, ...);
@@ -299,9 +311,11 @@ PRIMOP(0, rshift)                   \
 PRIMOP(1, assign)                   \
 PRIMOP(1, subscript)                \
 PRIMOP(1, alloca)                   \
+PRIMOP(1, alloca_logical)           \
 PRIMOP(0, load)                     \
 PRIMOP(1, store)                    \
 PRIMOP(0, lea)                      \
+PRIMOP(0, extract)                  \
 PRIMOP(0, select)                   \
 PRIMOP(0, convert)                  \
 PRIMOP(0, reinterpret)              \
@@ -565,19 +579,63 @@ typedef struct {
 IrArena* new_arena(ArenaConfig);
 void destroy_arena(IrArena*);
 
+/// How the tail-call dispatcher picks which of the diverged threads run next
+typedef enum {
+    /// waiting threads take turns, starting after the ones picked last time
+    SchedulerRoundRobin,
+    /// the lowest function ID first, IDs follow the control flow so that is the code furthest away from reconverging
+    SchedulerMinFnId,
+    /// threads parked on a join first, so the others don't run ahead of the point they are meant to meet at
+    SchedulerJoinPriority,
+} SchedulingPolicy;
+
 typedef struct CompilerConfig_ {
+    /// Functions whose jumps are all uniform are turned into a loop over a match on the next basic block, see lower_jumps_loop
     bool use_loop_for_fn_body;
     bool use_loop_for_fn_calls;
+    /// Threads used to emit function bodies, 0 means one per available core. The output does not depend on it.
+    size_t emission_threads;
+    /// emit_spirv writes each function as soon as it is emitted, on a single thread, to keep memory use down on huge modules.
+    /// Names of the values inside functions are not kept in that mode.
+    bool streaming_emission;
+    /// opt_inline pastes functions up to that size (in instructions) at their callsites, functions called from a single place are always inlined
+    size_t inlining_threshold;
+    /// Threads in a subgroup on the target, a power of two up to 64. Masks are lowered to integers just wide enough to hold one bit per thread.
+    uint32_t subgroup_size;
+    SchedulingPolicy scheduling_policy;
+    /// The tail-call dispatcher switches on a cluster of neighbouring function IDs first and then on the function, so it takes
+    /// about the square root of the function count in comparisons where switches end up as chains of branches
+    bool use_clustered_dispatcher;
+    /// scheduler.shady prepared for this configuration ahead of time, so the programs compiled with it share the work.
+    /// lower_tailcalls prepares it for each program when it is NULL.
+    const struct BuiltinModule_* builtins;
 } CompilerConfig;
 
 CompilerConfig default_compiler_config();
 
 typedef enum CompilationResult_ {
-    CompilationNoError
+    CompilationNoError,
+    /// the source is not valid slim, what was wrong with it has been logged
+    CompilationParseFailed,
+    /// a pass gave up on the program, the arena it was working in is still there to be destroyed
+    CompilationPassFailed,
 } CompilationResult;
 
+/// A SPIR-V module in memory, the words are owned by whoever holds the blob
+typedef struct ShadyBlob_ {
+    uint32_t* words;
+    size_t words_count;
+} ShadyBlob;
+
+void destroy_blob(ShadyBlob*);
+
 CompilationResult run_compiler_passes(CompilerConfig* config, IrArena** arena, const Node** program);
 void emit_spirv(CompilerConfig* config, IrArena*, const Node* root, FILE* output);
+void emit_spirv_to_blob(CompilerConfig* config, IrArena*, const Node* root, ShadyBlob* output);
+
+/// Parses, compiles and emits a slim program held in memory, without touching the filesystem.
+/// src does not need to be zero-terminated. Release the result with destroy_blob.
+CompilationResult shady_compile(const char* src, size_t len, const CompilerConfig* config, ShadyBlob* output);
 void dump_cfg(FILE* file, const Node* root);
 void print_node(const Node* node);
 
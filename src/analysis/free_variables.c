@@ -59,6 +59,13 @@ static void visit_fv(VisitorFV* visitor, const Node* node) {
                 visit_fn_blocks_except_head(&visitor->visitor, node);
             break;
         }
+        // nothing free in there
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case FnAddr_TAG:
+        case Constant_TAG:
+        case GlobalVariable_TAG: break;
         case Block_TAG:
         case Root_TAG: error("should not be reachable")
         default: visit_children(&visitor->visitor, node); break;
@@ -0,0 +1,226 @@
+#include "liveness.h"
+
+#include "../log.h"
+#include "../visit.h"
+#include "../portability.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef uint64_t Word;
+#define WORD_BITS (sizeof(Word) * 8)
+
+typedef struct {
+    Word* uses;
+    Word* defs;
+    Word* live_in;
+} BlockSets;
+
+struct Liveness_ {
+    Scope* scope;
+    /// variable -> dense index
+    struct Dict* indices;
+    /// dense index -> variable
+    struct List* variables;
+    size_t words;
+    /// indexed by rpo_index
+    BlockSets* sets;
+};
+
+typedef struct {
+    Visitor visitor;
+    Liveness* liveness;
+    BlockSets* block;
+} UsesVisitor;
+
+static size_t get_index(Liveness* liveness, const Node* variable) {
+    size_t* found = find_value_dict(const Node*, size_t, liveness->indices, variable);
+    if (found)
+        return *found;
+    size_t index = entries_count_list(liveness->variables);
+    insert_dict(const Node*, size_t, liveness->indices, variable, index);
+    append_list(const Node*, liveness->variables, variable);
+    return index;
+}
+
+static void set_bit(Word* set, size_t i) { set[i / WORD_BITS] |= (Word) 1 << (i % WORD_BITS); }
+static bool get_bit(const Word* set, size_t i) { return (set[i / WORD_BITS] >> (i % WORD_BITS)) & 1; }
+
+/// The numbering is done in a first pass, so the bitsets can be sized once and for all
+static void number_variables(Liveness* liveness, Nodes variables) {
+    for (size_t i = 0; i < variables.count; i++)
+        get_index(liveness, variables.nodes[i]);
+}
+
+static void visit_number(UsesVisitor* visitor, const Node* node) {
+    switch (node->tag) {
+        case Variable_TAG: get_index(visitor->liveness, node); break;
+        case Let_TAG: {
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.let.instruction);
+            number_variables(visitor->liveness, node->payload.let.variables);
+            break;
+        }
+        case Tuple_TAG: {
+            Nodes contents = node->payload.tuple.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                visitor->visitor.visit_fn(&visitor->visitor, contents.nodes[i]);
+            break;
+        }
+        // the visitor only looks at those operands when it also visits control flow targets
+        case Join_TAG: {
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.join.join_at);
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.join.desired_mask);
+            Nodes args = node->payload.join.args;
+            for (size_t i = 0; i < args.count; i++)
+                visitor->visitor.visit_fn(&visitor->visitor, args.nodes[i]);
+            break;
+        }
+        case Callc_TAG: {
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.callc.callee);
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.callc.ret_cont);
+            Nodes args = node->payload.callc.args;
+            for (size_t i = 0; i < args.count; i++)
+                visitor->visitor.visit_fn(&visitor->visitor, args.nodes[i]);
+            break;
+        }
+        case Block_TAG: visit_children(&visitor->visitor, node); break;
+        default:
+            if (is_instruction(node) || is_terminator(node))
+                visit_children(&visitor->visitor, node);
+            break;
+    }
+}
+
+static void visit_uses(UsesVisitor* visitor, const Node* node) {
+    switch (node->tag) {
+        case Variable_TAG: {
+            size_t index = get_index(visitor->liveness, node);
+            // upwards-exposed uses only
+            if (!get_bit(visitor->block->defs, index))
+                set_bit(visitor->block->uses, index);
+            break;
+        }
+        case Let_TAG: {
+            visitor->visitor.visit_fn(&visitor->visitor, node->payload.let.instruction);
+            Nodes outputs = node->payload.let.variables;
+            for (size_t i = 0; i < outputs.count; i++)
+                set_bit(visitor->block->defs, get_index(visitor->liveness, outputs.nodes[i]));
+            break;
+        }
+        // functions and continuations are not looked into, the edges of the scope take care of that
+        default: visit_number(visitor, node); break;
+    }
+}
+
+Liveness* compute_liveness(Scope* scope) {
+    assert(scope->rpo);
+    Liveness* liveness = malloc(sizeof(Liveness));
+    *liveness = (Liveness) {
+        .scope = scope,
+        .indices = new_dict(const Node*, size_t, (HashFn) hash_node, (CmpFn) compare_node),
+        .variables = new_list(const Node*),
+    };
+
+    UsesVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_number,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = false,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .liveness = liveness,
+    };
+
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* fn = scope->rpo[i]->node;
+        number_variables(liveness, fn->payload.fn.params);
+        visit_number(&visitor, fn->payload.fn.block);
+    }
+
+    size_t words = (entries_count_list(liveness->variables) + WORD_BITS - 1) / WORD_BITS;
+    liveness->words = words;
+    liveness->sets = calloc(scope->size, sizeof(BlockSets));
+    // one allocation for all of the sets
+    Word* storage = calloc(scope->size * 3 * words + 1, sizeof(Word));
+    for (size_t i = 0; i < scope->size; i++) {
+        liveness->sets[i].uses = storage + (i * 3 + 0) * words;
+        liveness->sets[i].defs = storage + (i * 3 + 1) * words;
+        liveness->sets[i].live_in = storage + (i * 3 + 2) * words;
+    }
+
+    visitor.visitor.visit_fn = (VisitFn) visit_uses;
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* fn = scope->rpo[i]->node;
+        visitor.block = &liveness->sets[i];
+        Nodes params = fn->payload.fn.params;
+        for (size_t j = 0; j < params.count; j++)
+            set_bit(visitor.block->defs, get_index(liveness, params.nodes[j]));
+        visit_uses(&visitor, fn->payload.fn.block);
+    }
+
+    // live_in = uses | (union of the successors' live_in & ~defs), iterating in post-order converges quickly
+    LARRAY(Word, live_out, words + 1);
+    bool changed = true;
+    size_t iterations = 0;
+    while (changed) {
+        changed = false;
+        for (size_t i = scope->size - 1; i < scope->size; i--) {
+            CFNode* cf_node = scope->rpo[i];
+            BlockSets* sets = &liveness->sets[i];
+            memset(live_out, 0, sizeof(Word) * words);
+            size_t succs_count = entries_count_list(cf_node->succs);
+            for (size_t j = 0; j < succs_count; j++) {
+                CFNode* succ = read_list(CFNode*, cf_node->succs)[j];
+                const Word* succ_live_in = liveness->sets[succ->rpo_index].live_in;
+                for (size_t w = 0; w < words; w++)
+                    live_out[w] |= succ_live_in[w];
+            }
+            for (size_t w = 0; w < words; w++) {
+                Word new_live_in = sets->uses[w] | (live_out[w] & ~sets->defs[w]);
+                if (new_live_in != sets->live_in[w]) {
+                    sets->live_in[w] = new_live_in;
+                    changed = true;
+                }
+            }
+        }
+        iterations++;
+    }
+    debug_print("Liveness of %s: %zu variables, converged after %zu iterations\n", get_decl_name(scope->entry->node), entries_count_list(liveness->variables), iterations);
+
+    return liveness;
+}
+
+void dispose_liveness(Liveness* liveness) {
+    if (liveness->scope->size > 0)
+        free(liveness->sets[0].uses);
+    free(liveness->sets);
+    destroy_dict(liveness->indices);
+    destroy_list(liveness->variables);
+    free(liveness);
+}
+
+struct List* get_live_in(const Liveness* liveness, const CFNode* cf_node) {
+    struct List* live = new_list(const Node*);
+    const Word* live_in = liveness->sets[cf_node->rpo_index].live_in;
+    size_t count = entries_count_list(liveness->variables);
+    for (size_t i = 0; i < count; i++)
+        if (get_bit(live_in, i))
+            append_list(const Node*, live, read_list(const Node*, liveness->variables)[i]);
+    return live;
+}
+
+bool is_live_in(const Liveness* liveness, const CFNode* cf_node, const Node* variable) {
+    size_t* found = find_value_dict(const Node*, size_t, liveness->indices, variable);
+    if (!found)
+        return false;
+    return get_bit(liveness->sets[cf_node->rpo_index].live_in, *found);
+}
@@ -0,0 +1,17 @@
+#ifndef SHADY_LIVENESS_H
+#define SHADY_LIVENESS_H
+
+#include "scope.h"
+
+typedef struct Liveness_ Liveness;
+
+/// Backward dataflow over the nodes of a scope, the variables are numbered densely in the order they are met in RPO
+/// and the sets are bitsets over those numbers.
+Liveness* compute_liveness(Scope*);
+void dispose_liveness(Liveness*);
+
+/// The variables that are needed when entering a node of the scope, not counting its own parameters, in a stable order
+struct List* get_live_in(const Liveness*, const CFNode*);
+bool is_live_in(const Liveness*, const CFNode*, const Node* variable);
+
+#endif
@@ -0,0 +1,107 @@
+#include "looptree.h"
+#include "../log.h"
+
+#include "list.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+static LTNode* new_lt_node(Scope* scope, CFNode* header, LTNode* parent) {
+    LTNode* node = malloc(sizeof(LTNode));
+    *node = (LTNode) {
+        .header = header,
+        .cf_nodes = new_list(CFNode*),
+        .contains = calloc(scope->size, sizeof(bool)),
+        .latches = new_list(CFNode*),
+        .parent = parent,
+        .children = new_list(LTNode*),
+        .depth = parent ? parent->depth + 1 : 0,
+    };
+    if (parent)
+        append_list(LTNode*, parent->children, node);
+    return node;
+}
+
+/// Everything that reaches n without going through the header is in the loop
+static void walk_back(LTNode* loop, CFNode* n) {
+    if (loop->contains[n->rpo_index])
+        return;
+    loop->contains[n->rpo_index] = true;
+    for (size_t i = 0; i < entries_count_list(n->preds); i++)
+        walk_back(loop, read_list(CFNode*, n->preds)[i]);
+}
+
+LoopTree build_loop_tree(Scope* scope) {
+    assert(scope->rpo && "the scope needs to be in RPO");
+    LoopTree tree = {
+        .root = new_lt_node(scope, NULL, NULL),
+        .loops = new_list(LTNode*),
+        .innermost = malloc(sizeof(LTNode*) * scope->size),
+        .scope = scope,
+    };
+    for (size_t i = 0; i < scope->size; i++) {
+        tree.root->contains[i] = true;
+        append_list(CFNode*, tree.root->cf_nodes, scope->rpo[i]);
+        tree.innermost[i] = tree.root;
+    }
+
+    // headers dominate their loops, so going in RPO we meet the outer loops first
+    for (size_t i = 0; i < scope->size; i++) {
+        CFNode* header = scope->rpo[i];
+        LTNode* loop = NULL;
+        for (size_t j = 0; j < entries_count_list(header->preds); j++) {
+            CFNode* pred = read_list(CFNode*, header->preds)[j];
+            if (!dominates(header, pred))
+                continue;
+            if (!loop) {
+                loop = new_lt_node(scope, header, tree.innermost[header->rpo_index]);
+                loop->contains[header->rpo_index] = true;
+            }
+            append_list(CFNode*, loop->latches, pred);
+            walk_back(loop, pred);
+        }
+        if (!loop)
+            continue;
+
+        // natural loops with different headers are either disjoint or nested, so the latest one is the innermost
+        for (size_t j = 0; j < scope->size; j++) {
+            if (!loop->contains[j])
+                continue;
+            append_list(CFNode*, loop->cf_nodes, scope->rpo[j]);
+            tree.innermost[j] = loop;
+        }
+        debug_print("looptree: loop at %s, depth %zu, %zu blocks\n", header->node->payload.fn.name, loop->depth, entries_count_list(loop->cf_nodes));
+        append_list(LTNode*, tree.loops, loop);
+    }
+
+    // innermost first
+    size_t count = entries_count_list(tree.loops);
+    LTNode** loops = read_list(LTNode*, tree.loops);
+    for (size_t i = 0; i < count / 2; i++) {
+        LTNode* tmp = loops[i];
+        loops[i] = loops[count - 1 - i];
+        loops[count - 1 - i] = tmp;
+    }
+
+    return tree;
+}
+
+bool is_in_loop(const LTNode* loop, const CFNode* n) {
+    return loop->contains[n->rpo_index];
+}
+
+static void dispose_lt_node(LTNode* node) {
+    for (size_t i = 0; i < entries_count_list(node->children); i++)
+        dispose_lt_node(read_list(LTNode*, node->children)[i]);
+    destroy_list(node->children);
+    destroy_list(node->cf_nodes);
+    destroy_list(node->latches);
+    free(node->contains);
+    free(node);
+}
+
+void dispose_loop_tree(LoopTree* tree) {
+    dispose_lt_node(tree->root);
+    destroy_list(tree->loops);
+    free(tree->innermost);
+}
@@ -0,0 +1,39 @@
+#ifndef SHADY_LOOPTREE_H
+#define SHADY_LOOPTREE_H
+
+#include "scope.h"
+
+typedef struct LTNode_ LTNode;
+
+/// A natural loop: the header and everything that can get back to it without leaving through it
+struct LTNode_ {
+    /// NULL for the root of the forest, which stands for the whole scope
+    CFNode* header;
+    /// the blocks of this loop, nested loops included, in RPO
+    struct List* cf_nodes;
+    /// same thing, indexed by rpo_index
+    bool* contains;
+    /// the blocks that jump back to the header
+    struct List* latches;
+    LTNode* parent;
+    struct List* children;
+    /// 0 for the root, 1 for outermost loops
+    size_t depth;
+};
+
+typedef struct LoopTree_ {
+    LTNode* root;
+    /// all the loops, innermost ones first
+    struct List* loops;
+    /// innermost loop of each block, indexed by rpo_index
+    LTNode** innermost;
+    Scope* scope;
+} LoopTree;
+
+/// Back-edges are edges to a dominator, irreducible control flow doesn't make loops here
+LoopTree build_loop_tree(Scope*);
+void dispose_loop_tree(LoopTree*);
+
+bool is_in_loop(const LTNode*, const CFNode*);
+
+#endif
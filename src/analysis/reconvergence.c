@@ -0,0 +1,96 @@
+#include "reconvergence.h"
+
+#include "../log.h"
+#include "../portability.h"
+
+#include "list.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+struct Reconvergence_ {
+    Scope* scope;
+    /// indexed by rpo_index
+    bool* divergent_branches;
+    size_t* depths;
+};
+
+static bool is_branch_divergent(const Uniformity* uniformity, const CFNode* cf_node) {
+    // there is nothing to split with only one way out
+    if (entries_count_list(cf_node->succs) < 2)
+        return false;
+    const Node* terminator = cf_node->node->payload.fn.block->payload.block.terminator;
+    if (terminator->tag != Branch_TAG)
+        return false;
+    const Branch* branch = &terminator->payload.branch;
+    switch (branch->branch_mode) {
+        case BrIfElse: return !is_value_uniform(uniformity, branch->branch_condition);
+        case BrSwitch: return !is_value_uniform(uniformity, branch->switch_value);
+        default: return false;
+    }
+}
+
+Reconvergence* compute_reconvergence(Scope* scope, const Uniformity* uniformity) {
+    assert(scope->rpo);
+    compute_post_domtree(scope);
+
+    size_t size = scope->size;
+    Reconvergence* reconvergence = malloc(sizeof(Reconvergence));
+    *reconvergence = (Reconvergence) {
+        .scope = scope,
+        .divergent_branches = calloc(size, sizeof(bool)),
+        .depths = calloc(size, sizeof(size_t)),
+    };
+
+    LARRAY(bool, in_region, size + 1);
+    struct List* queue = new_list(const CFNode*);
+    size_t divergent_count = 0;
+    size_t region_blocks = 0;
+    for (size_t i = 0; i < size; i++) {
+        const CFNode* branch = scope->rpo[i];
+        if (!is_branch_divergent(uniformity, branch))
+            continue;
+        reconvergence->divergent_branches[i] = true;
+        divergent_count++;
+
+        // everything we can get to before going through the reconvergence point runs with only some of the threads
+        for (size_t j = 0; j < size; j++)
+            in_region[j] = false;
+        append_list(const CFNode*, queue, branch);
+        while (entries_count_list(queue) > 0) {
+            const CFNode* cf_node = pop_last_list(const CFNode*, queue);
+            for (size_t j = 0; j < entries_count_list(cf_node->succs); j++) {
+                const CFNode* succ = read_list(const CFNode*, cf_node->succs)[j];
+                if (succ == branch->ipdom || in_region[succ->rpo_index])
+                    continue;
+                in_region[succ->rpo_index] = true;
+                reconvergence->depths[succ->rpo_index]++;
+                region_blocks++;
+                append_list(const CFNode*, queue, succ);
+            }
+        }
+    }
+    destroy_list(queue);
+
+    debug_print("Reconvergence in %s: %zu divergent branches, %zu blocks in their regions\n", get_decl_name(scope->entry->node), divergent_count, region_blocks);
+    return reconvergence;
+}
+
+void dispose_reconvergence(Reconvergence* reconvergence) {
+    free(reconvergence->divergent_branches);
+    free(reconvergence->depths);
+    free(reconvergence);
+}
+
+bool is_divergent_branch(const Reconvergence* reconvergence, const CFNode* cf_node) {
+    return reconvergence->divergent_branches[cf_node->rpo_index];
+}
+
+const CFNode* get_reconvergence_point(const Reconvergence* reconvergence, const CFNode* cf_node) {
+    assert(is_divergent_branch(reconvergence, cf_node));
+    return cf_node->ipdom;
+}
+
+size_t get_divergence_depth(const Reconvergence* reconvergence, const CFNode* cf_node) {
+    return reconvergence->depths[cf_node->rpo_index];
+}
@@ -0,0 +1,25 @@
+#ifndef SHADY_RECONVERGENCE_H
+#define SHADY_RECONVERGENCE_H
+
+#include "scope.h"
+#include "uniformity.h"
+
+typedef struct Reconvergence_ Reconvergence;
+
+/// Threads that took different ways at a divergent branch can all meet again at its immediate post-dominator, the first
+/// block every path out of the branch goes through. The blocks they go through until then are the divergent region of
+/// the branch: joining at the reconvergence point keeps that region as short as it can be.
+/// Computes the post-dominator tree of the scope if that wasn't done yet.
+Reconvergence* compute_reconvergence(Scope*, const Uniformity*);
+void dispose_reconvergence(Reconvergence*);
+
+/// The branch ending this node may send the threads of a subgroup to different places
+bool is_divergent_branch(const Reconvergence*, const CFNode*);
+/// Where the threads are together again after the divergent branch ending this node, NULL when that only happens once
+/// they leave the scope
+const CFNode* get_reconvergence_point(const Reconvergence*, const CFNode*);
+/// How many divergent regions of the scope this node is in, 0 when no branch of the scope can have split the threads
+/// running it
+size_t get_divergence_depth(const Reconvergence*, const CFNode*);
+
+#endif
@@ -1,5 +1,6 @@
 #include "scope.h"
 #include "../log.h"
+#include "../portability.h"
 
 #include "list.h"
 #include "dict.h"
@@ -34,6 +35,8 @@ static CFNode* get_or_create_cf_node(struct List* contents, struct Dict* d, cons
         .rpo_index = SIZE_MAX,
         .idom = NULL,
         .dominates = NULL,
+        .ipdom = NULL,
+        .post_dominates = NULL,
     };
     insert_dict(const Node*, CFNode*, d, n, new);
     append_list(CFNode*, contents, new);
@@ -215,6 +218,103 @@ void compute_domtree(Scope* scope) {
     }
 }
 
+bool dominates(const CFNode* a, const CFNode* b) {
+    // dominators come first in RPO, we can stop walking up once we are past a
+    while (b && b->rpo_index >= a->rpo_index) {
+        if (a == b)
+            return true;
+        b = b->idom;
+    }
+    return false;
+}
+
+/// Post-order over the reversed CFG, indices are given out once all of the predecessors are done
+static void reverse_post_order_visit(CFNode* n, size_t* indices, CFNode** order, size_t* count) {
+    indices[n->rpo_index] = SIZE_MAX - 1;
+
+    for (size_t j = 0; j < entries_count_list(n->preds); j++) {
+        CFNode* pred = read_list(CFNode*, n->preds)[j];
+        if (indices[pred->rpo_index] == SIZE_MAX)
+            reverse_post_order_visit(pred, indices, order, count);
+    }
+
+    indices[n->rpo_index] = *count;
+    order[(*count)++] = n;
+}
+
+void compute_post_domtree(Scope* scope) {
+    // already done
+    if (scope->size > 0 && scope->entry->post_dominates)
+        return;
+
+    size_t size = scope->size;
+    // indexed by rpo_index: where the node is in the post-order of the reversed CFG
+    LARRAY(size_t, indices, size + 1);
+    LARRAY(bool, goes_to_exit, size + 1);
+    // the virtual exit comes last, at index `size`
+    LARRAY(CFNode*, order, size + 1);
+    LARRAY(size_t, ipdoms, size + 1);
+    for (size_t i = 0; i < size; i++) {
+        indices[i] = SIZE_MAX;
+        goes_to_exit[i] = entries_count_list(scope->rpo[i]->succs) == 0;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++)
+        if (goes_to_exit[i] && indices[i] == SIZE_MAX)
+            reverse_post_order_visit(scope->rpo[i], indices, order, &count);
+    // whatever is left can't reach the exit, those loops get an edge to it
+    for (size_t i = size - 1; i < size; i--) {
+        if (indices[i] != SIZE_MAX) continue;
+        goes_to_exit[i] = true;
+        reverse_post_order_visit(scope->rpo[i], indices, order, &count);
+    }
+    assert(count == size);
+
+    for (size_t i = 0; i < size; i++)
+        ipdoms[i] = SIZE_MAX;
+    ipdoms[size] = size;
+
+    bool todo = true;
+    while (todo) {
+        todo = false;
+        for (size_t i = size - 1; i < size; i--) {
+            CFNode* n = order[i];
+            size_t new_ipdom = goes_to_exit[n->rpo_index] ? size : SIZE_MAX;
+            for (size_t j = 0; j < entries_count_list(n->succs); j++) {
+                size_t succ = indices[read_list(CFNode*, n->succs)[j]->rpo_index];
+                if (ipdoms[succ] == SIZE_MAX)
+                    continue;
+                if (new_ipdom == SIZE_MAX) {
+                    new_ipdom = succ;
+                    continue;
+                }
+                // same as least_common_ancestor, but over the post-order indices
+                while (new_ipdom != succ) {
+                    while (new_ipdom < succ) new_ipdom = ipdoms[new_ipdom];
+                    while (succ < new_ipdom) succ = ipdoms[succ];
+                }
+            }
+            assert(new_ipdom != SIZE_MAX);
+            if (ipdoms[i] != new_ipdom) {
+                ipdoms[i] = new_ipdom;
+                todo = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        CFNode* n = order[i];
+        n->ipdom = ipdoms[i] == size ? NULL : order[ipdoms[i]];
+        n->post_dominates = new_list(CFNode*);
+    }
+    for (size_t i = 0; i < size; i++) {
+        CFNode* n = order[i];
+        if (n->ipdom)
+            append_list(CFNode*, n->ipdom->post_dominates, n);
+    }
+}
+
 void dispose_scope(Scope* scope) {
     for (size_t i = 0; i < scope->size; i++) {
         CFNode* node = read_list(CFNode*, scope->contents)[i];
@@ -222,6 +322,8 @@ void dispose_scope(Scope* scope) {
         destroy_list(node->succs);
         if (node->dominates)
             destroy_list(node->dominates);
+        if (node->post_dominates)
+            destroy_list(node->post_dominates);
         free(node);
     }
     free(scope->rpo);
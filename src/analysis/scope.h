@@ -12,6 +12,9 @@ struct CFNode_ {
     // set by compute_domtree
     CFNode* idom;
     struct List* dominates;
+    // set by compute_post_domtree, a NULL ipdom stands for the virtual exit of the scope
+    CFNode* ipdom;
+    struct List* post_dominates;
 };
 
 typedef struct Scope_ {
@@ -27,6 +30,12 @@ Scope build_scope(const Node* entry);
 
 void compute_rpo(Scope* scope);
 void compute_domtree(Scope* scope);
+/// Whether every path from the entry to b goes through a, a dominates itself
+bool dominates(const CFNode* a, const CFNode* b);
+/// Dominators of the reversed CFG. Every node without successors goes to a virtual exit, and so do nodes that can't
+/// reach one (infinite loops), starting from the last ones in RPO. Not done by build_scope, call it when needed, calling
+/// it again does nothing.
+void compute_post_domtree(Scope* scope);
 
 void dispose_scope(Scope*);
 
@@ -0,0 +1,442 @@
+#include "uniformity.h"
+#include "scope.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+struct Uniformity_ {
+    /// values that may differ between threads
+    struct Dict* varying;
+    /// functions and continuations that may run with only part of the subgroup
+    struct Dict* divergent;
+    /// functions that may return different values to different threads
+    struct Dict* varying_returns;
+    /// functions whose threads may return at different times, even when called by the whole subgroup
+    struct Dict* divergent_returns;
+    /// functions whose address is taken: we don't know who calls them, or how
+    struct Dict* escaping;
+    /// results of subgroup_active_mask, and the ones taken while diverged
+    struct Dict* masks;
+    struct Dict* partial_masks;
+    /// structured loops that threads may leave at different iterations
+    struct Dict* divergent_loops;
+
+    bool changed;
+};
+
+/// The structured constructs enclosing a block, innermost first
+typedef struct Construct_ {
+    const Node* instruction;
+    Nodes outputs;
+    /// some control flow since the function entry depends on a varying condition
+    bool diverged;
+    /// same thing, but since the entry of the innermost loop
+    bool loop_diverged;
+    const struct Construct_* parent;
+} Construct;
+
+static const Nodes no_outputs = { .count = 0, .nodes = NULL };
+
+static bool is_in(struct Dict* set, const Node* node) {
+    return find_key_dict(const Node*, set, node) != NULL;
+}
+
+static void add_to(Uniformity* u, struct Dict* set, const Node* node) {
+    if (insert_set_get_result(const Node*, set, node))
+        u->changed = true;
+}
+
+static void mark_varying(Uniformity* u, const Node* var) {
+    assert(var->tag == Variable_TAG);
+    // what the type checker proved to be uniform stays that way
+    if (var->type && get_qualifier(var->type) == Uniform)
+        return;
+    add_to(u, u->varying, var);
+}
+
+static void mark_all_varying(Uniformity* u, Nodes vars) {
+    for (size_t i = 0; i < vars.count; i++)
+        mark_varying(u, vars.nodes[i]);
+}
+
+bool is_value_uniform(const Uniformity* u, const Node* value) {
+    switch (value->tag) {
+        case Variable_TAG: return !is_in(u->varying, value);
+        case Tuple_TAG: {
+            Nodes contents = value->payload.tuple.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                if (!is_value_uniform(u, contents.nodes[i]))
+                    return false;
+            return true;
+        }
+        // literals, constants, global variables and function addresses are the same for everyone
+        default: return true;
+    }
+}
+
+bool is_fn_convergent(const Uniformity* u, const Node* fn) {
+    assert(fn->tag == Function_TAG);
+    return !is_in(u->divergent, fn);
+}
+
+static bool is_per_thread_memory(AddressSpace as) {
+    switch (as) {
+        case AsGeneric:
+        case AsPrivatePhysical:
+        case AsFunctionLogical:
+        case AsPrivateLogical:
+        case AsInput:
+        case AsOutput: return true;
+        default: return false;
+    }
+}
+
+/// Functions used as anything else than the callee of a direct call escape
+static bool are_operands_uniform(Uniformity* u, Nodes operands) {
+    bool uniform = true;
+    for (size_t i = 0; i < operands.count; i++) {
+        const Node* operand = operands.nodes[i];
+        if (!operand)
+            continue;
+        if (operand->tag == FnAddr_TAG)
+            add_to(u, u->escaping, operand->payload.fn_addr.fn);
+        uniform &= is_value_uniform(u, operand);
+    }
+    return uniform;
+}
+
+static const Node* get_direct_callee(const Node* callee) {
+    switch (callee->tag) {
+        case FnAddr_TAG: return callee->payload.fn_addr.fn;
+        case Function_TAG: return callee;
+        default: return NULL;
+    }
+}
+
+static void propagate_args(Uniformity* u, const Node* target, Nodes args, bool merge_is_varying) {
+    assert(target->tag == Function_TAG);
+    Nodes params = target->payload.fn.params;
+    assert(params.count == args.count);
+    for (size_t i = 0; i < params.count; i++)
+        if (merge_is_varying || !is_value_uniform(u, args.nodes[i]))
+            mark_varying(u, params.nodes[i]);
+}
+
+/// Returns whether the results of that call are uniform
+static bool propagate_call(Uniformity* u, const Node* callee, Nodes args, bool divergent) {
+    are_operands_uniform(u, args);
+    const Node* fn = get_direct_callee(callee);
+    if (!fn)
+        return false;
+    propagate_args(u, fn, args, false);
+    if (divergent)
+        add_to(u, u->divergent, fn);
+    return !is_in(u->varying_returns, fn);
+}
+
+static void propagate_jump(Uniformity* u, const Node* target, Nodes args, bool divergent) {
+    propagate_args(u, target, args, false);
+    if (divergent)
+        add_to(u, u->divergent, target);
+}
+
+static const Construct* find_construct(const Construct* construct, NodeTag tag, NodeTag alt_tag) {
+    while (construct && construct->instruction->tag != tag && construct->instruction->tag != alt_tag)
+        construct = construct->parent;
+    assert(construct && "merge outside of a matching construct");
+    return construct;
+}
+
+static void analyse_block(Uniformity* u, const Node* entry, const Node* fn, const Node* block, bool divergent, const Construct* construct);
+
+static Construct enter_selection(const Node* instruction, Nodes outputs, bool uniform, const Construct* parent) {
+    return (Construct) {
+        .instruction = instruction,
+        .outputs = outputs,
+        .diverged = !uniform || (parent && parent->diverged),
+        .loop_diverged = !uniform || (parent && parent->loop_diverged),
+        .parent = parent,
+    };
+}
+
+static void analyse_instruction(Uniformity* u, const Node* entry, const Node* fn, const Node* instruction, Nodes outputs, bool divergent, const Construct* construct) {
+    switch (instruction->tag) {
+        case PrimOp_TAG: {
+            const PrimOp* prim_op = &instruction->payload.prim_op;
+            bool uniform = are_operands_uniform(u, prim_op->operands);
+            switch (prim_op->op) {
+                case subgroup_local_id_op:
+                case subgroup_elect_first_op:
+                case mask_is_thread_active_op:
+                case pop_stack_op: uniform = false; break;
+                case subgroup_broadcast_first_op:
+                case subgroup_ballot_op:
+                case empty_mask_op:
+                case pop_stack_uniform_op: uniform = true; break;
+                case subgroup_active_mask_op: {
+                    uniform = true;
+                    if (outputs.count == 1) {
+                        add_to(u, u->masks, outputs.nodes[0]);
+                        if (divergent)
+                            add_to(u, u->partial_masks, outputs.nodes[0]);
+                    }
+                    break;
+                }
+                case load_op: {
+                    const Type* ptr_type = without_qualifier(prim_op->operands.nodes[0]->type);
+                    assert(ptr_type->tag == PtrType_TAG);
+                    if (is_per_thread_memory(ptr_type->payload.ptr_type.address_space))
+                        uniform = false;
+                    break;
+                }
+                default: break;
+            }
+            if (!uniform)
+                mark_all_varying(u, outputs);
+            break;
+        }
+        case Call_TAG: {
+            if (!propagate_call(u, instruction->payload.call_instr.callee, instruction->payload.call_instr.args, divergent))
+                mark_all_varying(u, outputs);
+            break;
+        }
+        case If_TAG: {
+            const If* if_instr = &instruction->payload.if_instr;
+            bool uniform = is_value_uniform(u, if_instr->condition);
+            if (!uniform)
+                mark_all_varying(u, outputs);
+            Construct c = enter_selection(instruction, outputs, uniform, construct);
+            analyse_block(u, entry, fn, if_instr->if_true, divergent || !uniform, &c);
+            if (if_instr->if_false)
+                analyse_block(u, entry, fn, if_instr->if_false, divergent || !uniform, &c);
+            break;
+        }
+        case Match_TAG: {
+            const Match* match_instr = &instruction->payload.match_instr;
+            bool uniform = is_value_uniform(u, match_instr->inspect);
+            if (!uniform)
+                mark_all_varying(u, outputs);
+            Construct c = enter_selection(instruction, outputs, uniform, construct);
+            for (size_t i = 0; i < match_instr->cases.count; i++)
+                analyse_block(u, entry, fn, match_instr->cases.nodes[i], divergent || !uniform, &c);
+            analyse_block(u, entry, fn, match_instr->default_case, divergent || !uniform, &c);
+            break;
+        }
+        case Loop_TAG: {
+            const Loop* loop_instr = &instruction->payload.loop_instr;
+            // when threads leave at different iterations, the ones left behind see different values
+            bool diverges = is_in(u->divergent_loops, instruction);
+            for (size_t i = 0; i < loop_instr->params.count; i++)
+                if (diverges || !is_value_uniform(u, loop_instr->initial_args.nodes[i]))
+                    mark_varying(u, loop_instr->params.nodes[i]);
+            if (diverges)
+                mark_all_varying(u, outputs);
+            Construct c = {
+                .instruction = instruction,
+                .outputs = outputs,
+                .diverged = diverges || (construct && construct->diverged),
+                .loop_diverged = diverges,
+                .parent = construct,
+            };
+            analyse_block(u, entry, fn, loop_instr->body, divergent || diverges, &c);
+            break;
+        }
+        default: {
+            // values bound to new names
+            if (!are_operands_uniform(u, (Nodes) { .count = 1, .nodes = &instruction }))
+                mark_all_varying(u, outputs);
+            break;
+        }
+    }
+}
+
+static void analyse_terminator(Uniformity* u, const Node* entry, const Node* fn, const Node* terminator, bool divergent, const Construct* construct) {
+    switch (terminator->tag) {
+        case Branch_TAG: {
+            const Branch* branch = &terminator->payload.branch;
+            are_operands_uniform(u, branch->args);
+            switch (branch->branch_mode) {
+                case BrJump: propagate_jump(u, branch->target, branch->args, divergent); break;
+                case BrIfElse: {
+                    bool diverges = divergent || !is_value_uniform(u, branch->branch_condition);
+                    propagate_jump(u, branch->true_target, branch->args, diverges);
+                    propagate_jump(u, branch->false_target, branch->args, diverges);
+                    break;
+                }
+                case BrSwitch: {
+                    bool diverges = divergent || !is_value_uniform(u, branch->switch_value);
+                    for (size_t i = 0; i < branch->case_targets.count; i++)
+                        propagate_jump(u, branch->case_targets.nodes[i], branch->args, diverges);
+                    propagate_jump(u, branch->default_target, branch->args, diverges);
+                    break;
+                }
+                case BrTailcall: {
+                    bool uniform_target = is_value_uniform(u, branch->target);
+                    // the callee returns on our behalf
+                    if (!propagate_call(u, branch->target, branch->args, divergent || !uniform_target))
+                        add_to(u, u->varying_returns, entry);
+                    const Node* callee = get_direct_callee(branch->target);
+                    bool diverged = (fn != entry && divergent) || (construct && construct->diverged);
+                    if (!callee || diverged || is_in(u->divergent_returns, callee))
+                        add_to(u, u->divergent_returns, entry);
+                    break;
+                }
+            }
+            break;
+        }
+        case Join_TAG: {
+            const Join* join = &terminator->payload.join;
+            are_operands_uniform(u, join->args);
+            if (join->is_indirect)
+                break;
+            // threads coming from different paths meet here
+            propagate_args(u, join->join_at, join->args, divergent);
+            const Node* mask = join->desired_mask;
+            if (!is_in(u->masks, mask) || is_in(u->partial_masks, mask))
+                add_to(u, u->divergent, join->join_at);
+            break;
+        }
+        case Callc_TAG: {
+            const Callc* callc = &terminator->payload.callc;
+            bool uniform_results = propagate_call(u, callc->callee, callc->args, divergent);
+            const Node* ret_cont = callc->ret_cont;
+            if (callc->is_return_indirect) {
+                are_operands_uniform(u, (Nodes) { .count = 1, .nodes = &ret_cont });
+                break;
+            }
+            if (!uniform_results)
+                mark_all_varying(u, ret_cont->payload.fn.params);
+            // without reconvergence on the way back, the continuation only gets the threads the callee let go together
+            const Node* callee = get_direct_callee(callc->callee);
+            if (divergent || !callee || is_in(u->divergent_returns, callee))
+                add_to(u, u->divergent, ret_cont);
+            break;
+        }
+        case Return_TAG: {
+            bool uniform = are_operands_uniform(u, terminator->payload.fn_ret.values);
+            // threads that took different paths may return different things
+            bool diverged = (fn != entry && divergent) || (construct && construct->diverged);
+            if (!uniform || diverged)
+                add_to(u, u->varying_returns, entry);
+            if (diverged)
+                add_to(u, u->divergent_returns, entry);
+            break;
+        }
+        case MergeConstruct_TAG: {
+            const MergeConstruct* merge = &terminator->payload.merge_construct;
+            are_operands_uniform(u, merge->args);
+            const Construct* target;
+            Nodes targets;
+            switch (merge->construct) {
+                case Selection:
+                    target = find_construct(construct, If_TAG, Match_TAG);
+                    targets = target->outputs;
+                    break;
+                case Continue:
+                    target = find_construct(construct, Loop_TAG, Loop_TAG);
+                    targets = target->instruction->payload.loop_instr.params;
+                    if (construct->loop_diverged)
+                        add_to(u, u->divergent_loops, target->instruction);
+                    break;
+                case Break:
+                    target = find_construct(construct, Loop_TAG, Loop_TAG);
+                    targets = target->outputs;
+                    if (construct->loop_diverged)
+                        add_to(u, u->divergent_loops, target->instruction);
+                    break;
+                default: SHADY_UNREACHABLE;
+            }
+            for (size_t i = 0; i < targets.count && i < merge->args.count; i++)
+                if (!is_value_uniform(u, merge->args.nodes[i]))
+                    mark_varying(u, targets.nodes[i]);
+            break;
+        }
+        case Unreachable_TAG: break;
+        default: error("uniformity: unhandled terminator");
+    }
+}
+
+static void analyse_block(Uniformity* u, const Node* entry, const Node* fn, const Node* block, bool divergent, const Construct* construct) {
+    assert(block->tag == Block_TAG);
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        Nodes outputs = no_outputs;
+        if (instruction->tag == Let_TAG) {
+            outputs = instruction->payload.let.variables;
+            instruction = instruction->payload.let.instruction;
+        }
+        analyse_instruction(u, entry, fn, instruction, outputs, divergent, construct);
+    }
+    analyse_terminator(u, entry, fn, block->payload.block.terminator, divergent, construct);
+}
+
+static void analyse_fn(Uniformity* u, const Node* entry, const Node* fn) {
+    const Function* fun = &fn->payload.fn;
+    // we only know who calls non-escaping functions
+    if (fun->atttributes.entry_point_type != NotAnEntryPoint || is_in(u->escaping, fn))
+        mark_all_varying(u, fun->params);
+    if (is_in(u->escaping, fn) && fun->atttributes.entry_point_type == NotAnEntryPoint)
+        add_to(u, u->divergent, fn);
+    analyse_block(u, entry, fn, fun->block, is_in(u->divergent, fn), NULL);
+}
+
+Uniformity* analyse_uniformity(const Node* root) {
+    assert(root->tag == Root_TAG);
+    Uniformity* u = malloc(sizeof(Uniformity));
+    *u = (Uniformity) {
+        .varying = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .divergent = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .varying_returns = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .divergent_returns = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .escaping = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .masks = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .partial_masks = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .divergent_loops = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    struct List* scopes = build_scopes(root);
+    size_t scopes_count = entries_count_list(scopes);
+
+    // everything starts uniform and can only become varying, so this terminates
+    size_t iterations = 0;
+    do {
+        u->changed = false;
+        for (size_t i = 0; i < scopes_count; i++) {
+            Scope* scope = &read_list(Scope, scopes)[i];
+            const Node* entry = scope->entry->node;
+            for (size_t j = 0; j < scope->size; j++)
+                analyse_fn(u, entry, scope->rpo[j]->node);
+        }
+        iterations++;
+    } while (u->changed);
+
+    debug_print("Uniformity analysis converged after %zu iterations, %zu varying values\n", iterations, entries_count_dict(u->varying));
+
+    for (size_t i = 0; i < scopes_count; i++)
+        dispose_scope(&read_list(Scope, scopes)[i]);
+    destroy_list(scopes);
+    return u;
+}
+
+void dispose_uniformity(Uniformity* u) {
+    destroy_dict(u->varying);
+    destroy_dict(u->divergent);
+    destroy_dict(u->varying_returns);
+    destroy_dict(u->divergent_returns);
+    destroy_dict(u->escaping);
+    destroy_dict(u->masks);
+    destroy_dict(u->partial_masks);
+    destroy_dict(u->divergent_loops);
+    free(u);
+}
@@ -0,0 +1,21 @@
+#ifndef SHADY_UNIFORMITY_H
+#define SHADY_UNIFORMITY_H
+
+#include "shady/ir.h"
+
+typedef struct Uniformity_ Uniformity;
+
+/// Whole-program divergence analysis: starting from the values that can differ between the threads of a subgroup
+/// (thread ids, per-thread memory, varying parameters of entry points), propagates divergence through instructions,
+/// branches on varying conditions, call arguments and return values until nothing changes.
+/// Works both on structured control flow and on the continuations lower_cf_instrs leaves behind.
+Uniformity* analyse_uniformity(const Node* root);
+void dispose_uniformity(Uniformity*);
+
+/// False when the value may differ between the threads executing it
+bool is_value_uniform(const Uniformity*, const Node* value);
+/// False when the body of this function or continuation may run with only part of the subgroup. For return continuations
+/// that includes callees which may let threads return at different times.
+bool is_fn_convergent(const Uniformity*, const Node* fn);
+
+#endif
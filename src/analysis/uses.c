@@ -0,0 +1,115 @@
+#include "uses.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../visit.h"
+
+#include "dict.h"
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+bool is_alias_let(const Node* instruction) {
+    return instruction->tag == Let_TAG && instruction->payload.let.variables.count == 1 && is_value(instruction->payload.let.instruction);
+}
+
+void find_aliases(const Node* block, struct Dict* aliases) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (is_alias_let(instruction))
+            insert_dict(const Node*, const Node*, aliases, instruction->payload.let.variables.nodes[0], instruction->payload.let.instruction);
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                find_aliases(get_nested_block(instruction, j), aliases);
+    }
+}
+
+const Node* resolve_alias(struct Dict* aliases, const Node* node) {
+    const Node** found;
+    while ((found = find_value_dict(const Node*, const Node*, aliases, node)))
+        node = *found;
+    return node;
+}
+
+typedef struct {
+    Visitor visitor;
+    struct Dict* aliases;
+    const Node* var;
+    size_t uses;
+    struct Dict* seen;
+} UsesVisitor;
+
+static void visit_uses(UsesVisitor* visitor, const Node* node) {
+    if (is_type(node))
+        return;
+    switch (node->tag) {
+        case Variable_TAG: visitor->uses += resolve_alias(visitor->aliases, node) == visitor->var; return;
+        case Tuple_TAG: {
+            for (size_t i = 0; i < node->payload.tuple.contents.count; i++)
+                visit_uses(visitor, node->payload.tuple.contents.nodes[i]);
+            return;
+        }
+        case Unbound_TAG:
+        case UntypedNumber_TAG:
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case FnAddr_TAG:
+        case Constant_TAG:
+        case GlobalVariable_TAG: return;
+        case Function_TAG:
+            // continuations can see the variables of the function they live in, other functions can't
+            if (!node->payload.fn.atttributes.is_continuation || !insert_set_get_result(const Node*, visitor->seen, node))
+                return;
+            // fallthrough
+        default: visit_children(&visitor->visitor, node); return;
+    }
+}
+
+size_t count_uses(struct Dict* aliases, const Node* node, const Node* var) {
+    if (!node)
+        return 0;
+    UsesVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_uses,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = true,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .aliases = aliases,
+        .var = var,
+        .uses = 0,
+        .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    if (node->tag == Function_TAG)
+        visit_children(&visitor.visitor, node);
+    else
+        visit_uses(&visitor, node);
+    destroy_dict(visitor.seen);
+    return visitor.uses;
+}
+
+size_t nested_blocks_count(const Node* instruction) {
+    if (instruction->tag == Let_TAG)
+        instruction = instruction->payload.let.instruction;
+    switch (instruction->tag) {
+        case If_TAG: return 2;
+        case Loop_TAG: return 1;
+        case Match_TAG: return instruction->payload.match_instr.cases.count + 1;
+        default: return 0;
+    }
+}
+
+const Node* get_nested_block(const Node* instruction, size_t i) {
+    if (instruction->tag == Let_TAG)
+        instruction = instruction->payload.let.instruction;
+    switch (instruction->tag) {
+        case If_TAG: return i == 0 ? instruction->payload.if_instr.if_true : instruction->payload.if_instr.if_false;
+        case Loop_TAG: return instruction->payload.loop_instr.body;
+        case Match_TAG: return i < instruction->payload.match_instr.cases.count ? instruction->payload.match_instr.cases.nodes[i] : instruction->payload.match_instr.default_case;
+        default: SHADY_UNREACHABLE;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef SHADY_USES_H
+#define SHADY_USES_H
+
+#include "shady/ir.h"
+
+struct Dict;
+
+/// `let a = b` where b is a value: a is just another name for b
+bool is_alias_let(const Node* instruction);
+/// Records every alias let of the block and the blocks nested in it, variable -> value
+void find_aliases(const Node* block, struct Dict* aliases);
+/// Follows aliases until we get to something that isn't one
+const Node* resolve_alias(struct Dict* aliases, const Node* node);
+
+/// Counts the occurences of var or any of its aliases in node, continuations included but not other functions
+size_t count_uses(struct Dict* aliases, const Node* node, const Node* var);
+
+/// The blocks of a structured construct, missing else/default cases come back as NULL
+size_t nested_blocks_count(const Node* instruction);
+const Node* get_nested_block(const Node* instruction, size_t i);
+
+#endif
@@ -1,6 +1,7 @@
 #include "arena.h"
 #include "type.h"
 #include "portability.h"
+#include "log.h"
 
 #include "list.h"
 #include "dict.h"
@@ -13,6 +14,8 @@
 #include <stdarg.h>
 
 #define alloc_size 1024 * 1024
+/// past that many nodes, a list grown with append_nodes is most likely built in a loop
+#define APPEND_NODES_WARN_COUNT 64
 
 static KeyHash hash_nodes(Nodes* nodes);
 static bool compare_nodes(Nodes* a, Nodes* b);
@@ -42,6 +45,8 @@ IrArena* new_arena(ArenaConfig config) {
 
         .nodes_set   = new_set(Nodes, (HashFn) hash_nodes, (CmpFn) compare_nodes),
         .strings_set = new_set(Strings, (HashFn) hash_strings, (CmpFn) compare_strings),
+
+        .warned_long_append = false,
     };
     for (int i = 0; i < arena->maxblocks; i++)
         arena->blocks[i] = NULL;
@@ -134,7 +139,12 @@ Strings strings(IrArena* arena, size_t count, const char* in_strs[])  {
 }
 
 Nodes append_nodes(IrArena* arena, Nodes old, const Node* new) {
-    LARRAY(const Node*, tmp, old.count + 2);
+    // every call copies and interns the whole list again, growing a list this way is quadratic
+    if (old.count >= APPEND_NODES_WARN_COUNT && !arena->warned_long_append) {
+        warn_print("append_nodes: growing a list of %zu nodes one at a time, build it with a NodesBuilder instead\n", old.count);
+        arena->warned_long_append = true;
+    }
+    LARRAY(const Node*, tmp, old.count + 1);
     for (size_t i = 0; i < old.count; i++)
         tmp[i] = old.nodes[i];
     tmp[old.count] = new;
@@ -234,3 +244,37 @@ bool compare_string(const char** a, const char** b) {
 Nodes list_to_nodes(IrArena* arena, struct List* list) {
     return nodes(arena, entries_count_list(list), read_list(const Node*, list));
 }
+
+struct NodesBuilder_ {
+    IrArena* arena;
+    struct List* list;
+};
+
+NodesBuilder* begin_nodes(IrArena* arena) {
+    NodesBuilder* builder = malloc(sizeof(NodesBuilder));
+    *builder = (NodesBuilder) {
+        .arena = arena,
+        .list = new_list(const Node*)
+    };
+    return builder;
+}
+
+void add_node(NodesBuilder* builder, const Node* node) {
+    append_list(const Node*, builder->list, node);
+}
+
+void add_nodes(NodesBuilder* builder, Nodes nodes) {
+    for (size_t i = 0; i < nodes.count; i++)
+        add_node(builder, nodes.nodes[i]);
+}
+
+size_t nodes_builder_count(NodesBuilder* builder) {
+    return entries_count_list(builder->list);
+}
+
+Nodes finish_nodes(NodesBuilder* builder) {
+    Nodes result = list_to_nodes(builder->arena, builder->list);
+    destroy_list(builder->list);
+    free(builder);
+    return result;
+}
@@ -21,6 +21,9 @@ typedef struct IrArena_ {
 
     struct Dict* nodes_set;
     struct Dict* strings_set;
+
+    /// append_nodes warns once per arena about lists that should have been built with a NodesBuilder
+    bool warned_long_append;
 } IrArena_;
 
 void* arena_alloc(IrArena* arena, size_t size);
@@ -2,6 +2,8 @@
 #include "rewrite.h"
 #include "fold.h"
 #include "arena.h"
+#include "type.h"
+#include "portability.h"
 
 #include "list.h"
 #include "dict.h"
@@ -32,9 +34,39 @@ bool compare_node(Node**, Node**);
 typedef struct {
     Rewriter rewriter;
     struct Dict* in_use;
+    struct Dict* kept_lets;
 } Context;
 
+static const Node* process_node(Context* ctx, const Node* node);
+
+/// Lets whose instruction doesn't fold to anything new are kept with their variables, code outside of this block may
+/// already refer to them. The others get fresh variables, only this block can be using those.
+static const Node* process_let(Context* ctx, const Node* node) {
+    IrArena* arena = ctx->rewriter.dst_arena;
+    const Node* instruction = process_node(ctx, node->payload.let.instruction);
+    Nodes variables = node->payload.let.variables;
+    if (instruction == node->payload.let.instruction) {
+        for (size_t i = 0; i < variables.count; i++)
+            register_processed(&ctx->rewriter, variables.nodes[i], variables.nodes[i]);
+        insert_set_get_result(const Node*, ctx->kept_lets, node);
+        return node;
+    }
+
+    LARRAY(const char*, names, variables.count);
+    for (size_t i = 0; i < variables.count; i++)
+        names[i] = variables.nodes[i]->payload.var.name;
+    const Node* rewritten = node->payload.let.is_mutable ?
+        let_mut(arena, instruction, extract_variable_types(arena, &variables), variables.count, names) :
+        let(arena, instruction, variables.count, names);
+    for (size_t i = 0; i < variables.count; i++)
+        register_processed(&ctx->rewriter, variables.nodes[i], rewritten->payload.let.variables.nodes[i]);
+    return rewritten;
+}
+
 static const Node* process_node(Context* ctx, const Node* node) {
+    if (node->tag == Let_TAG)
+        return process_let(ctx, node);
+
     if (is_instruction(node) || is_terminator(node))
         return recreate_node_identity(&ctx->rewriter, node);
 
@@ -69,7 +101,8 @@ const Node* finish_block(BlockBuilder* builder, const Node* terminator) {
             .rewrite_decl_body = NULL,
             .processed = done,
         },
-        .in_use = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node)
+        .in_use = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .kept_lets = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
     };
 
     for (size_t i = 0; i < entries_count_list(builder->list); i++) {
@@ -92,7 +125,9 @@ const Node* finish_block(BlockBuilder* builder, const Node* terminator) {
             actual_instruction = actual_instruction->payload.let.instruction;
 
         // we keep instructions that have useful results, calls and primops tagged as having side effects
-        if (find_key_dict(const Node*, ctx.in_use, actual_instruction) || actual_instruction->tag == PrimOp_TAG && has_primop_got_side_effects(actual_instruction->payload.prim_op.op) || actual_instruction->tag != PrimOp_TAG)
+        // lets we kept as they were may be used by continuations, we don't see those uses from here
+        if (find_key_dict(const Node*, ctx.in_use, actual_instruction) || actual_instruction->tag == PrimOp_TAG && has_primop_got_side_effects(actual_instruction->payload.prim_op.op) || actual_instruction->tag != PrimOp_TAG
+            || find_key_dict(const Node*, ctx.kept_lets, instruction))
             append_list(const Node*, final_list, instruction);
     }
 
@@ -103,6 +138,7 @@ const Node* finish_block(BlockBuilder* builder, const Node* terminator) {
 
     destroy_dict(done);
     destroy_dict(ctx.in_use);
+    destroy_dict(ctx.kept_lets);
     destroy_list(folded_list);
     destroy_list(final_list);
     free(builder);
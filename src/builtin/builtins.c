@@ -0,0 +1,139 @@
+#include "builtins.h"
+
+#include "../passes/passes.h"
+#include "../slim/parser.h"
+#include "../rewrite.h"
+#include "../log.h"
+
+#include "dict.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+// generated from scheduler.shady at configure time, a zero-terminated char array
+#include "scheduler_src.h"
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+/// The front-end leaves constants mutable until they are bound, so they can be given another value from here
+static void specialise_constant(IrArena* arena, const Node* program, String name, int value) {
+    Nodes decls = program->payload.root.declarations;
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag != Constant_TAG || strcmp(get_decl_name(decls.nodes[i]), name) != 0)
+            continue;
+        Node* cnst = (Node*) decls.nodes[i];
+        cnst->payload.constant.value = untyped_number(arena, (UntypedNumber) {
+            .plaintext = format_string(arena, "%d", value)
+        });
+        return;
+    }
+    error("the builtin module has no constant called %s", name);
+}
+
+/// Copies declarations as they are, and turns allocas into function variables: the variables of the scheduler never have
+/// their address taken, they don't need to be emulated like the private memory of the programs it gets imported into
+static const Node* rewrite_builtin_node(Rewriter* rewriter, const Node* old) {
+    const Node* found = search_processed(rewriter, old);
+    if (found) return found;
+
+    switch (old->tag) {
+        case Constant_TAG:
+        case Function_TAG:
+        case GlobalVariable_TAG: {
+            Node* new = recreate_decl_header_identity(rewriter, old);
+            recreate_decl_body_identity(rewriter, old, new);
+            return new;
+        }
+        case PrimOp_TAG: {
+            if (old->payload.prim_op.op != alloca_op)
+                break;
+            return prim_op(rewriter->dst_arena, (PrimOp) {
+                .op = alloca_logical_op,
+                .operands = rewrite_nodes(rewriter, old->payload.prim_op.operands)
+            });
+        }
+        default: break;
+    }
+    return recreate_node_identity(rewriter, old);
+}
+
+static Nodes rewrite_builtin_decls(IrArena* src_arena, IrArena* dst_arena, Nodes decls) {
+    Rewriter rewriter = {
+        .src_arena = src_arena,
+        .dst_arena = dst_arena,
+        .rewrite_fn = rewrite_builtin_node,
+        .rewrite_decl_body = NULL,
+        .processed = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    Nodes rewritten = rewrite_nodes(&rewriter, decls);
+    destroy_dict(rewriter.processed);
+    return rewritten;
+}
+
+BuiltinModule* prepare_builtins(const CompilerConfig* config) {
+    CompilerConfig config_copy = *config;
+
+    IrArena* arena = new_arena((ArenaConfig) {
+        .check_types = false
+    });
+    // the parser wants a mutable string
+    char* contents = malloc(sizeof(scheduler_src));
+    memcpy(contents, scheduler_src, sizeof(scheduler_src));
+    const Node* program = parse((ParserConfig) { .front_end = true }, contents, arena);
+    free(contents);
+
+    specialise_constant(arena, program, "MASK_SIZE", (int) config->subgroup_size);
+    specialise_constant(arena, program, "SCHEDULING_POLICY", (int) config->scheduling_policy);
+
+    program = bind_program(&config_copy, arena, arena, program);
+    program = normalize(&config_copy, arena, arena, program);
+
+    ArenaConfig aconfig = {
+        .check_types = true,
+    };
+    IrArena* typed_arena = new_arena(aconfig);
+    program = infer_program(&config_copy, arena, typed_arena, program);
+    destroy_arena(arena);
+    arena = typed_arena;
+
+    program = root(arena, (Root) {
+        .declarations = rewrite_builtin_decls(arena, arena, program->payload.root.declarations)
+    });
+
+    // the branches on the specialised constants go away
+    aconfig.allow_fold = true;
+    IrArena* folding_arena = new_arena(aconfig);
+    program = opt_fold(&config_copy, arena, folding_arena, program);
+    destroy_arena(arena);
+    arena = folding_arena;
+    debug_print("Prepared the builtin module: \n");
+    debug_node(program);
+
+    BuiltinModule* module = malloc(sizeof(BuiltinModule));
+    *module = (BuiltinModule) {
+        .arena = arena,
+        .program = program,
+        .subgroup_size = config->subgroup_size,
+        .scheduling_policy = config->scheduling_policy,
+    };
+    return module;
+}
+
+void destroy_builtins(BuiltinModule* module) {
+    destroy_arena(module->arena);
+    free(module);
+}
+
+Nodes import_builtins(const BuiltinModule* module, IrArena* dst_arena) {
+    return rewrite_builtin_decls(module->arena, dst_arena, module->program->payload.root.declarations);
+}
+
+const Node* find_builtin(Nodes imported, String name) {
+    for (size_t i = 0; i < imported.count; i++)
+        if (strcmp(get_decl_name(imported.nodes[i]), name) == 0)
+            return imported.nodes[i];
+    error("the builtin module has no declaration called %s", name);
+}
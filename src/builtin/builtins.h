@@ -0,0 +1,24 @@
+#ifndef SHADY_BUILTINS_H
+#define SHADY_BUILTINS_H
+
+#include "shady/ir.h"
+
+/// scheduler.shady, parsed and type-checked once for a given configuration
+typedef struct BuiltinModule_ {
+    IrArena* arena;
+    const Node* program;
+    /// what MASK_SIZE was set to
+    uint32_t subgroup_size;
+    /// what SCHEDULING_POLICY was set to
+    SchedulingPolicy scheduling_policy;
+} BuiltinModule;
+
+BuiltinModule* prepare_builtins(const CompilerConfig*);
+void destroy_builtins(BuiltinModule*);
+
+/// Copies the declarations of the builtin module into another arena, the ones that refer to each other still do
+Nodes import_builtins(const BuiltinModule*, IrArena* dst_arena);
+/// Looks up one of the imported declarations by name
+const Node* find_builtin(Nodes imported, String name);
+
+#endif
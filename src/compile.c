@@ -1,16 +1,36 @@
 #include "shady/ir.h"
 #include "passes/passes.h"
+#include "slim/parser.h"
 #include "log.h"
 #include "portability.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 CompilerConfig default_compiler_config() {
     return (CompilerConfig) {
         .use_loop_for_fn_body = true,
         .use_loop_for_fn_calls = true,
+        .emission_threads = 0,
+        .streaming_emission = false,
+        .inlining_threshold = 16,
+        .subgroup_size = 64,
+        .scheduling_policy = SchedulerRoundRobin,
+        .use_clustered_dispatcher = false,
     };
 }
 
-CompilationResult run_compiler_passes(SHADY_UNUSED CompilerConfig* config, IrArena** arena, const Node** program) {
+typedef struct {
+    CompilerConfig* config;
+    IrArena** arena;
+    const Node** program;
+} PassesJob;
+
+static void run_passes(PassesJob* job) {
+    CompilerConfig* config = job->config;
+    IrArena** arena = job->arena;
+    const Node** program = job->program;
+
     *program = bind_program(config, *arena, *arena, *program);
     info_print("Bound program successfully: \n");
     info_node(*program);
@@ -29,13 +49,46 @@ CompilationResult run_compiler_passes(SHADY_UNUSED CompilerConfig* config, IrAre
     info_print("Type-checked program successfully: \n");
     info_node(*program);
 
+    *program = opt_inline(config, *arena, *arena, *program);
+    info_print("After opt_inline pass: \n");
+    info_node(*program);
+
+    *program = opt_dead_decls(config, *arena, *arena, *program);
+    info_print("After opt_dead_decls pass: \n");
+    info_node(*program);
+
+    *program = opt_sroa(config, *arena, *arena, *program);
+    info_print("After opt_sroa pass: \n");
+    info_node(*program);
+
+    *program = opt_mem2reg(config, *arena, *arena, *program);
+    info_print("After opt_mem2reg pass: \n");
+    info_node(*program);
+
     aconfig.allow_fold = true;
-    *arena = new_arena(aconfig);
+    IrArena* folding_arena = new_arena(aconfig);
+    *program = opt_fold(config, *arena, folding_arena, *program);
+    destroy_arena(*arena);
+    *arena = folding_arena;
+    info_print("After opt_fold pass: \n");
+    info_node(*program);
+
+    *program = opt_gvn(config, *arena, *arena, *program);
+    info_print("After opt_gvn pass: \n");
+    info_node(*program);
+
+    *program = opt_licm(config, *arena, *arena, *program);
+    info_print("After opt_licm pass: \n");
+    info_node(*program);
 
     *program = lower_cf_instrs(config, *arena, *arena, *program);
     info_print("After lower_cf_instrs pass: \n");
     info_node(*program);
 
+    *program = opt_simplify_cf(config, *arena, *arena, *program);
+    info_print("After opt_simplify_cf pass: \n");
+    info_node(*program);
+
     *program = lower_callc(config, *arena, *arena, *program);
     info_print("After lower_callc pass: \n");
     info_node(*program);
@@ -44,6 +97,27 @@ CompilationResult run_compiler_passes(SHADY_UNUSED CompilerConfig* config, IrAre
     info_print("After lower_callf pass: \n");
     info_node(*program);
 
+    // reducible bodies become native structured control flow, whatever is left goes through the loop
+    *program = lower_jumps_structure(config, *arena, *arena, *program);
+    info_print("After lower_jumps_structure pass: \n");
+    info_node(*program);
+
+    // whatever is left of uniform jumps inside a function becomes a loop over a switch instead of tail calls
+    if (config->use_loop_for_fn_body) {
+        *program = lower_jumps_loop(config, *arena, *arena, *program);
+        info_print("After lower_jumps_loop pass: \n");
+        info_node(*program);
+    }
+
+    // branches and joins across functions go through the dispatcher and the scheduler builtins
+    *program = lower_tailcalls(config, *arena, *arena, *program);
+    info_print("After lower_tailcalls pass: \n");
+    info_node(*program);
+
+    *program = lower_mask(config, *arena, *arena, *program);
+    info_print("After lower_mask pass: \n");
+    info_node(*program);
+
     *program = lower_stack(config, *arena, *arena, *program);
     info_print("After lower_stack pass: \n");
     info_node(*program);
@@ -52,9 +126,58 @@ CompilationResult run_compiler_passes(SHADY_UNUSED CompilerConfig* config, IrAre
     info_print("After lower_physical_ptrs pass: \n");
     info_node(*program);
 
-    // *program = lower_jumps_loop(config, *arena, *arena, *program);
-    // info_print("After lower_jumps_loop pass: \n");
-    // info_node(*program);
+    // lower_lea leaves address arithmetic in loops that only depends on the base pointer
+    *program = opt_licm(config, *arena, *arena, *program);
+    info_print("After opt_licm pass: \n");
+    info_node(*program);
+
+    // the lowerings leave helpers and lifted continuations behind, only emit what can still run
+    *program = opt_dead_decls(config, *arena, *arena, *program);
+    info_print("After opt_dead_decls pass: \n");
+    info_node(*program);
+}
 
+CompilationResult run_compiler_passes(CompilerConfig* config, IrArena** arena, const Node** program) {
+    PassesJob job = {
+        .config = config,
+        .arena = arena,
+        .program = program,
+    };
+    // the passes stop at the first thing they can't deal with, *arena is always one that is still alive
+    if (!run_recoverable((void (*)(void*)) run_passes, &job))
+        return CompilationPassFailed;
     return CompilationNoError;
 }
+
+CompilationResult shady_compile(const char* src, size_t len, const CompilerConfig* config, ShadyBlob* output) {
+    CompilerConfig config_copy = *config;
+
+    // the parser wants a mutable, zero-terminated string
+    char* contents = malloc(len + 1);
+    memcpy(contents, src, len);
+    contents[len] = '\0';
+
+    IrArena* arena = new_arena((ArenaConfig) {
+        .check_types = false
+    });
+    ParserConfig pconfig = {
+        .front_end = true
+    };
+    const Node* program = NULL;
+    CompilationResult result = parse_recoverable(pconfig, contents, arena, &program);
+    free(contents);
+
+    if (result == CompilationNoError)
+        result = run_compiler_passes(&config_copy, &arena, &program);
+    if (result == CompilationNoError)
+        emit_spirv_to_blob(&config_copy, arena, program, output);
+
+    destroy_arena(arena);
+    return result;
+}
+
+void destroy_blob(ShadyBlob* blob) {
+    free(blob->words);
+    blob->words = NULL;
+    blob->words_count = 0;
+}
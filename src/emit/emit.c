@@ -5,13 +5,18 @@
 #include "../portability.h"
 #include "../type.h"
 #include "../analysis/scope.h"
+#include "../visit.h"
 
 #include "spirv_builder.h"
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
 
+#include <pthread.h>
+#include <unistd.h>
+
 KeyHash hash_node(Node**);
 bool compare_node(Node**, Node**);
 
@@ -25,8 +30,40 @@ typedef struct Emitter_ {
     FileBuilder file_builder;
     SpvId void_t;
     struct Dict* node_ids;
+
+    /// Set when emitting a function body on its own: declarations, types and constants are looked up there but never created
+    struct Dict* global_ids;
+    /// The arena is not thread-safe, function bodies being emitted concurrently take this when they need to look up a node
+    pthread_mutex_t* arena_lock;
+
+    /// What the subgroup operations need, emitted the first time a function uses one, see prepare_subgroup_ops
+    struct {
+        SpvId scope;
+        SpvId u32_t;
+        SpvId uvec2_t;
+        SpvId ballot_t;
+        /// the Input variable holding SubgroupLocalInvocationId
+        SpvId local_id;
+    } subgroup;
 } Emitter;
 
+static void lock_arena(Emitter* emitter) {
+    if (emitter->arena_lock)
+        pthread_mutex_lock(emitter->arena_lock);
+}
+
+static void unlock_arena(Emitter* emitter) {
+    if (emitter->arena_lock)
+        pthread_mutex_unlock(emitter->arena_lock);
+}
+
+static SpvId* find_id(Emitter* emitter, const Node* node) {
+    SpvId* found = find_value_dict(struct Node*, SpvId, emitter->node_ids, node);
+    if (!found && emitter->global_ids)
+        found = find_value_dict(struct Node*, SpvId, emitter->global_ids, node);
+    return found;
+}
+
 SpvStorageClass emit_addr_space(AddressSpace address_space) {
     switch(address_space) {
         case AsGlobalLogical:   return SpvStorageClassStorageBuffer;
@@ -58,8 +95,8 @@ typedef struct {
 
 static void emit_block(Emitter* emitter, FnBuilder fn_builder, BBBuilder basic_block_builder, MergeTargets, const Node* node);
 
-static void register_result(Emitter* emitter, const Node* variable, SpvId id) {
-    spvb_name(emitter->file_builder, id, variable->payload.var.name);
+static void register_result(Emitter* emitter, FnBuilder fn_builder, const Node* variable, SpvId id) {
+    spvb_fn_name(fn_builder, id, variable->payload.var.name);
     insert_dict_and_get_result(struct Node*, SpvId, emitter->node_ids, variable, id);
 }
 
@@ -118,10 +155,14 @@ const struct IselTableEntry {
     [gt_op]  = { FirstOp, Bool, .fo = { SpvOpSGreaterThan,      SpvOpUGreaterThan,      SpvOpFOrdGreaterThan,      ISEL_ILLEG          }},
     [gte_op] = { FirstOp, Bool, .fo = { SpvOpSGreaterThanEqual, SpvOpUGreaterThanEqual, SpvOpFOrdGreaterThanEqual, ISEL_ILLEG          }},
 
-    [not_op] = { FirstOp, Same, .fo = { SpvOpNot,        SpvOpNot,        SpvOpLogicalNot }},
-    [and_op] = { FirstOp, Same, .fo = { SpvOpBitwiseAnd, SpvOpBitwiseAnd, SpvOpLogicalAnd }},
-    [or_op]  = { FirstOp, Same, .fo = { SpvOpBitwiseOr,  SpvOpBitwiseOr,  SpvOpLogicalOr }},
-    [xor_op] = { FirstOp, Same, .fo = { SpvOpBitwiseXor, SpvOpBitwiseXor, SpvOpLogicalNotEqual }},
+    [not_op] = { FirstOp, Same, .fo = { SpvOpNot,        SpvOpNot,        ISEL_ILLEG, SpvOpLogicalNot      }},
+    [and_op] = { FirstOp, Same, .fo = { SpvOpBitwiseAnd, SpvOpBitwiseAnd, ISEL_ILLEG, SpvOpLogicalAnd      }},
+    [or_op]  = { FirstOp, Same, .fo = { SpvOpBitwiseOr,  SpvOpBitwiseOr,  ISEL_ILLEG, SpvOpLogicalOr       }},
+    [xor_op] = { FirstOp, Same, .fo = { SpvOpBitwiseXor, SpvOpBitwiseXor, ISEL_ILLEG, SpvOpLogicalNotEqual }},
+
+    [lshift_logical_op] = { FirstOp, Same, .fo = { SpvOpShiftLeftLogical,     SpvOpShiftLeftLogical }},
+    [lshift_arithm_op]  = { FirstOp, Same, .fo = { SpvOpShiftLeftLogical,     SpvOpShiftLeftLogical }},
+    [rshift_op]         = { FirstOp, Same, .fo = { SpvOpShiftRightArithmetic, SpvOpShiftRightLogical }},
 
     [convert_op] = { FirstAndResult, TyOperand, .foar = {
         { SpvOpSConvert,    SpvOpUConvert,    SpvOpConvertSToF, ISEL_BOOLC },
@@ -141,6 +182,20 @@ const struct IselTableEntry {
     [PRIMOPS_COUNT] = { Custom }
 };
 
+/// OpGroupNonUniformBallot gives a uvec4 whatever the subgroup size is, masks keep the low bits in an integer
+static SpvId emit_ballot_as_int(Emitter* emitter, BBBuilder bb_builder, const Type* int_t, SpvId ballot) {
+    assert(int_t->tag == Int_TAG);
+    SpvId low = spvb_extract(bb_builder, emitter->subgroup.u32_t, ballot, 1, (uint32_t []) { 0 });
+    if (int_t->payload.int_type.width == IntTy32)
+        return spvb_convert(bb_builder, SpvOpBitcast, emit_type(emitter, int_t), low);
+
+    assert(int_t->payload.int_type.width == IntTy64);
+    SpvId high = spvb_extract(bb_builder, emitter->subgroup.u32_t, ballot, 1, (uint32_t []) { 1 });
+    // the lower-numbered component ends up in the low bits
+    SpvId halves = spvb_composite(bb_builder, emitter->subgroup.uvec2_t, 2, (SpvId []) { low, high });
+    return spvb_convert(bb_builder, SpvOpBitcast, emit_type(emitter, int_t), halves);
+}
+
 static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_builder, const Node* instr, Nodes variables) {
     PrimOp prim_op = instr->payload.prim_op;
     Nodes args = prim_op.operands;
@@ -173,15 +228,20 @@ static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_bui
         const Type* result_t;
         switch (entry.result_kind) {
             case Same:      result_t = without_qualifier(args.nodes[0]->type); break;
-            case Bool:      result_t = bool_type(emitter->arena); break;
+            case Bool: {
+                lock_arena(emitter);
+                result_t = bool_type(emitter->arena);
+                unlock_arena(emitter);
+                break;
+            }
             case TyOperand: result_t = args.nodes[0]; break;
             default: error("unhandled result kind");
         }
 
         if (args.count == 1)
-            register_result(emitter, variables.nodes[0], spvb_unop(bb_builder, opcode, emit_type(emitter, result_t), arr[0]));
+            register_result(emitter, fn_builder, variables.nodes[0], spvb_unop(bb_builder, opcode, emit_type(emitter, result_t), arr[0]));
         else if (args.count == 2)
-            register_result(emitter, variables.nodes[0], spvb_binop(bb_builder, opcode, emit_type(emitter, result_t), arr[0], arr[1]));
+            register_result(emitter, fn_builder, variables.nodes[0], spvb_binop(bb_builder, opcode, emit_type(emitter, result_t), arr[0], arr[1]));
         else
             error("unhandled isel for argsc > 2");
 
@@ -195,7 +255,7 @@ static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_bui
             const Type* elem_type = without_qualifier(args.nodes[0]->type)->payload.ptr_type.pointed_type;
             SpvId eptr = emit_value(emitter, args.nodes[0], NULL);
             SpvId result = spvb_load(bb_builder, emit_type(emitter, elem_type), eptr, 0, NULL);
-            register_result(emitter, variables.nodes[0], result);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
             return;
         }
         case store_op: {
@@ -205,13 +265,17 @@ static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_bui
             spvb_store(bb_builder, eval, eptr, 0, NULL);
             return;
         }
-        case alloca_op: {
+        case alloca_op:
+        case alloca_logical_op: {
             const Type* elem_type = args.nodes[0];
-            SpvId result = spvb_local_variable(fn_builder, emit_type(emitter, ptr_type(emitter->arena, (PtrType) {
+            lock_arena(emitter);
+            const Type* var_ptr_type = ptr_type(emitter->arena, (PtrType) {
                 .address_space = AsFunctionLogical,
                 .pointed_type = elem_type
-            })), SpvStorageClassFunction);
-            register_result(emitter, variables.nodes[0], result);
+            });
+            unlock_arena(emitter);
+            SpvId result = spvb_local_variable(fn_builder, emit_type(emitter, var_ptr_type), SpvStorageClassFunction);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
             return;
         }
         case lea_op: {
@@ -226,20 +290,61 @@ static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_bui
             } else {
                 const Type* target_type = instr->type;
                 SpvId result = spvb_access_chain(bb_builder, emit_type(emitter, target_type), base, args.count - 2, indices);
-                register_result(emitter, variables.nodes[0], result);
+                register_result(emitter, fn_builder, variables.nodes[0], result);
             }
             return;
         }
+        case extract_op: {
+            SpvId composite = emit_value(emitter, args.nodes[0], NULL);
+            LARRAY(uint32_t, indices, args.count - 1);
+            for (size_t i = 1; i < args.count; i++)
+                indices[i - 1] = (uint32_t) extract_int_literal_value(args.nodes[i], false);
+            SpvId result = spvb_extract(bb_builder, emit_type(emitter, variables.nodes[0]->type), composite, args.count - 1, indices);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
+            return;
+        }
         case select_op: {
             SpvId cond = emit_value(emitter, args.nodes[0], NULL);
             SpvId truv = emit_value(emitter, args.nodes[1], NULL);
             SpvId flsv = emit_value(emitter, args.nodes[2], NULL);
 
             SpvId result = spvb_select(bb_builder, emit_type(emitter, variables.nodes[0]->type), cond, truv, flsv);
-            register_result(emitter, variables.nodes[0], result);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
             return;
         }
-        default: error("TODO: unhandled op");
+        case subgroup_active_mask_op:
+        case subgroup_ballot_op: {
+            assert(args.count > 0 && is_type(args.nodes[0]) && "masks should have been lowered to integers");
+            SpvId predicate;
+            if (prim_op.op == subgroup_ballot_op)
+                predicate = emit_value(emitter, args.nodes[1], NULL);
+            else {
+                lock_arena(emitter);
+                const Node* true_value = true_lit(emitter->arena);
+                unlock_arena(emitter);
+                predicate = emit_value(emitter, true_value, NULL);
+            }
+            SpvId ballot = spvb_binop(bb_builder, SpvOpGroupNonUniformBallot, emitter->subgroup.ballot_t, emitter->subgroup.scope, predicate);
+            register_result(emitter, fn_builder, variables.nodes[0], emit_ballot_as_int(emitter, bb_builder, args.nodes[0], ballot));
+            return;
+        }
+        case subgroup_local_id_op: {
+            SpvId local_id = spvb_load(bb_builder, emitter->subgroup.u32_t, emitter->subgroup.local_id, 0, NULL);
+            register_result(emitter, fn_builder, variables.nodes[0], spvb_convert(bb_builder, SpvOpBitcast, emit_type(emitter, variables.nodes[0]->type), local_id));
+            return;
+        }
+        case subgroup_elect_first_op: {
+            SpvId result = spvb_unop(bb_builder, SpvOpGroupNonUniformElect, emit_type(emitter, variables.nodes[0]->type), emitter->subgroup.scope);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
+            return;
+        }
+        case subgroup_broadcast_first_op: {
+            SpvId value = emit_value(emitter, args.nodes[0], NULL);
+            SpvId result = spvb_binop(bb_builder, SpvOpGroupNonUniformBroadcastFirst, emit_type(emitter, variables.nodes[0]->type), emitter->subgroup.scope, value);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
+            return;
+        }
+        default: error("TODO: unhandled op %s", primop_names[prim_op.op]);
     }
     SHADY_UNREACHABLE;
 }
@@ -249,7 +354,9 @@ static SpvId nodes_to_codom(Emitter* emitter, Nodes return_types) {
         case 0: return emitter->void_t;
         case 1: return emit_type(emitter, return_types.nodes[0]);
         default: {
+            lock_arena(emitter);
             const Type* codom_ret_type = record_type(emitter->arena, (RecordType) {.members = return_types});
+            unlock_arena(emitter);
             return emit_type(emitter, codom_ret_type);
         }
     }
@@ -267,14 +374,14 @@ static void emit_call(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_build
     switch (variables.count) {
         case 0: break;
         case 1: {
-            register_result(emitter, variables.nodes[0], result);
+            register_result(emitter, fn_builder, variables.nodes[0], result);
             break;
         }
         default: {
             for (size_t i = 0; i < variables.count; i++) {
                 SpvId result_type = emit_type(emitter, variables.nodes[i]->type);
                 SpvId extracted_component = spvb_extract(bb_builder, result_type, result, 1, (uint32_t []) { i });
-                register_result(emitter, variables.nodes[i], extracted_component);
+                register_result(emitter, fn_builder, variables.nodes[i], extracted_component);
             }
             break;
         }
@@ -284,10 +391,10 @@ static void emit_call(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_build
 static void emit_if(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_builder, MergeTargets* merge_targets, If if_instr, Nodes variables) {
     assert(if_instr.yield_types.count == 0 && "TODO use phis");
 
-    SpvId next_id = spvb_fresh_id(emitter->file_builder);
+    SpvId next_id = spvb_fn_fresh_id(fn_builder);
 
-    SpvId true_id = spvb_fresh_id(emitter->file_builder);
-    SpvId false_id = if_instr.if_false ? spvb_fresh_id(emitter->file_builder) : next_id;
+    SpvId true_id = spvb_fn_fresh_id(fn_builder);
+    SpvId false_id = if_instr.if_false ? spvb_fn_fresh_id(fn_builder) : next_id;
 
     spvb_selection_merge(*bb_builder, next_id, 0);
     SpvId condition = emit_value(emitter, if_instr.condition, NULL);
@@ -307,14 +414,14 @@ static void emit_if(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_builde
 static void emit_match(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_builder, MergeTargets* merge_targets, Match match, Nodes variables) {
     assert(match.yield_types.count == 0 && "TODO use phis");
 
-    SpvId next_id = spvb_fresh_id(emitter->file_builder);
+    SpvId next_id = spvb_fn_fresh_id(fn_builder);
 
-    SpvId default_id = spvb_fresh_id(emitter->file_builder);
+    SpvId default_id = spvb_fn_fresh_id(fn_builder);
     LARRAY(SpvId, literals_and_cases, match.cases.count * 2);
     for (size_t i = 0; i < match.cases.count; i++) {
-        literals_and_cases[i * 2 + 0] = spvb_fresh_id(emitter->file_builder);
-        literals_and_cases[i * 2 + 1] = spvb_fresh_id(emitter->file_builder);
-        emit_value(emitter, match.literals.nodes[i], &literals_and_cases[i * 2 + 0]);
+        // OpSwitch takes the case values as literals, not as constant IDs
+        literals_and_cases[i * 2 + 0] = (SpvId) extract_int_literal_value(match.literals.nodes[i], false);
+        literals_and_cases[i * 2 + 1] = spvb_fn_fresh_id(fn_builder);
     }
 
     spvb_selection_merge(*bb_builder, next_id, 0);
@@ -337,10 +444,10 @@ static void emit_loop(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_buil
     assert(loop_instr.yield_types.count == 0 && "TODO use phis");
     assert(loop_instr.params.count == 0 && "TODO use phis");
 
-    SpvId header_id = spvb_fresh_id(emitter->file_builder);
-    SpvId body_id = spvb_fresh_id(emitter->file_builder);
-    SpvId continue_id = spvb_fresh_id(emitter->file_builder);
-    SpvId next_id = spvb_fresh_id(emitter->file_builder);
+    SpvId header_id = spvb_fn_fresh_id(fn_builder);
+    SpvId body_id = spvb_fn_fresh_id(fn_builder);
+    SpvId continue_id = spvb_fn_fresh_id(fn_builder);
+    SpvId next_id = spvb_fn_fresh_id(fn_builder);
 
     // The current block goes to the header (it can't be the header itself !)
     spvb_branch(*bb_builder, header_id);
@@ -349,7 +456,7 @@ static void emit_loop(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_buil
     BBBuilder header_builder = spvb_begin_bb(fn_builder, header_id);
     spvb_loop_merge(header_builder, next_id, continue_id, 0, 0, NULL);
     spvb_branch(header_builder, body_id);
-    spvb_name(emitter->file_builder, header_id, "loop_header");
+    spvb_fn_name(fn_builder, header_id, "loop_header");
 
     // Emission of the body requires extra info for the break/continue merge terminators
     MergeTargets merge_targets_branches = *merge_targets;
@@ -357,26 +464,33 @@ static void emit_loop(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_buil
     merge_targets_branches.break_target = next_id;
     BBBuilder body_builder = spvb_begin_bb(fn_builder, body_id);
     emit_block(emitter, fn_builder, body_builder, merge_targets_branches, loop_instr.body);
-    spvb_name(emitter->file_builder, body_id, "loop_body");
+    spvb_fn_name(fn_builder, body_id, "loop_body");
 
     // the continue block just jumps back into the header
     BBBuilder continue_builder = spvb_begin_bb(fn_builder, continue_id);
     spvb_branch(continue_builder, header_id);
-    spvb_name(emitter->file_builder, continue_id, "loop_continue");
+    spvb_fn_name(fn_builder, continue_id, "loop_continue");
 
     // We start the next block
     BBBuilder next = spvb_begin_bb(fn_builder, next_id);
-    spvb_name(emitter->file_builder, next_id, "loop_next");
+    spvb_fn_name(fn_builder, next_id, "loop_next");
     *bb_builder = next;
 }
 
 static void emit_instruction(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_builder, MergeTargets* merge_targets, const Node* instruction) {
     assert(is_instruction(instruction));
-    Nodes variables = nodes(emitter->arena, 0, NULL);
+    Nodes variables = { .count = 0, .nodes = NULL };
 
     if (instruction->tag == Let_TAG) {
         variables = instruction->payload.let.variables;
         instruction = instruction->payload.let.instruction;
+        // folding leaves values behind, the variable just stands for it
+        if (is_value(instruction)) {
+            assert(variables.count == 1);
+            SpvId value = emit_value(emitter, instruction, NULL);
+            insert_dict_and_get_result(struct Node*, SpvId, emitter->node_ids, variables.nodes[0], value);
+            return;
+        }
         assert(is_instruction(instruction) && instruction->tag != Let_TAG);
     }
 
@@ -391,7 +505,7 @@ static void emit_instruction(Emitter* emitter, FnBuilder fn_builder, BBBuilder*
 }
 
 static SpvId find_reserved_id(Emitter* emitter, const Node* node) {
-    SpvId* found = find_value_dict(const Node*, SpvId, emitter->node_ids, node);
+    SpvId* found = find_id(emitter, node);
     assert(found);
     return *found;
 }
@@ -471,9 +585,9 @@ static void emit_block(Emitter* emitter, FnBuilder fn_builder, BBBuilder basic_b
 static void emit_basic_block(Emitter* emitter, FnBuilder fn_builder, const CFNode* node, bool is_entry) {
     assert(node->node->tag == Function_TAG);
     // Find the preassigned ID to this
-    SpvId bb_id = is_entry ? spvb_fresh_id(emitter->file_builder) : find_reserved_id(emitter, node->node);
+    SpvId bb_id = is_entry ? spvb_fn_fresh_id(fn_builder) : find_reserved_id(emitter, node->node);
     BBBuilder basic_block_builder = spvb_begin_bb(fn_builder, bb_id);
-    spvb_name(emitter->file_builder, bb_id, node->node->payload.fn.name);
+    spvb_fn_name(fn_builder, bb_id, node->node->payload.fn.name);
 
     MergeTargets merge_targets = {
         .continue_target = 0,
@@ -490,11 +604,19 @@ static void emit_basic_block(Emitter* emitter, FnBuilder fn_builder, const CFNod
     }
 }
 
-static void emit_function(Emitter* emitter, const Node* node) {
+/// Emits a function body into its own builder, using only IDs from the range reserved for it by prepare_function.
+/// This does not write to the file builder nor to the emitter's dictionary, so several functions can be emitted at once.
+static FnBuilder emit_function(Emitter* emitter, const Node* node, SpvId ids_begin, size_t ids_count) {
     assert(node->tag == Function_TAG);
 
+    Emitter fn_emitter = *emitter;
+    fn_emitter.global_ids = emitter->node_ids;
+    fn_emitter.node_ids = new_dict(Node*, SpvId, (HashFn) hash_node, (CmpFn) compare_node);
+    emitter = &fn_emitter;
+
     const Type* fn_type = node->type;
     FnBuilder fn_builder = spvb_begin_fn(emitter->file_builder, find_reserved_id(emitter, node), emit_type(emitter, fn_type), nodes_to_codom(emitter, node->payload.fn.return_types));
+    spvb_fn_use_id_range(fn_builder, ids_begin, ids_count);
 
     Nodes params = node->payload.fn.params;
     for (size_t i = 0; i < params.count; i++) {
@@ -503,19 +625,170 @@ static void emit_function(Emitter* emitter, const Node* node) {
     }
 
     Scope scope = build_scope(node);
+    // Basic blocks can be branched to before they are emitted
+    for (size_t i = 1; i < scope.size; i++) {
+        const Node* bb = read_list(CFNode*, scope.contents)[i]->node;
+        SpvId bb_id = spvb_fn_fresh_id(fn_builder);
+        insert_dict_and_get_result(struct Node*, SpvId, emitter->node_ids, bb, bb_id);
+    }
     emit_basic_block(emitter, fn_builder, scope.entry, true);
     dispose_scope(&scope);
 
-    spvb_define_function(emitter->file_builder, fn_builder);
+    destroy_dict(fn_emitter.node_ids);
+    return fn_builder;
+}
+
+static void prepare_subgroup_ops(Emitter* emitter) {
+    if (emitter->subgroup.scope)
+        return;
+    FileBuilder file_builder = emitter->file_builder;
+    spvb_capability(file_builder, SpvCapabilityGroupNonUniform);
+    spvb_capability(file_builder, SpvCapabilityGroupNonUniformBallot);
+    emitter->subgroup.u32_t = spvb_int_type(file_builder, 32, false);
+    emitter->subgroup.uvec2_t = spvb_vector_type(file_builder, emitter->subgroup.u32_t, 2);
+    emitter->subgroup.ballot_t = spvb_vector_type(file_builder, emitter->subgroup.u32_t, 4);
+    emitter->subgroup.scope = spvb_fresh_id(file_builder);
+    spvb_constant(file_builder, emitter->subgroup.scope, emitter->subgroup.u32_t, 1, (uint32_t []) { SpvScopeSubgroup });
+}
+
+static void prepare_subgroup_local_id(Emitter* emitter) {
+    prepare_subgroup_ops(emitter);
+    if (emitter->subgroup.local_id)
+        return;
+    FileBuilder file_builder = emitter->file_builder;
+    SpvId ptr_t = spvb_ptr_type(file_builder, SpvStorageClassInput, emitter->subgroup.u32_t);
+    emitter->subgroup.local_id = spvb_global_variable(file_builder, spvb_fresh_id(file_builder), ptr_t, SpvStorageClassInput, false, 0);
+    spvb_decorate(file_builder, emitter->subgroup.local_id, SpvDecorationBuiltIn, 1, (uint32_t []) { SpvBuiltInSubgroupLocalInvocationId });
+    spvb_name(file_builder, emitter->subgroup.local_id, "subgroup_local_id");
+}
+
+/// What emit_primop needs out of the shared sections besides its operands and results, returns how many IDs it takes
+static size_t prepare_primop(Emitter* emitter, const Node* instr) {
+    Nodes args = instr->payload.prim_op.operands;
+    switch (instr->payload.prim_op.op) {
+        case alloca_op:
+        case alloca_logical_op: {
+            emit_type(emitter, ptr_type(emitter->arena, (PtrType) {
+                .address_space = AsFunctionLogical,
+                .pointed_type = args.nodes[0]
+            }));
+            return 1;
+        }
+        case lea_op: emit_type(emitter, instr->type); return 1;
+        case subgroup_active_mask_op:
+        case subgroup_ballot_op: {
+            prepare_subgroup_ops(emitter);
+            emit_value(emitter, true_lit(emitter->arena), NULL);
+            // the ballot, the components it's made of and the bitcast
+            return 5;
+        }
+        case subgroup_local_id_op: {
+            prepare_subgroup_local_id(emitter);
+            emit_type(emitter, int32_type(emitter->arena));
+            // the load and the bitcast
+            return 2;
+        }
+        case subgroup_elect_first_op: prepare_subgroup_ops(emitter); emit_type(emitter, bool_type(emitter->arena)); return 1;
+        case subgroup_broadcast_first_op: prepare_subgroup_ops(emitter); emit_type(emitter, without_qualifier(args.nodes[0]->type)); return 1;
+        default: break;
+    }
+
+    if (isel_table[instr->payload.prim_op.op].i_sel_mechanism != Custom) {
+        switch (isel_table[instr->payload.prim_op.op].result_kind) {
+            case Same:      emit_type(emitter, without_qualifier(args.nodes[0]->type)); break;
+            case Bool:      emit_type(emitter, bool_type(emitter->arena)); break;
+            case TyOperand: break;
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    Visitor visitor;
+    Emitter* emitter;
+    /// an upper bound on the fresh IDs emitting what was visited takes
+    size_t ids_count;
+} PrepareVisitor;
+
+/// Emits the types and constants it meets in the shared sections and counts the IDs the rest will take.
+/// Only the nodes that need more than that are looked at here, everything else goes through visit_children.
+static void prepare_node(PrepareVisitor* visitor, const Node* node) {
+    Emitter* emitter = visitor->emitter;
+    if (is_type(node)) {
+        emit_type(emitter, node);
+        return;
+    }
+
+    switch (node->tag) {
+        // declarations get their IDs from emit_declarations
+        case Function_TAG:
+        case Constant_TAG:
+        case GlobalVariable_TAG: return;
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG: emit_value(emitter, node, NULL); return;
+        case Variable_TAG: emit_type(emitter, node->payload.var.type); return;
+        // several results are extracted out of a composite one by one
+        case Let_TAG: visitor->ids_count += node->payload.let.variables.count; break;
+        case PrimOp_TAG: visitor->ids_count += prepare_primop(emitter, node); break;
+        case Call_TAG: {
+            const Type* callee_type = without_qualifier(node->payload.call_instr.callee->type);
+            assert(callee_type->tag == FnType_TAG);
+            nodes_to_codom(emitter, callee_type->payload.fn_type.return_types);
+            visitor->ids_count += 1;
+            break;
+        }
+        case If_TAG:    visitor->ids_count += 3; break;
+        case Match_TAG: visitor->ids_count += 2 + node->payload.match_instr.cases.count; break;
+        case Loop_TAG:  visitor->ids_count += 4; break;
+        // returning several values builds a composite
+        case Return_TAG: visitor->ids_count += 1; break;
+        default: break;
+    }
+    visit_children(&visitor->visitor, node);
+}
+
+/// Emits, in the shared sections, every type and constant the function refers to.
+/// Returns how many IDs must be reserved to emit the body.
+static size_t prepare_function(Emitter* emitter, const Node* node) {
+    assert(node->tag == Function_TAG);
+    emit_type(emitter, node->type);
+    nodes_to_codom(emitter, node->payload.fn.return_types);
+
+    PrepareVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) prepare_node,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = false,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .emitter = emitter,
+        .ids_count = node->payload.fn.params.count,
+    };
+    for (size_t i = 0; i < node->payload.fn.params.count; i++)
+        prepare_node(&visitor, node->payload.fn.params.nodes[i]);
+
+    Scope scope = build_scope(node);
+    visitor.ids_count += scope.size;
+    for (size_t i = 0; i < scope.size; i++) {
+        const Node* bb = read_list(CFNode*, scope.contents)[i]->node;
+        prepare_node(&visitor, bb->payload.fn.block);
+    }
+    dispose_scope(&scope);
+    return visitor.ids_count;
 }
 
 static SpvId emit_value(Emitter* emitter, const Node* node, const SpvId* use_id) {
     if (!use_id) { // re-emit the thing multiple times if we need a specific ID
-        SpvId* existing = find_value_dict(struct Node*, SpvId, emitter->node_ids, node);
+        SpvId* existing = find_id(emitter, node);
         if (existing)
             return *existing;
     }
 
+    if (emitter->global_ids)
+        error("value %s was not emitted ahead of the function body", node_tags[node->tag]);
+
     SpvId new = use_id ? *use_id : spvb_fresh_id(emitter->file_builder);
     insert_dict_and_get_result(struct Node*, SpvId, emitter->node_ids, node, new);
 
@@ -523,9 +796,9 @@ static SpvId emit_value(Emitter* emitter, const Node* node, const SpvId* use_id)
         case Variable_TAG: error("this node should have been resolved already");
         case IntLiteral_TAG: {
             SpvId ty = emit_type(emitter, node->type);
-            // 64-bit constants take two spirv words, anythinfg else fits in one
+            // 64-bit constants take two spirv words, low-order word first, anything else fits in one
             if (node->payload.int_literal.width == IntTy64) {
-                uint32_t arr[] = { node->payload.int_literal.value_i64 >> 32, node->payload.int_literal.value_i64 & 0xFFFFFFFF };
+                uint32_t arr[] = { node->payload.int_literal.value_i64 & 0xFFFFFFFF, node->payload.int_literal.value_i64 >> 32 };
                 spvb_constant(emitter->file_builder, new, ty, 2, arr);
             } else {
                 uint32_t arr[] = { node->payload.int_literal.value_i32 };
@@ -547,19 +820,22 @@ static SpvId emit_value(Emitter* emitter, const Node* node, const SpvId* use_id)
 }
 
 static SpvId emit_type(Emitter* emitter, const Type* type) {
-    SpvId* existing = find_value_dict(struct Node*, SpvId, emitter->node_ids, type);
+    SpvId* existing = find_id(emitter, type);
     if (existing)
         return *existing;
-    
+
+    if (emitter->global_ids)
+        error("type %s was not emitted ahead of the function body", node_tags[type->tag]);
+
     SpvId new;
     switch (type->tag) {
         case Int_TAG: {
             int width;
             switch (type->payload.int_type.width) {
-                case IntTy8:  width = 8;  break;
-                case IntTy16: width = 16; break;
+                case IntTy8:  width = 8;  spvb_capability(emitter->file_builder, SpvCapabilityInt8);  break;
+                case IntTy16: width = 16; spvb_capability(emitter->file_builder, SpvCapabilityInt16); break;
                 case IntTy32: width = 32; break;
-                case IntTy64: width = 64; break;
+                case IntTy64: width = 64; spvb_capability(emitter->file_builder, SpvCapabilityInt64); break;
                 default: assert(false);
             }
             new = spvb_int_type(emitter->file_builder, width, true);
@@ -611,20 +887,47 @@ static SpvId emit_type(Emitter* emitter, const Type* type) {
     return new;
 }
 
-void emit_spirv(CompilerConfig* config, IrArena* arena, const Node* root_node, FILE* output) {
-    const Root* top_level = &root_node->payload.root;
-    struct List* words = new_list(uint32_t);
+typedef struct {
+    Emitter* emitter;
+    size_t count;
+    const Node** functions;
+    SpvId* ids_begin;
+    size_t* ids_count;
+    FnBuilder* fn_builders;
+
+    pthread_mutex_t queue_lock;
+    size_t next;
+} FnEmissionQueue;
+
+static void* emit_functions_worker(FnEmissionQueue* queue) {
+    while (true) {
+        pthread_mutex_lock(&queue->queue_lock);
+        size_t i = queue->next++;
+        pthread_mutex_unlock(&queue->queue_lock);
+        if (i >= queue->count)
+            return NULL;
+        queue->fn_builders[i] = emit_function(queue->emitter, queue->functions[i], queue->ids_begin[i], queue->ids_count[i]);
+    }
+}
 
-    FileBuilder file_builder = spvb_begin();
+static size_t emission_threads_count(CompilerConfig* config, size_t functions_count) {
+    size_t threads = config->emission_threads;
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (size_t) cores : 1;
+    }
+    if (threads > functions_count)
+        threads = functions_count;
+    return threads;
+}
 
-    Emitter emitter = {
-        .configuration = config,
-        .arena = arena,
-        .file_builder = file_builder,
-        .node_ids = new_dict(Node*, SpvId, (HashFn) hash_node, (CmpFn) compare_node),
-    };
+/// Emits everything that lives in the shared sections, in declaration order.
+/// Each function gets the types and constants it uses emitted here, along with a range of IDs for its body, and is queued for later.
+static void emit_declarations(Emitter* emitter, const Node* root_node, FnEmissionQueue* queue) {
+    const Root* top_level = &root_node->payload.root;
+    FileBuilder file_builder = emitter->file_builder;
 
-    emitter.void_t = spvb_void_type(emitter.file_builder);
+    emitter->void_t = spvb_void_type(file_builder);
 
     spvb_capability(file_builder, SpvCapabilityShader);
     spvb_capability(file_builder, SpvCapabilityLinkage);
@@ -632,45 +935,148 @@ void emit_spirv(CompilerConfig* config, IrArena* arena, const Node* root_node, F
     spvb_capability(file_builder, SpvCapabilitySubgroupBallotKHR);
 
     // First reserve IDs for declarations
-    LARRAY(SpvId, ids, top_level->declarations.count);
-    int global_fn_case_number = 1;
-    for (size_t i = 0; i < top_level->declarations.count; i++) {
+    size_t decls_count = top_level->declarations.count;
+    LARRAY(SpvId, ids, decls_count);
+    for (size_t i = 0; i < decls_count; i++) {
         const Node* decl = top_level->declarations.nodes[i];
         ids[i] = spvb_fresh_id(file_builder);
-        insert_dict_and_get_result(struct Node*, SpvId, emitter.node_ids, decl, ids[i]);
+        insert_dict_and_get_result(struct Node*, SpvId, emitter->node_ids, decl, ids[i]);
     }
 
-    for (size_t i = 0; i < top_level->declarations.count; i++) {
+    *queue = (FnEmissionQueue) {
+        .emitter = emitter,
+        .count = 0,
+        .functions = malloc(sizeof(const Node*) * decls_count),
+        .ids_begin = malloc(sizeof(SpvId) * decls_count),
+        .ids_count = malloc(sizeof(size_t) * decls_count),
+        .fn_builders = malloc(sizeof(FnBuilder) * decls_count),
+        .next = 0,
+    };
+
+    for (size_t i = 0; i < decls_count; i++) {
         const Node* decl = top_level->declarations.nodes[i];
         switch (decl->tag) {
             case GlobalVariable_TAG: {
                 const GlobalVariable* gvar = &decl->payload.global_variable;
                 SpvId init = 0;
                 if (gvar->init)
-                    init = emit_value(&emitter, gvar->init, NULL);
-                spvb_global_variable(file_builder, ids[i], emit_type(&emitter, decl->type), emit_addr_space(gvar->address_space), false, init);
+                    init = emit_value(emitter, gvar->init, NULL);
+                spvb_global_variable(file_builder, ids[i], emit_type(emitter, decl->type), emit_addr_space(gvar->address_space), false, init);
                 spvb_name(file_builder, ids[i], gvar->name);
                 break;
             } case Function_TAG: {
-                emit_function(&emitter, decl);
+                size_t fn_index = queue->count++;
+                queue->functions[fn_index] = decl;
+                queue->ids_count[fn_index] = prepare_function(emitter, decl);
+                queue->ids_begin[fn_index] = spvb_reserve_ids(file_builder, queue->ids_count[fn_index]);
                 spvb_name(file_builder, ids[i], decl->payload.fn.name);
                 break;
             } case Constant_TAG: {
                 const Constant* cnst = &decl->payload.constant;
-                emit_value(&emitter, cnst->value, &ids[i]);
+                emit_value(emitter, cnst->value, &ids[i]);
                 spvb_name(file_builder, ids[i], cnst->name);
                 break;
             }
             default: error("unhandled declaration kind")
         }
     }
+}
+
+static void destroy_queue(FnEmissionQueue* queue) {
+    free(queue->functions);
+    free(queue->ids_begin);
+    free(queue->ids_count);
+    free(queue->fn_builders);
+}
+
+static FileBuilder emit_module(CompilerConfig* config, IrArena* arena, const Node* root_node) {
+    FileBuilder file_builder = spvb_begin();
+    Emitter emitter = {
+        .configuration = config,
+        .arena = arena,
+        .file_builder = file_builder,
+        .node_ids = new_dict(Node*, SpvId, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    FnEmissionQueue queue;
+    emit_declarations(&emitter, root_node, &queue);
+
+    // Function bodies only read the shared state from now on, so they can be emitted concurrently.
+    // Since every ID was handed out above, the result does not depend on the number of threads.
+    pthread_mutex_init(&queue.queue_lock, NULL);
+    size_t threads_count = emission_threads_count(config, queue.count);
+    if (threads_count <= 1) {
+        emit_functions_worker(&queue);
+    } else {
+        pthread_mutex_t arena_lock;
+        pthread_mutex_init(&arena_lock, NULL);
+        emitter.arena_lock = &arena_lock;
+
+        LARRAY(pthread_t, threads, threads_count);
+        for (size_t i = 0; i < threads_count; i++)
+            if (pthread_create(&threads[i], NULL, (void*(*)(void*)) emit_functions_worker, &queue) != 0)
+                error("failed to start an emission thread");
+        for (size_t i = 0; i < threads_count; i++)
+            pthread_join(threads[i], NULL);
+
+        emitter.arena_lock = NULL;
+        pthread_mutex_destroy(&arena_lock);
+    }
+    pthread_mutex_destroy(&queue.queue_lock);
 
-    spvb_finish(file_builder, words);
+    for (size_t i = 0; i < queue.count; i++)
+        spvb_define_function(file_builder, queue.fn_builders[i]);
 
     // cleanup the emitter
+    destroy_queue(&queue);
     destroy_dict(emitter.node_ids);
 
-    fwrite(words->alloc, words->elements_count, 4, output);
+    return file_builder;
+}
+
+/// Writes the shared sections as soon as the declarations are done, then emits and writes the functions one by one,
+/// so only a single function body is held in memory at any time.
+static void emit_module_streaming(CompilerConfig* config, IrArena* arena, const Node* root_node, int fd) {
+    FileBuilder file_builder = spvb_begin();
+    Emitter emitter = {
+        .configuration = config,
+        .arena = arena,
+        .file_builder = file_builder,
+        .node_ids = new_dict(Node*, SpvId, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    FnEmissionQueue queue;
+    emit_declarations(&emitter, root_node, &queue);
+
+    if (!spvb_flush_header_to_fd(file_builder, fd))
+        error("failed to write the SPIR-V module");
+    for (size_t i = 0; i < queue.count; i++) {
+        FnBuilder fn_builder = emit_function(&emitter, queue.functions[i], queue.ids_begin[i], queue.ids_count[i]);
+        if (!spvb_flush_function_to_fd(file_builder, fn_builder, fd))
+            error("failed to write the SPIR-V module");
+    }
+
+    destroy_queue(&queue);
+    destroy_dict(emitter.node_ids);
+    spvb_destroy(file_builder);
+}
+
+void emit_spirv_to_blob(CompilerConfig* config, IrArena* arena, const Node* root_node, ShadyBlob* output) {
+    FileBuilder file_builder = emit_module(config, arena, root_node);
+    output->words_count = spvb_finished_size(file_builder);
+    output->words = malloc(output->words_count * sizeof(uint32_t));
+    spvb_finish(file_builder, output->words);
+}
+
+void emit_spirv(CompilerConfig* config, IrArena* arena, const Node* root_node, FILE* output) {
+    // the sections bypass stdio, anything already buffered in it has to go out first
+    fflush(output);
+    if (config->streaming_emission) {
+        emit_module_streaming(config, arena, root_node, fileno(output));
+        return;
+    }
 
-    destroy_list(words);
+    FileBuilder file_builder = emit_module(config, arena, root_node);
+    if (!spvb_finish_to_fd(file_builder, fileno(output)))
+        error("failed to write the SPIR-V module");
 }
@@ -8,24 +8,18 @@
 #include <stdlib.h>
 #include <assert.h>
 
-typedef struct List* SpvSectionBuilder;
+#include <sys/uio.h>
+#include <limits.h>
 
-struct PhiOp {
-    SpvId value;
-    SpvId basic_block;
-};
+// limits.h only has it with the XSI extensions, which the C11 builds do not enable
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-struct Phi {
-    SpvId type;
-    SpvId value;
-    struct List* preds;
-};
+typedef struct List* SpvSectionBuilder;
 
 struct SpvBasicBlockBuilder {
-    struct SpvFileBuilder* file_builder;
-    struct List* section_data;
-
-    struct List* phis;
+    struct SpvFnBuilder* fn_builder;
     SpvId label;
 };
 
@@ -36,10 +30,21 @@ struct SpvFnBuilder {
     SpvId fn_type;
     SpvId fn_ret_type;
     struct List* bbs;
+    // Basic blocks are written to the body as they come, so only the last one started can be appended to
+    struct SpvBasicBlockBuilder* current_bb;
 
-    // Contains OpFunctionParams
+    // Contains OpFunction, the OpFunctionParams and the label of the first basic block
     SpvSectionBuilder header;
+    // OpVariables must come first in the first basic block, they are stitched in between the header and the body
     SpvSectionBuilder variables;
+    // Everything else
+    SpvSectionBuilder body;
+    // OpNames for IDs local to this function, merged into the file's debug names on definition
+    SpvSectionBuilder debug_names;
+
+    // When set, fresh IDs come from this preallocated range and the function can be built without touching the file
+    SpvId next_id;
+    SpvId ids_end;
 };
 
 struct SpvFileBuilder {
@@ -47,6 +52,8 @@ struct SpvFileBuilder {
     SpvMemoryModel memory_model;
 
     uint32_t bound;
+    // In streaming mode, set once everything but the function definitions has been written out
+    bool header_flushed;
 
     // Ordered as per https://www.khronos.org/registry/spir-v/specs/unified1/SPIRV.pdf#subsection.2.4
     SpvSectionBuilder capabilities;
@@ -60,13 +67,29 @@ struct SpvFileBuilder {
     SpvSectionBuilder annotations;
     SpvSectionBuilder types_constants;
     SpvSectionBuilder fn_decls;
-    SpvSectionBuilder fn_defs;
+    // Defined functions are not merged into a section, their own sections get written out directly
+    struct List* fn_defs;
 };
 
 SpvId spvb_fresh_id(struct SpvFileBuilder* file_builder) {
+    assert(!file_builder->header_flushed && "the bound was already written out");
     return file_builder->bound++;
 }
 
+SpvId spvb_reserve_ids(struct SpvFileBuilder* file_builder, size_t count) {
+    assert(!file_builder->header_flushed && "the bound was already written out");
+    SpvId first = file_builder->bound;
+    file_builder->bound += count;
+    return first;
+}
+
+SpvId spvb_fn_fresh_id(struct SpvFnBuilder* fn_builder) {
+    if (fn_builder->ids_end == 0)
+        return spvb_fresh_id(fn_builder->file_builder);
+    assert(fn_builder->next_id < fn_builder->ids_end && "function ran out of reserved IDs");
+    return fn_builder->next_id++;
+}
+
 inline static int div_roundup(int a, int b) {
     if (a % b == 0)
         return a / b;
@@ -114,20 +137,19 @@ inline static void literal_int_(SpvSectionBuilder data, uint32_t i) {
     output_word(data, i);
 }
 
-#define copy_section(section) copy_section_(target_data, section)
-inline static void copy_section_(SpvSectionBuilder target, SpvSectionBuilder source) {
-    for (size_t i = 0; i < source->elements_count; i++)
-        literal_int_(target, read_list(uint32_t, source)[i]);
+inline static SpvSectionBuilder bb_section(struct SpvBasicBlockBuilder* bb_builder) {
+    assert(bb_builder == bb_builder->fn_builder->current_bb && "basic blocks must be built one after the other");
+    return bb_builder->fn_builder->body;
 }
 
 // It is tiresome to pass the context over and over again. Let's not !
 // We use this macro to save us some typing
-#define target_data bb_builder->section_data
+#define target_data bb_section(bb_builder)
 
 SpvId spvb_undef(struct SpvBasicBlockBuilder* bb_builder, SpvId type) {
     op(SpvOpUndef, 3);
     ref_id(type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     return id;
 }
@@ -135,7 +157,7 @@ SpvId spvb_undef(struct SpvBasicBlockBuilder* bb_builder, SpvId type) {
 SpvId spvb_composite(struct SpvBasicBlockBuilder* bb_builder, SpvId aggregate_t, size_t elements_count, SpvId elements[]) {
     op(SpvOpCompositeConstruct, 3u + elements_count);
     ref_id(aggregate_t);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     for (size_t i = 0; i < elements_count; i++)
         ref_id(elements[i]);
@@ -145,7 +167,7 @@ SpvId spvb_composite(struct SpvBasicBlockBuilder* bb_builder, SpvId aggregate_t,
 SpvId spvb_select(struct SpvBasicBlockBuilder* bb_builder, SpvId type, SpvId condition, SpvId if_true, SpvId if_false) {
     op(SpvOpSelect, 6);
     ref_id(type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     ref_id(condition);
     ref_id(if_true);
@@ -156,7 +178,7 @@ SpvId spvb_select(struct SpvBasicBlockBuilder* bb_builder, SpvId type, SpvId con
 SpvId spvb_extract(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId composite, size_t indices_count, uint32_t indices[]) {
     op(SpvOpCompositeExtract, 4u + indices_count);
     ref_id(target_type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     ref_id(composite);
     for (size_t i = 0; i < indices_count; i++)
@@ -167,7 +189,7 @@ SpvId spvb_extract(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, S
 SpvId spvb_insert(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId object, SpvId composite, size_t indices_count, uint32_t indices[]) {
     op(SpvOpCompositeInsert, 5 + indices_count);
     ref_id(target_type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     ref_id(object);
     ref_id(composite);
@@ -179,7 +201,7 @@ SpvId spvb_insert(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, Sp
 SpvId spvb_vector_extract_dynamic(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId vector, SpvId index) {
     op(SpvOpVectorExtractDynamic, 5);
     ref_id(target_type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     ref_id(vector);
     ref_id(index);
@@ -189,7 +211,7 @@ SpvId spvb_vector_extract_dynamic(struct SpvBasicBlockBuilder* bb_builder, SpvId
 SpvId spvb_vector_insert_dynamic(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId vector, SpvId component, SpvId index) {
     op(SpvOpVectorInsertDynamic, 6);
     ref_id(target_type);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(id);
     ref_id(vector);
     ref_id(component);
@@ -200,7 +222,7 @@ SpvId spvb_vector_insert_dynamic(struct SpvBasicBlockBuilder* bb_builder, SpvId
 // Used for almost all conversion operations
 SpvId spvb_convert(struct SpvBasicBlockBuilder* bb_builder, SpvOp op, SpvId target_type, SpvId value) {
     op(op, 4);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(target_type);
     ref_id(id);
     ref_id(value);
@@ -209,7 +231,7 @@ SpvId spvb_convert(struct SpvBasicBlockBuilder* bb_builder, SpvOp op, SpvId targ
 
 SpvId spvb_access_chain(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId element, size_t indices_count, SpvId indices[]) {
     op(SpvOpAccessChain, 4 + indices_count);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(target_type);
     ref_id(id);
     ref_id(element);
@@ -220,7 +242,7 @@ SpvId spvb_access_chain(struct SpvBasicBlockBuilder* bb_builder, SpvId target_ty
 
 SpvId spvb_ptr_access_chain(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId base, SpvId element, size_t indices_count, SpvId indices[]) {
     op(SpvOpPtrAccessChain, 5 + indices_count);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(target_type);
     ref_id(id);
     ref_id(base);
@@ -232,7 +254,7 @@ SpvId spvb_ptr_access_chain(struct SpvBasicBlockBuilder* bb_builder, SpvId targe
 
 SpvId spvb_load(struct SpvBasicBlockBuilder* bb_builder, SpvId target_type, SpvId pointer, size_t operands_count, uint32_t operands[]) {
     op(SpvOpLoad, 4 + operands_count);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(target_type);
     ref_id(id);
     ref_id(pointer);
@@ -251,7 +273,7 @@ void spvb_store(struct SpvBasicBlockBuilder* bb_builder, SpvId value, SpvId poin
 
 SpvId spvb_binop(struct SpvBasicBlockBuilder* bb_builder, SpvOp op, SpvId result_type, SpvId lhs, SpvId rhs) {
     op(op, 5);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(result_type);
     ref_id(id);
     ref_id(lhs);
@@ -261,7 +283,7 @@ SpvId spvb_binop(struct SpvBasicBlockBuilder* bb_builder, SpvOp op, SpvId result
 
 SpvId spvb_unop(struct SpvBasicBlockBuilder* bb_builder, SpvOp op, SpvId result_type, SpvId value) {
     op(op, 4);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(result_type);
     ref_id(id);
     ref_id(value);
@@ -308,7 +330,7 @@ void spvb_loop_merge(struct SpvBasicBlockBuilder* bb_builder, SpvId merge_bb, Sp
 
 SpvId spvb_call(struct SpvBasicBlockBuilder* bb_builder, SpvId return_type, SpvId callee, size_t arguments_count, SpvId arguments[]) {
     op(SpvOpFunctionCall, 4u + arguments_count);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(return_type);
     ref_id(id);
     ref_id(callee);
@@ -319,7 +341,7 @@ SpvId spvb_call(struct SpvBasicBlockBuilder* bb_builder, SpvId return_type, SpvI
 
 SpvId spvb_ext_instruction(struct SpvBasicBlockBuilder* bb_builder, SpvId return_type, SpvId set, uint32_t instruction, size_t arguments_count, SpvId arguments[]) {
     op(SpvOpExtInst, 5 + arguments_count);
-    SpvId id = spvb_fresh_id(bb_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(bb_builder->fn_builder);
     ref_id(return_type);
     ref_id(id);
     ref_id(set);
@@ -346,8 +368,9 @@ void spvb_unreachable(struct SpvBasicBlockBuilder* bb_builder) {
 #define target_data fn_builder->header
 
 SpvId spvb_parameter(struct SpvFnBuilder* fn_builder, SpvId param_type) {
+    assert(!fn_builder->current_bb && "parameters must be declared before the first basic block");
     op(SpvOpFunctionParameter, 3);
-    SpvId id = spvb_fresh_id(fn_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(fn_builder);
     ref_id(param_type);
     ref_id(id);
     return id;
@@ -359,12 +382,21 @@ SpvId spvb_parameter(struct SpvFnBuilder* fn_builder, SpvId param_type) {
 SpvId spvb_local_variable(struct SpvFnBuilder* fn_builder, SpvId type, SpvStorageClass storage_class) {
     op(SpvOpVariable, 4);
     ref_id(type);
-    SpvId id = spvb_fresh_id(fn_builder->file_builder);
+    SpvId id = spvb_fn_fresh_id(fn_builder);
     ref_id(id);
     literal_int(storage_class);
     return id;
 }
 
+#undef target_data
+#define target_data fn_builder->debug_names
+
+void spvb_fn_name(struct SpvFnBuilder* fn_builder, SpvId id, const char* str) {
+    op(SpvOpName, 2 + div_roundup(strlen(str) + 1, 4));
+    ref_id(id);
+    literal_name(str);
+}
+
 #undef target_data
 #define target_data file_builder->debug_names
 
@@ -528,59 +560,25 @@ SpvId spvb_debug_string(struct SpvFileBuilder* file_builder, const char* string)
     return id;
 }
 
-#undef target_data
-#define target_data file_builder->fn_defs
+static void end_function(struct SpvFnBuilder* fn_builder) {
+    assert(fn_builder->current_bb && "functions need at least one basic block");
+    op_(fn_builder->body, SpvOpFunctionEnd, 1);
+}
 
 void spvb_define_function(struct SpvFileBuilder* file_builder, struct SpvFnBuilder* fn_builder) {
-    op(SpvOpFunction, 5);
-    ref_id(fn_builder->fn_ret_type);
-    ref_id(fn_builder->function_id);
-    literal_int(SpvFunctionControlMaskNone);
-    ref_id(fn_builder->fn_type);
-
-    // Includes stuff like OpFunctionParameters
-    copy_section(fn_builder->header);
-
-    bool first = true;
-    for (size_t i = 0; i < fn_builder->bbs->elements_count; i++) {
-        op(SpvOpLabel, 2);
-        struct SpvBasicBlockBuilder* bb = read_list(struct SpvBasicBlockBuilder*, fn_builder->bbs)[i];
-        ref_id(bb->label);
-
-        if (first) {
-            // Variables are to be defined in the first BB
-            copy_section(fn_builder->variables);
-            first = false;
-        }
-
-        for (size_t j = 0; j < bb->phis->elements_count; j++) {
-            struct Phi* phi = &read_list(struct Phi, bb->phis)[j];
-
-            op(SpvOpPhi, 3 + 2 * phi->preds->elements_count);
-            ref_id(phi->type);
-            ref_id(phi->value);
-            assert(phi->preds->elements_count != 0);
-            for (size_t k = 0; k < phi->preds->elements_count; k++) {
-                struct PhiOp* pred = &read_list(struct PhiOp, phi->preds)[k];
-                ref_id(pred->value);
-                ref_id(pred->basic_block);
-            }
-
-            destroy_list(phi->preds);
-        }
-
-        copy_section(bb->section_data);
-
-        destroy_list(bb->phis);
-        destroy_list(bb->section_data);
-        free(bb);
-    }
-
-    op(SpvOpFunctionEnd, 1);
+    assert(!file_builder->header_flushed && "use spvb_flush_function_to_fd when streaming");
+    end_function(fn_builder);
+    append_list(struct SpvFnBuilder*, file_builder->fn_defs, fn_builder);
+}
 
+static void destroy_fn_builder(struct SpvFnBuilder* fn_builder) {
+    for (size_t i = 0; i < fn_builder->bbs->elements_count; i++)
+        free(read_list(struct SpvBasicBlockBuilder*, fn_builder->bbs)[i]);
     destroy_list(fn_builder->bbs);
     destroy_list(fn_builder->header);
     destroy_list(fn_builder->variables);
+    destroy_list(fn_builder->body);
+    destroy_list(fn_builder->debug_names);
     free(fn_builder);
 }
 
@@ -644,40 +642,97 @@ SpvId spvb_extended_import(struct SpvFileBuilder* file_builder, const char* name
 }*/
 
 #undef target_data
-#define target_data final_output
 
-inline static void merge_sections(SpvSectionBuilder final_output, struct SpvFileBuilder* file_builder) {
-    literal_int(SpvMagicNumber);
-    literal_int(0x00010500);
-    literal_int(0); // TODO get a magic number ?
-    literal_int(file_builder->bound);
-    literal_int(0); // instruction schema padding
+/// A run of words that goes into the final module as-is
+typedef struct {
+    const uint32_t* words;
+    size_t count;
+} Span;
+
+inline static void add_span(struct List* spans, const uint32_t* words, size_t count) {
+    if (count == 0)
+        return;
+    Span span = { .words = words, .count = count };
+    append_list(Span, spans, span);
+}
+
+inline static void add_section_span(struct List* spans, SpvSectionBuilder section) {
+    add_span(spans, section->alloc, section->elements_count);
+}
+
+/// Lists the pieces of the module in order, without copying any of them. fixed_words must hold 8 words and outlive the spans.
+static struct List* collect_spans(struct SpvFileBuilder* file_builder, uint32_t* fixed_words) {
+    fixed_words[0] = SpvMagicNumber;
+    fixed_words[1] = 0x00010500;
+    fixed_words[2] = 0; // TODO get a magic number ?
+    fixed_words[3] = file_builder->bound;
+    fixed_words[4] = 0; // instruction schema padding
+
+    fixed_words[5] = SpvOpMemoryModel | (3u << 16);
+    fixed_words[6] = file_builder->addressing_model;
+    fixed_words[7] = file_builder->memory_model;
+
+    size_t fns_count = file_builder->fn_defs->elements_count;
+    struct SpvFnBuilder** fns = read_list(struct SpvFnBuilder*, file_builder->fn_defs);
+
+    struct List* spans = new_list(Span);
+    add_span(spans, &fixed_words[0], 5);
+    add_section_span(spans, file_builder->capabilities);
+    add_section_span(spans, file_builder->extensions);
+    add_section_span(spans, file_builder->ext_inst_import);
+    add_span(spans, &fixed_words[5], 3);
+    add_section_span(spans, file_builder->entry_points);
+    add_section_span(spans, file_builder->execution_modes);
+    add_section_span(spans, file_builder->debug_string_source);
+    add_section_span(spans, file_builder->debug_names);
+    for (size_t i = 0; i < fns_count; i++)
+        add_section_span(spans, fns[i]->debug_names);
+    add_section_span(spans, file_builder->debug_module_processed);
+    add_section_span(spans, file_builder->annotations);
+    add_section_span(spans, file_builder->types_constants);
+    add_section_span(spans, file_builder->fn_decls);
+    for (size_t i = 0; i < fns_count; i++) {
+        add_section_span(spans, fns[i]->header);
+        add_section_span(spans, fns[i]->variables);
+        add_section_span(spans, fns[i]->body);
+    }
+    return spans;
+}
 
-    copy_section(file_builder->capabilities);
-    copy_section(file_builder->extensions);
-    copy_section(file_builder->ext_inst_import);
+size_t spvb_finished_size(struct SpvFileBuilder* file_builder) {
+    uint32_t fixed_words[8];
+    struct List* spans = collect_spans(file_builder, fixed_words);
+    size_t size = 0;
+    for (size_t i = 0; i < spans->elements_count; i++)
+        size += read_list(Span, spans)[i].count;
+    destroy_list(spans);
+    return size;
+}
 
-    op(SpvOpMemoryModel, 3);
-    literal_int(file_builder->addressing_model);
-    literal_int(file_builder->memory_model);
+static void destroy_file_builder(struct SpvFileBuilder* file_builder) {
+    for (size_t i = 0; i < file_builder->fn_defs->elements_count; i++)
+        destroy_fn_builder(read_list(struct SpvFnBuilder*, file_builder->fn_defs)[i]);
+    destroy_list(file_builder->fn_defs);
+    destroy_list(file_builder->fn_decls);
+    destroy_list(file_builder->types_constants);
+    destroy_list(file_builder->annotations);
+    destroy_list(file_builder->debug_module_processed);
+    destroy_list(file_builder->debug_names);
+    destroy_list(file_builder->debug_string_source);
+    destroy_list(file_builder->execution_modes);
+    destroy_list(file_builder->entry_points);
+    destroy_list(file_builder->ext_inst_import);
+    destroy_list(file_builder->extensions);
+    destroy_list(file_builder->capabilities);
 
-    copy_section(file_builder->entry_points);
-    copy_section(file_builder->execution_modes);
-    copy_section(file_builder->debug_string_source);
-    copy_section(file_builder->debug_names);
-    copy_section(file_builder->debug_module_processed);
-    copy_section(file_builder->annotations);
-    copy_section(file_builder->types_constants);
-    copy_section(file_builder->fn_decls);
-    copy_section(file_builder->fn_defs);
+    free(file_builder);
 }
 
-void spvb_build_function(struct SpvFileBuilder* file_builder);
-
 struct SpvFileBuilder* spvb_begin() {
     struct SpvFileBuilder* file_builder = (struct SpvFileBuilder*) malloc(sizeof(struct SpvFileBuilder));
     *file_builder = (struct SpvFileBuilder) {
         .bound = 1,
+        .header_flushed = false,
         .capabilities = new_list(uint32_t),
         .extensions = new_list(uint32_t),
         .ext_inst_import = new_list(uint32_t),
@@ -689,28 +744,93 @@ struct SpvFileBuilder* spvb_begin() {
         .annotations = new_list(uint32_t),
         .types_constants = new_list(uint32_t),
         .fn_decls = new_list(uint32_t),
-        .fn_defs = new_list(uint32_t),
+        .fn_defs = new_list(struct SpvFnBuilder*),
     };
     return file_builder;
 }
 
-void spvb_finish(struct SpvFileBuilder* file_builder, SpvSectionBuilder output) {
-    merge_sections(output, file_builder);
+void spvb_finish(struct SpvFileBuilder* file_builder, uint32_t* output) {
+    uint32_t fixed_words[8];
+    struct List* spans = collect_spans(file_builder, fixed_words);
+    for (size_t i = 0; i < spans->elements_count; i++) {
+        Span span = read_list(Span, spans)[i];
+        memcpy(output, span.words, span.count * sizeof(uint32_t));
+        output += span.count;
+    }
+    destroy_list(spans);
+    destroy_file_builder(file_builder);
+}
 
-    destroy_list(file_builder->fn_defs);
-    destroy_list(file_builder->fn_decls);
-    destroy_list(file_builder->types_constants);
-    destroy_list(file_builder->annotations);
-    destroy_list(file_builder->debug_module_processed);
-    destroy_list(file_builder->debug_names);
-    destroy_list(file_builder->debug_string_source);
-    destroy_list(file_builder->execution_modes);
-    destroy_list(file_builder->entry_points);
-    destroy_list(file_builder->ext_inst_import);
-    destroy_list(file_builder->extensions);
-    destroy_list(file_builder->capabilities);
+static bool write_spans_to_fd(struct List* spans, int fd) {
+    size_t spans_count = spans->elements_count;
 
-    free(file_builder);
+    struct iovec* iovecs = malloc(sizeof(struct iovec) * spans_count);
+    for (size_t i = 0; i < spans_count; i++) {
+        Span span = read_list(Span, spans)[i];
+        iovecs[i] = (struct iovec) { .iov_base = (void*) span.words, .iov_len = span.count * sizeof(uint32_t) };
+    }
+
+    bool ok = true;
+    struct iovec* remaining = iovecs;
+    size_t remaining_count = spans_count;
+    while (remaining_count > 0) {
+        int batch = remaining_count > IOV_MAX ? IOV_MAX : (int) remaining_count;
+        ssize_t written = writev(fd, remaining, batch);
+        if (written < 0) {
+            ok = false;
+            break;
+        }
+        // skip over what got written, writev is allowed to stop anywhere
+        size_t left = (size_t) written;
+        while (remaining_count > 0 && left >= remaining->iov_len) {
+            left -= remaining->iov_len;
+            remaining++;
+            remaining_count--;
+        }
+        if (left > 0) {
+            remaining->iov_base = (char*) remaining->iov_base + left;
+            remaining->iov_len -= left;
+        }
+    }
+
+    free(iovecs);
+    return ok;
+}
+
+bool spvb_finish_to_fd(struct SpvFileBuilder* file_builder, int fd) {
+    uint32_t fixed_words[8];
+    struct List* spans = collect_spans(file_builder, fixed_words);
+    bool ok = write_spans_to_fd(spans, fd);
+    destroy_list(spans);
+    destroy_file_builder(file_builder);
+    return ok;
+}
+
+bool spvb_flush_header_to_fd(struct SpvFileBuilder* file_builder, int fd) {
+    assert(!file_builder->header_flushed && file_builder->fn_defs->elements_count == 0);
+    uint32_t fixed_words[8];
+    struct List* spans = collect_spans(file_builder, fixed_words);
+    bool ok = write_spans_to_fd(spans, fd);
+    destroy_list(spans);
+    file_builder->header_flushed = true;
+    return ok;
+}
+
+bool spvb_flush_function_to_fd(struct SpvFileBuilder* file_builder, struct SpvFnBuilder* fn_builder, int fd) {
+    assert(file_builder->header_flushed && fn_builder->file_builder == file_builder);
+    end_function(fn_builder);
+    struct List* spans = new_list(Span);
+    add_section_span(spans, fn_builder->header);
+    add_section_span(spans, fn_builder->variables);
+    add_section_span(spans, fn_builder->body);
+    bool ok = write_spans_to_fd(spans, fd);
+    destroy_list(spans);
+    destroy_fn_builder(fn_builder);
+    return ok;
+}
+
+void spvb_destroy(struct SpvFileBuilder* file_builder) {
+    destroy_file_builder(file_builder);
 }
 
 struct SpvFnBuilder* spvb_begin_fn(struct SpvFileBuilder* file_builder, SpvId fn_id, SpvId fn_type, SpvId fn_ret_type) {
@@ -721,20 +841,42 @@ struct SpvFnBuilder* spvb_begin_fn(struct SpvFileBuilder* file_builder, SpvId fn
         .fn_ret_type = fn_ret_type,
         .file_builder = file_builder,
         .bbs = new_list(struct SpvBasicBlockBuilder*),
+        .current_bb = NULL,
         .variables = new_list(uint32_t),
         .header = new_list(uint32_t),
+        .body = new_list(uint32_t),
+        .debug_names = new_list(uint32_t),
     };
+
+    SpvSectionBuilder target_data = fnb->header;
+    op(SpvOpFunction, 5);
+    ref_id(fn_ret_type);
+    ref_id(fn_id);
+    literal_int(SpvFunctionControlMaskNone);
+    ref_id(fn_type);
+
     return fnb;
 }
 
+void spvb_fn_use_id_range(struct SpvFnBuilder* fn_builder, SpvId first, size_t count) {
+    assert(first + count <= fn_builder->file_builder->bound);
+    fn_builder->next_id = first;
+    fn_builder->ids_end = first + count;
+}
+
 struct SpvBasicBlockBuilder* spvb_begin_bb(struct SpvFnBuilder* fn_builder, SpvId label) {
     struct SpvBasicBlockBuilder* bbb = (struct SpvBasicBlockBuilder*) malloc(sizeof(struct SpvBasicBlockBuilder));
     *bbb = (struct SpvBasicBlockBuilder) {
-        .file_builder = fn_builder->file_builder,
+        .fn_builder = fn_builder,
         .label = label,
-        .phis = new_list(struct Phi),
-        .section_data = new_list(uint32_t)
     };
+
+    // the label of the first block goes before the variables, the others are part of the body
+    SpvSectionBuilder target_data = fn_builder->current_bb ? fn_builder->body : fn_builder->header;
+    op(SpvOpLabel, 2);
+    ref_id(label);
+
+    fn_builder->current_bb = bbb;
     append_list(struct SpvBasicBlockBuilder*, fn_builder->bbs, bbb);
     return bbb;
 }
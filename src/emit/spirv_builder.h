@@ -42,6 +42,8 @@ SpvId spvb_parameter(struct SpvFnBuilder* fn_builder, SpvId param_type);
 SpvId spvb_local_variable(struct SpvFnBuilder* fn_builder, SpvId type, SpvStorageClass storage_class);
 
 void  spvb_name(struct SpvFileBuilder* file_builder, SpvId id, const char* str);
+/// Names an ID that belongs to this function, the name is only written to the file when the function gets defined
+void  spvb_fn_name(struct SpvFnBuilder* fn_builder, SpvId id, const char* str);
 
 SpvId spvb_void_type(struct SpvFileBuilder* file_builder);
 SpvId spvb_bool_type(struct SpvFileBuilder* file_builder);
@@ -74,7 +76,20 @@ void  spvb_extension(struct SpvFileBuilder* file_builder, const char* name);
 SpvId spvb_extended_import(struct SpvFileBuilder* file_builder, const char* name);
 
 struct SpvFileBuilder* spvb_begin();
-void  spvb_finish(struct SpvFileBuilder*, SpvSectionBuilder output);
+/// Number of words spvb_finish will write
+size_t spvb_finished_size(struct SpvFileBuilder*);
+/// Writes the whole module to output, which must hold spvb_finished_size words, and destroys the builder
+void  spvb_finish(struct SpvFileBuilder*, uint32_t* output);
+/// Writes the whole module straight from the sections with writev and destroys the builder
+bool  spvb_finish_to_fd(struct SpvFileBuilder*, int fd);
+
+/// Streaming: writes everything but the function definitions, after which no new IDs can be handed out.
+/// All the IDs function bodies need must have been reserved beforehand.
+bool  spvb_flush_header_to_fd(struct SpvFileBuilder*, int fd);
+/// Streaming: writes a function definition right away and destroys its builder.
+/// OpNames for the function's own IDs can't go in the already written debug section and are dropped.
+bool  spvb_flush_function_to_fd(struct SpvFileBuilder*, struct SpvFnBuilder*, int fd);
+void  spvb_destroy(struct SpvFileBuilder*);
 
 struct SpvFnBuilder* spvb_begin_fn(struct SpvFileBuilder*, SpvId fn_id, SpvId fn_type, SpvId fn_ret_type);
 struct SpvBasicBlockBuilder* spvb_begin_bb(struct SpvFnBuilder*, SpvId label);
@@ -82,5 +97,12 @@ struct SpvBasicBlockBuilder* spvb_begin_bb(struct SpvFnBuilder*, SpvId label);
 SpvId fn_ret_type_id(struct SpvFnBuilder*);
 
 SpvId spvb_fresh_id(struct SpvFileBuilder* file_builder);
+/// Reserves a contiguous range of IDs and returns the first one
+SpvId spvb_reserve_ids(struct SpvFileBuilder* file_builder, size_t count);
+
+/// Makes the function builder take its fresh IDs from a range obtained with spvb_reserve_ids.
+/// Function builders with their own range don't write to the file builder until spvb_define_function, so several of them can be filled concurrently.
+void  spvb_fn_use_id_range(struct SpvFnBuilder*, SpvId first, size_t count);
+SpvId spvb_fn_fresh_id(struct SpvFnBuilder*);
 
 #endif
@@ -1,5 +1,7 @@
 #include "fold.h"
 #include "type.h"
+#include "portability.h"
+#include "log.h"
 
 #include <assert.h>
 
@@ -23,64 +25,310 @@ const Node* resolve_known_vars(const Node* node, bool stop_at_values) {
     return node;
 }
 
+const Node* resolve_to_literal_node(const Node* node) {
+    if (!node)
+        return NULL;
+    while (true) {
+        node = resolve_known_vars(node, false);
+        if (node->tag == Constant_TAG && node->payload.constant.value) {
+            node = node->payload.constant.value;
+            continue;
+        }
+        break;
+    }
+    switch (node->tag) {
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG: return node;
+        default: return NULL;
+    }
+}
+
 bool is_zero(const Node* node) {
-    node = resolve_known_vars(node, false);
-    if (node->tag == IntLiteral_TAG) {
+    node = resolve_to_literal_node(node);
+    if (node && node->tag == IntLiteral_TAG) {
         if (extract_int_literal_value(node, false) == 0)
             return true;
     }
     return false;
 }
 bool is_one(const Node* node) {
-    node = resolve_known_vars(node, false);
-    if (node->tag == IntLiteral_TAG) {
+    node = resolve_to_literal_node(node);
+    if (node && node->tag == IntLiteral_TAG) {
         if (extract_int_literal_value(node, false) == 1)
             return true;
     }
     return false;
 }
 
+static int width_in_bits(IntSizes width) {
+    switch (width) {
+        case IntTy8:  return 8;
+        case IntTy16: return 16;
+        case IntTy32: return 32;
+        case IntTy64: return 64;
+    }
+    SHADY_UNREACHABLE;
+}
+
+static uint64_t width_mask(IntSizes width) {
+    return width == IntTy64 ? UINT64_MAX : (UINT64_C(1) << width_in_bits(width)) - 1;
+}
+
+/// Literals are kept truncated to their width with the unused bits cleared, so identical values get the same node
+static const Node* make_int_literal(IrArena* arena, IntSizes width, uint64_t value) {
+    return int_literal(arena, (IntLiteral) { .width = width, .value_u64 = value & width_mask(width) });
+}
+
+static const Node* make_bool_literal(IrArena* arena, bool value) {
+    return value ? true_lit(arena) : false_lit(arena);
+}
+
+/// Evaluates operations where every operand is a literal. Integers are signed, like the emitter treats them.
+/// Returns NULL when the result is undefined (division by zero, overflowing division, oversized shifts) or the operation can't be evaluated.
+static const Node* evaluate_prim_op(IrArena* arena, Op op, size_t count, const Node* lits[]) {
+    if (count == 0)
+        return NULL;
+
+    if (lits[0]->tag == True_TAG || lits[0]->tag == False_TAG) {
+        LARRAY(bool, b, count);
+        for (size_t i = 0; i < count; i++) {
+            if (lits[i]->tag != True_TAG && lits[i]->tag != False_TAG)
+                return NULL;
+            b[i] = lits[i]->tag == True_TAG;
+        }
+        switch (op) {
+            case not_op: return count == 1 ? make_bool_literal(arena, !b[0]) : NULL;
+            case and_op: return count == 2 ? make_bool_literal(arena, b[0] && b[1]) : NULL;
+            case or_op:  return count == 2 ? make_bool_literal(arena, b[0] || b[1]) : NULL;
+            case xor_op:
+            case neq_op: return count == 2 ? make_bool_literal(arena, b[0] != b[1]) : NULL;
+            case eq_op:  return count == 2 ? make_bool_literal(arena, b[0] == b[1]) : NULL;
+            default: return NULL;
+        }
+    }
+
+    IntSizes width = lits[0]->payload.int_literal.width;
+    int bits = width_in_bits(width);
+    LARRAY(uint64_t, u, count);
+    LARRAY(int64_t, s, count);
+    for (size_t i = 0; i < count; i++) {
+        if (lits[i]->tag != IntLiteral_TAG || lits[i]->payload.int_literal.width != width)
+            return NULL;
+        u[i] = (uint64_t) extract_int_literal_value(lits[i], false);
+        s[i] = extract_int_literal_value(lits[i], true);
+    }
+    int64_t min_value = bits == 64 ? INT64_MIN : -((int64_t) 1 << (bits - 1));
+
+    if (count == 1) {
+        switch (op) {
+            case neg_op: return make_int_literal(arena, width, 0 - u[0]);
+            case not_op: return make_int_literal(arena, width, ~u[0]);
+            default: return NULL;
+        }
+    }
+
+    if (count != 2)
+        return NULL;
+
+    switch (op) {
+        // unsigned arithmetic wraps the same way two's complement does
+        case add_op: return make_int_literal(arena, width, u[0] + u[1]);
+        case sub_op: return make_int_literal(arena, width, u[0] - u[1]);
+        case mul_op: return make_int_literal(arena, width, u[0] * u[1]);
+        case div_op: {
+            if (s[1] == 0 || (s[0] == min_value && s[1] == -1))
+                return NULL;
+            return make_int_literal(arena, width, (uint64_t) (s[0] / s[1]));
+        }
+        case mod_op: {
+            if (s[1] == 0 || (s[0] == min_value && s[1] == -1))
+                return NULL;
+            // the remainder takes the sign of the divisor, like SPIR-V's OpSMod
+            int64_t r = s[0] % s[1];
+            if (r != 0 && (r < 0) != (s[1] < 0))
+                r += s[1];
+            return make_int_literal(arena, width, (uint64_t) r);
+        }
+        case and_op: return make_int_literal(arena, width, u[0] & u[1]);
+        case or_op:  return make_int_literal(arena, width, u[0] | u[1]);
+        case xor_op: return make_int_literal(arena, width, u[0] ^ u[1]);
+        case lshift_logical_op:
+        case lshift_arithm_op: {
+            if (u[1] >= (uint64_t) bits)
+                return NULL;
+            return make_int_literal(arena, width, u[0] << u[1]);
+        }
+        case rshift_op: {
+            if (u[1] >= (uint64_t) bits)
+                return NULL;
+            // arithmetic shift, written so it does not depend on how the host shifts negative numbers
+            uint64_t shifted = s[0] < 0 ? ~(~(uint64_t) s[0] >> u[1]) : (uint64_t) s[0] >> u[1];
+            return make_int_literal(arena, width, shifted);
+        }
+        case eq_op:  return make_bool_literal(arena, u[0] == u[1]);
+        case neq_op: return make_bool_literal(arena, u[0] != u[1]);
+        case lt_op:  return make_bool_literal(arena, s[0] <  s[1]);
+        case lte_op: return make_bool_literal(arena, s[0] <= s[1]);
+        case gt_op:  return make_bool_literal(arena, s[0] >  s[1]);
+        case gte_op: return make_bool_literal(arena, s[0] >= s[1]);
+        default: return NULL;
+    }
+}
+
+static bool is_arithmetic_op(Op op) {
+    switch (op) {
+        case add_op: case sub_op: case mul_op: case div_op: case mod_op: case neg_op:
+        case gt_op: case gte_op: case lt_op: case lte_op: case eq_op: case neq_op:
+        case and_op: case or_op: case xor_op: case not_op:
+        case lshift_logical_op: case lshift_arithm_op: case rshift_op:
+            return true;
+        default: return false;
+    }
+}
+
 const Node* fold_prim_op(IrArena* arena, const Node* node) {
     PrimOp prim_op = node->payload.prim_op;
+    Nodes operands = prim_op.operands;
+
+    if (is_arithmetic_op(prim_op.op)) {
+        LARRAY(const Node*, lits, operands.count);
+        bool all_literals = true;
+        for (size_t i = 0; i < operands.count; i++) {
+            lits[i] = resolve_to_literal_node(operands.nodes[i]);
+            all_literals &= lits[i] != NULL;
+        }
+        if (all_literals) {
+            const Node* result = evaluate_prim_op(arena, prim_op.op, operands.count, lits);
+            if (result)
+                return result;
+        }
+    }
+
     switch (prim_op.op) {
         case add_op: {
             // If either operand is zero, destroy the add
             for (size_t i = 0; i < 2; i++)
-                if (is_zero(prim_op.operands.nodes[i]))
-                    return prim_op.operands.nodes[1 - i];
+                if (is_zero(operands.nodes[i]))
+                    return operands.nodes[1 - i];
+            break;
+        }
+        case sub_op: {
+            if (is_zero(operands.nodes[1]))
+                return operands.nodes[0];
             break;
         }
         case mul_op: {
             for (size_t i = 0; i < 2; i++)
-                if (is_zero(prim_op.operands.nodes[i]))
-                    return int_literal(arena, (IntLiteral) {
-                        .value_i64 = 0
-                    });
+                if (is_zero(operands.nodes[i]))
+                    return make_int_literal(arena, resolve_to_literal_node(operands.nodes[i])->payload.int_literal.width, 0);
 
             for (size_t i = 0; i < 2; i++)
-                if (is_one(prim_op.operands.nodes[i]))
-                    return prim_op.operands.nodes[1 - i];
+                if (is_one(operands.nodes[i]))
+                    return operands.nodes[1 - i];
 
             break;
         }
+        case div_op: {
+            if (is_one(operands.nodes[1]))
+                return operands.nodes[0];
+            break;
+        }
+        case select_op: {
+            const Node* condition = resolve_to_literal_node(operands.nodes[0]);
+            if (condition)
+                return operands.nodes[condition->tag == True_TAG ? 1 : 2];
+            if (operands.nodes[1] == operands.nodes[2])
+                return operands.nodes[1];
+            break;
+        }
+        case subgroup_broadcast_first_op: {
+            // literals are the same in every lane
+            const Node* lit = resolve_to_literal_node(operands.nodes[0]);
+            if (lit)
+                return lit;
+            break;
+        }
+        case convert_op: {
+            const Node* lit = resolve_to_literal_node(operands.nodes[1]);
+            const Type* dst_type = operands.nodes[0];
+            // integer conversions sign extend, like OpSConvert
+            if (lit && lit->tag == IntLiteral_TAG && dst_type->tag == Int_TAG)
+                return make_int_literal(arena, dst_type->payload.int_type.width, (uint64_t) extract_int_literal_value(lit, true));
+        }
+        // fallthrough
         case reinterpret_op:
-        case convert_op:
             // get rid of identity casts
-            if (is_subtype(prim_op.operands.nodes[0], without_qualifier(prim_op.operands.nodes[1]->type)))
-                return prim_op.operands.nodes[1];
+            if (operands.nodes[1]->type && is_subtype(operands.nodes[0], without_qualifier(operands.nodes[1]->type)))
+                return operands.nodes[1];
             break;
         default: break;
     }
     return node;
 }
 
+/// Turns conditional branches on known conditions into jumps
+static const Node* fold_branch(IrArena* arena, const Node* node) {
+    Branch payload = node->payload.branch;
+    if (payload.branch_mode != BrIfElse)
+        return node;
+    const Node* condition = resolve_to_literal_node(payload.branch_condition);
+    if (!condition)
+        return node;
+    return branch(arena, (Branch) {
+        .branch_mode = BrJump,
+        .yield = payload.yield,
+        .target = condition->tag == True_TAG ? payload.true_target : payload.false_target,
+        .args = payload.args,
+    });
+}
+
+/// Splices the taken side of `if`s with known conditions into the block.
+/// Ifs that yield values are bound to variables and need the users rewritten, that is left to opt_fold.
 const Node* fold_block(IrArena* arena, const Node* node) {
-    return node;
+    Block payload = node->payload.block;
+    size_t i = 0;
+    for (; i < payload.instructions.count; i++) {
+        const Node* instr = payload.instructions.nodes[i];
+        if (instr->tag == If_TAG && instr->payload.if_instr.yield_types.count == 0 && resolve_to_literal_node(instr->payload.if_instr.condition))
+            break;
+    }
+    if (i == payload.instructions.count)
+        return node;
+
+    const If* if_instr = &payload.instructions.nodes[i]->payload.if_instr;
+    const Node* taken = resolve_to_literal_node(if_instr->condition)->tag == True_TAG ? if_instr->if_true : if_instr->if_false;
+
+    NodesBuilder* instructions = begin_nodes(arena);
+    for (size_t j = 0; j < i; j++)
+        add_node(instructions, payload.instructions.nodes[j]);
+
+    const Node* terminator = payload.terminator;
+    bool rest_reachable = true;
+    if (taken) {
+        add_nodes(instructions, taken->payload.block.instructions);
+        const Node* taken_terminator = taken->payload.block.terminator;
+        // anything but the merge back into this block (returns, breaks to an outer loop ...) makes the rest of the block dead
+        if (taken_terminator->tag != MergeConstruct_TAG || taken_terminator->payload.merge_construct.construct != Selection) {
+            terminator = taken_terminator;
+            rest_reachable = false;
+        }
+    }
+    if (rest_reachable)
+        for (size_t j = i + 1; j < payload.instructions.count; j++)
+            add_node(instructions, payload.instructions.nodes[j]);
+
+    // this goes through fold_block again for the remaining ifs
+    return block(arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = terminator,
+    });
 }
 
 const Node* fold_node(IrArena* arena, const Node* instruction) {
     switch (instruction->tag) {
         case PrimOp_TAG: return fold_prim_op(arena, instruction);
+        case Branch_TAG: return fold_branch(arena, instruction);
         case Block_TAG: return fold_block(arena, instruction);
         default: return instruction;
     }
@@ -5,5 +5,7 @@
 
 const Node* fold_node(IrArena* arena, const Node* instruction);
 const Node* resolve_known_vars(const Node* node, bool stop_at_values);
+/// Looks through let-bound values and constant declarations, returns the int or bool literal behind the node, or NULL
+const Node* resolve_to_literal_node(const Node* node);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef SHADY_LOG_H
 #define SHADY_LOG_H
 
+#include <stdbool.h>
+
 typedef struct Node_ Node;
 
 typedef enum LogLevel_ {
@@ -49,4 +51,8 @@ void log_node(LogLevel level, const Node* node);
 
 void error_die();
 
+/// Runs fn(arg) so that error() and failed asserts in it come back here instead of ending the process, on this thread.
+/// Returns false when they did: whatever fn was building is left as it is, the caller only cleans up what it owns.
+bool run_recoverable(void (*fn)(void*), void* arg);
+
 #endif
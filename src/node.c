@@ -281,6 +281,7 @@ case Variable_TAG: {                  \
     break;                            \
 }                                     \
 case IntLiteral_TAG: {                \
+    field(int_literal.width);         \
     field(int_literal.value_i64);     \
     break;                            \
 }                                     \
@@ -289,6 +290,11 @@ case Let_TAG: {                       \
     field(let.instruction);           \
     break;                            \
 }                                     \
+case PrimOp_TAG: {                    \
+    field(prim_op.op);                \
+    field(prim_op.operands);          \
+    break;                            \
+}                                     \
 case QualifiedType_TAG: {             \
     field(qualified_type.type);       \
     field(qualified_type.is_uniform); \
@@ -368,6 +374,7 @@ String get_decl_name(const Node* node) {
     switch (node->tag) {
         case Constant_TAG: return node->payload.constant.name;
         case Function_TAG: return node->payload.fn.name;
+        case GlobalVariable_TAG: return node->payload.global_variable.name;
         case Variable_TAG: return node->payload.var.name;
         default: return NULL;
     }
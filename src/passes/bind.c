@@ -136,7 +136,10 @@ static Nodes rewrite_instructions(Context* ctx, Nodes instructions) {
                     names[j] = old_instruction->payload.let.variables.nodes[j]->payload.var.name;
 
                 const Node* new_let = let(dst_arena, bound_instr, outputs_count, names);
-                append_list(const Node*, list, new_let);
+                // a variable initialised with a literal stores it right away, so the store gives it the variable's type
+                bool init_with_value = old_instruction->payload.let.is_mutable && is_value(bound_instr);
+                if (!init_with_value)
+                    append_list(const Node*, list, new_let);
 
                 for (size_t j = 0; j < outputs_count; j++) {
                     const Variable* old_var = &old_instruction->payload.let.variables.nodes[j]->payload.var;
@@ -149,7 +152,7 @@ static Nodes rewrite_instructions(Context* ctx, Nodes instructions) {
                         .next = NULL
                     };
 
-                    const Node* value = new_let->payload.let.variables.nodes[j];
+                    const Node* value = init_with_value ? bound_instr : new_let->payload.let.variables.nodes[j];
 
                     if (old_instruction->payload.let.is_mutable) {
                         assert(old_var->type);
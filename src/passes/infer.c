@@ -8,13 +8,17 @@
 #include <assert.h>
 
 static void annotate_all_types(IrArena* arena, Nodes* types, bool uniform_by_default) {
+    // Nodes are hash-consed and shared across the arena, don't write into them !
+    LARRAY(const Node*, ntypes, types->count);
     for (size_t i = 0; i < types->count; i++) {
-        if (get_qualifier(types->nodes[i]) == Unknown)
-            types->nodes[i] = qualified_type(arena, (QualifiedType) {
-                .type = types->nodes[i],
+        ntypes[i] = types->nodes[i];
+        if (get_qualifier(ntypes[i]) == Unknown)
+            ntypes[i] = qualified_type(arena, (QualifiedType) {
+                .type = ntypes[i],
                 .is_uniform = uniform_by_default,
             });
     }
+    *types = nodes(arena, types->count, ntypes);
 }
 
 typedef struct {
@@ -161,11 +165,23 @@ static const Node* infer_primop(Context* ctx, const Node* node) {
         case mod_op:
         case lt_op:
         case lte_op:
-        case eq_op:
-        case neq_op:
         case gt_op:
         case gte_op:
             input_types = nodes(dst_arena, 2, (const Type*[]){ int32_type(dst_arena), int32_type(dst_arena) }); break;
+        // those work on booleans and masks too, the other operands are typed after the first one
+        case eq_op:
+        case neq_op:
+        case not_op:
+        case and_op:
+        case or_op:
+        case xor_op: {
+            assert(old_inputs.count == (node->payload.prim_op.op == not_op ? 1 : 2));
+            const Node* first = old_inputs.nodes[0];
+            new_inputs_scratch[0] = infer_value(ctx, first, first->tag == UntypedNumber_TAG ? int32_type(dst_arena) : NULL);
+            for (size_t i = 1; i < old_inputs.count; i++)
+                new_inputs_scratch[i] = infer_value(ctx, old_inputs.nodes[i], new_inputs_scratch[0]->type);
+            goto skip_input_types;
+        }
         case push_stack_op:
         case push_stack_uniform_op: {
             assert(old_inputs.count == 2);
@@ -197,7 +213,8 @@ static const Node* infer_primop(Context* ctx, const Node* node) {
             new_inputs_scratch[1] = infer_value(ctx, old_inputs.nodes[1], ptr_type->pointed_type);
             goto skip_input_types;
         }
-        case alloca_op: {
+        case alloca_op:
+        case alloca_logical_op: {
             assert(old_inputs.count == 1);
             new_inputs_scratch[0] = import_node(ctx->rewriter.dst_arena, old_inputs.nodes[0]);
             assert(is_type(new_inputs_scratch[0]));
@@ -212,6 +229,13 @@ static const Node* infer_primop(Context* ctx, const Node* node) {
             }
             goto skip_input_types;
         }
+        case extract_op: {
+            assert(old_inputs.count >= 2);
+            new_inputs_scratch[0] = infer_value(ctx, old_inputs.nodes[0], NULL);
+            for (size_t i = 1; i < old_inputs.count; i++)
+                new_inputs_scratch[i] = infer_value(ctx, old_inputs.nodes[i], int32_type(dst_arena));
+            goto skip_input_types;
+        }
         case empty_mask_op:
         case subgroup_active_mask_op:
         case subgroup_local_id_op:
@@ -6,26 +6,126 @@
 #include "../portability.h"
 
 #include "../transform/ir_gen_helpers.h"
-#include "../analysis/free_variables.h"
+#include "../transform/memory_layout.h"
+#include "../analysis/scope.h"
+#include "../analysis/liveness.h"
+#include "../analysis/uniformity.h"
 
 #include "list.h"
 #include "dict.h"
 
 #include <assert.h>
 
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
 typedef struct Context_ {
     Rewriter rewriter;
+    CompilerConfig* config;
     struct Dict* spilled;
     struct List* new_fns;
     struct List* todo;
+    /// set while rewriting the body of a lifted continuation
+    bool lifting;
+
+    /// old return continuation -> list of the variables live when entering it
+    struct Dict* live_in;
+    Uniformity* uniformity;
+    size_t uniform_spills;
+    size_t total_spills;
 } Context;
 
 typedef struct {
+    const Node* old_fn;
     const Node* old_block;
     const Node** new_block;
 } Todo;
 
-static const Node* lift_continuation_into_function(Context* ctx, const Node* cont, Nodes* callsite_instructions) {
+/// The uniform stack is shared by the whole subgroup, it's only safe to use when everyone is there to push and pop the same thing:
+/// at the call and again when the callee returns to the continuation
+static bool use_uniform_stack(Context* ctx, const Node* callsite_fn, const Node* ret_cont, const Node* value) {
+    return is_fn_convergent(ctx->uniformity, callsite_fn) && is_fn_convergent(ctx->uniformity, ret_cont) && is_value_uniform(ctx->uniformity, value);
+}
+
+static bool is_available(struct Dict* live, const Node* value) {
+    switch (value->tag) {
+        case Variable_TAG: return find_key_dict(const Node*, live, value);
+        case Tuple_TAG: {
+            Nodes contents = value->payload.tuple.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                if (!is_available(live, contents.nodes[i]))
+                    return false;
+            return true;
+        }
+        default: return true;
+    }
+}
+
+/// Whether a live variable can be computed again after the call from the other live variables, instead of going through the stack.
+/// Loads could see the stores made by the callee and the subgroup ops depend on who is active at that point.
+static bool is_rematerialisable(struct Dict* live, const Node* variable) {
+    const Node* instruction = variable->payload.var.instruction;
+    if (!instruction)
+        return false;
+    if (is_value(instruction))
+        return is_available(live, instruction);
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    if (has_primop_got_side_effects(op))
+        return false;
+    switch (op) {
+        case load_op:
+        case subgroup_elect_first_op:
+        case subgroup_broadcast_first_op:
+        case subgroup_active_mask_op:
+        case subgroup_ballot_op: return false;
+        default: break;
+    }
+    Nodes operands = instruction->payload.prim_op.operands;
+    for (size_t i = 0; i < operands.count; i++)
+        if (operands.nodes[i] && !is_type(operands.nodes[i]) && !is_available(live, operands.nodes[i]))
+            return false;
+    return true;
+}
+
+static const Node* rematerialise(Context* ctx, NodesBuilder* instructions, struct Dict* remat, const Node* value) {
+    switch (value->tag) {
+        case Variable_TAG: {
+            const Node** done = find_value_dict(const Node*, const Node*, ctx->spilled, value);
+            if (done)
+                return *done;
+            assert(find_key_dict(const Node*, remat, value));
+            const Node* instruction = value->payload.var.instruction;
+            const Node* new;
+            if (is_value(instruction)) {
+                new = rematerialise(ctx, instructions, remat, instruction);
+            } else {
+                // operands first
+                Nodes operands = instruction->payload.prim_op.operands;
+                for (size_t i = 0; i < operands.count; i++)
+                    if (operands.nodes[i] && !is_type(operands.nodes[i]))
+                        rematerialise(ctx, instructions, remat, operands.nodes[i]);
+                const Node* let_remat = let(ctx->rewriter.dst_arena, rewrite_node(&ctx->rewriter, instruction), 1, (const char* []) { value->payload.var.name });
+                add_node(instructions, let_remat);
+                new = let_remat->payload.let.variables.nodes[0];
+            }
+            insert_dict(const Node*, const Node*, ctx->spilled, value, new);
+            return new;
+        }
+        case Tuple_TAG: {
+            Nodes contents = value->payload.tuple.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                rematerialise(ctx, instructions, remat, contents.nodes[i]);
+            return rewrite_node(&ctx->rewriter, value);
+        }
+        default: return rewrite_node(&ctx->rewriter, value);
+    }
+}
+
+static const Node* lower_callc_terminator(Context* ctx, const Node* callsite_fn, const Node* old_callc, NodesBuilder* instructions);
+
+static const Node* lift_continuation_into_function(Context* ctx, const Node* callsite_fn, const Node* cont, NodesBuilder* callsite_instructions) {
     assert(cont->tag == Function_TAG);
     IrArena* dst_arena = ctx->rewriter.dst_arena;
 
@@ -34,75 +134,130 @@ static const Node* lift_continuation_into_function(Context* ctx, const Node* con
     //if (already_done)
     //    return already_done;
 
+    // Only what is live when entering the continuation needs to make it through the call
+    struct List** found_live = find_value_dict(const Node*, struct List*, ctx->live_in, cont);
+    assert(found_live && "return continuations should have had their liveness computed");
+    struct List* live = *found_live;
+    size_t live_count = entries_count_list(live);
+
+    struct Dict* live_set = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    for (size_t i = 0; i < live_count; i++)
+        insert_set_get_result(const Node*, live_set, read_list(const Node*, live)[i]);
+
+    // The rest gets spilled
+    struct Dict* remat = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* spills = new_list(const Node*);
+    size_t spilled_bytes = 0;
+    for (size_t i = 0; i < live_count; i++) {
+        const Node* ovar = read_list(const Node*, live)[i];
+        if (is_rematerialisable(live_set, ovar)) {
+            insert_set_get_result(const Node*, remat, ovar);
+            continue;
+        }
+        append_list(const Node*, spills, ovar);
+
+        const Type* type = rewrite_node(&ctx->rewriter, without_qualifier(ovar->payload.var.type));
+        spilled_bytes += get_mem_layout(ctx->config, dst_arena, type).size_in_bytes;
+        bool uniform = use_uniform_stack(ctx, callsite_fn, cont, ovar);
+        ctx->uniform_spills += uniform;
+        ctx->total_spills++;
+        const Node* save_instruction = prim_op(dst_arena, (PrimOp) {
+            .op = uniform ? push_stack_uniform_op : push_stack_op,
+            .operands = nodes(dst_arena, 2, (const Node* []) { type, rewrite_node(&ctx->rewriter, ovar) })
+        });
+        add_node(callsite_instructions, save_instruction);
+    }
+    size_t spills_count = entries_count_list(spills);
+    info_print("lower_callc: spilling %zu bytes (%zu values) at the call to %s, rematerialising %zu values\n", spilled_bytes, spills_count, get_decl_name(cont), live_count - spills_count);
+
     // Create a new context
     // TODO: ensure this context has the top-level decls but NOT the continuations we might have previously encountered !
     Context new_ctx = *ctx;
     struct Dict* new_dict = clone_dict(ctx->rewriter.processed);
     new_ctx.rewriter.processed = new_dict;
+    new_ctx.spilled = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    new_ctx.lifting = true;
 
     // Create and register new parameters for the lifted continuation
     Nodes new_params = recreate_variables(&ctx->rewriter, cont->payload.fn.params);
     for (size_t i = 0; i < new_params.count; i++)
         register_processed(&new_ctx.rewriter, cont->payload.fn.params.nodes[i], new_params.nodes[i]);
 
-    // Compute the live stuff we'll need
-    struct List* recover_context = compute_free_variables(cont);
-    size_t recover_context_size = entries_count_list(recover_context);
-
-    // Save what we'll need later
-    for (size_t i = 0; i < recover_context_size; i++) {
-        const Variable* var = &read_list(const Node*, recover_context)[i]->payload.var;
-        // TODO: shouldn't we recreate everything (ie the type too) here ?
-        // We should at least be consistent
-        const Node* args[] = {without_qualifier(var->type), read_list(const Node*, recover_context)[i] };
-        const Node* save_instruction = prim_op(dst_arena, (PrimOp) {
-            .op = push_stack_op,
-            .operands = nodes(dst_arena, 2, args)
-        });
-        *callsite_instructions = append_nodes(dst_arena, *callsite_instructions, save_instruction);
-    }
-
     // Recover that stuff inside the new block
-    Nodes new_block_instructions = nodes(dst_arena, 0, NULL);
-    for (size_t i = recover_context_size - 1; i < recover_context_size; i--) {
-        const Node* ovar = read_list(const Node*, recover_context)[i];
+    NodesBuilder* new_block_instructions = begin_nodes(dst_arena);
+    for (size_t i = spills_count - 1; i < spills_count; i--) {
+        const Node* ovar = read_list(const Node*, spills)[i];
         const char* output_names[] = {ovar->payload.var.name };
 
         const Type* type = rewrite_node(&ctx->rewriter, without_qualifier(ovar->payload.var.type));
 
         const Node* let_load = let(dst_arena, prim_op(dst_arena, (PrimOp) {
-            .op = pop_stack_op,
+            .op = use_uniform_stack(ctx, callsite_fn, cont, ovar) ? pop_stack_uniform_op : pop_stack_op,
             .operands = nodes(dst_arena, 1, (const Node* []) {type})
         }), 1, output_names);
-        insert_dict(const Node*, const Node*, ctx->spilled, ovar, let_load->payload.let.variables.nodes[0]);
-        // register_processed(&new_ctx.rewriter, ovar, let_load->payload.let.variables.nodes[0]);
-        new_block_instructions = append_nodes(dst_arena, new_block_instructions, let_load);
+        insert_dict(const Node*, const Node*, new_ctx.spilled, ovar, let_load->payload.let.variables.nodes[0]);
+        add_node(new_block_instructions, let_load);
     }
 
-    // Write out the rest of the new block using this fresh context
-    for (size_t i = 0; i < cont->payload.fn.block->payload.block.instructions.count; i++) {
-        const Node* new_instruction = rewrite_node(&new_ctx.rewriter, cont->payload.fn.block->payload.block.instructions.nodes[i]);
-        new_block_instructions = append_nodes(dst_arena, new_block_instructions, new_instruction);
+    // And recompute the cheap stuff from it
+    for (size_t i = 0; i < live_count; i++) {
+        const Node* ovar = read_list(const Node*, live)[i];
+        if (find_key_dict(const Node*, remat, ovar))
+            rematerialise(&new_ctx, new_block_instructions, remat, ovar);
     }
-    const Node* new_terminator = rewrite_node(&new_ctx.rewriter, cont->payload.fn.block->payload.block.terminator);
 
-    clear_dict(ctx->spilled);
+    // Write out the rest of the new block using this fresh context
+    const Block* old_block = &cont->payload.fn.block->payload.block;
+    for (size_t i = 0; i < old_block->instructions.count; i++) {
+        const Node* new_instruction = rewrite_node(&new_ctx.rewriter, old_block->instructions.nodes[i]);
+        add_node(new_block_instructions, new_instruction);
+    }
+    const Node* new_terminator;
+    if (old_block->terminator->tag == Callc_TAG)
+        new_terminator = lower_callc_terminator(&new_ctx, cont, old_block->terminator, new_block_instructions);
+    else
+        new_terminator = rewrite_node(&new_ctx.rewriter, old_block->terminator);
 
     FnAttributes new_attributes = cont->payload.fn.atttributes;
     new_attributes.is_continuation = false;
 
     Node* new_fn = fn(dst_arena, new_attributes, cont->payload.fn.name, new_params, nodes(dst_arena, 0, NULL));
     new_fn->payload.fn.block = block(dst_arena, (Block) {
-        .instructions = new_block_instructions,
+        .instructions = finish_nodes(new_block_instructions),
         .terminator = new_terminator,
     });
     append_list(const Node*, ctx->new_fns, new_fn);
 
-    destroy_list(recover_context);
+    // the lifted body might have had calls of its own
+    ctx->uniform_spills = new_ctx.uniform_spills;
+    ctx->total_spills = new_ctx.total_spills;
+
+    destroy_list(spills);
+    destroy_dict(remat);
+    destroy_dict(live_set);
+    destroy_dict(new_ctx.spilled);
     destroy_dict(new_dict);
     return new_fn;
 }
 
+/// Lifts the return continuation, appends the spilling code to instructions and returns the new terminator
+static const Node* lower_callc_terminator(Context* ctx, const Node* callsite_fn, const Node* old_callc, NodesBuilder* instructions) {
+    assert(old_callc->tag == Callc_TAG);
+    assert(!old_callc->payload.callc.is_return_indirect && "Return continuations should be function pointers at this stage.");
+
+    debug_print("Processing callc ret_cont: ");
+    debug_node(old_callc->payload.callc.ret_cont);
+    debug_print("\n");
+
+    const Node* lifted_fn = lift_continuation_into_function(ctx, callsite_fn, old_callc->payload.callc.ret_cont, instructions);
+    return callc(ctx->rewriter.dst_arena, (Callc) {
+        .is_return_indirect = true,
+        .callee = rewrite_node(&ctx->rewriter, old_callc->payload.callc.callee),
+        .args = rewrite_nodes(&ctx->rewriter, old_callc->payload.callc.args),
+        .ret_cont = fn_addr(ctx->rewriter.dst_arena, (FnAddr) {.fn = lifted_fn}),
+    });
+}
+
 static const Node* process_node(Context* ctx, const Node* node) {
     const Node** spilled = find_value_dict(const Node*, const Node*, ctx->spilled, node);
     if (spilled) return *spilled;
@@ -117,8 +272,18 @@ static const Node* process_node(Context* ctx, const Node* node) {
             const Node* old_block = node->payload.fn.block;
             // If the block has a callc, delay
             if (old_block->payload.block.terminator->tag == Callc_TAG) {
-                assert(!old_block->payload.block.terminator->payload.callc.is_return_indirect && "Return continuations should be function pointers at this stage.");
-                Todo t = { old_block, &new->payload.fn.block };
+                // continuations of a lifted function need what's been spilled into it, they can't wait
+                if (ctx->lifting) {
+                    NodesBuilder* instructions = begin_nodes(ctx->rewriter.dst_arena);
+                    add_nodes(instructions, rewrite_nodes(&ctx->rewriter, old_block->payload.block.instructions));
+                    const Node* terminator = lower_callc_terminator(ctx, node, old_block->payload.block.terminator, instructions);
+                    new->payload.fn.block = block(ctx->rewriter.dst_arena, (Block) {
+                        .instructions = finish_nodes(instructions),
+                        .terminator = terminator,
+                    });
+                    return new;
+                }
+                Todo t = { node, old_block, &new->payload.fn.block };
                 debug_print("Found a callc - adding to todo list\n");
                 append_list(Todo, ctx->todo, t);
                 return new;
@@ -136,34 +301,49 @@ static const Node* process_node(Context* ctx, const Node* node) {
 }
 
 static void handle_todo_entry(Context* ctx, Todo todo) {
-    assert(todo.old_block->payload.block.terminator->tag == Callc_TAG);
-    const Callc* old_callc = &todo.old_block->payload.block.terminator->payload.callc;
-
-    debug_print("Processing callc ret_cont: ");
-    debug_node(old_callc->ret_cont);
-    debug_print("\n");
-
-    Nodes instructions = todo.old_block->payload.block.instructions;
-    const Node* lifted_fn = lift_continuation_into_function(ctx, old_callc->ret_cont, &instructions);
+    NodesBuilder* instructions = begin_nodes(ctx->rewriter.dst_arena);
+    add_nodes(instructions, rewrite_nodes(&ctx->rewriter, todo.old_block->payload.block.instructions));
+    const Node* terminator = lower_callc_terminator(ctx, todo.old_fn, todo.old_block->payload.block.terminator, instructions);
     *todo.new_block = block(ctx->rewriter.dst_arena, (Block) {
-        .instructions = rewrite_nodes(&ctx->rewriter, instructions),
-        .terminator = callc(ctx->rewriter.dst_arena, (Callc) {
-            .is_return_indirect = true,
-            .callee = process_node(ctx, old_callc->callee),
-            .args = rewrite_nodes(&ctx->rewriter, old_callc->args),
-            .ret_cont = fn_addr(ctx->rewriter.dst_arena, (FnAddr) {.fn = lifted_fn}),
-        })
+        .instructions = finish_nodes(instructions),
+        .terminator = terminator,
     });
 }
 
-KeyHash hash_node(Node**);
-bool compare_node(Node**, Node**);
+/// Runs liveness on every function, and keeps what is live when entering the return continuations
+static void compute_live_in_at_callsites(Context* ctx, const Node* src_program, struct List* live_lists) {
+    Nodes decls = src_program->payload.root.declarations;
+    for (size_t i = 0; i < decls.count; i++) {
+        if (decls.nodes[i]->tag != Function_TAG)
+            continue;
+        Scope scope = build_scope(decls.nodes[i]);
+        Liveness* liveness = compute_liveness(&scope);
+        for (size_t j = 0; j < scope.size; j++) {
+            CFNode* cf_node = scope.rpo[j];
+            const Node* terminator = cf_node->node->payload.fn.block->payload.block.terminator;
+            if (terminator->tag != Callc_TAG || terminator->payload.callc.is_return_indirect)
+                continue;
+            const Node* ret_cont = terminator->payload.callc.ret_cont;
+            if (find_key_dict(const Node*, ctx->live_in, ret_cont))
+                continue;
+            assert(entries_count_list(cf_node->succs) == 1);
+            CFNode* ret_cont_node = read_list(CFNode*, cf_node->succs)[0];
+            struct List* live = get_live_in(liveness, ret_cont_node);
+            insert_dict(const Node*, struct List*, ctx->live_in, ret_cont, live);
+            append_list(struct List*, live_lists, live);
+        }
+        dispose_liveness(liveness);
+        dispose_scope(&scope);
+    }
+}
 
-const Node* lower_callc(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+const Node* lower_callc(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
     struct List* new_decls_list = new_list(const Node*);
     struct List* todos = new_list(Todo);
     struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
     struct Dict* spilled = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct Dict* live_in = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* live_lists = new_list(struct List*);
 
     Context ctx = {
         .rewriter = {
@@ -173,12 +353,17 @@ const Node* lower_callc(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena,
             .rewrite_decl_body = NULL,
             .processed = done,
         },
+        .config = config,
         .new_fns = new_decls_list,
         .todo = todos,
         .spilled = spilled,
+        .lifting = false,
+        .live_in = live_in,
+        .uniformity = analyse_uniformity(src_program),
     };
 
     assert(src_program->tag == Root_TAG);
+    compute_live_in_at_callsites(&ctx, src_program, live_lists);
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
     debug_print("Size of processed after initial rewrite: %d\n", entries_count_dict(done));
@@ -187,18 +372,24 @@ const Node* lower_callc(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena,
         Todo entry = pop_last_list(Todo, todos);
         handle_todo_entry(&ctx, entry);
     }
+    info_print("lower_callc: %zu of %zu spilled values go to the uniform stack\n", ctx.uniform_spills, ctx.total_spills);
 
-    Nodes new_decls = rewritten->payload.root.declarations;
-    for (size_t i = 0; i < entries_count_list(new_decls_list); i++) {
-        new_decls = append_nodes(dst_arena, new_decls, read_list(const Node*, new_decls_list)[i]);
-    }
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    add_nodes(new_decls, rewritten->payload.root.declarations);
+    for (size_t i = 0; i < entries_count_list(new_decls_list); i++)
+        add_node(new_decls, read_list(const Node*, new_decls_list)[i]);
     rewritten = root(dst_arena, (Root) {
-        .declarations = new_decls
+        .declarations = finish_nodes(new_decls)
     });
 
     destroy_list(new_decls_list);
     destroy_list(todos);
     destroy_dict(spilled);
+    for (size_t i = 0; i < entries_count_list(live_lists); i++)
+        destroy_list(read_list(struct List*, live_lists)[i]);
+    destroy_list(live_lists);
+    destroy_dict(live_in);
+    dispose_uniformity(ctx.uniformity);
     destroy_dict(done);
     return rewritten;
 }
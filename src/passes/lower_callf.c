@@ -82,7 +82,7 @@ static const Node* lower_callf_process(Context* ctx, const Node* old) {
                     // put the return address and a convergence token in the stack
                     const Node* conv_token = gen_primop(instructions, (PrimOp) { .op = subgroup_active_mask_op, .operands = nodes(dst_arena, 0, NULL)}).nodes[0];
                     gen_push_value_stack(instructions, conv_token);
-                    gen_push_value_stack(instructions, terminator->payload.callc.ret_cont);
+                    gen_push_value_stack(instructions, rewrite_node(&ctx->rewriter, terminator->payload.callc.ret_cont));
                     // Branch to the callee
                     terminator = branch(dst_arena, (Branch) {
                         .branch_mode = BrTailcall,
@@ -120,12 +120,12 @@ const Node* lower_callf(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena,
     };
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
-    Nodes new_decls = rewritten->payload.root.declarations;
-    for (size_t i = 0; i < entries_count_list(new_decls_list); i++) {
-        new_decls = append_nodes(dst_arena, new_decls, read_list(const Node*, new_decls_list)[i]);
-    }
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    add_nodes(new_decls, rewritten->payload.root.declarations);
+    for (size_t i = 0; i < entries_count_list(new_decls_list); i++)
+        add_node(new_decls, read_list(const Node*, new_decls_list)[i]);
     rewritten = root(dst_arena, (Root) {
-        .declarations = new_decls
+        .declarations = finish_nodes(new_decls)
     });
 
     destroy_list(new_decls_list);
@@ -5,6 +5,8 @@
 #include "../portability.h"
 #include "../rewrite.h"
 
+#include "../analysis/uniformity.h"
+
 #include "list.h"
 
 #include "dict.h"
@@ -13,6 +15,7 @@
 
 typedef struct Context_ {
     Rewriter rewriter;
+    Uniformity* uniformity;
 } Context;
 
 static const Node* process_node(Context* ctx, const Node* node);
@@ -40,30 +43,35 @@ static const Node* handle_block(Context* ctx, const Node* node, size_t start, co
 
                 LARRAY(const Node*, rest_params, yield_types.count);
                 for (size_t j = 0; j < yield_types.count; j++) {
-                    rest_params[j] = let_node->payload.let.variables.nodes[j];
+                    rest_params[j] = recreate_variable(&ctx->rewriter, let_node->payload.let.variables.nodes[j]);
+                    register_processed(&ctx->rewriter, let_node->payload.let.variables.nodes[j], rest_params[j]);
                 }
 
-                const Node* let_mask = let(dst_arena, prim_op(dst_arena, (PrimOp) {
-                    .op = subgroup_active_mask_op,
-                    .operands = nodes(dst_arena, 0, NULL)
-                }), 1, NULL);
-                append_list(const Node*, accumulator, let_mask);
-                // reconvergence_token = NULL;
+                // all threads go the same way on uniform conditions, so there is nothing to reconverge
+                const Node* branch_mask = NULL;
+                if (!is_value_uniform(ctx->uniformity, instr->payload.if_instr.condition)) {
+                    const Node* let_mask = let(dst_arena, prim_op(dst_arena, (PrimOp) {
+                        .op = subgroup_active_mask_op,
+                        .operands = nodes(dst_arena, 0, NULL)
+                    }), 1, NULL);
+                    append_list(const Node*, accumulator, let_mask);
+                    branch_mask = let_mask->payload.let.variables.nodes[0];
+                }
 
                 Node* join_cont = fn(dst_arena, cont_attr, unique_name(dst_arena, "if_join"), nodes(dst_arena, yield_types.count, rest_params), nodes(dst_arena, 0, NULL));
                 Node* true_branch = fn(dst_arena, cont_attr, unique_name(dst_arena, "if_true"), nodes(dst_arena, 0, NULL), nodes(dst_arena, 0, NULL));
                 Node* false_branch = has_false_branch ? fn(dst_arena, cont_attr, unique_name(dst_arena, "if_false"), nodes(dst_arena, 0, NULL), nodes(dst_arena, 0, NULL)) : NULL;
 
-                true_branch->payload.fn.block = handle_block(ctx,  instr->payload.if_instr.if_true, 0, join_cont, let_mask->payload.let.variables.nodes[0]);
+                true_branch->payload.fn.block = handle_block(ctx,  instr->payload.if_instr.if_true, 0, join_cont, branch_mask);
                 if (has_false_branch)
-                    false_branch->payload.fn.block = handle_block(ctx,  instr->payload.if_instr.if_false, 0, join_cont, let_mask->payload.let.variables.nodes[0]);
+                    false_branch->payload.fn.block = handle_block(ctx,  instr->payload.if_instr.if_false, 0, join_cont, branch_mask);
                 join_cont->payload.fn.block = handle_block(ctx, node, i + 1, outer_join, reconvergence_token);
 
                 Nodes instructions = nodes(dst_arena, entries_count_list(accumulator), read_list(const Node*, accumulator));
                 destroy_list(accumulator);
                 const Node* branch_t = branch(dst_arena, (Branch) {
                     .branch_mode = BrIfElse,
-                    .branch_condition = instr->payload.if_instr.condition,
+                    .branch_condition = rewrite_node(&ctx->rewriter, instr->payload.if_instr.condition),
                     .true_target = true_branch,
                     .false_target = has_false_branch ? false_branch : join_cont,
                     .args = nodes(dst_arena, 0, NULL),
@@ -122,9 +130,17 @@ static const Node* handle_block(Context* ctx, const Node* node, size_t start, co
             switch (old_terminator->payload.merge_construct.construct) {
                 case Selection: {
                     assert(outer_join);
+                    if (!reconvergence_token) {
+                        new_terminator = branch(dst_arena, (Branch) {
+                            .branch_mode = BrJump,
+                            .target = outer_join,
+                            .args = rewrite_nodes(&ctx->rewriter, old_terminator->payload.merge_construct.args),
+                        });
+                        break;
+                    }
                     new_terminator = join(dst_arena, (Join) {
                         .join_at = outer_join,
-                        .args = nodes(dst_arena, old_terminator->payload.merge_construct.args.count, old_terminator->payload.merge_construct.args.nodes),
+                        .args = rewrite_nodes(&ctx->rewriter, old_terminator->payload.merge_construct.args),
                         .desired_mask = reconvergence_token
                     });
                     break;
@@ -183,12 +199,14 @@ const Node* lower_cf_instrs(SHADY_UNUSED CompilerConfig* config, IrArena* src_ar
             .rewrite_decl_body = NULL,
             .processed = done,
         },
+        .uniformity = analyse_uniformity(src_program),
     };
 
     assert(src_program->tag == Root_TAG);
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
 
+    dispose_uniformity(ctx.uniformity);
     destroy_dict(done);
     return rewritten;
 }
@@ -1,171 +1,284 @@
-#if 0
-
 #include "shady/ir.h"
 
 #include "../log.h"
 #include "../rewrite.h"
+#include "../type.h"
+#include "../block_builder.h"
 #include "../transform/ir_gen_helpers.h"
 #include "../portability.h"
 #include "../analysis/scope.h"
+#include "../analysis/liveness.h"
+#include "../analysis/uniformity.h"
 
 #include "list.h"
 #include "dict.h"
 
-#include <string.h>
 #include <assert.h>
 
 typedef struct {
     Rewriter rewriter;
     CompilerConfig* config;
+    Uniformity* uniformity;
+    size_t lowered_fns;
+    size_t lowered_bbs;
 } Context;
 
-typedef size_t CaseId;
+typedef int32_t CaseId;
 
+/// The state machine of the function being lowered
 typedef struct {
-    CaseId case_id;
-    const CFNode* cf_node;
-} BBMeta;
+    Scope* scope;
+    Liveness* liveness;
+    /// holds the case of the basic block to run next
+    const Node* next_bb;
+    /// old variable -> the alloca it goes through when it crosses from one case to another
+    struct Dict* slots;
+} FnLowering;
 
 KeyHash hash_node(Node**);
 bool compare_node(Node**, Node**);
 
-static CaseId find_bb_case_id(struct Dict* bbs, const Node* bb) {
-    BBMeta* found = find_value_dict(const Node*, BBMeta, bbs, bb);
-    if (!found) error("missing case id for BB")
-    return found->case_id;
+/// The entry runs before the loop, the other basic blocks get a case each, in RPO
+static CaseId find_bb_case_id(FnLowering* fnl, const Node* bb) {
+    for (size_t i = 1; i < fnl->scope->size; i++)
+        if (fnl->scope->rpo[i]->node == bb)
+            return (CaseId) (i - 1);
+    error("missing case id for BB")
 }
 
-static const Node* handle_basic_block(Context* ctx, const Node* next_bb, struct Dict* bbs, const Node* node) {
-    assert(node->tag == Function_TAG);
-    IrArena* dst_arena = ctx->rewriter.dst_arena;
-    const Block* old_block = &node->payload.fn.block->payload.block;
+static const Node* case_id_literal(IrArena* arena, CaseId id) {
+    return int_literal(arena, (IntLiteral) { .value_i32 = id, .width = IntTy32 });
+}
 
-    //Node* fun = fn(dst_arena, node->payload.fn.atttributes, node->payload.fn.name, nodes(dst_arena, 0, NULL), nodes(dst_arena, 0, NULL));
-    Instructions instructions = begin_instructions(dst_arena);
-    for (size_t i = 0; i < old_block->instructions.count; i++) {
-        append_instr(instructions, recreate_node_identity(&ctx->rewriter, old_block->instructions.nodes[i]));
+static const Node* find_slot(FnLowering* fnl, const Node* old_var) {
+    const Node** found = find_value_dict(const Node*, const Node*, fnl->slots, old_var);
+    return found ? *found : NULL;
+}
+
+/// Jumps don't leave the function, anything that does can stay as it is inside the case
+static bool is_fn_exit(const Node* terminator) {
+    switch (terminator->tag) {
+        case Return_TAG:
+        case Unreachable_TAG: return true;
+        case Branch_TAG: return terminator->payload.branch.branch_mode == BrTailcall;
+        case Join_TAG: return terminator->payload.join.is_indirect;
+        default: return false;
     }
+}
+
+/// Only functions whose jumps are all uniform are turned into a state machine, the rest is left to the generic machinery
+static bool can_lower_fn(Context* ctx, Scope* scope) {
+    if (entries_count_list(scope->entry->preds) > 0)
+        return false;
+    for (size_t i = 0; i < scope->size; i++) {
+        const Node* terminator = scope->rpo[i]->node->payload.fn.block->payload.block.terminator;
+        if (is_fn_exit(terminator))
+            continue;
+        if (terminator->tag != Branch_TAG)
+            return false;
+        switch (terminator->payload.branch.branch_mode) {
+            case BrJump: break;
+            case BrIfElse: {
+                if (!is_value_uniform(ctx->uniformity, terminator->payload.branch.branch_condition))
+                    return false;
+                break;
+            }
+            default: return false;
+        }
+    }
+    return true;
+}
 
-    const Node* terminator = NULL;
-    switch (old_block->terminator->tag) {
-        case Jump_TAG: {
-            // TODO BB arguments
-            assert(old_block->terminator->payload.jump.args.count == 0);
-            CaseId target_id = find_bb_case_id(bbs, old_block->terminator->payload.jump.target);
-            gen_store(instructions, next_bb, int_literal(dst_arena, (IntLiteral) {.value = target_id}));
-            terminator = merge_construct(dst_arena, (MergeConstruct) {
-                .args = nodes(dst_arena, 0, NULL),
-                .construct = Continue,
-            });
+static void gen_store_args(Context* ctx, FnLowering* fnl, BlockBuilder* instructions, const Node* target, Nodes args) {
+    Nodes params = target->payload.fn.params;
+    assert(params.count == args.count);
+    for (size_t i = 0; i < params.count; i++)
+        gen_store(instructions, find_slot(fnl, params.nodes[i]), rewrite_node(&ctx->rewriter, args.nodes[i]));
+}
+
+/// Jumps store the arguments and the next case, and go around the loop
+static const Node* gen_terminator(Context* ctx, FnLowering* fnl, BlockBuilder* instructions, const Node* old_terminator) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    if (is_fn_exit(old_terminator))
+        return recreate_node_identity(&ctx->rewriter, old_terminator);
+
+    const Branch* branch = &old_terminator->payload.branch;
+    const Node* next_case = NULL;
+    switch (branch->branch_mode) {
+        case BrJump: {
+            gen_store_args(ctx, fnl, instructions, branch->target, branch->args);
+            next_case = case_id_literal(dst_arena, find_bb_case_id(fnl, branch->target));
             break;
         }
-        case Branch_TAG: {
-            // TODO BB arguments
-            assert(old_block->terminator->payload.branch.args.count == 0);
-            CaseId true_id = find_bb_case_id(bbs, old_block->terminator->payload.branch.true_target);
-            CaseId false_id = find_bb_case_id(bbs, old_block->terminator->payload.branch.false_target);
-            const Node* new_cond = rewrite_node(&ctx->rewriter, old_block->terminator->payload.branch.condition);
-            const Node* selected_target = gen_primop(instructions, (PrimOp) {
+        case BrIfElse: {
+            // only the target we end up in reads its parameters, so both can be given the arguments
+            gen_store_args(ctx, fnl, instructions, branch->true_target, branch->args);
+            gen_store_args(ctx, fnl, instructions, branch->false_target, branch->args);
+            const Node* true_id = case_id_literal(dst_arena, find_bb_case_id(fnl, branch->true_target));
+            const Node* false_id = case_id_literal(dst_arena, find_bb_case_id(fnl, branch->false_target));
+            next_case = gen_primop(instructions, (PrimOp) {
                 .op = select_op,
-                .operands = nodes(dst_arena, 3, (const Node* []) { new_cond, int_literal(dst_arena, (IntLiteral) {.value = true_id}), int_literal(dst_arena, (IntLiteral) {.value = false_id})})
+                .operands = nodes(dst_arena, 3, (const Node* []) { rewrite_node(&ctx->rewriter, branch->branch_condition), true_id, false_id })
             }).nodes[0];
-            gen_store(instructions, next_bb, selected_target);
-            terminator = merge_construct(dst_arena, (MergeConstruct) {
-                .args = nodes(dst_arena, 0, NULL),
-                .construct = Continue,
-            });
             break;
         }
-        case Unreachable_TAG:
-        case Return_TAG: terminator = recreate_node_identity(&ctx->rewriter, old_block->terminator); break;
-        default: error("Unhandled terminator");
+        default: SHADY_UNREACHABLE;
     }
+    gen_store(instructions, fnl->next_bb, next_case);
 
-    return block(dst_arena, (Block) {
-        .instructions = finish_instructions(instructions),
-        .terminator = terminator
+    return merge_construct(dst_arena, (MergeConstruct) {
+        .args = nodes(dst_arena, 0, NULL),
+        .construct = Continue,
     });
 }
 
-static void handle_function(Context* ctx, const Node* node, Node* new) {
-    assert(node->tag == Function_TAG);
+/// Rewrites the instructions of a basic block, the values the other ones need are stored in their slots on the way out
+static const Node* gen_basic_block(Context* ctx, FnLowering* fnl, BlockBuilder* instructions, const CFNode* cf_node) {
+    const Block* old_block = &cf_node->node->payload.fn.block->payload.block;
+    size_t succs_count = entries_count_list(cf_node->succs);
+    for (size_t i = 0; i < old_block->instructions.count; i++) {
+        const Node* old_instruction = old_block->instructions.nodes[i];
+        append_block(instructions, recreate_node_identity(&ctx->rewriter, old_instruction));
+        if (old_instruction->tag != Let_TAG)
+            continue;
+
+        Nodes outputs = old_instruction->payload.let.variables;
+        for (size_t j = 0; j < outputs.count; j++) {
+            const Node* slot = find_slot(fnl, outputs.nodes[j]);
+            if (!slot)
+                continue;
+            for (size_t k = 0; k < succs_count; k++) {
+                if (is_live_in(fnl->liveness, read_list(CFNode*, cf_node->succs)[k], outputs.nodes[j])) {
+                    gen_store(instructions, slot, find_processed(&ctx->rewriter, outputs.nodes[j]));
+                    break;
+                }
+            }
+        }
+    }
+    return gen_terminator(ctx, fnl, instructions, old_block->terminator);
+}
+
+static const Node* gen_case(Context* ctx, FnLowering* fnl, const CFNode* cf_node) {
     IrArena* dst_arena = ctx->rewriter.dst_arena;
 
-    Scope scope = build_scope(node);
+    // each case sees its own values for what comes through the slots
+    Context case_ctx = *ctx;
+    case_ctx.rewriter.processed = clone_dict(ctx->rewriter.processed);
+
+    BlockBuilder* instructions = begin_block(dst_arena);
+    Nodes params = cf_node->node->payload.fn.params;
+    for (size_t i = 0; i < params.count; i++)
+        register_processed(&case_ctx.rewriter, params.nodes[i], gen_load(instructions, find_slot(fnl, params.nodes[i])));
+
+    // the values that don't have a slot were defined by the entry, it dominates everything
+    struct List* live = get_live_in(fnl->liveness, cf_node);
+    for (size_t i = 0; i < entries_count_list(live); i++) {
+        const Node* old_var = read_list(const Node*, live)[i];
+        const Node* slot = find_slot(fnl, old_var);
+        if (slot)
+            register_processed(&case_ctx.rewriter, old_var, gen_load(instructions, slot));
+    }
+    destroy_list(live);
+
+    const Node* terminator = gen_basic_block(&case_ctx, fnl, instructions, cf_node);
+    destroy_dict(case_ctx.rewriter.processed);
+    return finish_block(instructions, terminator);
+}
+
+/// Turns the basic blocks of a function into the cases of a match in a loop, the next one to run is kept in a local variable.
+/// Parameters of basic blocks, and values that are used in another basic block than the one making them, go through
+/// local variables too. The entry block is dominating everything so it runs before the loop and its values are used as they are.
+static void lower_fn_body(Context* ctx, const Node* old, Node* new) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    Scope scope = build_scope(old);
 
-    if (scope.size == 1) {
+    if (scope.size == 1 || !can_lower_fn(ctx, &scope)) {
         dispose_scope(&scope);
-        recreate_decl_body_identity(&ctx->rewriter, node, new);
+        recreate_decl_body_identity(&ctx->rewriter, old, new);
         return;
     }
-    
-    struct Dict* bbs = new_dict(const Node*, BBMeta,  (HashFn) hash_node, (CmpFn) compare_node);
-
-    for (size_t i = 0; i < new->payload.fn.params.count; i++)
-        register_processed(&ctx->rewriter, node->payload.fn.params.nodes[i], new->payload.fn.params.nodes[i]);
-
-    // Reserve and assign IDs for basic blocks within this
-    LARRAY(const Node*, literals, scope.size);
-    LARRAY(const Node*, cases, scope.size);
-    for (size_t i = 0; i < scope.size; i++) {
-        CFNode* bb = read_list(CFNode*, scope.contents)[i];
-
-        BBMeta bb_ectx = {
-            .case_id = (CaseId) i,
-            .cf_node = bb
-        };
-        insert_dict_and_get_result(struct Node*, BBEmissionCtx, bbs, bb->node, bb_ectx);
-        literals[i] = int_literal(dst_arena, (IntLiteral) {.value = i});
-    }
 
-    Instructions body_instructions = begin_instructions(dst_arena);
-    const Node* next_bb = gen_primop(body_instructions, (PrimOp) {
-        .op = alloca_op,
-        .operands = nodes(dst_arena, 1, (const Node* []) { int_type(dst_arena) })
+    FnLowering fnl = {
+        .scope = &scope,
+        .liveness = compute_liveness(&scope),
+        .slots = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    BlockBuilder* body_instructions = begin_block(dst_arena);
+    fnl.next_bb = gen_primop(body_instructions, (PrimOp) {
+        .op = alloca_logical_op,
+        .operands = nodes(dst_arena, 1, (const Node* []) { int32_type(dst_arena) })
     }).nodes[0];
-    gen_store(body_instructions, next_bb, int_literal(dst_arena, (IntLiteral) { .value = 0 }));
 
-    for (size_t i = 0; i < scope.size; i++) {
-        CFNode* bb = read_list(CFNode*, scope.contents)[i];
-        cases[i] = handle_basic_block(ctx, next_bb, bbs, bb->node);
+    for (size_t i = 1; i < scope.size; i++) {
+        const Node* bb = scope.rpo[i]->node;
+        Nodes params = bb->payload.fn.params;
+        for (size_t j = 0; j < params.count; j++) {
+            const Node* slot = gen_primop(body_instructions, (PrimOp) {
+                .op = alloca_logical_op,
+                .operands = nodes(dst_arena, 1, (const Node* []) { rewrite_node(&ctx->rewriter, without_qualifier(params.nodes[j]->type)) })
+            }).nodes[0];
+            insert_dict(const Node*, const Node*, fnl.slots, params.nodes[j], slot);
+        }
+
+        Nodes old_instructions = bb->payload.fn.block->payload.block.instructions;
+        for (size_t j = 0; j < old_instructions.count; j++) {
+            if (old_instructions.nodes[j]->tag != Let_TAG)
+                continue;
+            Nodes outputs = old_instructions.nodes[j]->payload.let.variables;
+            for (size_t k = 0; k < outputs.count; k++) {
+                bool crosses = false;
+                for (size_t l = 1; l < scope.size && !crosses; l++)
+                    crosses = is_live_in(fnl.liveness, scope.rpo[l], outputs.nodes[k]);
+                if (!crosses)
+                    continue;
+                const Node* slot = gen_primop(body_instructions, (PrimOp) {
+                    .op = alloca_logical_op,
+                    .operands = nodes(dst_arena, 1, (const Node* []) { rewrite_node(&ctx->rewriter, without_qualifier(outputs.nodes[k]->type)) })
+                }).nodes[0];
+                insert_dict(const Node*, const Node*, fnl.slots, outputs.nodes[k], slot);
+            }
+        }
+    }
+
+    // the entry can only end in a jump, if it left the function it would be the only basic block
+    const Node* entry_terminator = gen_basic_block(ctx, &fnl, body_instructions, scope.entry);
+    assert(entry_terminator->tag == MergeConstruct_TAG);
+
+    LARRAY(const Node*, literals, scope.size - 1);
+    LARRAY(const Node*, cases, scope.size - 1);
+    for (size_t i = 1; i < scope.size; i++) {
+        literals[i - 1] = case_id_literal(dst_arena, (CaseId) (i - 1));
+        cases[i - 1] = gen_case(ctx, &fnl, scope.rpo[i]);
     }
 
-    Instructions loop_instructions = begin_instructions(dst_arena);
-    const Node* next_bb_loaded = gen_load(loop_instructions, next_bb);
-    const Node* match_i = match_instr(dst_arena, (Match) {
+    BlockBuilder* loop_instructions = begin_block(dst_arena);
+    const Node* next_bb_loaded = gen_load(loop_instructions, fnl.next_bb);
+    append_block(loop_instructions, match_instr(dst_arena, (Match) {
         .yield_types = nodes(dst_arena, 0, NULL),
         .inspect = next_bb_loaded,
+        .literals = nodes(dst_arena, scope.size - 1, literals),
+        .cases = nodes(dst_arena, scope.size - 1, cases),
         .default_case = block(dst_arena, (Block) {
             .instructions = nodes(dst_arena, 0, NULL),
             .terminator = unreachable(dst_arena)
         }),
-        .literals = nodes(dst_arena, scope.size, literals),
-        .cases = nodes(dst_arena, scope.size, cases),
-    });
-
-    append_instr(loop_instructions, match_i);
+    }));
 
-    const Node* loop_body = block(dst_arena, (Block) {
-        .instructions = finish_instructions(loop_instructions),
-        .terminator = unreachable(dst_arena)
-    });
-
-    const Node* the_loop = loop_instr(dst_arena, (Loop) {
+    append_block(body_instructions, loop_instr(dst_arena, (Loop) {
         .yield_types = nodes(dst_arena, 0, NULL),
         .params = nodes(dst_arena, 0, NULL),
         .initial_args = nodes(dst_arena, 0, NULL),
-        .body = loop_body
-    });
+        .body = finish_block(loop_instructions, unreachable(dst_arena))
+    }));
 
-    append_instr(body_instructions, the_loop);
-
-    new->payload.fn.block = block(dst_arena, (Block) {
-        .instructions = finish_instructions(body_instructions),
-        .terminator = unreachable(dst_arena),
-    });
+    new->payload.fn.block = finish_block(body_instructions, unreachable(dst_arena));
 
+    ctx->lowered_fns++;
+    ctx->lowered_bbs += scope.size;
+    dispose_liveness(fnl.liveness);
+    destroy_dict(fnl.slots);
     dispose_scope(&scope);
-    destroy_dict(bbs);
 }
 
 static const Node* process_node(Context* ctx, const Node* old) {
@@ -181,14 +294,17 @@ static const Node* process_node(Context* ctx, const Node* old) {
         }
         case Function_TAG: {
             Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
-            // leave this out - we rebuild functions afterwards
+            // continuations of the functions we leave alone are rewritten as they are met
+            if (old->payload.fn.atttributes.is_continuation)
+                recreate_decl_body_identity(&ctx->rewriter, old, new);
+            else
+                lower_fn_body(ctx, old, new);
             return new;
         }
         default: return recreate_node_identity(&ctx->rewriter, old);
     }
 }
 
-
 const Node* lower_jumps_loop(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
     struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
 
@@ -202,22 +318,13 @@ const Node* lower_jumps_loop(CompilerConfig* config, IrArena* src_arena, IrArena
         },
 
         .config = config,
+        .uniformity = analyse_uniformity(src_program),
     };
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
-    for (size_t i = 0; i < rewritten->payload.root.declarations.count; i++) {
-        const Node* old_decl = src_program->payload.root.declarations.nodes[i];
-        if (old_decl->tag != Function_TAG) continue;
-
-        Node* new_decl = (Node*) rewritten->payload.root.declarations.nodes[i];
-        if (strcmp(old_decl->payload.fn.name, "top_dispatcher") == 0)
-            recreate_decl_body_identity(&ctx.rewriter, old_decl, new_decl);
-        else
-            handle_function(&ctx, old_decl, new_decl);
-    }
+    info_print("lower_jumps_loop: %zu functions turned into loops, %zu basic blocks\n", ctx.lowered_fns, ctx.lowered_bbs);
 
+    dispose_uniformity(ctx.uniformity);
     destroy_dict(done);
     return rewritten;
 }
-
-#endif
\ No newline at end of file
@@ -0,0 +1,461 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../rewrite.h"
+#include "../type.h"
+#include "../block_builder.h"
+#include "../transform/ir_gen_helpers.h"
+#include "../portability.h"
+#include "../analysis/scope.h"
+#include "../analysis/looptree.h"
+#include "../analysis/liveness.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    CompilerConfig* config;
+    /// Loop bodies and branches get rewritten in a context of their own, declarations are still rewritten by the outermost one
+    struct Context_* root;
+    size_t structured_fns;
+    size_t left_fns;
+} Context;
+
+/// Where a basic block ends up in the structured function
+typedef struct {
+    bool planned;
+    /// the basic block whose code this one is nested in, NULL for the entry
+    const CFNode* parent;
+    /// the parameters are bound to the arguments of the one jump going there, instead of going through variables
+    bool direct;
+    bool is_loop_header;
+    /// where the loop goes once it's done, NULL if it is only left through returns and the like
+    const CFNode* loop_follow;
+} BlockPlan;
+
+typedef struct {
+    Scope* scope;
+    Liveness* liveness;
+    /// indexed by rpo_index
+    BlockPlan* plans;
+    /// old basic block -> its CFNode
+    struct Dict* cf_nodes;
+    /// old variable -> the alloca it goes through, when it is needed outside of the structured code that defines it
+    struct Dict* slots;
+} Structure;
+
+/// Where jumps go when they leave the construct that is being built
+typedef struct {
+    const CFNode* loop_header;
+    const CFNode* loop_follow;
+    const CFNode* merge;
+} Exits;
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+static const CFNode* get_cf_node(Structure* s, const Node* bb) {
+    CFNode** found = find_value_dict(const Node*, CFNode*, s->cf_nodes, bb);
+    assert(found);
+    return *found;
+}
+
+static const Node* find_slot(Structure* s, const Node* old_var) {
+    const Node** found = find_value_dict(const Node*, const Node*, s->slots, old_var);
+    return found ? *found : NULL;
+}
+
+static bool is_nested_in(Structure* s, const CFNode* bb, const CFNode* ancestor) {
+    while (bb && bb != ancestor)
+        bb = s->plans[bb->rpo_index].parent;
+    return bb == ancestor;
+}
+
+/// Terminators that leave the function stay where they are
+static bool is_fn_exit(const Node* terminator) {
+    switch (terminator->tag) {
+        case Return_TAG:
+        case Unreachable_TAG: return true;
+        case Branch_TAG: return terminator->payload.branch.branch_mode == BrTailcall;
+        case Join_TAG: return terminator->payload.join.is_indirect;
+        default: return false;
+    }
+}
+
+/// Direct joins go to the continuation where the threads meet again, the merge of the structured construct does that for us
+static bool get_jump(const Node* terminator, const Node** target, Nodes* args) {
+    if (terminator->tag == Branch_TAG && terminator->payload.branch.branch_mode == BrJump) {
+        *target = terminator->payload.branch.target;
+        *args = terminator->payload.branch.args;
+        return true;
+    } else if (terminator->tag == Join_TAG && !terminator->payload.join.is_indirect) {
+        *target = terminator->payload.join.join_at;
+        *args = terminator->payload.join.args;
+        return true;
+    }
+    return false;
+}
+
+static const Node* get_terminator(const CFNode* bb) {
+    return bb->node->payload.fn.block->payload.block.terminator;
+}
+
+static bool is_exit(const CFNode* bb, Exits exits) {
+    return bb == exits.loop_header || bb == exits.loop_follow || bb == exits.merge;
+}
+
+/// Branches can use their immediate post-dominator as the merge of an if, if nothing else is jumping into it
+static bool is_proper_merge(const CFNode* bb, Exits exits) {
+    return bb->ipdom && !is_exit(bb->ipdom, exits) && dominates(bb, bb->ipdom);
+}
+
+/// The loops have to be natural loops with at most one place to exit to
+static bool find_loops(Structure* s) {
+    Scope* scope = s->scope;
+    // a back edge to something that doesn't dominate where it comes from: the loop has more than one entry
+    for (size_t i = 0; i < scope->size; i++) {
+        const CFNode* bb = scope->rpo[i];
+        for (size_t j = 0; j < entries_count_list(bb->succs); j++) {
+            const CFNode* succ = read_list(const CFNode*, bb->succs)[j];
+            if (succ->rpo_index <= bb->rpo_index && !dominates(succ, bb))
+                return false;
+        }
+    }
+
+    LoopTree loop_tree = build_loop_tree(scope);
+    bool ok = true;
+    for (size_t i = 0; i < entries_count_list(loop_tree.loops) && ok; i++) {
+        const LTNode* loop = read_list(const LTNode*, loop_tree.loops)[i];
+        BlockPlan* plan = &s->plans[loop->header->rpo_index];
+        plan->is_loop_header = true;
+        for (size_t j = 0; j < entries_count_list(loop->cf_nodes) && ok; j++) {
+            const CFNode* bb = read_list(const CFNode*, loop->cf_nodes)[j];
+            for (size_t k = 0; k < entries_count_list(bb->succs); k++) {
+                const CFNode* succ = read_list(const CFNode*, bb->succs)[k];
+                if (is_in_loop(loop, succ) || succ == plan->loop_follow)
+                    continue;
+                // leaving to several places would need flags to know where to go after the loop
+                if (plan->loop_follow) {
+                    ok = false;
+                    break;
+                }
+                plan->loop_follow = succ;
+            }
+        }
+    }
+    dispose_loop_tree(&loop_tree);
+    return ok;
+}
+
+static bool plan_block(Structure* s, const CFNode* bb, const CFNode* parent, bool direct, Exits exits);
+
+/// Follows an edge the same way gen_edge does, without building anything
+static bool plan_edge(Structure* s, const CFNode* from, const CFNode* target, bool direct, Exits exits) {
+    if (is_exit(target, exits))
+        return true;
+    BlockPlan* plan = &s->plans[target->rpo_index];
+    // we don't copy code, a basic block we get to from several places has to be a merge point
+    if (plan->planned)
+        return false;
+    if (plan->is_loop_header) {
+        if (!plan_block(s, target, from, false, (Exits) { .loop_header = target, .loop_follow = plan->loop_follow }))
+            return false;
+        return !plan->loop_follow || plan_edge(s, from, plan->loop_follow, false, exits);
+    }
+    return plan_block(s, target, from, direct, exits);
+}
+
+static bool plan_block(Structure* s, const CFNode* bb, const CFNode* parent, bool direct, Exits exits) {
+    BlockPlan* plan = &s->plans[bb->rpo_index];
+    plan->planned = true;
+    plan->parent = parent;
+    plan->direct = direct && !plan->is_loop_header;
+
+    const Node* terminator = get_terminator(bb);
+    const Node* target;
+    Nodes args;
+    if (is_fn_exit(terminator))
+        return true;
+    if (get_jump(terminator, &target, &args))
+        return plan_edge(s, bb, get_cf_node(s, target), true, exits);
+    if (terminator->tag != Branch_TAG || terminator->payload.branch.branch_mode != BrIfElse)
+        return false;
+
+    const CFNode* true_target = get_cf_node(s, terminator->payload.branch.true_target);
+    const CFNode* false_target = get_cf_node(s, terminator->payload.branch.false_target);
+    if (is_proper_merge(bb, exits)) {
+        Exits branch_exits = exits;
+        branch_exits.merge = bb->ipdom;
+        return plan_edge(s, bb, true_target, true, branch_exits)
+            && plan_edge(s, bb, false_target, true, branch_exits)
+            && plan_edge(s, bb, bb->ipdom, false, exits);
+    }
+    // no merge of our own: the branches leave through the merge of an outer construct, or don't come back at all
+    if (bb->ipdom && !is_exit(bb->ipdom, exits))
+        return false;
+    return plan_edge(s, bb, true_target, true, exits) && plan_edge(s, bb, false_target, true, exits);
+}
+
+static const Node* gen_block(Context* ctx, Structure* s, BlockBuilder* instructions, const CFNode* bb, Exits exits);
+
+/// Generates what comes once control gets to a basic block: either leaving the current construct, entering a loop, or
+/// just the code of that block. The arguments have been taken care of already.
+static const Node* gen_arrival(Context* ctx, Structure* s, BlockBuilder* instructions, const CFNode* target, Exits exits) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    BlockPlan* plan = &s->plans[target->rpo_index];
+
+    if (target == exits.loop_header)
+        return merge_construct(dst_arena, (MergeConstruct) { .construct = Continue, .args = nodes(dst_arena, 0, NULL) });
+    if (target == exits.loop_follow)
+        return merge_construct(dst_arena, (MergeConstruct) { .construct = Break, .args = nodes(dst_arena, 0, NULL) });
+    if (target == exits.merge)
+        return merge_construct(dst_arena, (MergeConstruct) { .construct = Selection, .args = nodes(dst_arena, 0, NULL) });
+
+    if (!plan->is_loop_header)
+        return gen_block(ctx, s, instructions, target, exits);
+
+    Context body_ctx = *ctx;
+    body_ctx.rewriter.processed = clone_dict(ctx->rewriter.processed);
+    BlockBuilder* body_instructions = begin_block(dst_arena);
+    const Node* body_terminator = gen_block(&body_ctx, s, body_instructions, target, (Exits) { .loop_header = target, .loop_follow = plan->loop_follow });
+    append_block(instructions, loop_instr(dst_arena, (Loop) {
+        .yield_types = nodes(dst_arena, 0, NULL),
+        .params = nodes(dst_arena, 0, NULL),
+        .initial_args = nodes(dst_arena, 0, NULL),
+        .body = finish_block(body_instructions, body_terminator),
+    }));
+    destroy_dict(body_ctx.rewriter.processed);
+
+    // the breaks stored the arguments of the follow already
+    if (!plan->loop_follow)
+        return unreachable(dst_arena);
+    return gen_arrival(ctx, s, instructions, plan->loop_follow, exits);
+}
+
+/// Binds or stores the arguments of a jump, and follows it
+static const Node* gen_edge(Context* ctx, Structure* s, BlockBuilder* instructions, const CFNode* target, Nodes args, Exits exits) {
+    BlockPlan* plan = &s->plans[target->rpo_index];
+    Nodes params = target->node->payload.fn.params;
+    assert(params.count == args.count);
+    for (size_t i = 0; i < args.count; i++) {
+        const Node* arg = rewrite_node(&ctx->rewriter, args.nodes[i]);
+        if (plan->direct && !is_exit(target, exits))
+            register_processed(&ctx->rewriter, params.nodes[i], arg);
+        else
+            gen_store(instructions, find_slot(s, params.nodes[i]), arg);
+    }
+    return gen_arrival(ctx, s, instructions, target, exits);
+}
+
+static const Node* gen_branch(Context* ctx, Structure* s, const CFNode* target, Nodes args, Exits exits) {
+    Context branch_ctx = *ctx;
+    branch_ctx.rewriter.processed = clone_dict(ctx->rewriter.processed);
+    BlockBuilder* instructions = begin_block(ctx->rewriter.dst_arena);
+    const Node* terminator = gen_edge(&branch_ctx, s, instructions, target, args, exits);
+    destroy_dict(branch_ctx.rewriter.processed);
+    return finish_block(instructions, terminator);
+}
+
+static const Node* gen_block(Context* ctx, Structure* s, BlockBuilder* instructions, const CFNode* bb, Exits exits) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+
+    Nodes params = bb->node->payload.fn.params;
+    if (!s->plans[bb->rpo_index].direct)
+        for (size_t i = 0; i < params.count; i++)
+            register_processed(&ctx->rewriter, params.nodes[i], gen_load(instructions, find_slot(s, params.nodes[i])));
+
+    struct List* live = get_live_in(s->liveness, bb);
+    for (size_t i = 0; i < entries_count_list(live); i++) {
+        const Node* old_var = read_list(const Node*, live)[i];
+        const Node* slot = find_slot(s, old_var);
+        if (slot && !search_processed(&ctx->rewriter, old_var))
+            register_processed(&ctx->rewriter, old_var, gen_load(instructions, slot));
+    }
+    destroy_list(live);
+
+    const Block* old_block = &bb->node->payload.fn.block->payload.block;
+    for (size_t i = 0; i < old_block->instructions.count; i++) {
+        const Node* old_instruction = old_block->instructions.nodes[i];
+        append_block(instructions, recreate_node_identity(&ctx->rewriter, old_instruction));
+        if (old_instruction->tag != Let_TAG)
+            continue;
+        Nodes outputs = old_instruction->payload.let.variables;
+        for (size_t j = 0; j < outputs.count; j++) {
+            const Node* slot = find_slot(s, outputs.nodes[j]);
+            if (slot)
+                gen_store(instructions, slot, find_processed(&ctx->rewriter, outputs.nodes[j]));
+        }
+    }
+
+    const Node* terminator = old_block->terminator;
+    const Node* target;
+    Nodes args;
+    if (is_fn_exit(terminator))
+        return recreate_node_identity(&ctx->rewriter, terminator);
+    if (get_jump(terminator, &target, &args))
+        return gen_edge(ctx, s, instructions, get_cf_node(s, target), args, exits);
+
+    const Branch* branch = &terminator->payload.branch;
+    assert(terminator->tag == Branch_TAG && branch->branch_mode == BrIfElse);
+    bool has_merge = is_proper_merge(bb, exits);
+    Exits branch_exits = exits;
+    if (has_merge)
+        branch_exits.merge = bb->ipdom;
+
+    const Node* condition = rewrite_node(&ctx->rewriter, branch->branch_condition);
+    const Node* if_true = gen_branch(ctx, s, get_cf_node(s, branch->true_target), branch->args, branch_exits);
+    const Node* if_false = gen_branch(ctx, s, get_cf_node(s, branch->false_target), branch->args, branch_exits);
+    append_block(instructions, if_instr(dst_arena, (If) {
+        .yield_types = nodes(dst_arena, 0, NULL),
+        .condition = condition,
+        .if_true = if_true,
+        .if_false = if_false,
+    }));
+
+    // the branches stored the arguments of the merge already
+    if (has_merge)
+        return gen_arrival(ctx, s, instructions, bb->ipdom, exits);
+    // selection merges land right after the if, they were meant for the construct we are in
+    if (exits.merge)
+        return merge_construct(dst_arena, (MergeConstruct) { .construct = Selection, .args = nodes(dst_arena, 0, NULL) });
+    return unreachable(dst_arena);
+}
+
+/// Values are visible in the structured code nested in the basic block that defines them, the others need a variable.
+/// So do the parameters of basic blocks that are not bound directly by the jump going to them.
+static void gen_slots(Context* ctx, Structure* s, BlockBuilder* instructions) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    Scope* scope = s->scope;
+    for (size_t i = 1; i < scope->size; i++) {
+        const CFNode* bb = scope->rpo[i];
+        Nodes params = bb->node->payload.fn.params;
+        for (size_t j = 0; j < params.count && !s->plans[i].direct; j++) {
+            const Node* slot = gen_primop(instructions, (PrimOp) {
+                .op = alloca_logical_op,
+                .operands = nodes(dst_arena, 1, (const Node* []) { rewrite_node(&ctx->rewriter, without_qualifier(params.nodes[j]->type)) })
+            }).nodes[0];
+            insert_dict(const Node*, const Node*, s->slots, params.nodes[j], slot);
+        }
+
+        Nodes old_instructions = bb->node->payload.fn.block->payload.block.instructions;
+        for (size_t j = 0; j < old_instructions.count; j++) {
+            if (old_instructions.nodes[j]->tag != Let_TAG)
+                continue;
+            Nodes outputs = old_instructions.nodes[j]->payload.let.variables;
+            for (size_t k = 0; k < outputs.count; k++) {
+                bool escapes = false;
+                for (size_t l = 1; l < scope->size && !escapes; l++)
+                    escapes = is_live_in(s->liveness, scope->rpo[l], outputs.nodes[k]) && !is_nested_in(s, scope->rpo[l], bb);
+                if (!escapes)
+                    continue;
+                const Node* slot = gen_primop(instructions, (PrimOp) {
+                    .op = alloca_logical_op,
+                    .operands = nodes(dst_arena, 1, (const Node* []) { rewrite_node(&ctx->rewriter, without_qualifier(outputs.nodes[k]->type)) })
+                }).nodes[0];
+                insert_dict(const Node*, const Node*, s->slots, outputs.nodes[k], slot);
+            }
+        }
+    }
+}
+
+/// Rebuilds the body of a function as nested ifs and loops, following the dominator tree for what is nested in what, and
+/// the post-dominator tree for where ifs merge. Returns false and builds nothing when the control flow can't be expressed
+/// like that: irreducible loops, loops exiting to several places, jumps that would need code to be copied...
+static bool structure_fn_body(Context* ctx, const Node* old, Node* new) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    Scope scope = build_scope(old);
+    if (entries_count_list(scope.entry->preds) > 0) {
+        dispose_scope(&scope);
+        return false;
+    }
+    compute_post_domtree(&scope);
+
+    Structure s = {
+        .scope = &scope,
+        .plans = calloc(scope.size, sizeof(BlockPlan)),
+        .cf_nodes = new_dict(const Node*, CFNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .slots = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    for (size_t i = 0; i < scope.size; i++)
+        insert_dict(const Node*, CFNode*, s.cf_nodes, scope.rpo[i]->node, scope.rpo[i]);
+
+    bool ok = find_loops(&s) && plan_block(&s, scope.entry, NULL, true, (Exits) { .merge = NULL });
+    if (ok) {
+        // basic blocks can be shared with other functions, what their instructions are rewritten to stays in this one
+        Context fn_ctx = *ctx;
+        fn_ctx.rewriter.processed = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+        for (size_t i = 0; i < old->payload.fn.params.count; i++)
+            register_processed(&fn_ctx.rewriter, old->payload.fn.params.nodes[i], new->payload.fn.params.nodes[i]);
+        s.liveness = compute_liveness(&scope);
+        BlockBuilder* instructions = begin_block(dst_arena);
+        gen_slots(&fn_ctx, &s, instructions);
+        const Node* terminator = gen_block(&fn_ctx, &s, instructions, scope.entry, (Exits) { .merge = NULL });
+        new->payload.fn.block = finish_block(instructions, terminator);
+        dispose_liveness(s.liveness);
+        destroy_dict(fn_ctx.rewriter.processed);
+        if (scope.size > 1)
+            ctx->structured_fns++;
+    }
+
+    free(s.plans);
+    destroy_dict(s.cf_nodes);
+    destroy_dict(s.slots);
+    dispose_scope(&scope);
+    return ok;
+}
+
+static const Node* process_node(Context* ctx, const Node* old) {
+    const Node* found = search_processed(&ctx->rewriter, old);
+    if (found) return found;
+
+    if (is_declaration(old->tag) && ctx->root != ctx)
+        return rewrite_node(&ctx->root->rewriter, old);
+
+    switch (old->tag) {
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
+            recreate_decl_body_identity(&ctx->rewriter, old, new);
+            return new;
+        }
+        case Function_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
+            if (old->payload.fn.atttributes.is_continuation)
+                recreate_decl_body_identity(&ctx->rewriter, old, new);
+            else if (!structure_fn_body(ctx, old, new)) {
+                debug_print("lower_jumps_structure: leaving %s to the other lowerings\n", old->payload.fn.name);
+                recreate_decl_body_identity(&ctx->rewriter, old, new);
+                ctx->left_fns++;
+            }
+            return new;
+        }
+        default: return recreate_node_identity(&ctx->rewriter, old);
+    }
+}
+
+const Node* lower_jumps_structure(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+
+        .config = config,
+    };
+    ctx.root = &ctx;
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    info_print("lower_jumps_structure: %zu functions structured, %zu left to the other lowerings\n", ctx.structured_fns, ctx.left_fns);
+
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,135 @@
+#include "shady/ir.h"
+
+#include "../transform/memory_layout.h"
+#include "../transform/ir_gen_helpers.h"
+
+#include "../block_builder.h"
+#include "../rewrite.h"
+#include "../type.h"
+#include "../log.h"
+#include "../portability.h"
+
+#include "dict.h"
+
+#include <assert.h>
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    CompilerConfig* config;
+    /// what masks become, one bit per thread
+    const Type* mask_int_type;
+} Context;
+
+static const Node* mask_int_literal(Context* ctx, int64_t value) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    if (ctx->mask_int_type->payload.int_type.width == IntTy64)
+        return int_literal(dst_arena, (IntLiteral) { .value_i64 = value, .width = IntTy64 });
+    return int_literal(dst_arena, (IntLiteral) { .value_i32 = (int32_t) value, .width = IntTy32 });
+}
+
+static const Node* gen_mask_op(BlockBuilder* instructions, Op op, const Node* a, const Node* b) {
+    return gen_primop(instructions, (PrimOp) {
+        .op = op,
+        .operands = nodes(instructions->arena, 2, (const Node* []) { a, b })
+    }).nodes[0];
+}
+
+static const Node* handle_block(Context* ctx, const Node* node) {
+    assert(node->tag == Block_TAG);
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+
+    BlockBuilder* instructions = begin_block(dst_arena);
+    Nodes oinstructions = node->payload.block.instructions;
+
+    for (size_t i = 0; i < oinstructions.count; i++) {
+        const Node* oinstruction = oinstructions.nodes[i];
+        const Node* olet = NULL;
+        if (oinstruction->tag == Let_TAG) {
+            olet = oinstruction;
+            oinstruction = olet->payload.let.instruction;
+        }
+
+        if (olet && oinstruction->tag == PrimOp_TAG) {
+            const PrimOp* oprim_op = &oinstruction->payload.prim_op;
+            switch (oprim_op->op) {
+                case empty_mask_op: {
+                    register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], mask_int_literal(ctx, 0));
+                    continue;
+                }
+                // the hardware hands out a ballot of at least the subgroup size, the emitter only keeps the bits that fit in the integer
+                case subgroup_active_mask_op:
+                case subgroup_ballot_op: {
+                    Nodes operands = rewrite_nodes(&ctx->rewriter, oprim_op->operands);
+                    LARRAY(const Node*, noperands, operands.count + 1);
+                    noperands[0] = ctx->mask_int_type;
+                    for (size_t j = 0; j < operands.count; j++)
+                        noperands[j + 1] = operands.nodes[j];
+                    const Node* mask = gen_primop(instructions, (PrimOp) {
+                        .op = oprim_op->op,
+                        .operands = nodes(dst_arena, operands.count + 1, noperands)
+                    }).nodes[0];
+                    register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], mask);
+                    continue;
+                }
+                case mask_is_thread_active_op: {
+                    const Node* mask = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[0]);
+                    const Node* thread = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[1]);
+                    if (ctx->mask_int_type->payload.int_type.width != IntTy32)
+                        thread = gen_mask_op(instructions, convert_op, ctx->mask_int_type, thread);
+                    const Node* shifted = gen_mask_op(instructions, rshift_op, mask, thread);
+                    const Node* bit = gen_mask_op(instructions, and_op, shifted, mask_int_literal(ctx, 1));
+                    const Node* active = gen_mask_op(instructions, neq_op, bit, mask_int_literal(ctx, 0));
+                    register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], active);
+                    continue;
+                }
+                default: break;
+            }
+        }
+
+        append_block(instructions, recreate_node_identity(&ctx->rewriter, oinstructions.nodes[i]));
+    }
+
+    return finish_block(instructions, recreate_node_identity(&ctx->rewriter, node->payload.block.terminator));
+}
+
+static const Node* process_node(Context* ctx, const Node* old) {
+    const Node* found = search_processed(&ctx->rewriter, old);
+    if (found) return found;
+
+    switch (old->tag) {
+        case Constant_TAG:
+        case Function_TAG:
+        case GlobalVariable_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, old);
+            recreate_decl_body_identity(&ctx->rewriter, old, new);
+            return new;
+        }
+        case MaskType_TAG: return ctx->mask_int_type;
+        case Block_TAG: return handle_block(ctx, old);
+        default: return recreate_node_identity(&ctx->rewriter, old);
+    }
+}
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+const Node* lower_mask(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .config = config,
+        .mask_int_type = get_mask_int_type(config, dst_arena),
+    };
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+
+    destroy_dict(done);
+    return rewritten;
+}
@@ -5,6 +5,7 @@
 
 #include "../rewrite.h"
 #include "../type.h"
+#include "../fold.h"
 #include "../log.h"
 #include "../portability.h"
 
@@ -21,6 +22,11 @@ typedef struct Context_ {
     const Node* physical_subgroup_buffer;
 
     struct List* new_decls;
+
+    /// what the emulated pointers we made are made of
+    struct Dict* addresses;
+    /// the address arithmetic emitted in the current block
+    struct Dict* computed;
 } Context;
 
 // TODO: make this configuration-dependant
@@ -34,10 +40,69 @@ static bool is_as_emulated(SHADY_UNUSED Context* ctx, AddressSpace as) {
     }
 }
 
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+/// Emulated pointers are offsets into the backing arrays, we keep track of them as a dynamic part plus a constant so chained leas don't have to start over
+typedef struct {
+    /// NULL when the whole offset is known
+    const Node* dynamic;
+    int64_t constant;
+} Address;
+
+/// Address arithmetic is pure, so within a block, what the previous loads and stores to the same array computed can be reused
+static const Node* gen_address_op(Context* ctx, BlockBuilder* instructions, Op op, const Node* a, const Node* b) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Node* instruction = prim_op(dst_arena, (PrimOp) {
+        .op = op,
+        .operands = nodes(dst_arena, 2, (const Node* []) { a, b })
+    });
+    const Node** found = find_value_dict(const Node*, const Node*, ctx->computed, instruction);
+    if (found)
+        return *found;
+    const Node* value = gen_primop(instructions, instruction->payload.prim_op).nodes[0];
+    insert_dict(const Node*, const Node*, ctx->computed, instruction, value);
+    return value;
+}
+
+static const Node* int32_literal(IrArena* arena, int64_t value) {
+    return int_literal(arena, (IntLiteral) { .value_i32 = (int32_t) value, .width = IntTy32 });
+}
+
+static Address get_address(Context* ctx, const Node* faked_pointer) {
+    const Address* found = find_value_dict(const Node*, Address, ctx->addresses, faked_pointer);
+    if (found)
+        return *found;
+    const Node* literal = resolve_to_literal_node(faked_pointer);
+    if (literal && literal->tag == IntLiteral_TAG)
+        return (Address) { .dynamic = NULL, .constant = extract_int_literal_value(literal, true) };
+    return (Address) { .dynamic = faked_pointer, .constant = 0 };
+}
+
+static void add_to_address(Context* ctx, BlockBuilder* instructions, Address* address, const Node* old_index, size_t scale) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Node* index = rewrite_node(&ctx->rewriter, old_index);
+    const Node* literal = resolve_to_literal_node(index);
+    if (literal && literal->tag == IntLiteral_TAG) {
+        address->constant += extract_int_literal_value(literal, true) * (int64_t) scale;
+        return;
+    }
+    if (scale == 0)
+        return;
+
+    // power-of-two scales stay multiplications too, the driver turns those into shifts
+    const Node* term = index;
+    if (scale > 1)
+        term = gen_address_op(ctx, instructions, mul_op, index, int32_literal(dst_arena, scale));
+
+    address->dynamic = address->dynamic ? gen_address_op(ctx, instructions, add_op, address->dynamic, term) : term;
+}
+
 static const Node* lower_lea(Context* ctx, BlockBuilder* instructions, const PrimOp* lea) {
     IrArena* dst_arena = ctx->rewriter.dst_arena;
     const Node* old_pointer = lea->operands.nodes[0];
-    const Node* faked_pointer = rewrite_node(&ctx->rewriter, old_pointer);
+    // a lea of a lea picks up where the first one left
+    Address address = get_address(ctx, rewrite_node(&ctx->rewriter, old_pointer));
     const Type* pointer_type = without_qualifier(old_pointer->type);
     assert(pointer_type->tag == PtrType_TAG);
 
@@ -47,17 +112,7 @@ static const Node* lower_lea(Context* ctx, BlockBuilder* instructions, const Pri
         assert(arr_type->tag == ArrType_TAG);
         const Type* element_type = arr_type->payload.arr_type.element_type;
         TypeMemLayout element_t_layout = get_mem_layout(ctx->config, ctx->rewriter.dst_arena, element_type);
-
-        const Node* elem_size_val = int_literal(dst_arena, (IntLiteral) { .value_i32 = element_t_layout.size_in_cells, .width = IntTy32 });
-        const Node* computed_offset = gen_primop(instructions, (PrimOp) {
-            .op = mul_op,
-            .operands = nodes(dst_arena, 2, (const Node* []) { rewrite_node(&ctx->rewriter, old_offset), elem_size_val})
-        }).nodes[0];
-
-        faked_pointer = gen_primop(instructions, (PrimOp) {
-            .op = add_op,
-            .operands = nodes(dst_arena, 2, (const Node* []) { faked_pointer, computed_offset})
-        }).nodes[0];
+        add_to_address(ctx, instructions, &address, old_offset, element_t_layout.size_in_cells);
     }
 
     for (size_t i = 2; i < lea->operands.count; i++) {
@@ -66,19 +121,8 @@ static const Node* lower_lea(Context* ctx, BlockBuilder* instructions, const Pri
         switch (pointed_type->tag) {
             case ArrType_TAG: {
                 const Type* element_type = pointed_type->payload.arr_type.element_type;
-
                 TypeMemLayout element_t_layout = get_mem_layout(ctx->config, ctx->rewriter.dst_arena, element_type);
-
-                const Node* elem_size_val = int_literal(dst_arena, (IntLiteral) { .value_i32 = element_t_layout.size_in_cells, .width = IntTy32 });
-                const Node* computed_offset = gen_primop(instructions, (PrimOp) {
-                    .op = mul_op,
-                    .operands = nodes(dst_arena, 2, (const Node* []) { rewrite_node(&ctx->rewriter, lea->operands.nodes[i]), elem_size_val})
-                }).nodes[0];
-
-                faked_pointer = gen_primop(instructions, (PrimOp) {
-                    .op = add_op,
-                    .operands = nodes(dst_arena, 2, (const Node* []) { faked_pointer, computed_offset})
-                }).nodes[0];
+                add_to_address(ctx, instructions, &address, lea->operands.nodes[i], element_t_layout.size_in_cells);
 
                 pointer_type = ptr_type(dst_arena, (PtrType) {
                     .pointed_type = element_type,
@@ -87,12 +131,30 @@ static const Node* lower_lea(Context* ctx, BlockBuilder* instructions, const Pri
                 break;
             }
             case RecordType_TAG: {
-                error("TODO");
+                const Node* selector = lea->operands.nodes[i];
+                assert(selector->tag == IntLiteral_TAG && "selectors for records must be literals");
+                size_t member = extract_int_literal_value(selector, false);
+                address.constant += get_record_member_offset_in_cells(ctx->config, dst_arena, pointed_type, member);
+
+                pointer_type = ptr_type(dst_arena, (PtrType) {
+                    .pointed_type = pointed_type->payload.record_type.members.nodes[member],
+                    .address_space = pointer_type->payload.ptr_type.address_space
+                });
+                break;
             }
             default: error("cannot index into this")
         }
     }
 
+    // in the common case this is the only instruction left: the dynamic part of the address plus a constant
+    const Node* faked_pointer;
+    if (!address.dynamic)
+        faked_pointer = int32_literal(dst_arena, address.constant);
+    else if (address.constant == 0)
+        faked_pointer = address.dynamic;
+    else
+        faked_pointer = gen_address_op(ctx, instructions, add_op, address.dynamic, int32_literal(dst_arena, address.constant));
+    insert_dict(const Node*, Address, ctx->addresses, faked_pointer, address);
     return faked_pointer;
 }
 
@@ -103,6 +165,9 @@ static const Node* handle_block(Context* ctx, const Node* node) {
     BlockBuilder* instructions = begin_block(dst_arena);
     Nodes oinstructions = node->payload.block.instructions;
 
+    struct Dict* outer_computed = ctx->computed;
+    ctx->computed = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+
     for (size_t i = 0; i < oinstructions.count; i++) {
         const Node* oinstruction = oinstructions.nodes[i];
         const Node* olet = NULL;
@@ -127,8 +192,7 @@ static const Node* handle_block(Context* ctx, const Node* node) {
                 case reinterpret_op: {
                     const Type* ptr_type = oprim_op->operands.nodes[1]->type;
                     ptr_type = without_qualifier(ptr_type);
-                    assert(ptr_type->tag == PtrType_TAG);
-                    if (!is_as_emulated(ctx, ptr_type->payload.ptr_type.address_space))
+                    if (ptr_type->tag != PtrType_TAG || !is_as_emulated(ctx, ptr_type->payload.ptr_type.address_space))
                         goto unchanged;
                     // TODO ensure source is an integer and the bit width is appropriate
                     register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[1]));
@@ -153,13 +217,17 @@ static const Node* handle_block(Context* ctx, const Node* node) {
                     }
 
                     const Node* fake_ptr = rewrite_node(&ctx->rewriter, old_ptr);
+                    // known addresses let the (de)serialisation code fold the offsets of the individual cells
+                    Address address = get_address(ctx, fake_ptr);
+                    if (!address.dynamic)
+                        fake_ptr = int32_literal(dst_arena, address.constant);
 
                     if (oprim_op->op == load_op) {
-                        const Node* result = gen_deserialisation(instructions, element_type, base, fake_ptr);
+                        const Node* result = gen_deserialisation(ctx->config, instructions, element_type, base, fake_ptr);
                         register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], result);
                     } else {
                         const Node* value = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[1]);
-                        gen_serialisation(instructions, element_type, base, fake_ptr, value);
+                        gen_serialisation(ctx->config, instructions, element_type, base, fake_ptr, value);
                     }
                     continue;
                 }
@@ -171,6 +239,9 @@ static const Node* handle_block(Context* ctx, const Node* node) {
         append_block(instructions, recreate_node_identity(&ctx->rewriter, oinstructions.nodes[i]));
     }
 
+    destroy_dict(ctx->computed);
+    ctx->computed = outer_computed;
+
     return finish_block(instructions, recreate_node_identity(&ctx->rewriter, node->payload.block.terminator));
 }
 
@@ -209,9 +280,6 @@ static const Node* process_node(Context* ctx, const Node* old) {
     }
 }
 
-KeyHash hash_node(Node**);
-bool compare_node(Node**, Node**);
-
 const Node* lower_physical_ptrs(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
     struct List* new_decls_list = new_list(const Node*);
     struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
@@ -243,19 +311,23 @@ const Node* lower_physical_ptrs(CompilerConfig* config, IrArena* src_arena, IrAr
         .physical_subgroup_buffer = physical_subgroup_buffer,
 
         .new_decls = new_decls_list,
+
+        .addresses = new_dict(const Node*, Address, (HashFn) hash_node, (CmpFn) compare_node),
+        .computed = NULL,
     };
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
 
-    Nodes new_decls = rewritten->payload.root.declarations;
-    for (size_t i = 0; i < entries_count_list(new_decls_list); i++) {
-        new_decls = append_nodes(dst_arena, new_decls, read_list(const Node*, new_decls_list)[i]);
-    }
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    add_nodes(new_decls, rewritten->payload.root.declarations);
+    for (size_t i = 0; i < entries_count_list(new_decls_list); i++)
+        add_node(new_decls, read_list(const Node*, new_decls_list)[i]);
     rewritten = root(dst_arena, (Root) {
-        .declarations = new_decls
+        .declarations = finish_nodes(new_decls)
     });
 
     destroy_list(new_decls_list);
+    destroy_dict(ctx.addresses);
 
     destroy_dict(done);
     return rewritten;
@@ -25,8 +25,119 @@ typedef struct Context_ {
     const Node* uniform_stack_pointer;
 
     struct List* new_decls;
+
+    size_t stack_ops;
+    size_t cancelled_ops;
+    size_t stack_pointer_updates;
 } Context;
 
+typedef struct {
+    int32_t offset;
+    const Type* type;
+    const Node* value;
+} PendingPush;
+
+/// The pushes and pops of a block are laid out at fixed offsets from the stack pointer it started with,
+/// which only needs to be loaded once and written back once.
+typedef struct {
+    const Node* stack;
+    const Node* stack_pointer;
+    bool uniform;
+    /// loaded on first use
+    const Node* base;
+    /// in cells, relative to base
+    int32_t offset;
+    /// stores are delayed, so a pop of the same block can take the value back without going through memory
+    struct List* pending;
+} Frame;
+
+static const Node* int32_literal(IrArena* arena, int32_t value) {
+    return int_literal(arena, (IntLiteral) { .value_i32 = value, .width = IntTy32 });
+}
+
+static const Node* gen_frame_address(Context* ctx, BlockBuilder* instructions, Frame* frame, int32_t offset, const Type* element_type) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    if (!frame->base)
+        frame->base = gen_load(instructions, frame->stack_pointer);
+
+    const Node* addr = gen_lea(instructions, frame->stack, frame->base, nodes(dst_arena, 1, (const Node* []) { int32_literal(dst_arena, offset) }));
+    assert(without_qualifier(addr->type)->tag == PtrType_TAG);
+    AddressSpace addr_space = without_qualifier(addr->type)->payload.ptr_type.address_space;
+
+    addr = gen_primop(instructions, (PrimOp) {
+        .op = reinterpret_op,
+        .operands = nodes(dst_arena, 2, (const Node* []) { ptr_type(dst_arena, (PtrType) {.address_space = addr_space, .pointed_type = element_type}), addr })
+    }).nodes[0];
+
+    if (frame->uniform) {
+        assert(get_qualifier(frame->stack_pointer->type) == Uniform);
+        assert(get_qualifier(frame->base->type) == Uniform);
+        assert(get_qualifier(frame->stack->type) == Uniform);
+        assert(get_qualifier(addr->type) == Uniform);
+    }
+    return addr;
+}
+
+static void flush_pending_pushes(Context* ctx, BlockBuilder* instructions, Frame* frame) {
+    for (size_t i = 0; i < entries_count_list(frame->pending); i++) {
+        PendingPush push = read_list(PendingPush, frame->pending)[i];
+        gen_store(instructions, gen_frame_address(ctx, instructions, frame, push.offset, push.type), push.value);
+    }
+    clear_list(frame->pending);
+}
+
+/// Writes everything back, after this the frame starts over from the updated stack pointer
+static void flush_frame(Context* ctx, BlockBuilder* instructions, Frame* frame) {
+    flush_pending_pushes(ctx, instructions, frame);
+    if (frame->offset != 0) {
+        const Node* new_stack_pointer = gen_primop(instructions, (PrimOp) {
+            .op = add_op,
+            .operands = nodes(ctx->rewriter.dst_arena, 2, (const Node* []) { frame->base, int32_literal(ctx->rewriter.dst_arena, frame->offset) })
+        }).nodes[0];
+        gen_store(instructions, frame->stack_pointer, new_stack_pointer);
+        ctx->stack_pointer_updates++;
+        frame->base = new_stack_pointer;
+        frame->offset = 0;
+    }
+}
+
+static void handle_stack_op(Context* ctx, BlockBuilder* instructions, Frame* frame, const Node* olet, const PrimOp* oprim_op) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Type* element_type = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[0]);
+    TypeMemLayout layout = get_mem_layout(ctx->config, dst_arena, element_type);
+    int32_t element_size = (int32_t) layout.size_in_cells;
+    ctx->stack_ops++;
+
+    bool push = oprim_op->op == push_stack_op || oprim_op->op == push_stack_uniform_op;
+    if (push) {
+        PendingPush pending = {
+            .offset = frame->offset,
+            .type = element_type,
+            .value = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[1]),
+        };
+        append_list(PendingPush, frame->pending, pending);
+        frame->offset += element_size;
+        return;
+    }
+
+    frame->offset -= element_size;
+    size_t pending_count = entries_count_list(frame->pending);
+    if (pending_count > 0) {
+        PendingPush last = read_list(PendingPush, frame->pending)[pending_count - 1];
+        if (last.offset == frame->offset && last.type == element_type) {
+            // this pop undoes the last push, neither needs to touch memory
+            pop_last_list(PendingPush, frame->pending);
+            register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], last.value);
+            ctx->cancelled_ops += 2;
+            return;
+        }
+        flush_pending_pushes(ctx, instructions, frame);
+    }
+
+    const Node* popped = gen_load(instructions, gen_frame_address(ctx, instructions, frame, frame->offset, element_type));
+    register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], popped);
+}
+
 static const Node* handle_block(Context* ctx, const Node* node) {
     assert(node->tag == Block_TAG);
     IrArena* dst_arena = ctx->rewriter.dst_arena;
@@ -34,6 +145,10 @@ static const Node* handle_block(Context* ctx, const Node* node) {
     BlockBuilder* instructions = begin_block(dst_arena);
     Nodes oinstructions = node->payload.block.instructions;
 
+    // lower_callc only picks the uniform stack where the whole subgroup is converged, so everyone agrees on the uniform stack pointer
+    Frame frame = { .stack = ctx->stack, .stack_pointer = ctx->stack_pointer, .uniform = false, .pending = new_list(PendingPush) };
+    Frame uniform_frame = { .stack = ctx->uniform_stack, .stack_pointer = ctx->uniform_stack_pointer, .uniform = true, .pending = new_list(PendingPush) };
+
     for (size_t i = 0; i < oinstructions.count; i++) {
         const Node* oinstruction = oinstructions.nodes[i];
         const Node* olet = NULL;
@@ -46,74 +161,28 @@ static const Node* handle_block(Context* ctx, const Node* node) {
             const PrimOp* oprim_op = &oinstruction->payload.prim_op;
             switch (oprim_op->op) {
                 case push_stack_op:
+                case pop_stack_op: handle_stack_op(ctx, instructions, &frame, olet, oprim_op); continue;
                 case push_stack_uniform_op:
-                case pop_stack_op:
-                case pop_stack_uniform_op: {
-                    const Type* element_type = oprim_op->operands.nodes[0];
-                    TypeMemLayout layout = get_mem_layout(ctx->config, dst_arena, element_type);
-                    const Node* element_size = int_literal(dst_arena, (IntLiteral) { .value_i32 = layout.size_in_cells, .width = IntTy32 });
-
-                    bool push = oprim_op->op == push_stack_op || oprim_op->op == push_stack_uniform_op;
-                    bool uniform = oprim_op->op == push_stack_uniform_op || oprim_op->op == pop_stack_uniform_op;
-
-                    // TODO somehow annotate the uniform guys as uniform
-                    const Node* stack_pointer = uniform ? ctx->uniform_stack_pointer : ctx->stack_pointer;
-                    const Node* stack = uniform ? ctx->uniform_stack : ctx->stack;
-
-                    const Node* stack_size = gen_load(instructions, stack_pointer);
-
-                    if (!push) // for pop, we decrease the stack size first
-                        stack_size = gen_primop(instructions, (PrimOp) {
-                            .op = sub_op,
-                            .operands = nodes(dst_arena, 2, (const Node* []) { stack_size, element_size})
-                        }).nodes[0];
-
-                    const Node* addr = gen_lea(instructions, stack, stack_size, nodes(dst_arena, 1, (const Node* []) { int_literal(dst_arena, (IntLiteral) { .value_i32 = 0, .width = IntTy32 })}));
-                    assert(without_qualifier(addr->type)->tag == PtrType_TAG);
-                    AddressSpace addr_space = without_qualifier(addr->type)->payload.ptr_type.address_space;
-
-                    addr = gen_primop(instructions, (PrimOp) {
-                        .op = reinterpret_op,
-                        .operands = nodes(dst_arena, 2, (const Node* []) { ptr_type(dst_arena, (PtrType) {.address_space = addr_space, .pointed_type = element_type}), addr })
-                    }).nodes[0];
-
-                    if (uniform) {
-                        assert(get_qualifier(stack_pointer->type) == Uniform);
-                        assert(get_qualifier(stack_size->type) == Uniform);
-                        assert(get_qualifier(stack->type) == Uniform);
-                        assert(get_qualifier(addr->type) == Uniform);
-                    }
-
-                    if (push) {
-                        const Node* new_value = rewrite_node(&ctx->rewriter, oprim_op->operands.nodes[1]);
-                        gen_store(instructions, addr, new_value);
-                    } else {
-                        const Node* popped = gen_primop(instructions, (PrimOp) {
-                            .op = load_op,
-                            .operands = nodes(dst_arena, 1, (const Node* []) {addr})
-                        }).nodes[0];
-                        register_processed(&ctx->rewriter, olet->payload.let.variables.nodes[0], popped);
-                    }
-
-                    if (push)
-                        stack_size = gen_primop(instructions, (PrimOp) {
-                            .op = add_op,
-                            .operands = nodes(dst_arena, 2, (const Node* []) { stack_size, element_size})
-                        }).nodes[0];
-
-                    // store updated stack size
-                    gen_store(instructions, stack_pointer, stack_size);
-
-                    continue;
-                }
+                case pop_stack_uniform_op: handle_stack_op(ctx, instructions, &uniform_frame, olet, oprim_op); continue;
                 default: goto unchanged;
             }
         }
 
+        // structured constructs have blocks of their own which may use the stacks
+        flush_frame(ctx, instructions, &frame);
+        flush_frame(ctx, instructions, &uniform_frame);
+        frame.base = NULL;
+        uniform_frame.base = NULL;
+
         unchanged:
         append_block(instructions, recreate_node_identity(&ctx->rewriter, oinstructions.nodes[i]));
     }
 
+    flush_frame(ctx, instructions, &frame);
+    flush_frame(ctx, instructions, &uniform_frame);
+    destroy_list(frame.pending);
+    destroy_list(uniform_frame.pending);
+
     return finish_block(instructions, recreate_node_identity(&ctx->rewriter, node->payload.block.terminator));
 }
 
@@ -182,13 +251,14 @@ const Node* lower_stack(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena,
     };
 
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    info_print("lower_stack: %zu pushes and pops, %zu cancelled out, %zu stack pointer updates\n", ctx.stack_ops, ctx.cancelled_ops, ctx.stack_pointer_updates);
 
-    Nodes new_decls = rewritten->payload.root.declarations;
-    for (size_t i = 0; i < entries_count_list(new_decls_list); i++) {
-        new_decls = append_nodes(dst_arena, new_decls, read_list(const Node*, new_decls_list)[i]);
-    }
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    add_nodes(new_decls, rewritten->payload.root.declarations);
+    for (size_t i = 0; i < entries_count_list(new_decls_list); i++)
+        add_node(new_decls, read_list(const Node*, new_decls_list)[i]);
     rewritten = root(dst_arena, (Root) {
-        .declarations = new_decls
+        .declarations = finish_nodes(new_decls)
     });
 
     destroy_list(new_decls_list);
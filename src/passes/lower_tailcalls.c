@@ -1,30 +1,42 @@
 #include "shady/ir.h"
 
 #include "../rewrite.h"
+#include "../visit.h"
 #include "../type.h"
 #include "../log.h"
 #include "../portability.h"
 
 #include "../transform/ir_gen_helpers.h"
+#include "../builtin/builtins.h"
 
 #include "list.h"
 #include "dict.h"
 
+#include <stdlib.h>
 #include <assert.h>
 
 typedef uint32_t FnPtr;
 
+/// What the scheduler builtins set next_fn to when they need the whole subgroup to pick what runs next
+#define SCHEDULER_FN_PTR ((FnPtr) -1)
+
 typedef struct Context_ {
     Rewriter rewriter;
+    CompilerConfig* config;
+    /// keyed by the old functions
     struct Dict* assigned_fn_ptrs;
     FnPtr next_fn_ptr;
+    /// the old functions that got an ID, in the order of their IDs
+    struct List* dispatched_fns;
 
     const Node* god_fn;
 
     const Node* next_fn_var;
     const Node* next_mask_var;
+    const Node* init_fn;
     const Node* branch_fn;
     const Node* join_fn;
+    const Node* rotate_fn;
     struct List* new_decls;
 } Context;
 
@@ -42,18 +54,204 @@ static const Node* lower_fn_addr(Context* ctx, const Node* the_function) {
     assert(the_function->tag == Function_TAG);
 
     FnPtr* found = find_value_dict(const Node*, FnPtr, ctx->assigned_fn_ptrs, the_function);
-    if (found) return fn_ptr_as_value(ctx->rewriter.dst_arena, *found);
+    if (!found)
+        error("%s has no function ID, only top-level functions can be dispatched to", get_decl_name(the_function));
+    return fn_ptr_as_value(ctx->rewriter.dst_arena, *found);
+}
 
-    FnPtr ptr = ctx->next_fn_ptr++;
-    bool r = insert_dict_and_get_result(const Node*, FnPtr, ctx->assigned_fn_ptrs, the_function, ptr);
-    assert(r);
-    return fn_ptr_as_value(ctx->rewriter.dst_arena, ptr);
+/// The functions a function refers to, the targets of its terminator are kept apart from the addresses its instructions take
+typedef struct {
+    struct List* targets;
+    struct List* refs;
+    /// continuations the callers of this function want it to come back to
+    struct List* returns;
+} FnEdges;
+
+typedef struct {
+    Visitor visitor;
+    FnEdges* edges;
+    bool in_terminator;
+    /// the functions met through a FnAddr
+    struct Dict* addressed;
+} EdgesVisitor;
+
+static void visit_edges(EdgesVisitor* visitor, const Node* node) {
+    switch (node->tag) {
+        case FnAddr_TAG: {
+            node = node->payload.fn_addr.fn;
+            insert_set_get_result(const Node*, visitor->addressed, node);
+            SHADY_FALLTHROUGH
+        }
+        case Function_TAG: append_list(const Node*, visitor->in_terminator ? visitor->edges->targets : visitor->edges->refs, node); break;
+        case Tuple_TAG: {
+            Nodes contents = node->payload.tuple.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                visit_edges(visitor, contents.nodes[i]);
+            break;
+        }
+        case Block_TAG: {
+            Nodes instructions = node->payload.block.instructions;
+            for (size_t i = 0; i < instructions.count; i++)
+                visit_edges(visitor, instructions.nodes[i]);
+            visitor->in_terminator = true;
+            visit_edges(visitor, node->payload.block.terminator);
+            visitor->in_terminator = false;
+            break;
+        }
+        case Callc_TAG: {
+            visitor->in_terminator = false;
+            visit_edges(visitor, node->payload.callc.ret_cont);
+            visitor->in_terminator = true;
+            visit_edges(visitor, node->payload.callc.callee);
+            break;
+        }
+        case Let_TAG: visit_children(&visitor->visitor, node); break;
+        default:
+            if (is_instruction(node) || is_terminator(node))
+                visit_children(&visitor->visitor, node);
+            break;
+    }
 }
 
-static const Node* push_args_stack(Context* ctx, Nodes args, BlockBuilder* builder) {
-    for (size_t i = 0; i < args.count; i++) {
-        assert("TODO");
+typedef struct {
+    /// function -> FnEdges*
+    struct Dict* edges;
+    struct Dict* visited;
+    /// the top-level functions the dispatcher can be asked to run: the entry points and the ones that have their address taken
+    struct Dict* dispatched;
+    /// every function met, once
+    struct List* functions;
+    /// of the top-level functions
+    struct List* post_order;
+} FnOrder;
+
+static FnEdges* get_fn_edges(FnOrder* order, const Node* fun) {
+    FnEdges** found = find_value_dict(const Node*, FnEdges*, order->edges, fun);
+    assert(found);
+    return *found;
+}
+
+static void walk_fn(FnOrder* order, const Node* fun) {
+    if (!insert_set_get_result(const Node*, order->visited, fun))
+        return;
+    FnEdges* edges = get_fn_edges(order, fun);
+    // the terminator goes first, so a callee is entered before the continuation it returns to is reached some other way
+    for (size_t i = 0; i < entries_count_list(edges->targets); i++)
+        walk_fn(order, read_list(const Node*, edges->targets)[i]);
+    for (size_t i = 0; i < entries_count_list(edges->returns); i++)
+        walk_fn(order, read_list(const Node*, edges->returns)[i]);
+    for (size_t i = 0; i < entries_count_list(edges->refs); i++)
+        walk_fn(order, read_list(const Node*, edges->refs)[i]);
+    if (find_key_dict(const Node*, order->dispatched, fun))
+        append_list(const Node*, order->post_order, fun);
+}
+
+/// Function IDs are dense, from 1, and only go to the functions the dispatcher can be asked to run.
+/// They follow the reverse post-order of the graph of function references, starting from the entry points.
+/// A function that takes the address of a continuation and then tail calls another one is calling it, so the callee
+/// gets an edge to that continuation: whatever control flow meets again somewhere gets higher IDs on the way there,
+/// and picking the lowest ID runs the threads furthest from that point first.
+static void assign_fn_ptrs(Context* ctx, const Node* src_program) {
+    Nodes decls = src_program->payload.root.declarations;
+    FnOrder order = {
+        .edges = new_dict(const Node*, FnEdges*, (HashFn) hash_node, (CmpFn) compare_node),
+        .visited = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .dispatched = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .functions = new_list(const Node*),
+        .post_order = new_list(const Node*),
+    };
+
+    // gather the edges of every function first, the return edges come from all over the program
+    struct List* worklist = new_list(const Node*);
+    for (size_t i = 0; i < decls.count; i++)
+        if (decls.nodes[i]->tag == Function_TAG)
+            append_list(const Node*, worklist, decls.nodes[i]);
+    EdgesVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_edges,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = true,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .addressed = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    for (size_t i = 0; i < entries_count_list(worklist); i++) {
+        const Node* fun = read_list(const Node*, worklist)[i];
+        if (find_value_dict(const Node*, FnEdges*, order.edges, fun))
+            continue;
+        FnEdges* edges = malloc(sizeof(FnEdges));
+        *edges = (FnEdges) {
+            .targets = new_list(const Node*),
+            .refs = new_list(const Node*),
+            .returns = new_list(const Node*),
+        };
+        insert_dict(const Node*, FnEdges*, order.edges, fun, edges);
+        append_list(const Node*, order.functions, fun);
+        visitor.edges = edges;
+        if (fun->payload.fn.block)
+            visit_edges(&visitor, fun->payload.fn.block);
+        // continuations are part of the graph too, they just don't get an ID of their own
+        for (size_t j = 0; j < entries_count_list(edges->targets); j++)
+            append_list(const Node*, worklist, read_list(const Node*, edges->targets)[j]);
+        for (size_t j = 0; j < entries_count_list(edges->refs); j++)
+            append_list(const Node*, worklist, read_list(const Node*, edges->refs)[j]);
+    }
+    destroy_list(worklist);
+    for (size_t i = 0; i < entries_count_list(order.functions); i++) {
+        FnEdges* edges = get_fn_edges(&order, read_list(const Node*, order.functions)[i]);
+        for (size_t j = 0; j < entries_count_list(edges->targets); j++) {
+            FnEdges* callee_edges = get_fn_edges(&order, read_list(const Node*, edges->targets)[j]);
+            for (size_t k = 0; k < entries_count_list(edges->refs); k++)
+                append_list(const Node*, callee_edges->returns, read_list(const Node*, edges->refs)[k]);
+        }
+    }
+
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != Function_TAG)
+            continue;
+        if (decl->payload.fn.atttributes.entry_point_type != NotAnEntryPoint || find_key_dict(const Node*, visitor.addressed, decl))
+            insert_set_get_result(const Node*, order.dispatched, decl);
+    }
+    destroy_dict(visitor.addressed);
+
+    for (size_t i = 0; i < decls.count; i++)
+        if (decls.nodes[i]->tag == Function_TAG && decls.nodes[i]->payload.fn.atttributes.entry_point_type != NotAnEntryPoint)
+            walk_fn(&order, decls.nodes[i]);
+    // functions that have their address taken but can't be reached from an entry point still get an ID, after the others
+    size_t reachable = entries_count_list(order.post_order);
+    for (size_t i = 0; i < decls.count; i++)
+        if (decls.nodes[i]->tag == Function_TAG)
+            walk_fn(&order, decls.nodes[i]);
+    size_t count = entries_count_list(order.post_order);
+    for (size_t i = reachable; i > 0; i--) {
+        const Node* fun = read_list(const Node*, order.post_order)[i - 1];
+        debug_print("Function %s gets ID %d\n", fun->payload.fn.name, ctx->next_fn_ptr);
+        FnPtr ptr = ctx->next_fn_ptr++;
+        insert_dict(const Node*, FnPtr, ctx->assigned_fn_ptrs, fun, ptr);
+        append_list(const Node*, ctx->dispatched_fns, fun);
+    }
+    for (size_t i = count; i > reachable; i--) {
+        const Node* fun = read_list(const Node*, order.post_order)[i - 1];
+        debug_print("Function %s gets ID %d (unreachable)\n", fun->payload.fn.name, ctx->next_fn_ptr);
+        FnPtr ptr = ctx->next_fn_ptr++;
+        insert_dict(const Node*, FnPtr, ctx->assigned_fn_ptrs, fun, ptr);
+        append_list(const Node*, ctx->dispatched_fns, fun);
+    }
+
+    for (size_t i = 0; i < entries_count_list(order.functions); i++) {
+        FnEdges* edges = get_fn_edges(&order, read_list(const Node*, order.functions)[i]);
+        destroy_list(edges->targets);
+        destroy_list(edges->refs);
+        destroy_list(edges->returns);
+        free(edges);
     }
+    destroy_dict(order.edges);
+    destroy_dict(order.visited);
+    destroy_dict(order.dispatched);
+    destroy_list(order.functions);
+    destroy_list(order.post_order);
 }
 
 static const Node* rewrite_block(Context* ctx, const Node* old_block, BlockBuilder* block_builder) {
@@ -70,13 +268,14 @@ static const Node* rewrite_block(Context* ctx, const Node* old_block, BlockBuild
     switch (old_terminator->tag) {
         case Branch_TAG: {
             assert(old_terminator->payload.branch.branch_mode == BrTailcall);
-            push_args_stack(ctx, rewrite_nodes(&ctx->rewriter, old_terminator->payload.branch.args), block_builder);
+            // the first argument ends up on top, that's where the dispatcher pops it from
+            gen_push_values_stack(block_builder, rewrite_nodes(&ctx->rewriter, old_terminator->payload.branch.args));
 
             const Node* target = rewrite_node(&ctx->rewriter, old_terminator->payload.branch.target);
 
             const Node* call = call_instr(arena, (Call) {
-                .callee = ctx->join_fn,
-                .args = nodes(arena, 2, (const Node*[]) { target })
+                .callee = ctx->branch_fn,
+                .args = nodes(arena, 1, (const Node*[]) { target })
             });
 
             append_block(block_builder, call);
@@ -86,7 +285,7 @@ static const Node* rewrite_block(Context* ctx, const Node* old_block, BlockBuild
         }
         case Join_TAG: {
             assert(old_terminator->payload.join.is_indirect);
-            push_args_stack(ctx, rewrite_nodes(&ctx->rewriter, old_terminator->payload.join.args), block_builder);
+            gen_push_values_stack(block_builder, rewrite_nodes(&ctx->rewriter, old_terminator->payload.join.args));
 
             const Node* target = rewrite_node(&ctx->rewriter, old_terminator->payload.join.join_at);
             const Node* mask = rewrite_node(&ctx->rewriter, old_terminator->payload.join.desired_mask);
@@ -115,7 +314,10 @@ static const Node* rewrite_block(Context* ctx, const Node* old_block, BlockBuild
     return finish_block(block_builder, new_terminator);
 }
 
-static const Node* lower_callf_process(Context* ctx, const Node* old) {
+static const Node* lower_tailcalls_process(Context* ctx, const Node* old) {
+    const Node* found = search_processed(&ctx->rewriter, old);
+    if (found) return found;
+
     IrArena* dst_arena = ctx->rewriter.dst_arena;
     switch (old->tag) {
         case GlobalVariable_TAG:
@@ -129,22 +331,32 @@ static const Node* lower_callf_process(Context* ctx, const Node* old) {
             nattrs.entry_point_type = NotAnEntryPoint;
             String new_name = nattrs.is_continuation ? old->payload.fn.name : format_string(dst_arena, "%s_leaf", old->payload.fn.name);
 
-            Node* fun = fn(dst_arena, nattrs, new_name, nodes(dst_arena, 0, NULL), nodes(dst_arena, 0, NULL));
+            // the dispatcher pops the arguments and hands them over, see gen_dispatch_case
+            Nodes nparams = recreate_variables(&ctx->rewriter, old->payload.fn.params);
+            for (size_t i = 0; i < nparams.count; i++)
+                register_processed(&ctx->rewriter, old->payload.fn.params.nodes[i], nparams.nodes[i]);
+            Node* fun = fn(dst_arena, nattrs, new_name, nparams, nodes(dst_arena, 0, NULL));
 
             if (old->payload.fn.atttributes.entry_point_type != NotAnEntryPoint) {
-                Node* new_entry_pt = fn(dst_arena, old->payload.fn.atttributes, old->payload.fn.name, old->payload.fn.params, nodes(dst_arena, 0, NULL));
+                Nodes entry_params = recreate_variables(&ctx->rewriter, old->payload.fn.params);
+                Node* new_entry_pt = fn(dst_arena, old->payload.fn.atttributes, old->payload.fn.name, entry_params, nodes(dst_arena, 0, NULL));
                 append_list(const Node*, ctx->new_decls, new_entry_pt);
 
                 BlockBuilder* builder = begin_block(dst_arena);
-                for (size_t i = fun->payload.fn.params.count - 1; i < fun->payload.fn.params.count; i--) {
-                    gen_push_value_stack(builder, fun->payload.fn.params.nodes[i]);
-                }
-
-                gen_store(builder, ctx->next_fn_var, lower_fn_addr(ctx, fun));
                 const Node* entry_mask = gen_primop(builder, (PrimOp) {
                     .op = subgroup_active_mask_op,
                     .operands = nodes(dst_arena, 0, NULL)
                 }).nodes[0];
+                // the entry point returns like any function, see lower_callf: joining at 0 leaves the dispatcher
+                gen_push_value_stack(builder, entry_mask);
+                gen_push_value_stack(builder, fn_ptr_as_value(dst_arena, 0));
+                gen_push_values_stack(builder, entry_params);
+
+                append_block(builder, call_instr(dst_arena, (Call) {
+                    .callee = ctx->init_fn,
+                    .args = nodes(dst_arena, 0, NULL)
+                }));
+                gen_store(builder, ctx->next_fn_var, lower_fn_addr(ctx, old));
                 gen_store(builder, ctx->next_mask_var, entry_mask);
 
                 append_block(builder, call_instr(dst_arena, (Call) {
@@ -160,13 +372,6 @@ static const Node* lower_callf_process(Context* ctx, const Node* old) {
 
             register_processed(&ctx->rewriter, old, fun);
             BlockBuilder* block_builder = begin_block(dst_arena);
-
-            // Params become stack pops !
-            for (size_t i = 0; i < fun->payload.fn.params.count; i++) {
-                const Node* old_param = old->payload.fn.params.nodes[i];
-                const Node* popped = gen_pop_value_stack(block_builder, format_string(dst_arena, "arg%d", i), rewrite_node(&ctx->rewriter, without_qualifier(old_param->type)));
-                register_processed(&ctx->rewriter, old_param, popped);
-            }
             fun->payload.fn.block = rewrite_block(ctx, old->payload.fn.block, block_builder);
 
             return fun;
@@ -188,71 +393,170 @@ static const Node* lower_callf_process(Context* ctx, const Node* old) {
     }
 }
 
-void generate_top_level_dispatch_fn(Context* ctx, const Node* old_root, Node* dispatcher_fn) {
+/// Pops the arguments of a function and calls it, so the functions themselves keep plain parameters.
+/// Only the threads in next_mask go there, the others wait for the dispatcher to come back around.
+static const Node* gen_dispatch_case(Context* ctx, const Node* old_fn) {
     IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Node* leaf = find_processed(&ctx->rewriter, old_fn);
+    Nodes params = leaf->payload.fn.params;
 
-    BlockBuilder* loop_body_builder = begin_block(dst_arena);
+    BlockBuilder* call_builder = begin_block(dst_arena);
+    LARRAY(const Node*, args, params.count);
+    for (size_t i = 0; i < params.count; i++)
+        args[i] = gen_pop_value_stack(call_builder, format_string(dst_arena, "arg_%d", (int) i), without_qualifier(params.nodes[i]->type));
 
-    const Node* next_function = gen_load(loop_body_builder, ctx->next_fn_var);
+    append_block(call_builder, call_instr(dst_arena, (Call) {
+        .callee = leaf,
+        .args = nodes(dst_arena, params.count, args)
+    }));
+    const Node* call_block = finish_block(call_builder, merge_construct(dst_arena, (MergeConstruct) {
+        .args = nodes(dst_arena, 0, NULL),
+        .construct = Selection
+    }));
 
-    struct List* literals = new_list(const Node*);
-    struct List* cases = new_list(const Node*);
+    BlockBuilder* case_builder = begin_block(dst_arena);
+    const Node* next_mask = gen_load(case_builder, ctx->next_mask_var);
+    const Node* local_id = gen_primop(case_builder, (PrimOp) {
+        .op = subgroup_local_id_op,
+        .operands = nodes(dst_arena, 0, NULL)
+    }).nodes[0];
+    const Node* is_active = gen_primop(case_builder, (PrimOp) {
+        .op = mask_is_thread_active_op,
+        .operands = nodes(dst_arena, 2, (const Node* []) { next_mask, local_id })
+    }).nodes[0];
+    append_block(case_builder, if_instr(dst_arena, (If) {
+        .yield_types = nodes(dst_arena, 0, NULL),
+        .condition = is_active,
+        .if_true = call_block,
+        .if_false = NULL
+    }));
+
+    return finish_block(case_builder, merge_construct(dst_arena, (MergeConstruct) {
+        .args = nodes(dst_arena, 0, NULL),
+        .construct = Continue
+    }));
+}
 
-    const Node* zero_lit = int_literal(dst_arena, (IntLiteral) { .value_i32 = 0, .width = IntTy32 });
-    const Node* zero_case = block(dst_arena, (Block) {
-        .instructions = nodes(dst_arena, 0, NULL),
+/// Runs the scheduler with the whole subgroup, it picks what to resume and sets next_fn again
+static const Node* gen_scheduler_case(Context* ctx) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    return block(dst_arena, (Block) {
+        .instructions = nodes(dst_arena, 1, (const Node* []) { call_instr(dst_arena, (Call) {
+            .callee = ctx->rotate_fn,
+            .args = nodes(dst_arena, 0, NULL)
+        }) }),
         .terminator = merge_construct(dst_arena, (MergeConstruct) {
             .args = nodes(dst_arena, 0, NULL),
-            .construct = Break
+            .construct = Continue
         })
     });
+}
 
-    append_list(const Node*, literals, zero_lit);
-    append_list(const Node*, cases, zero_case);
-
-    for (size_t i = 0; i < old_root->payload.root.declarations.count; i++) {
-        const Node* decl = old_root->payload.root.declarations.nodes[i];
-        if (decl->tag == Function_TAG) {
-            const Node* fn_lit = lower_fn_addr(ctx, find_processed(&ctx->rewriter, decl));
-
-            const FnType* fn_type = &without_qualifier(decl->type)->payload.fn_type;
-            BlockBuilder* case_builder = begin_block(dst_arena);
-
-            // LARRAY(const Node*, fn_args, fn_type->param_types.count);
-            // for (size_t j = 0; j < fn_type->param_types.count; j++) {
-            //     fn_args[j] = gen_pop_value_stack(case_builder, format_string(dst_arena, "arg_%d", (int) j), without_qualifier(fn_type->param_types.nodes[j]));
-            // }
-
-            // TODO wrap in if(mask)
-            append_block(case_builder, call_instr(dst_arena, (Call) {
-                .callee = find_processed(&ctx->rewriter, decl),
-                // .args = nodes(dst_arena, fn_type->param_types.count, fn_args)
-                .args = nodes(dst_arena, 0, NULL)
-            }));
-
-            const Node* fn_case = finish_block(case_builder, merge_construct(dst_arena, (MergeConstruct) {
-                .args = nodes(dst_arena, 0, NULL),
-                .construct = Continue
-            }));
-
-            append_list(const Node*, literals, fn_lit);
-            append_list(const Node*, cases, fn_case);
-        }
-    }
-
-    append_block(loop_body_builder, match_instr(dst_arena, (Match) {
+static const Node* gen_dispatch_match(IrArena* dst_arena, const Node* inspect, struct List* literals, struct List* cases) {
+    return match_instr(dst_arena, (Match) {
         .yield_types = nodes(dst_arena, 0, NULL),
-        .inspect = next_function,
+        .inspect = inspect,
         .literals = nodes(dst_arena, entries_count_list(literals), read_list(const Node*, literals)),
         .cases = nodes(dst_arena, entries_count_list(cases), read_list(const Node*, cases)),
         .default_case = block(dst_arena, (Block) {
             .instructions = nodes(dst_arena, 0, NULL),
             .terminator = unreachable(dst_arena)
         })
-    }));
+    });
+}
+
+/// The cases for the IDs in [first, end), 0 stands for leaving the dispatcher
+static const Node* gen_dispatch_range(Context* ctx, const Node* next_function, FnPtr first, FnPtr end, bool with_scheduler) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    struct List* literals = new_list(const Node*);
+    struct List* cases = new_list(const Node*);
+
+    if (first == 0) {
+        const Node* zero_lit = fn_ptr_as_value(dst_arena, 0);
+        const Node* zero_case = block(dst_arena, (Block) {
+            .instructions = nodes(dst_arena, 0, NULL),
+            .terminator = merge_construct(dst_arena, (MergeConstruct) {
+                .args = nodes(dst_arena, 0, NULL),
+                .construct = Break
+            })
+        });
+        append_list(const Node*, literals, zero_lit);
+        append_list(const Node*, cases, zero_case);
+    }
+
+    if (with_scheduler) {
+        const Node* scheduler_lit = fn_ptr_as_value(dst_arena, SCHEDULER_FN_PTR);
+        const Node* scheduler_case = gen_scheduler_case(ctx);
+        append_list(const Node*, literals, scheduler_lit);
+        append_list(const Node*, cases, scheduler_case);
+    }
+
+    for (FnPtr ptr = first > 0 ? first : 1; ptr < end && ptr < ctx->next_fn_ptr; ptr++) {
+        const Node* old_fn = read_list(const Node*, ctx->dispatched_fns)[ptr - 1];
+        const Node* fn_lit = fn_ptr_as_value(dst_arena, ptr);
+        const Node* fn_case = gen_dispatch_case(ctx, old_fn);
+        append_list(const Node*, literals, fn_lit);
+        append_list(const Node*, cases, fn_case);
+    }
 
+    const Node* match = gen_dispatch_match(dst_arena, next_function, literals, cases);
     destroy_list(literals);
     destroy_list(cases);
+    return match;
+}
+
+/// Past that many functions the dispatcher is clustered even when use_clustered_dispatcher is off
+#define CLUSTERED_DISPATCH_MIN_FNS 64
+
+/// Neighbouring IDs are neighbours in the call graph, so the clusters of the two-level dispatcher are ranges of IDs.
+/// They are a power of two wide, close to the square root of the function count.
+static uint32_t get_dispatch_cluster_bits(Context* ctx) {
+    uint32_t bits = 0;
+    while (((FnPtr) 1 << (2 * bits)) < ctx->next_fn_ptr)
+        bits++;
+    return bits;
+}
+
+static void generate_top_level_dispatch_fn(Context* ctx, Node* dispatcher_fn) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+
+    BlockBuilder* loop_body_builder = begin_block(dst_arena);
+
+    const Node* next_function = gen_load(loop_body_builder, ctx->next_fn_var);
+
+    if (ctx->config->use_clustered_dispatcher || ctx->next_fn_ptr > CLUSTERED_DISPATCH_MIN_FNS) {
+        uint32_t bits = get_dispatch_cluster_bits(ctx);
+        FnPtr cluster_size = (FnPtr) 1 << bits;
+        const Node* cluster = gen_primop(loop_body_builder, (PrimOp) {
+            .op = rshift_op,
+            .operands = nodes(dst_arena, 2, (const Node* []) { next_function, fn_ptr_as_value(dst_arena, bits) })
+        }).nodes[0];
+
+        struct List* literals = new_list(const Node*);
+        struct List* cases = new_list(const Node*);
+        for (FnPtr first = 0; first < ctx->next_fn_ptr; first += cluster_size) {
+            const Node* inner_match = gen_dispatch_range(ctx, next_function, first, first + cluster_size, false);
+            const Node* cluster_lit = fn_ptr_as_value(dst_arena, first >> bits);
+            const Node* cluster_case = block(dst_arena, (Block) {
+                .instructions = nodes(dst_arena, 1, (const Node* []) { inner_match }),
+                .terminator = unreachable(dst_arena)
+            });
+            append_list(const Node*, literals, cluster_lit);
+            append_list(const Node*, cases, cluster_case);
+        }
+        info_print("lower_tailcalls: dispatching to %d functions in %zu clusters\n", ctx->next_fn_ptr - 1, entries_count_list(cases));
+        // the shift is an arithmetic one, SCHEDULER_FN_PTR stays the same
+        const Node* scheduler_lit = fn_ptr_as_value(dst_arena, SCHEDULER_FN_PTR);
+        const Node* scheduler_case = gen_scheduler_case(ctx);
+        append_list(const Node*, literals, scheduler_lit);
+        append_list(const Node*, cases, scheduler_case);
+        append_block(loop_body_builder, gen_dispatch_match(dst_arena, cluster, literals, cases));
+        destroy_list(literals);
+        destroy_list(cases);
+    } else {
+        info_print("lower_tailcalls: dispatching to %d functions\n", ctx->next_fn_ptr - 1);
+        append_block(loop_body_builder, gen_dispatch_range(ctx, next_function, 0, ctx->next_fn_ptr, true));
+    }
 
     const Node* loop_body = finish_block(loop_body_builder, unreachable(dst_arena));
 
@@ -272,44 +576,66 @@ void generate_top_level_dispatch_fn(Context* ctx, const Node* old_root, Node* di
     });
 }
 
-const Node* lower_callf(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+const Node* lower_tailcalls(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
     struct List* new_decls_list = new_list(const Node*);
     struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
     struct Dict* ptrs = new_dict(const Node*, FnPtr, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* dispatched_fns = new_list(const Node*);
 
     Node* dispatcher_fn = fn(dst_arena, (FnAttributes) {.entry_point_type = NotAnEntryPoint, .is_continuation = false}, "top_dispatcher", nodes(dst_arena, 0, NULL), nodes(dst_arena, 0, NULL));
     append_list(const Node*, new_decls_list, dispatcher_fn);
 
+    // the state of the dispatcher lives in the builtin module, along with the functions that update it
+    BuiltinModule* prepared = config->builtins ? NULL : prepare_builtins(config);
+    const BuiltinModule* builtins = config->builtins ? config->builtins : prepared;
+    assert(builtins->subgroup_size == config->subgroup_size && builtins->scheduling_policy == config->scheduling_policy);
+    Nodes builtin_decls = import_builtins(builtins, dst_arena);
+    if (prepared)
+        destroy_builtins(prepared);
+    for (size_t i = 0; i < builtin_decls.count; i++)
+        append_list(const Node*, new_decls_list, builtin_decls.nodes[i]);
+
     Context ctx = {
         .rewriter = {
             .dst_arena = dst_arena,
             .src_arena = src_arena,
-            .rewrite_fn = (RewriteFn) lower_callf_process,
+            .rewrite_fn = (RewriteFn) lower_tailcalls_process,
             .rewrite_decl_body = NULL,
             .processed = done,
         },
+        .config = config,
         .assigned_fn_ptrs = ptrs,
         .next_fn_ptr = 1,
+        .dispatched_fns = dispatched_fns,
 
         .new_decls = new_decls_list,
         .god_fn = dispatcher_fn,
+        .next_fn_var = find_builtin(builtin_decls, "next_fn"),
+        .next_mask_var = find_builtin(builtin_decls, "next_mask"),
+        .init_fn = find_builtin(builtin_decls, "builtin_init_scheduler"),
+        .branch_fn = find_builtin(builtin_decls, "builtin_branch"),
+        .join_fn = find_builtin(builtin_decls, "builtin_join"),
+        .rotate_fn = find_builtin(builtin_decls, "builtin_rotate_active_branch"),
     };
 
+    assign_fn_ptrs(&ctx, src_program);
+
     const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
 
-    generate_top_level_dispatch_fn(&ctx, src_program, dispatcher_fn);
+    generate_top_level_dispatch_fn(&ctx, dispatcher_fn);
 
-    Nodes new_decls = rewritten->payload.root.declarations;
-    for (size_t i = 0; i < entries_count_list(new_decls_list); i++) {
-        new_decls = append_nodes(dst_arena, new_decls, read_list(const Node*, new_decls_list)[i]);
-    }
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    add_nodes(new_decls, rewritten->payload.root.declarations);
+    for (size_t i = 0; i < entries_count_list(new_decls_list); i++)
+        add_node(new_decls, read_list(const Node*, new_decls_list)[i]);
     rewritten = root(dst_arena, (Root) {
-        .declarations = new_decls
+        .declarations = finish_nodes(new_decls)
     });
 
     destroy_list(new_decls_list);
 
     destroy_dict(done);
     destroy_dict(ptrs);
+    destroy_list(dispatched_fns);
     return rewritten;
 }
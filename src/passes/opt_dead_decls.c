@@ -0,0 +1,128 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../visit.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef struct {
+    Visitor visitor;
+    /// Every node seen so far, the declarations in there are the live ones
+    struct Dict* live;
+} LivenessVisitor;
+
+static void visit_live(LivenessVisitor* visitor, const Node* node) {
+    if (is_type(node))
+        return;
+    switch (node->tag) {
+        case Variable_TAG:
+        case Unbound_TAG:
+        case UntypedNumber_TAG:
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG: return;
+        case Tuple_TAG: {
+            for (size_t i = 0; i < node->payload.tuple.contents.count; i++)
+                visit_live(visitor, node->payload.tuple.contents.nodes[i]);
+            return;
+        }
+        case FnAddr_TAG: visit_live(visitor, node->payload.fn_addr.fn); return;
+        case GlobalVariable_TAG: {
+            if (insert_set_get_result(const Node*, visitor->live, node) && node->payload.global_variable.init)
+                visit_live(visitor, node->payload.global_variable.init);
+            return;
+        }
+        case Function_TAG:
+        case Constant_TAG:
+            if (!insert_set_get_result(const Node*, visitor->live, node))
+                return;
+            // fallthrough
+        default: visit_children(&visitor->visitor, node); return;
+    }
+}
+
+static const Node* process_node(Rewriter* rewriter, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        case Function_TAG:
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* decl = recreate_decl_header_identity(rewriter, node);
+            recreate_decl_body_identity(rewriter, node, decl);
+            return decl;
+        }
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(rewriter, node);
+    }
+}
+
+const Node* opt_dead_decls(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    assert(src_program->tag == Root_TAG);
+    Nodes old_decls = src_program->payload.root.declarations;
+
+    LivenessVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_live,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = true,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .live = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+
+    size_t entry_points = 0;
+    for (size_t i = 0; i < old_decls.count; i++) {
+        const Node* decl = old_decls.nodes[i];
+        if (decl->tag == Function_TAG && decl->payload.fn.atttributes.entry_point_type != NotAnEntryPoint) {
+            visit_live(&visitor, decl);
+            entry_points++;
+        }
+    }
+
+    // without entry points we are looking at a library, everything in there is meant to be kept
+    if (entry_points == 0) {
+        for (size_t i = 0; i < old_decls.count; i++)
+            visit_live(&visitor, old_decls.nodes[i]);
+    }
+
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    Rewriter rewriter = {
+        .dst_arena = dst_arena,
+        .src_arena = src_arena,
+        .rewrite_fn = (RewriteFn) process_node,
+        .rewrite_decl_body = NULL,
+        .processed = done,
+    };
+
+    NodesBuilder* new_decls = begin_nodes(dst_arena);
+    for (size_t i = 0; i < old_decls.count; i++) {
+        const Node* decl = old_decls.nodes[i];
+        if (find_key_dict(const Node*, visitor.live, decl))
+            add_node(new_decls, rewrite_node(&rewriter, decl));
+        else
+            debug_print("opt_dead_decls: removing %s\n", get_decl_name(decl));
+    }
+    Nodes live_decls = finish_nodes(new_decls);
+    info_print("opt_dead_decls: removed %zu out of %zu declarations\n", old_decls.count - live_decls.count, old_decls.count);
+
+    destroy_dict(visitor.live);
+    destroy_dict(done);
+    return root(dst_arena, (Root) {
+        .declarations = live_decls,
+    });
+}
@@ -0,0 +1,219 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../fold.h"
+#include "../portability.h"
+#include "../rewrite.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    size_t folded_ifs;
+    size_t propagated_values;
+    size_t invariant_params;
+} Context;
+
+static const Node* process_node(Context* ctx, const Node* node);
+
+/// Gathers the arguments of every `continue` that targets the loop owning this block.
+/// Returns false if the body leaves structured control flow, in which case we can't see all of them.
+static bool collect_continues(const Node* block, struct List* continues) {
+    if (!block)
+        return true;
+    assert(block->tag == Block_TAG);
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instr = instructions.nodes[i];
+        if (instr->tag == Let_TAG)
+            instr = instr->payload.let.instruction;
+        switch (instr->tag) {
+            case If_TAG:
+                if (!collect_continues(instr->payload.if_instr.if_true, continues) || !collect_continues(instr->payload.if_instr.if_false, continues))
+                    return false;
+                break;
+            case Match_TAG:
+                for (size_t j = 0; j < instr->payload.match_instr.cases.count; j++)
+                    if (!collect_continues(instr->payload.match_instr.cases.nodes[j], continues))
+                        return false;
+                if (!collect_continues(instr->payload.match_instr.default_case, continues))
+                    return false;
+                break;
+            // continues in there belong to the inner loop
+            case Loop_TAG:
+            default: break;
+        }
+    }
+
+    const Node* terminator = block->payload.block.terminator;
+    switch (terminator->tag) {
+        case MergeConstruct_TAG:
+            if (terminator->payload.merge_construct.construct == Continue)
+                append_list(Nodes, continues, terminator->payload.merge_construct.args);
+            return true;
+        case Return_TAG:
+        case Unreachable_TAG: return true;
+        default: return false;
+    }
+}
+
+static const Node* process_loop(Context* ctx, const Node* node) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Loop* old_loop = &node->payload.loop_instr;
+    Nodes old_params = old_loop->params;
+
+    struct List* continues = new_list(Nodes);
+    bool visible = collect_continues(old_loop->body, continues);
+
+    Nodes new_initial_args = rewrite_nodes(&ctx->rewriter, old_loop->initial_args);
+    LARRAY(const Node*, new_params, old_params.count);
+    for (size_t i = 0; i < old_params.count; i++) {
+        new_params[i] = recreate_variable(&ctx->rewriter, old_params.nodes[i]);
+
+        // a param that every iteration passes back unchanged always holds its initial value
+        bool invariant = visible;
+        for (size_t j = 0; invariant && j < entries_count_list(continues); j++) {
+            const Node* arg = read_list(Nodes, continues)[j].nodes[i];
+            invariant &= arg == old_params.nodes[i] || arg == old_loop->initial_args.nodes[i];
+        }
+
+        if (invariant && resolve_to_literal_node(new_initial_args.nodes[i])) {
+            register_processed(&ctx->rewriter, old_params.nodes[i], new_initial_args.nodes[i]);
+            ctx->invariant_params++;
+        } else
+            register_processed(&ctx->rewriter, old_params.nodes[i], new_params[i]);
+    }
+    destroy_list(continues);
+
+    return loop_instr(dst_arena, (Loop) {
+        .yield_types = rewrite_nodes(&ctx->rewriter, old_loop->yield_types),
+        .params = nodes(dst_arena, old_params.count, new_params),
+        .initial_args = new_initial_args,
+        .body = rewrite_node(&ctx->rewriter, old_loop->body),
+    });
+}
+
+/// Rewrites the instructions of an old block into the builder and returns the new terminator.
+/// Ifs on known conditions get the taken side spliced in, so the terminator may come from there.
+static const Node* fold_instructions(Context* ctx, NodesBuilder* instructions, const Node* old_block) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++) {
+        const Node* old = old_instructions.nodes[i];
+        const Node* old_let = old->tag == Let_TAG ? old : NULL;
+        const Node* old_instr = old_let ? old_let->payload.let.instruction : old;
+
+        if (old_instr->tag == If_TAG) {
+            const If* old_if = &old_instr->payload.if_instr;
+            const Node* condition = resolve_to_literal_node(rewrite_node(&ctx->rewriter, old_if->condition));
+            if (condition) {
+                ctx->folded_ifs++;
+                const Node* taken = condition->tag == True_TAG ? old_if->if_true : old_if->if_false;
+                if (!taken)
+                    continue;
+                const Node* terminator = fold_instructions(ctx, instructions, taken);
+                if (terminator->tag != MergeConstruct_TAG || terminator->payload.merge_construct.construct != Selection)
+                    return terminator;
+                // the values the branch yields take the place of the let-bound variables
+                if (old_let) {
+                    Nodes yielded = terminator->payload.merge_construct.args;
+                    assert(yielded.count == old_let->payload.let.variables.count);
+                    for (size_t j = 0; j < yielded.count; j++)
+                        register_processed(&ctx->rewriter, old_let->payload.let.variables.nodes[j], yielded.nodes[j]);
+                }
+                continue;
+            }
+        }
+
+        if (!old_let) {
+            add_node(instructions, rewrite_node(&ctx->rewriter, old));
+            continue;
+        }
+
+        const Node* new_instr = rewrite_node(&ctx->rewriter, old_instr);
+        Nodes old_vars = old_let->payload.let.variables;
+
+        // the instruction folded down to a value, use it directly instead of binding it
+        if (!old_let->payload.let.is_mutable && old_vars.count == 1 && is_value(new_instr)) {
+            register_processed(&ctx->rewriter, old_vars.nodes[0], new_instr);
+            ctx->propagated_values++;
+            continue;
+        }
+
+        LARRAY(const char*, names, old_vars.count);
+        for (size_t j = 0; j < old_vars.count; j++)
+            names[j] = old_vars.nodes[j]->payload.var.name;
+        const Node* new_let = old_let->payload.let.is_mutable ?
+            let_mut(dst_arena, new_instr, rewrite_nodes(&ctx->rewriter, extract_variable_types(ctx->rewriter.src_arena, &old_vars)), old_vars.count, names) :
+            let(dst_arena, new_instr, old_vars.count, names);
+        for (size_t j = 0; j < old_vars.count; j++)
+            register_processed(&ctx->rewriter, old_vars.nodes[j], new_let->payload.let.variables.nodes[j]);
+        add_node(instructions, new_let);
+    }
+    return rewrite_node(&ctx->rewriter, old_block->payload.block.terminator);
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    switch (node->tag) {
+        case Function_TAG: {
+            Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
+            fun->payload.fn.block = process_node(ctx, node->payload.fn.block);
+            return fun;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* decl = recreate_decl_header_identity(&ctx->rewriter, node);
+            recreate_decl_body_identity(&ctx->rewriter, node, decl);
+            return decl;
+        }
+        case Block_TAG: {
+            NodesBuilder* instructions = begin_nodes(dst_arena);
+            const Node* terminator = fold_instructions(ctx, instructions, node);
+            return block(dst_arena, (Block) {
+                .instructions = finish_nodes(instructions),
+                .terminator = terminator,
+            });
+        }
+        case Loop_TAG: return process_loop(ctx, node);
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+const Node* opt_fold(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .folded_ifs = 0,
+        .propagated_values = 0,
+        .invariant_params = 0,
+    };
+
+    assert(src_program->tag == Root_TAG);
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    debug_print("opt_fold: folded %zu ifs, propagated %zu values and %zu loop-invariant params\n", ctx.folded_ifs, ctx.propagated_values, ctx.invariant_params);
+
+    destroy_dict(done);
+    return rewritten;
+}
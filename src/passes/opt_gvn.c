@@ -0,0 +1,206 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../analysis/scope.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+/// The values computed so far along the current path of the dominator tree, one level per dominator/enclosing block
+typedef struct AvailableValues_ AvailableValues;
+struct AvailableValues_ {
+    struct Dict* values;
+    AvailableValues* parent;
+};
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    AvailableValues* available;
+    struct List* new_fns;
+    size_t removed;
+} Context;
+
+static const Node* process_node(Context* ctx, const Node* node);
+
+static AvailableValues* push_available(Context* ctx) {
+    AvailableValues* level = malloc(sizeof(AvailableValues));
+    *level = (AvailableValues) {
+        .values = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .parent = ctx->available,
+    };
+    ctx->available = level;
+    return level;
+}
+
+static void pop_available(Context* ctx, AvailableValues* level) {
+    assert(ctx->available == level);
+    ctx->available = level->parent;
+    destroy_dict(level->values);
+    free(level);
+}
+
+static const Node* find_available(Context* ctx, const Node* instruction) {
+    for (AvailableValues* level = ctx->available; level; level = level->parent) {
+        const Node** found = find_value_dict(const Node*, const Node*, level->values, instruction);
+        if (found)
+            return *found;
+    }
+    return NULL;
+}
+
+/// Whether two occurrences of the same primop are guaranteed to give the same result.
+/// Loads can see stores in between, and the subgroup ops depend on which lanes are active at that point.
+static bool is_value_numberable(Op op) {
+    if (has_primop_got_side_effects(op))
+        return false;
+    switch (op) {
+        case load_op:
+        case subgroup_elect_first_op:
+        case subgroup_broadcast_first_op:
+        case subgroup_active_mask_op:
+        case subgroup_ballot_op: return false;
+        default: return true;
+    }
+}
+
+/// Rewrites the instructions of a block, making what they compute available to the current level
+static const Node* rewrite_block_contents(Context* ctx, const Node* old_block) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    NodesBuilder* instructions = begin_nodes(dst_arena);
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++) {
+        const Node* old = old_instructions.nodes[i];
+        if (old->tag != Let_TAG || old->payload.let.is_mutable || old->payload.let.variables.count != 1) {
+            add_node(instructions, rewrite_node(&ctx->rewriter, old));
+            continue;
+        }
+
+        const Node* old_var = old->payload.let.variables.nodes[0];
+        const Node* instruction = rewrite_node(&ctx->rewriter, old->payload.let.instruction);
+        bool numberable = instruction->tag == PrimOp_TAG && is_value_numberable(instruction->payload.prim_op.op);
+        if (numberable) {
+            // hash-consing makes identical primops the same node once their operands are numbered
+            const Node* found = find_available(ctx, instruction);
+            if (found) {
+                register_processed(&ctx->rewriter, old_var, found);
+                ctx->removed++;
+                continue;
+            }
+        }
+
+        const Node* new_let = let(dst_arena, instruction, 1, (const char* []) { old_var->payload.var.name });
+        const Node* new_var = new_let->payload.let.variables.nodes[0];
+        register_processed(&ctx->rewriter, old_var, new_var);
+        if (numberable)
+            insert_dict(const Node*, const Node*, ctx->available->values, instruction, new_var);
+        add_node(instructions, new_let);
+    }
+    return block(dst_arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = rewrite_node(&ctx->rewriter, old_block->payload.block.terminator),
+    });
+}
+
+/// Rewrites the bodies of the continuations in dominator tree order, so each one sees what its dominators computed
+static void process_dominated(Context* ctx, CFNode* cf_node) {
+    AvailableValues* level = push_available(ctx);
+
+    Node* new_fn = (Node*) process_node(ctx, cf_node->node);
+    if (!new_fn->payload.fn.block)
+        new_fn->payload.fn.block = rewrite_block_contents(ctx, cf_node->node->payload.fn.block);
+
+    for (size_t i = 0; i < entries_count_list(cf_node->dominates); i++)
+        process_dominated(ctx, read_list(CFNode*, cf_node->dominates)[i]);
+
+    pop_available(ctx, level);
+}
+
+static void process_function_body(Context* ctx, const Node* old_fn) {
+    Scope scope = build_scope(old_fn);
+    AvailableValues* outer = ctx->available;
+    ctx->available = NULL;
+    process_dominated(ctx, scope.entry);
+    ctx->available = outer;
+    dispose_scope(&scope);
+}
+
+static void process_decl_body(Context* ctx, const Node* old, Node* new) {
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!new->payload.fn.block)
+                process_function_body(ctx, old);
+            break;
+        }
+        default: recreate_decl_body_identity(&ctx->rewriter, old, new); break;
+    }
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        // bodies are filled in dominator tree order, see process_dominated
+        case Function_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, node);
+            append_list(const Node*, ctx->new_fns, node);
+            return new;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: return recreate_decl_header_identity(&ctx->rewriter, node);
+        // structured constructs can use what the enclosing block computed, but not the other way around
+        case Block_TAG: {
+            AvailableValues* level = push_available(ctx);
+            const Node* new = rewrite_block_contents(ctx, node);
+            pop_available(ctx, level);
+            return new;
+        }
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_gvn(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* new_fns = new_list(const Node*);
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = (RewriteFnMut) process_decl_body,
+            .processed = done,
+        },
+        .available = NULL,
+        .new_fns = new_fns,
+        .removed = 0,
+    };
+
+    assert(src_program->tag == Root_TAG);
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+
+    // continuations outside of the scopes we walked, like the ones only referenced through a function pointer
+    for (size_t i = 0; i < entries_count_list(new_fns); i++) {
+        const Node* old_fn = read_list(const Node*, new_fns)[i];
+        if (!find_processed(&ctx.rewriter, old_fn)->payload.fn.block)
+            process_function_body(&ctx, old_fn);
+    }
+
+    info_print("opt_gvn: removed %zu redundant instructions\n", ctx.removed);
+
+    destroy_list(new_fns);
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,411 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../visit.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+/// What we know about each function before deciding to inline it
+typedef struct {
+    size_t call_sites;
+    struct List* callees;
+    bool recursive;
+} CalleeInfo;
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    CompilerConfig* config;
+    struct Dict* infos;
+    /// Inlined bodies get rewritten in a context of their own, declarations are still rewritten by the outermost one
+    struct Context_* root;
+    const Node* current_fn;
+    size_t inlined;
+} Context;
+
+typedef struct {
+    Visitor visitor;
+    struct Dict* infos;
+    struct List* functions;
+    struct Dict* seen;
+    const Node* current_fn;
+} CallGraphVisitor;
+
+static CalleeInfo* get_info(struct Dict* infos, const Node* fn) {
+    CalleeInfo** found = find_value_dict(const Node*, CalleeInfo*, infos, fn);
+    if (found)
+        return *found;
+    CalleeInfo* info = malloc(sizeof(CalleeInfo));
+    *info = (CalleeInfo) {
+        .call_sites = 0,
+        .callees = new_list(const Node*),
+        .recursive = false,
+    };
+    insert_dict(const Node*, CalleeInfo*, infos, fn, info);
+    return info;
+}
+
+static void visit_call_graph(CallGraphVisitor* visitor, const Node* node) {
+    if (is_type(node))
+        return;
+    switch (node->tag) {
+        case Call_TAG: {
+            const Node* callee = node->payload.call_instr.callee;
+            if (callee->tag == Function_TAG && visitor->current_fn) {
+                get_info(visitor->infos, callee)->call_sites++;
+                append_list(const Node*, get_info(visitor->infos, visitor->current_fn)->callees, callee);
+            }
+            visit_children(&visitor->visitor, node);
+            return;
+        }
+        case Tuple_TAG: {
+            for (size_t i = 0; i < node->payload.tuple.contents.count; i++)
+                visit_call_graph(visitor, node->payload.tuple.contents.nodes[i]);
+            return;
+        }
+        case Variable_TAG:
+        case Unbound_TAG:
+        case UntypedNumber_TAG:
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case GlobalVariable_TAG: return;
+        case Function_TAG: {
+            if (!insert_set_get_result(const Node*, visitor->seen, node))
+                return;
+            // calls made from continuations count as calls made by the function they belong to
+            const Node* outer_fn = visitor->current_fn;
+            if (!node->payload.fn.atttributes.is_continuation) {
+                visitor->current_fn = node;
+                get_info(visitor->infos, node);
+                append_list(const Node*, visitor->functions, node);
+            }
+            visit_children(&visitor->visitor, node);
+            visitor->current_fn = outer_fn;
+            return;
+        }
+        case Constant_TAG:
+            if (!insert_set_get_result(const Node*, visitor->seen, node))
+                return;
+            // fallthrough
+        default: visit_children(&visitor->visitor, node); return;
+    }
+}
+
+static bool reaches(struct Dict* infos, struct Dict* visited, const Node* from, const Node* to) {
+    CalleeInfo* info = get_info(infos, from);
+    for (size_t i = 0; i < entries_count_list(info->callees); i++) {
+        const Node* callee = read_list(const Node*, info->callees)[i];
+        if (callee == to)
+            return true;
+        if (insert_set_get_result(const Node*, visited, callee) && reaches(infos, visited, callee, to))
+            return true;
+    }
+    return false;
+}
+
+static bool has_returns(const Node* node) {
+    if (!node)
+        return false;
+    switch (node->tag) {
+        case Let_TAG: return has_returns(node->payload.let.instruction);
+        case If_TAG: return has_returns(node->payload.if_instr.if_true) || has_returns(node->payload.if_instr.if_false);
+        case Loop_TAG: return has_returns(node->payload.loop_instr.body);
+        case Match_TAG: {
+            for (size_t i = 0; i < node->payload.match_instr.cases.count; i++)
+                if (has_returns(node->payload.match_instr.cases.nodes[i]))
+                    return true;
+            return has_returns(node->payload.match_instr.default_case);
+        }
+        case Block_TAG: {
+            for (size_t i = 0; i < node->payload.block.instructions.count; i++)
+                if (has_returns(node->payload.block.instructions.nodes[i]))
+                    return true;
+            return node->payload.block.terminator->tag == Return_TAG;
+        }
+        default: return false;
+    }
+}
+
+/// Whether the block only ever returns at its very end, possibly from the two sides of a trailing if.
+/// That is the shape we can paste at a callsite without having to model early exits.
+static bool returns_at_tail(const Node* block) {
+    Nodes instructions = block->payload.block.instructions;
+    const Node* terminator = block->payload.block.terminator;
+    size_t checked = instructions.count;
+    switch (terminator->tag) {
+        case Return_TAG: break;
+        case Unreachable_TAG: {
+            if (instructions.count == 0)
+                return false;
+            const Node* last = instructions.nodes[instructions.count - 1];
+            if (last->tag != If_TAG || !last->payload.if_instr.if_false || last->payload.if_instr.yield_types.count > 0)
+                return false;
+            if (!returns_at_tail(last->payload.if_instr.if_true) || !returns_at_tail(last->payload.if_instr.if_false))
+                return false;
+            checked--;
+            break;
+        }
+        default: return false;
+    }
+    for (size_t i = 0; i < checked; i++)
+        if (has_returns(instructions.nodes[i]))
+            return false;
+    return true;
+}
+
+static size_t measure(const Node* node) {
+    if (!node)
+        return 0;
+    switch (node->tag) {
+        case Let_TAG: return measure(node->payload.let.instruction);
+        case If_TAG: return 1 + measure(node->payload.if_instr.if_true) + measure(node->payload.if_instr.if_false);
+        case Loop_TAG: return 1 + measure(node->payload.loop_instr.body);
+        case Match_TAG: {
+            size_t size = 1 + measure(node->payload.match_instr.default_case);
+            for (size_t i = 0; i < node->payload.match_instr.cases.count; i++)
+                size += measure(node->payload.match_instr.cases.nodes[i]);
+            return size;
+        }
+        case Block_TAG: {
+            size_t size = 1;
+            for (size_t i = 0; i < node->payload.block.instructions.count; i++)
+                size += measure(node->payload.block.instructions.nodes[i]);
+            return size;
+        }
+        default: return 1;
+    }
+}
+
+static bool should_inline(Context* ctx, const Node* callee) {
+    const char* caller_name = ctx->current_fn ? ctx->current_fn->payload.fn.name : "?";
+    const char* callee_name = callee->payload.fn.name;
+    CalleeInfo* info = get_info(ctx->root->infos, callee);
+    if (callee->payload.fn.atttributes.entry_point_type != NotAnEntryPoint || callee->payload.fn.atttributes.is_continuation)
+        return false;
+    if (info->recursive) {
+        debug_print("opt_inline: not inlining %s into %s, it is recursive\n", callee_name, caller_name);
+        return false;
+    }
+    if (!callee->payload.fn.block || !returns_at_tail(callee->payload.fn.block)) {
+        debug_print("opt_inline: not inlining %s into %s, it returns from the middle of its body\n", callee_name, caller_name);
+        return false;
+    }
+    size_t size = measure(callee->payload.fn.block);
+    if (size > ctx->config->inlining_threshold && info->call_sites > 1) {
+        debug_print("opt_inline: not inlining %s into %s, it is too big (%zu > %zu) and called from %zu places\n", callee_name, caller_name, size, ctx->config->inlining_threshold, info->call_sites);
+        return false;
+    }
+    info_print("opt_inline: inlining %s into %s (size %zu, called from %zu places)\n", callee_name, caller_name, size, info->call_sites);
+    return true;
+}
+
+static const Node* process_node(Context* ctx, const Node* node);
+
+static Nodes inline_block(Context* ctx, NodesBuilder* instructions, const Node* old_block, Nodes return_types);
+static Nodes inline_call(Context* ctx, NodesBuilder* instructions, const Node* callee, Nodes new_args);
+
+/// Rewrites an instruction into the builder, pasting the callee instead if it is a call worth inlining
+static void process_instruction(Context* ctx, NodesBuilder* instructions, const Node* old) {
+    const Node* old_let = old->tag == Let_TAG && !old->payload.let.is_mutable ? old : NULL;
+    const Node* old_instr = old_let ? old_let->payload.let.instruction : old;
+    if (old_instr->tag == Call_TAG) {
+        const Node* callee = old_instr->payload.call_instr.callee;
+        if (callee->tag == Function_TAG && should_inline(ctx, callee)) {
+            Nodes new_args = rewrite_nodes(&ctx->rewriter, old_instr->payload.call_instr.args);
+            Nodes values = inline_call(ctx, instructions, callee, new_args);
+            if (old_let) {
+                Nodes old_vars = old_let->payload.let.variables;
+                assert(old_vars.count == values.count);
+                for (size_t j = 0; j < old_vars.count; j++)
+                    register_processed(&ctx->rewriter, old_vars.nodes[j], values.nodes[j]);
+            }
+            return;
+        }
+    }
+    add_node(instructions, rewrite_node(&ctx->rewriter, old));
+}
+
+/// Turns a side of the trailing if of an inlined body into a block yielding what it would have returned
+static const Node* inline_branch(Context* ctx, const Node* old_block, Nodes return_types) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    NodesBuilder* instructions = begin_nodes(dst_arena);
+    Nodes values = inline_block(ctx, instructions, old_block, return_types);
+    return block(dst_arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = merge_construct(dst_arena, (MergeConstruct) {
+            .construct = Selection,
+            .args = values,
+        }),
+    });
+}
+
+/// Pastes the contents of a block of the callee, see returns_at_tail for its shape. Returns the values it returns.
+static Nodes inline_block(Context* ctx, NodesBuilder* instructions, const Node* old_block, Nodes return_types) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    Nodes old_instructions = old_block->payload.block.instructions;
+    const Node* old_terminator = old_block->payload.block.terminator;
+    size_t straight = old_terminator->tag == Return_TAG ? old_instructions.count : old_instructions.count - 1;
+    for (size_t i = 0; i < straight; i++)
+        process_instruction(ctx, instructions, old_instructions.nodes[i]);
+
+    if (old_terminator->tag == Return_TAG)
+        return rewrite_nodes(&ctx->rewriter, old_terminator->payload.fn_ret.values);
+
+    const If* old_if = &old_instructions.nodes[straight]->payload.if_instr;
+    const Node* new_if = if_instr(dst_arena, (If) {
+        .yield_types = return_types,
+        .condition = rewrite_node(&ctx->rewriter, old_if->condition),
+        .if_true = inline_branch(ctx, old_if->if_true, return_types),
+        .if_false = inline_branch(ctx, old_if->if_false, return_types),
+    });
+    if (return_types.count == 0) {
+        add_node(instructions, new_if);
+        return nodes(dst_arena, 0, NULL);
+    }
+    const Node* new_let = let(dst_arena, new_if, return_types.count, NULL);
+    add_node(instructions, new_let);
+    return new_let->payload.let.variables;
+}
+
+/// Pastes the body of the callee in place of the call, and returns what it returns
+static Nodes inline_call(Context* ctx, NodesBuilder* instructions, const Node* callee, Nodes new_args) {
+    Context* root = ctx->root;
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    Context inlined_ctx = {
+        .rewriter = {
+            .dst_arena = ctx->rewriter.dst_arena,
+            .src_arena = ctx->rewriter.src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .config = ctx->config,
+        .infos = NULL,
+        .root = root,
+        .current_fn = ctx->current_fn,
+        .inlined = 0,
+    };
+
+    Nodes params = callee->payload.fn.params;
+    assert(params.count == new_args.count);
+    for (size_t i = 0; i < params.count; i++)
+        register_processed(&inlined_ctx.rewriter, params.nodes[i], new_args.nodes[i]);
+
+    Nodes return_types = rewrite_nodes(&root->rewriter, callee->payload.fn.return_types);
+    Nodes values = inline_block(&inlined_ctx, instructions, callee->payload.fn.block, return_types);
+
+    destroy_dict(done);
+    root->inlined++;
+    return values;
+}
+
+static const Node* process_block(Context* ctx, const Node* old_block) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    NodesBuilder* instructions = begin_nodes(dst_arena);
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++)
+        process_instruction(ctx, instructions, old_instructions.nodes[i]);
+    return block(dst_arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = rewrite_node(&ctx->rewriter, old_block->payload.block.terminator),
+    });
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        case Function_TAG:
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            if (ctx->root != ctx)
+                return rewrite_node(&ctx->root->rewriter, node);
+            Node* decl = recreate_decl_header_identity(&ctx->rewriter, node);
+            if (node->tag == Function_TAG) {
+                const Node* outer_fn = ctx->current_fn;
+                if (!node->payload.fn.atttributes.is_continuation)
+                    ctx->current_fn = node;
+                decl->payload.fn.block = process_node(ctx, node->payload.fn.block);
+                ctx->current_fn = outer_fn;
+            } else
+                recreate_decl_body_identity(&ctx->rewriter, node, decl);
+            return decl;
+        }
+        case Block_TAG: return process_block(ctx, node);
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_inline(CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct Dict* infos = new_dict(const Node*, CalleeInfo*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* functions = new_list(const Node*);
+
+    CallGraphVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_call_graph,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = true,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .infos = infos,
+        .functions = functions,
+        .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .current_fn = NULL,
+    };
+    visit_children(&visitor.visitor, src_program);
+    destroy_dict(visitor.seen);
+
+    // anything that can call back into itself would need unrolling, we leave those alone
+    for (size_t i = 0; i < entries_count_list(functions); i++) {
+        const Node* fn = read_list(const Node*, functions)[i];
+        struct Dict* visited = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+        get_info(infos, fn)->recursive = reaches(infos, visited, fn, fn);
+        destroy_dict(visited);
+    }
+
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .config = config,
+        .infos = infos,
+        .current_fn = NULL,
+        .inlined = 0,
+    };
+    ctx.root = &ctx;
+
+    assert(src_program->tag == Root_TAG);
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    info_print("opt_inline: inlined %zu calls\n", ctx.inlined);
+
+    for (size_t i = 0; i < entries_count_list(functions); i++) {
+        CalleeInfo* info = get_info(infos, read_list(const Node*, functions)[i]);
+        destroy_list(info->callees);
+        free(info);
+    }
+    destroy_list(functions);
+    destroy_dict(infos);
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,390 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../analysis/scope.h"
+#include "../analysis/looptree.h"
+#include "../analysis/uses.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    /// lets that got hoisted out of the continuation they were in, and the continuation they now go at the end of
+    struct Dict* location;
+    /// for each preheader, what got hoisted into it in order
+    struct Dict* hoisted_into;
+    struct List* hoisted_lists;
+    /// lets hoisted out of structured loops, they are emitted ahead of the loop
+    struct Dict* hoisted_structured;
+    struct List* new_fns;
+    size_t hoisted;
+    size_t divergent_loops;
+} Context;
+
+static const Node* process_node(Context* ctx, const Node* node);
+
+/// Whether the instruction can be computed once ahead of the loop instead of on every iteration, and possibly when the loop isn't entered at all.
+/// Loads can see the stores of the loop, divisions could trap when speculated, and in a loop where threads leave at different times,
+/// the subgroup ops would see a different set of active threads out of it.
+static bool is_hoistable(const Node* instruction, bool divergent) {
+    // another name for a value is free to move around
+    if (is_value(instruction))
+        return true;
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    if (has_primop_got_side_effects(op))
+        return false;
+    switch (op) {
+        case load_op:
+        case div_op:
+        case mod_op: return false;
+        case subgroup_elect_first_op:
+        case subgroup_broadcast_first_op:
+        case subgroup_active_mask_op:
+        case subgroup_ballot_op: return !divergent;
+        default: return true;
+    }
+}
+
+static bool is_defined_outside(struct Dict* defs, const Node* value) {
+    if (!value || is_type(value))
+        return true;
+    switch (value->tag) {
+        case Variable_TAG: return !find_key_dict(const Node*, defs, value);
+        case Tuple_TAG: {
+            for (size_t i = 0; i < value->payload.tuple.contents.count; i++)
+                if (!is_defined_outside(defs, value->payload.tuple.contents.nodes[i]))
+                    return false;
+            return true;
+        }
+        default: return true;
+    }
+}
+
+static bool is_invariant(struct Dict* defs, const Node* instruction) {
+    if (is_value(instruction))
+        return is_defined_outside(defs, instruction);
+    Nodes operands = instruction->payload.prim_op.operands;
+    for (size_t i = 0; i < operands.count; i++)
+        if (!is_defined_outside(defs, operands.nodes[i]))
+            return false;
+    return true;
+}
+
+static bool is_candidate_let(const Node* instruction) {
+    return instruction->tag == Let_TAG && !instruction->payload.let.is_mutable;
+}
+
+static void add_defs(struct Dict* defs, Nodes vars) {
+    for (size_t i = 0; i < vars.count; i++)
+        insert_set_get_result(const Node*, defs, vars.nodes[i]);
+}
+
+static void remove_defs(struct Dict* defs, Nodes vars) {
+    for (size_t i = 0; i < vars.count; i++)
+        remove_dict(const Node*, defs, vars.nodes[i]);
+}
+
+// -------------------------------- structured loops --------------------------------
+
+/// Everything bound inside of the block, and whether it selects on anything varying
+static void collect_structured_defs(Context* ctx, const Node* block, struct Dict* defs, bool* divergent) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (instruction->tag == Let_TAG && !find_key_dict(const Node*, ctx->hoisted_structured, instruction))
+            add_defs(defs, instruction->payload.let.variables);
+        const Node* construct = instruction->tag == Let_TAG ? instruction->payload.let.instruction : instruction;
+        switch (construct->tag) {
+            case If_TAG: *divergent |= get_qualifier(construct->payload.if_instr.condition->type) != Uniform; break;
+            case Match_TAG: *divergent |= get_qualifier(construct->payload.match_instr.inspect->type) != Uniform; break;
+            case Loop_TAG: add_defs(defs, construct->payload.loop_instr.params); break;
+            default: break;
+        }
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                collect_structured_defs(ctx, get_nested_block(instruction, j), defs, divergent);
+    }
+}
+
+/// In program order, so what an instruction depends on gets hoisted before it
+static void find_structured_invariants(Context* ctx, const Node* block, struct Dict* defs, bool divergent, struct List* hoisted) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (is_candidate_let(instruction) && !find_key_dict(const Node*, ctx->hoisted_structured, instruction)) {
+            const Node* rhs = instruction->payload.let.instruction;
+            if (is_hoistable(rhs, divergent) && is_invariant(defs, rhs)) {
+                insert_set_get_result(const Node*, ctx->hoisted_structured, instruction);
+                append_list(const Node*, hoisted, instruction);
+                remove_defs(defs, instruction->payload.let.variables);
+                continue;
+            }
+        }
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                find_structured_invariants(ctx, get_nested_block(instruction, j), defs, divergent, hoisted);
+    }
+}
+
+static void hoist_out_of_structured_loop(Context* ctx, NodesBuilder* instructions, const Node* old_loop) {
+    struct Dict* defs = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    bool divergent = false;
+    add_defs(defs, old_loop->payload.loop_instr.params);
+    collect_structured_defs(ctx, old_loop->payload.loop_instr.body, defs, &divergent);
+    ctx->divergent_loops += divergent;
+
+    struct List* hoisted = new_list(const Node*);
+    find_structured_invariants(ctx, old_loop->payload.loop_instr.body, defs, divergent, hoisted);
+    for (size_t i = 0; i < entries_count_list(hoisted); i++)
+        add_node(instructions, rewrite_node(&ctx->rewriter, read_list(const Node*, hoisted)[i]));
+    ctx->hoisted += entries_count_list(hoisted);
+
+    destroy_list(hoisted);
+    destroy_dict(defs);
+}
+
+// -------------------------------- loops made of continuations --------------------------------
+
+static CFNode* find_preheader(LTNode* loop) {
+    CFNode* preheader = NULL;
+    for (size_t i = 0; i < entries_count_list(loop->header->preds); i++) {
+        CFNode* pred = read_list(CFNode*, loop->header->preds)[i];
+        if (is_in_loop(loop, pred))
+            continue;
+        if (preheader && preheader != pred)
+            return NULL;
+        preheader = pred;
+    }
+    // the preheader runs what we hoist unconditionally, it has to be a plain block in the same function
+    if (!preheader || preheader->node->payload.fn.block->payload.block.terminator->tag != Branch_TAG)
+        return NULL;
+    return preheader;
+}
+
+static bool is_loop_divergent(LTNode* loop) {
+    for (size_t i = 0; i < entries_count_list(loop->cf_nodes); i++) {
+        const Node* terminator = read_list(CFNode*, loop->cf_nodes)[i]->node->payload.fn.block->payload.block.terminator;
+        if (terminator->tag != Branch_TAG)
+            continue;
+        switch (terminator->payload.branch.branch_mode) {
+            case BrIfElse: if (get_qualifier(terminator->payload.branch.branch_condition->type) != Uniform) return true; break;
+            case BrSwitch: if (get_qualifier(terminator->payload.branch.switch_value->type) != Uniform) return true; break;
+            default: break;
+        }
+    }
+    return false;
+}
+
+static CFNode* get_location(Context* ctx, const Node* instruction, CFNode* original) {
+    CFNode** found = find_value_dict(const Node*, CFNode*, ctx->location, instruction);
+    return found ? *found : original;
+}
+
+static struct List* get_hoisted_into(Context* ctx, const Node* fn) {
+    struct List** found = find_value_dict(const Node*, struct List*, ctx->hoisted_into, fn);
+    if (found)
+        return *found;
+    struct List* list = new_list(const Node*);
+    insert_dict(const Node*, struct List*, ctx->hoisted_into, fn, list);
+    append_list(struct List*, ctx->hoisted_lists, list);
+    return list;
+}
+
+/// What currently sits in a continuation: what it had to begin with, minus what got hoisted out of it, plus what got hoisted into it
+static void collect_current_lets(Context* ctx, CFNode* n, struct List* lets) {
+    Nodes instructions = n->node->payload.fn.block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++)
+        if (instructions.nodes[i]->tag == Let_TAG && get_location(ctx, instructions.nodes[i], n) == n)
+            append_list(const Node*, lets, instructions.nodes[i]);
+    struct List* hoisted = get_hoisted_into(ctx, n->node);
+    for (size_t i = 0; i < entries_count_list(hoisted); i++) {
+        const Node* instruction = read_list(const Node*, hoisted)[i];
+        if (get_location(ctx, instruction, NULL) == n)
+            append_list(const Node*, lets, instruction);
+    }
+}
+
+static void hoist_out_of_loop(Context* ctx, LTNode* loop) {
+    CFNode* preheader = find_preheader(loop);
+    if (!preheader) {
+        debug_print("opt_licm: loop at %s has no preheader\n", loop->header->node->payload.fn.name);
+        return;
+    }
+    bool divergent = is_loop_divergent(loop);
+    ctx->divergent_loops += divergent;
+
+    struct Dict* defs = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* lets = new_list(const Node*);
+    for (size_t i = 0; i < entries_count_list(loop->cf_nodes); i++) {
+        CFNode* n = read_list(CFNode*, loop->cf_nodes)[i];
+        add_defs(defs, n->node->payload.fn.params);
+        clear_list(lets);
+        collect_current_lets(ctx, n, lets);
+        for (size_t j = 0; j < entries_count_list(lets); j++)
+            add_defs(defs, read_list(const Node*, lets)[j]->payload.let.variables);
+    }
+
+    size_t hoisted = 0;
+    for (size_t i = 0; i < entries_count_list(loop->cf_nodes); i++) {
+        CFNode* n = read_list(CFNode*, loop->cf_nodes)[i];
+        clear_list(lets);
+        collect_current_lets(ctx, n, lets);
+        for (size_t j = 0; j < entries_count_list(lets); j++) {
+            const Node* instruction = read_list(const Node*, lets)[j];
+            const Node* rhs = instruction->payload.let.instruction;
+            if (!is_candidate_let(instruction) || !is_hoistable(rhs, divergent) || !is_invariant(defs, rhs))
+                continue;
+            insert_dict(const Node*, CFNode*, ctx->location, instruction, preheader);
+            append_list(const Node*, get_hoisted_into(ctx, preheader->node), instruction);
+            remove_defs(defs, instruction->payload.let.variables);
+            hoisted++;
+        }
+    }
+    debug_print("opt_licm: hoisted %zu instructions out of the loop at %s%s\n", hoisted, loop->header->node->payload.fn.name, divergent ? " (divergent)" : "");
+
+    destroy_list(lets);
+    destroy_dict(defs);
+}
+
+// -------------------------------- rewriting --------------------------------
+
+static const Node* rewrite_block_contents(Context* ctx, const Node* old_block, CFNode* cf_node) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    NodesBuilder* instructions = begin_nodes(dst_arena);
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++) {
+        const Node* old = old_instructions.nodes[i];
+        if (find_key_dict(const Node*, ctx->hoisted_structured, old))
+            continue;
+        if (cf_node && get_location(ctx, old, cf_node) != cf_node)
+            continue;
+        const Node* construct = old->tag == Let_TAG ? old->payload.let.instruction : old;
+        if (construct->tag == Loop_TAG)
+            hoist_out_of_structured_loop(ctx, instructions, construct);
+        add_node(instructions, rewrite_node(&ctx->rewriter, old));
+    }
+
+    // the preheaders come before their loops in dominator tree order, so these get emitted before the loops use them
+    if (cf_node) {
+        struct List* hoisted = get_hoisted_into(ctx, cf_node->node);
+        for (size_t i = 0; i < entries_count_list(hoisted); i++) {
+            const Node* old = read_list(const Node*, hoisted)[i];
+            if (get_location(ctx, old, NULL) == cf_node) {
+                add_node(instructions, rewrite_node(&ctx->rewriter, old));
+                ctx->hoisted++;
+            }
+        }
+    }
+
+    return block(dst_arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = rewrite_node(&ctx->rewriter, old_block->payload.block.terminator),
+    });
+}
+
+static void process_dominated(Context* ctx, CFNode* cf_node) {
+    Node* new_fn = (Node*) process_node(ctx, cf_node->node);
+    if (!new_fn->payload.fn.block)
+        new_fn->payload.fn.block = rewrite_block_contents(ctx, cf_node->node->payload.fn.block, cf_node);
+
+    for (size_t i = 0; i < entries_count_list(cf_node->dominates); i++)
+        process_dominated(ctx, read_list(CFNode*, cf_node->dominates)[i]);
+}
+
+static void process_function_body(Context* ctx, const Node* old_fn) {
+    Scope scope = build_scope(old_fn);
+    LoopTree loop_tree = build_loop_tree(&scope);
+    for (size_t i = 0; i < entries_count_list(loop_tree.loops); i++)
+        hoist_out_of_loop(ctx, read_list(LTNode*, loop_tree.loops)[i]);
+    process_dominated(ctx, scope.entry);
+    dispose_loop_tree(&loop_tree);
+    dispose_scope(&scope);
+}
+
+static void process_decl_body(Context* ctx, const Node* old, Node* new) {
+    switch (old->tag) {
+        case Function_TAG: {
+            if (!new->payload.fn.block)
+                process_function_body(ctx, old);
+            break;
+        }
+        default: recreate_decl_body_identity(&ctx->rewriter, old, new); break;
+    }
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        // bodies are filled in dominator tree order, see process_dominated
+        case Function_TAG: {
+            Node* new = recreate_decl_header_identity(&ctx->rewriter, node);
+            append_list(const Node*, ctx->new_fns, node);
+            return new;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: return recreate_decl_header_identity(&ctx->rewriter, node);
+        case Block_TAG: return rewrite_block_contents(ctx, node, NULL);
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_licm(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* new_fns = new_list(const Node*);
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = (RewriteFnMut) process_decl_body,
+            .processed = done,
+        },
+        .location = new_dict(const Node*, CFNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .hoisted_into = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node),
+        .hoisted_lists = new_list(struct List*),
+        .hoisted_structured = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .new_fns = new_fns,
+        .hoisted = 0,
+        .divergent_loops = 0,
+    };
+
+    assert(src_program->tag == Root_TAG);
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+
+    // continuations outside of the scopes we walked, like the ones only referenced through a function pointer
+    for (size_t i = 0; i < entries_count_list(new_fns); i++) {
+        const Node* old_fn = read_list(const Node*, new_fns)[i];
+        if (!find_processed(&ctx.rewriter, old_fn)->payload.fn.block)
+            process_function_body(&ctx, old_fn);
+    }
+
+    info_print("opt_licm: hoisted %zu instructions, %zu loops were divergent\n", ctx.hoisted, ctx.divergent_loops);
+
+    for (size_t i = 0; i < entries_count_list(ctx.hoisted_lists); i++)
+        destroy_list(read_list(struct List*, ctx.hoisted_lists)[i]);
+    destroy_list(ctx.hoisted_lists);
+    destroy_dict(ctx.hoisted_into);
+    destroy_dict(ctx.location);
+    destroy_dict(ctx.hoisted_structured);
+    destroy_list(new_fns);
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,420 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../analysis/uses.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    /// allocas of the current function that are turned into values, in the order they are allocated
+    struct List* promoted;
+    /// what each promoted alloca holds at the current point in the rewritten program
+    struct Dict* values;
+    /// promoted allocas whose values flow out of the innermost if/match, and out of or around the innermost loop
+    struct List* selection_vars;
+    struct List* loop_vars;
+    /// variables of the current function that are just another name for a value (`let a = b`)
+    struct Dict* aliases;
+    size_t promoted_count;
+} Context;
+
+static const Node* get_memory_access(struct Dict* aliases, const Node* instruction, Op op) {
+    if (instruction->tag == Let_TAG)
+        instruction = instruction->payload.let.instruction;
+    if (instruction->tag != PrimOp_TAG || instruction->payload.prim_op.op != op)
+        return NULL;
+    return resolve_alias(aliases, instruction->payload.prim_op.operands.nodes[0]);
+}
+
+/// Counts the loads binding a variable, the plain stores to var and its aliases, the only uses we know how to replace
+static size_t count_promotable_uses(struct Dict* aliases, const Node* block, const Node* var) {
+    size_t uses = 0;
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (instruction->tag == Let_TAG && instruction->payload.let.variables.count == 1 && get_memory_access(aliases, instruction, load_op) == var)
+            uses++;
+        if (instruction->tag == PrimOp_TAG && get_memory_access(aliases, instruction, store_op) == var && resolve_alias(aliases, instruction->payload.prim_op.operands.nodes[1]) != var)
+            uses++;
+        // both the alias and what it aliases count
+        if (is_alias_let(instruction) && resolve_alias(aliases, instruction->payload.let.instruction) == var)
+            uses += 2;
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                uses += count_promotable_uses(aliases, get_nested_block(instruction, j), var);
+    }
+    return uses;
+}
+
+/// The first thing done with the alloca has to be storing to it, in the block it was made in, so we never read a value we don't have
+static bool is_stored_before_use(struct Dict* aliases, Nodes instructions, size_t alloca_index, const Node* var) {
+    for (size_t i = alloca_index + 1; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (instruction->tag == PrimOp_TAG && get_memory_access(aliases, instruction, store_op) == var)
+            return true;
+        if (is_alias_let(instruction))
+            continue;
+        if (count_uses(aliases, instruction, var) > 0)
+            return false;
+    }
+    return false;
+}
+
+static void find_promotable_allocas(struct Dict* aliases, const Node* fn, const Node* block, struct List* promoted) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                find_promotable_allocas(aliases, fn, get_nested_block(instruction, j), promoted);
+
+        if (instruction->tag != Let_TAG || instruction->payload.let.is_mutable || instruction->payload.let.variables.count != 1 || !get_memory_access(aliases, instruction, alloca_op))
+            continue;
+        const Node* var = instruction->payload.let.variables.nodes[0];
+        // the variable appears once where it is bound, anything beyond loads and stores lets the pointer escape
+        size_t all_uses = count_uses(aliases, fn, var);
+        size_t promotable_uses = count_promotable_uses(aliases, fn->payload.fn.block, var);
+        if (all_uses != promotable_uses + 1) {
+            debug_print("opt_mem2reg: %s escapes\n", var->payload.var.name);
+            continue;
+        }
+        if (!is_stored_before_use(aliases, instructions, i, var)) {
+            debug_print("opt_mem2reg: %s might be read before it is written\n", var->payload.var.name);
+            continue;
+        }
+        append_list(const Node*, promoted, var);
+    }
+}
+
+static bool is_promoted(Context* ctx, const Node* var) {
+    for (size_t i = 0; i < entries_count_list(ctx->promoted); i++)
+        if (read_list(const Node*, ctx->promoted)[i] == var)
+            return true;
+    return false;
+}
+
+static bool is_stored_in(struct Dict* aliases, const Node* block, const Node* var) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        if (instruction->tag == PrimOp_TAG && get_memory_access(aliases, instruction, store_op) == var)
+            return true;
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j) && is_stored_in(aliases, get_nested_block(instruction, j), var))
+                return true;
+    }
+    return false;
+}
+
+/// Promoted allocas that hold a value before the construct and get stored to inside of it: these need to flow out of it
+static struct List* find_merged_vars(Context* ctx, const Node* instruction) {
+    struct List* merged = new_list(const Node*);
+    for (size_t i = 0; i < entries_count_list(ctx->promoted); i++) {
+        const Node* var = read_list(const Node*, ctx->promoted)[i];
+        if (!find_value_dict(const Node*, const Node*, ctx->values, var))
+            continue;
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++) {
+            if (get_nested_block(instruction, j) && is_stored_in(ctx->aliases, get_nested_block(instruction, j), var)) {
+                append_list(const Node*, merged, var);
+                break;
+            }
+        }
+    }
+    return merged;
+}
+
+static const Node* get_value(Context* ctx, const Node* var) {
+    const Node** found = find_value_dict(const Node*, const Node*, ctx->values, var);
+    assert(found);
+    return *found;
+}
+
+static void set_value(Context* ctx, const Node* var, const Node* value) {
+    insert_dict(const Node*, const Node*, ctx->values, var, value);
+}
+
+/// Appends the current values of the promoted allocas to a list of arguments
+static Nodes append_values(Context* ctx, Nodes args, struct List* vars) {
+    NodesBuilder* builder = begin_nodes(ctx->rewriter.dst_arena);
+    add_nodes(builder, args);
+    for (size_t i = 0; i < entries_count_list(vars); i++)
+        add_node(builder, get_value(ctx, read_list(const Node*, vars)[i]));
+    return finish_nodes(builder);
+}
+
+/// Values coming from different places might not agree, so merged values are varying
+static const Type* get_merged_type(Context* ctx, const Node* var) {
+    const Type* ptr_type = without_qualifier(var->payload.var.type);
+    assert(ptr_type->tag == PtrType_TAG);
+    return qualified_type(ctx->rewriter.dst_arena, (QualifiedType) {
+        .is_uniform = false,
+        .type = rewrite_node(&ctx->rewriter, without_qualifier(ptr_type->payload.ptr_type.pointed_type)),
+    });
+}
+
+static Nodes get_merged_types(Context* ctx, Nodes old_yield_types, struct List* vars) {
+    NodesBuilder* builder = begin_nodes(ctx->rewriter.dst_arena);
+    add_nodes(builder, rewrite_nodes(&ctx->rewriter, old_yield_types));
+    for (size_t i = 0; i < entries_count_list(vars); i++)
+        add_node(builder, get_merged_type(ctx, read_list(const Node*, vars)[i]));
+    return finish_nodes(builder);
+}
+
+/// Binds the results of the rewritten construct: the old variables first, then the values of the merged allocas
+static void bind_merged_results(Context* ctx, NodesBuilder* instructions, const Node* old_let, const Node* new_instruction, struct List* vars) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    size_t old_count = old_let ? old_let->payload.let.variables.count : 0;
+    size_t count = old_count + entries_count_list(vars);
+    if (count == 0) {
+        add_node(instructions, new_instruction);
+        return;
+    }
+
+    LARRAY(const char*, names, count);
+    for (size_t i = 0; i < old_count; i++)
+        names[i] = old_let->payload.let.variables.nodes[i]->payload.var.name;
+    for (size_t i = 0; i < entries_count_list(vars); i++)
+        names[old_count + i] = read_list(const Node*, vars)[i]->payload.var.name;
+
+    const Node* new_let = let(dst_arena, new_instruction, count, names);
+    Nodes new_vars = new_let->payload.let.variables;
+    for (size_t i = 0; i < old_count; i++)
+        register_processed(&ctx->rewriter, old_let->payload.let.variables.nodes[i], new_vars.nodes[i]);
+    for (size_t i = 0; i < entries_count_list(vars); i++)
+        set_value(ctx, read_list(const Node*, vars)[i], new_vars.nodes[old_count + i]);
+    add_node(instructions, new_let);
+}
+
+static const Node* process_block(Context* ctx, const Node* old_block);
+
+/// Rewrites a block in its own copy of the current values, the construct it belongs to merges them back
+static const Node* process_branch(Context* ctx, const Node* old_block, struct List* vars) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    struct Dict* values = ctx->values;
+    ctx->values = clone_dict(values);
+    const Node* new_block;
+    if (old_block)
+        new_block = process_block(ctx, old_block);
+    else if (entries_count_list(vars) > 0) {
+        // the missing side of the construct just passes the values along
+        new_block = block(dst_arena, (Block) {
+            .instructions = nodes(dst_arena, 0, NULL),
+            .terminator = merge_construct(dst_arena, (MergeConstruct) {
+                .construct = Selection,
+                .args = append_values(ctx, nodes(dst_arena, 0, NULL), vars),
+            }),
+        });
+    } else
+        new_block = NULL;
+    destroy_dict(ctx->values);
+    ctx->values = values;
+    return new_block;
+}
+
+static void process_selection(Context* ctx, NodesBuilder* instructions, const Node* old_let, const Node* old_instruction) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    struct List* vars = find_merged_vars(ctx, old_instruction);
+    struct List* outer_selection_vars = ctx->selection_vars;
+    ctx->selection_vars = vars;
+
+    const Node* new_instruction;
+    if (old_instruction->tag == If_TAG) {
+        const If* old_if = &old_instruction->payload.if_instr;
+        new_instruction = if_instr(dst_arena, (If) {
+            .yield_types = get_merged_types(ctx, old_if->yield_types, vars),
+            .condition = rewrite_node(&ctx->rewriter, old_if->condition),
+            .if_true = process_branch(ctx, old_if->if_true, vars),
+            .if_false = process_branch(ctx, old_if->if_false, vars),
+        });
+    } else {
+        const Match* old_match = &old_instruction->payload.match_instr;
+        LARRAY(const Node*, cases, old_match->cases.count);
+        for (size_t i = 0; i < old_match->cases.count; i++)
+            cases[i] = process_branch(ctx, old_match->cases.nodes[i], vars);
+        new_instruction = match_instr(dst_arena, (Match) {
+            .yield_types = get_merged_types(ctx, old_match->yield_types, vars),
+            .inspect = rewrite_node(&ctx->rewriter, old_match->inspect),
+            .literals = rewrite_nodes(&ctx->rewriter, old_match->literals),
+            .cases = nodes(dst_arena, old_match->cases.count, cases),
+            .default_case = process_branch(ctx, old_match->default_case, vars),
+        });
+    }
+
+    ctx->selection_vars = outer_selection_vars;
+    bind_merged_results(ctx, instructions, old_let, new_instruction, vars);
+    destroy_list(vars);
+}
+
+static void process_loop(Context* ctx, NodesBuilder* instructions, const Node* old_let, const Node* old_instruction) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    const Loop* old_loop = &old_instruction->payload.loop_instr;
+    struct List* vars = find_merged_vars(ctx, old_instruction);
+
+    // the merged allocas become extra loop parameters, they are passed around by continue and out by break
+    Nodes params = recreate_variables(&ctx->rewriter, old_loop->params);
+    for (size_t i = 0; i < old_loop->params.count; i++)
+        register_processed(&ctx->rewriter, old_loop->params.nodes[i], params.nodes[i]);
+    Nodes initial_args = append_values(ctx, rewrite_nodes(&ctx->rewriter, old_loop->initial_args), vars);
+
+    struct Dict* values = ctx->values;
+    ctx->values = clone_dict(values);
+    NodesBuilder* all_params = begin_nodes(dst_arena);
+    add_nodes(all_params, params);
+    for (size_t i = 0; i < entries_count_list(vars); i++) {
+        const Node* alloca_var = read_list(const Node*, vars)[i];
+        const Node* param = var(dst_arena, get_merged_type(ctx, alloca_var), alloca_var->payload.var.name);
+        add_node(all_params, param);
+        set_value(ctx, alloca_var, param);
+    }
+    params = finish_nodes(all_params);
+
+    struct List* outer_selection_vars = ctx->selection_vars;
+    struct List* outer_loop_vars = ctx->loop_vars;
+    ctx->selection_vars = NULL;
+    ctx->loop_vars = vars;
+    const Node* body = process_block(ctx, old_loop->body);
+    ctx->selection_vars = outer_selection_vars;
+    ctx->loop_vars = outer_loop_vars;
+
+    destroy_dict(ctx->values);
+    ctx->values = values;
+
+    const Node* new_instruction = loop_instr(dst_arena, (Loop) {
+        .yield_types = get_merged_types(ctx, old_loop->yield_types, vars),
+        .params = params,
+        .initial_args = initial_args,
+        .body = body,
+    });
+    bind_merged_results(ctx, instructions, old_let, new_instruction, vars);
+    destroy_list(vars);
+}
+
+static const Node* process_terminator(Context* ctx, const Node* old_terminator) {
+    if (old_terminator->tag != MergeConstruct_TAG)
+        return rewrite_node(&ctx->rewriter, old_terminator);
+
+    const MergeConstruct* old_merge = &old_terminator->payload.merge_construct;
+    struct List* vars = old_merge->construct == Selection ? ctx->selection_vars : ctx->loop_vars;
+    Nodes args = rewrite_nodes(&ctx->rewriter, old_merge->args);
+    if (vars)
+        args = append_values(ctx, args, vars);
+    return merge_construct(ctx->rewriter.dst_arena, (MergeConstruct) {
+        .construct = old_merge->construct,
+        .args = args,
+    });
+}
+
+static const Node* process_block(Context* ctx, const Node* old_block) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    NodesBuilder* instructions = begin_nodes(dst_arena);
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++) {
+        const Node* old = old_instructions.nodes[i];
+        const Node* old_let = old->tag == Let_TAG ? old : NULL;
+        const Node* old_instruction = old_let ? old_let->payload.let.instruction : old;
+
+        const Node* ptr;
+        if (old_let && (ptr = get_memory_access(ctx->aliases, old, alloca_op)) && is_promoted(ctx, old_let->payload.let.variables.nodes[0]))
+            continue;
+        if (is_alias_let(old) && is_promoted(ctx, resolve_alias(ctx->aliases, old_instruction)))
+            continue;
+        if (old_let && (ptr = get_memory_access(ctx->aliases, old, load_op)) && is_promoted(ctx, ptr)) {
+            register_processed(&ctx->rewriter, old_let->payload.let.variables.nodes[0], get_value(ctx, ptr));
+            continue;
+        }
+        if (!old_let && (ptr = get_memory_access(ctx->aliases, old, store_op)) && is_promoted(ctx, ptr)) {
+            set_value(ctx, ptr, rewrite_node(&ctx->rewriter, old->payload.prim_op.operands.nodes[1]));
+            continue;
+        }
+
+        switch (old_instruction->tag) {
+            case If_TAG:
+            case Match_TAG: process_selection(ctx, instructions, old_let, old_instruction); break;
+            case Loop_TAG: process_loop(ctx, instructions, old_let, old_instruction); break;
+            default: add_node(instructions, rewrite_node(&ctx->rewriter, old)); break;
+        }
+    }
+
+    return block(dst_arena, (Block) {
+        .instructions = finish_nodes(instructions),
+        .terminator = process_terminator(ctx, old_block->payload.block.terminator),
+    });
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        case Function_TAG: {
+            Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
+
+            Context fn_ctx = *ctx;
+            fn_ctx.promoted = new_list(const Node*);
+            fn_ctx.values = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.selection_vars = NULL;
+            fn_ctx.loop_vars = NULL;
+            fn_ctx.aliases = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            find_aliases(node->payload.fn.block, fn_ctx.aliases);
+            find_promotable_allocas(fn_ctx.aliases, node, node->payload.fn.block, fn_ctx.promoted);
+            fn_ctx.promoted_count += entries_count_list(fn_ctx.promoted);
+
+            fun->payload.fn.block = process_block(&fn_ctx, node->payload.fn.block);
+
+            ctx->promoted_count = fn_ctx.promoted_count;
+            destroy_list(fn_ctx.promoted);
+            destroy_dict(fn_ctx.values);
+            destroy_dict(fn_ctx.aliases);
+            return fun;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* decl = recreate_decl_header_identity(&ctx->rewriter, node);
+            recreate_decl_body_identity(&ctx->rewriter, node, decl);
+            return decl;
+        }
+        case Block_TAG: return process_block(ctx, node);
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_mem2reg(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .promoted = NULL,
+        .values = NULL,
+        .selection_vars = NULL,
+        .loop_vars = NULL,
+        .aliases = NULL,
+        .promoted_count = 0,
+    };
+
+    assert(src_program->tag == Root_TAG);
+
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    info_print("opt_mem2reg: promoted %zu allocas\n", ctx.promoted_count);
+
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,329 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../visit.h"
+#include "../analysis/scope.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    /// Functions that have their address taken, we can't tell where they are called from
+    struct Dict* address_taken;
+    /// Scope of the function being rewritten, and where its continuations sit in it
+    Scope* scope;
+    struct Dict* cf_nodes;
+
+    size_t merged;
+    size_t threaded;
+    size_t collapsed;
+} Context;
+
+typedef struct {
+    Visitor visitor;
+    struct Dict* seen;
+    struct Dict* address_taken;
+} AddressTakenVisitor;
+
+static void visit_address_taken(AddressTakenVisitor* visitor, const Node* node) {
+    if (is_type(node))
+        return;
+    switch (node->tag) {
+        case FnAddr_TAG: insert_set_get_result(const Node*, visitor->address_taken, node->payload.fn_addr.fn); return;
+        case Tuple_TAG: {
+            for (size_t i = 0; i < node->payload.tuple.contents.count; i++)
+                visit_address_taken(visitor, node->payload.tuple.contents.nodes[i]);
+            return;
+        }
+        case Variable_TAG:
+        case Unbound_TAG:
+        case UntypedNumber_TAG:
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case GlobalVariable_TAG: return;
+        case Function_TAG:
+        case Constant_TAG:
+            if (!insert_set_get_result(const Node*, visitor->seen, node))
+                return;
+            // fallthrough
+        default: visit_children(&visitor->visitor, node); return;
+    }
+}
+
+static CFNode* find_cf_node(Context* ctx, const Node* node) {
+    if (!ctx->cf_nodes)
+        return NULL;
+    CFNode** found = find_value_dict(const Node*, CFNode*, ctx->cf_nodes, node);
+    return found ? *found : NULL;
+}
+
+/// A continuation that only this jump leads to can be pasted at the end of the jumping block
+static bool can_merge_into_pred(Context* ctx, const Node* target) {
+    if (!target->payload.fn.atttributes.is_continuation || find_key_dict(const Node*, ctx->address_taken, target))
+        return false;
+    CFNode* cf_node = find_cf_node(ctx, target);
+    if (!cf_node || cf_node == ctx->scope->entry || entries_count_list(cf_node->preds) == 0)
+        return false;
+    // a branch with both sides going there counts twice, but collapses into a single jump
+    CFNode* pred = read_list(CFNode*, cf_node->preds)[0];
+    for (size_t i = 1; i < entries_count_list(cf_node->preds); i++)
+        if (read_list(CFNode*, cf_node->preds)[i] != pred)
+            return false;
+    return true;
+}
+
+static bool is_empty_jump(const Node* cont) {
+    const Block* body = &cont->payload.fn.block->payload.block;
+    return body->instructions.count == 0 && body->terminator->tag == Branch_TAG && body->terminator->payload.branch.branch_mode == BrJump;
+}
+
+/// An empty continuation that leaves straight away, jumping to it is the same as leaving from where we are
+static bool is_trivial_exit(const Node* cont) {
+    if (!cont->payload.fn.atttributes.is_continuation || cont->payload.fn.params.count > 0)
+        return false;
+    const Block* body = &cont->payload.fn.block->payload.block;
+    if (body->instructions.count > 0)
+        return false;
+    switch (body->terminator->tag) {
+        case Join_TAG:
+        case Return_TAG:
+        case Unreachable_TAG: return true;
+        default: return false;
+    }
+}
+
+/// Follows jumps to continuations that do nothing but jump further, substituting their params with the arguments along the way.
+/// Arguments are already rewritten.
+static const Node* thread_jump(Context* ctx, const Node* target, Nodes* args) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    // bounded so a cycle of empty blocks can't get us stuck
+    size_t budget = ctx->scope ? ctx->scope->size : 1;
+    while (budget-- > 0 && target->payload.fn.atttributes.is_continuation && is_empty_jump(target) && !can_merge_into_pred(ctx, target)) {
+        const Branch* next = &target->payload.fn.block->payload.block.terminator->payload.branch;
+        // a continuation only the skipped one leads to would end up pasted in two places
+        if (next->target == target || can_merge_into_pred(ctx, next->target))
+            break;
+
+        Nodes params = target->payload.fn.params;
+        assert(params.count == args->count);
+        LARRAY(const Node*, new_args, next->args.count);
+        for (size_t i = 0; i < next->args.count; i++) {
+            const Node* arg = next->args.nodes[i];
+            new_args[i] = NULL;
+            for (size_t j = 0; j < params.count; j++)
+                if (params.nodes[j] == arg)
+                    new_args[i] = args->nodes[j];
+            if (new_args[i])
+                continue;
+            // anything else has to come from outside of the continuation, and thus dominates where we jump from
+            switch (arg->tag) {
+                case Variable_TAG:
+                case IntLiteral_TAG:
+                case True_TAG:
+                case False_TAG:
+                case FnAddr_TAG: new_args[i] = rewrite_node(&ctx->rewriter, arg); break;
+                default: return target;
+            }
+        }
+
+        *args = nodes(dst_arena, next->args.count, new_args);
+        target = next->target;
+        ctx->threaded++;
+    }
+    return target;
+}
+
+static const Node* simplify_block(Context* ctx, NodesBuilder* instructions, const Node* old_block);
+
+/// Jumps to an old target with rewritten arguments, pasting it in place when nothing else leads there
+static const Node* simplify_jump(Context* ctx, NodesBuilder* instructions, const Node* target, Nodes args, bool yield) {
+    if (can_merge_into_pred(ctx, target)) {
+        Nodes params = target->payload.fn.params;
+        assert(params.count == args.count);
+        for (size_t i = 0; i < params.count; i++)
+            register_processed(&ctx->rewriter, params.nodes[i], args.nodes[i]);
+        ctx->merged++;
+        return simplify_block(ctx, instructions, target->payload.fn.block);
+    }
+
+    if (is_trivial_exit(target)) {
+        ctx->threaded++;
+        return rewrite_node(&ctx->rewriter, target->payload.fn.block->payload.block.terminator);
+    }
+
+    return branch(ctx->rewriter.dst_arena, (Branch) {
+        .branch_mode = BrJump,
+        .yield = yield,
+        .target = rewrite_node(&ctx->rewriter, target),
+        .args = args,
+    });
+}
+
+static const Node* simplify_terminator(Context* ctx, NodesBuilder* instructions, const Node* old_terminator) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    if (old_terminator->tag != Branch_TAG)
+        return rewrite_node(&ctx->rewriter, old_terminator);
+
+    const Branch* old_branch = &old_terminator->payload.branch;
+    switch (old_branch->branch_mode) {
+        case BrJump: {
+            Nodes args = rewrite_nodes(&ctx->rewriter, old_branch->args);
+            const Node* target = thread_jump(ctx, old_branch->target, &args);
+            return simplify_jump(ctx, instructions, target, args, old_branch->yield);
+        }
+        case BrIfElse: {
+            Nodes args = rewrite_nodes(&ctx->rewriter, old_branch->args);
+            const Node* true_target = old_branch->true_target;
+            const Node* false_target = old_branch->false_target;
+            // both targets share the arguments, so we can only thread through targets that take none and pass none on
+            if (args.count == 0) {
+                Nodes true_args = args;
+                const Node* threaded_true = thread_jump(ctx, true_target, &true_args);
+                if (true_args.count == 0)
+                    true_target = threaded_true;
+                Nodes false_args = args;
+                const Node* threaded_false = thread_jump(ctx, false_target, &false_args);
+                if (false_args.count == 0)
+                    false_target = threaded_false;
+            }
+
+            // both sides leave the same way, so does the branch (hash-consing makes identical terminators the same node)
+            const Node* true_exit = is_trivial_exit(true_target) ? true_target->payload.fn.block->payload.block.terminator : NULL;
+            const Node* false_exit = is_trivial_exit(false_target) ? false_target->payload.fn.block->payload.block.terminator : NULL;
+            if (true_exit && true_exit == false_exit) {
+                ctx->collapsed++;
+                return rewrite_node(&ctx->rewriter, true_exit);
+            }
+
+            if (true_target == false_target) {
+                ctx->collapsed++;
+                return simplify_jump(ctx, instructions, true_target, args, old_branch->yield);
+            }
+
+            return branch(dst_arena, (Branch) {
+                .branch_mode = BrIfElse,
+                .yield = old_branch->yield,
+                .branch_condition = rewrite_node(&ctx->rewriter, old_branch->branch_condition),
+                .true_target = rewrite_node(&ctx->rewriter, true_target),
+                .false_target = rewrite_node(&ctx->rewriter, false_target),
+                .args = args,
+            });
+        }
+        default: return rewrite_node(&ctx->rewriter, old_terminator);
+    }
+}
+
+/// Rewrites the instructions of a block into the builder, and returns the terminator, which might come from merged continuations
+static const Node* simplify_block(Context* ctx, NodesBuilder* instructions, const Node* old_block) {
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++)
+        add_node(instructions, rewrite_node(&ctx->rewriter, old_instructions.nodes[i]));
+    return simplify_terminator(ctx, instructions, old_block->payload.block.terminator);
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    switch (node->tag) {
+        case Function_TAG: {
+            Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
+
+            // continuations belong to the scope of the function being rewritten
+            Scope* outer_scope = ctx->scope;
+            struct Dict* outer_cf_nodes = ctx->cf_nodes;
+            Scope scope;
+            if (!node->payload.fn.atttributes.is_continuation) {
+                scope = build_scope(node);
+                ctx->scope = &scope;
+                ctx->cf_nodes = new_dict(const Node*, CFNode*, (HashFn) hash_node, (CmpFn) compare_node);
+                for (size_t i = 0; i < scope.size; i++) {
+                    CFNode* cf_node = read_list(CFNode*, scope.contents)[i];
+                    insert_dict(const Node*, CFNode*, ctx->cf_nodes, cf_node->node, cf_node);
+                }
+            }
+
+            NodesBuilder* instructions = begin_nodes(dst_arena);
+            const Node* terminator = simplify_block(ctx, instructions, node->payload.fn.block);
+            fun->payload.fn.block = block(dst_arena, (Block) {
+                .instructions = finish_nodes(instructions),
+                .terminator = terminator,
+            });
+
+            if (!node->payload.fn.atttributes.is_continuation) {
+                destroy_dict(ctx->cf_nodes);
+                dispose_scope(&scope);
+                ctx->scope = outer_scope;
+                ctx->cf_nodes = outer_cf_nodes;
+            }
+            return fun;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* decl = recreate_decl_header_identity(&ctx->rewriter, node);
+            recreate_decl_body_identity(&ctx->rewriter, node, decl);
+            return decl;
+        }
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_simplify_cf(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct Dict* address_taken = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+
+    AddressTakenVisitor visitor = {
+        .visitor = {
+            .visit_fn = (VisitFn) visit_address_taken,
+            .visit_fn_scope_rpo = false,
+            .visit_cf_targets = true,
+            .visit_return_fn_annotation = false,
+            .visit_callf_return_fn_annotation = false,
+        },
+        .seen = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .address_taken = address_taken,
+    };
+    visit_children(&visitor.visitor, src_program);
+    destroy_dict(visitor.seen);
+
+    Context ctx = {
+        .rewriter = {
+            .dst_arena = dst_arena,
+            .src_arena = src_arena,
+            .rewrite_fn = (RewriteFn) process_node,
+            .rewrite_decl_body = NULL,
+            .processed = done,
+        },
+        .address_taken = address_taken,
+        .scope = NULL,
+        .cf_nodes = NULL,
+        .merged = 0,
+        .threaded = 0,
+        .collapsed = 0,
+    };
+
+    assert(src_program->tag == Root_TAG);
+
+    // continuations nothing leads to anymore never get rewritten, and thus are dropped
+    const Node* rewritten = recreate_node_identity(&ctx.rewriter, src_program);
+    info_print("opt_simplify_cf: merged %zu blocks, threaded %zu jumps and collapsed %zu branches\n", ctx.merged, ctx.threaded, ctx.collapsed);
+
+    destroy_dict(address_taken);
+    destroy_dict(done);
+    return rewritten;
+}
@@ -0,0 +1,229 @@
+#include "shady/ir.h"
+
+#include "../log.h"
+#include "../type.h"
+#include "../portability.h"
+#include "../rewrite.h"
+#include "../block_builder.h"
+#include "../analysis/uses.h"
+#include "../transform/ir_gen_helpers.h"
+
+#include "list.h"
+#include "dict.h"
+
+#include <assert.h>
+
+KeyHash hash_node(Node**);
+bool compare_node(Node**, Node**);
+
+typedef struct Context_ {
+    Rewriter rewriter;
+    /// record allocas of the current function that get split, and the new pointers to each of their members
+    struct Dict* split;
+    /// variables of the current function that are just another name for a value (`let a = b`)
+    struct Dict* aliases;
+    size_t split_count;
+} Context;
+
+static const PrimOp* get_prim_op(const Node* instruction, Op op) {
+    if (instruction->tag == Let_TAG)
+        instruction = instruction->payload.let.instruction;
+    if (instruction->tag != PrimOp_TAG || instruction->payload.prim_op.op != op)
+        return NULL;
+    return &instruction->payload.prim_op;
+}
+
+/// `lea(ptr, NULL, member, ...)`: the only way to get at a member, the first selector tells us which one
+static bool is_member_lea(struct Dict* aliases, const PrimOp* lea, const Node* var) {
+    return lea->operands.count >= 3 && resolve_alias(aliases, lea->operands.nodes[0]) == var && !lea->operands.nodes[1] && lea->operands.nodes[2]->tag == IntLiteral_TAG;
+}
+
+/// Counts the member leas, the whole loads and the stores of records we can see the members of, the uses we know how to split
+static size_t count_splittable_uses(struct Dict* aliases, const Node* block, const Node* var) {
+    size_t uses = 0;
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        const PrimOp* prim_op;
+        if (instruction->tag == Let_TAG && (prim_op = get_prim_op(instruction, lea_op)) && is_member_lea(aliases, prim_op, var))
+            uses++;
+        if (instruction->tag == Let_TAG && (prim_op = get_prim_op(instruction, load_op)) && resolve_alias(aliases, prim_op->operands.nodes[0]) == var)
+            uses++;
+        if (instruction->tag == PrimOp_TAG && (prim_op = get_prim_op(instruction, store_op)) && resolve_alias(aliases, prim_op->operands.nodes[0]) == var && resolve_alias(aliases, prim_op->operands.nodes[1])->tag == Tuple_TAG)
+            uses++;
+        // both the alias and what it aliases count
+        if (is_alias_let(instruction) && resolve_alias(aliases, instruction->payload.let.instruction) == var)
+            uses += 2;
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                uses += count_splittable_uses(aliases, get_nested_block(instruction, j), var);
+    }
+    return uses;
+}
+
+static void find_splittable_allocas(struct Dict* aliases, const Node* fn, const Node* block, struct List* splittable) {
+    Nodes instructions = block->payload.block.instructions;
+    for (size_t i = 0; i < instructions.count; i++) {
+        const Node* instruction = instructions.nodes[i];
+        for (size_t j = 0; j < nested_blocks_count(instruction); j++)
+            if (get_nested_block(instruction, j))
+                find_splittable_allocas(aliases, fn, get_nested_block(instruction, j), splittable);
+
+        const PrimOp* alloca;
+        if (instruction->tag != Let_TAG || instruction->payload.let.is_mutable || instruction->payload.let.variables.count != 1 || !(alloca = get_prim_op(instruction, alloca_op)))
+            continue;
+        const Type* record_type = alloca->operands.nodes[0];
+        if (record_type->tag != RecordType_TAG || record_type->payload.record_type.must_be_deconstructed)
+            continue;
+        const Node* var = instruction->payload.let.variables.nodes[0];
+        // the variable appears once where it is bound, anything else lets the whole record escape
+        if (count_uses(aliases, fn, var) != count_splittable_uses(aliases, fn->payload.fn.block, var) + 1) {
+            debug_print("opt_sroa: %s escapes\n", var->payload.var.name);
+            continue;
+        }
+        append_list(const Node*, splittable, var);
+    }
+}
+
+static const Node* process_block(Context* ctx, const Node* old_block) {
+    IrArena* dst_arena = ctx->rewriter.dst_arena;
+    BlockBuilder* instructions = begin_block(dst_arena);
+    Nodes old_instructions = old_block->payload.block.instructions;
+    for (size_t i = 0; i < old_instructions.count; i++) {
+        const Node* old = old_instructions.nodes[i];
+        const PrimOp* old_op;
+        const Nodes* members;
+        const Node* ptr;
+
+        if (old->tag == Let_TAG && (old_op = get_prim_op(old, alloca_op)) && (ptr = old->payload.let.variables.nodes[0]) && (members = find_value_dict(const Node*, Nodes, ctx->split, ptr))) {
+            const Node* old_var = ptr;
+            Nodes member_types = old_op->operands.nodes[0]->payload.record_type.members;
+            LARRAY(const Node*, new_members, member_types.count);
+            for (size_t j = 0; j < member_types.count; j++) {
+                const Node* member_alloca = let(dst_arena, prim_op(dst_arena, (PrimOp) {
+                    .op = alloca_op,
+                    .operands = nodes(dst_arena, 1, (const Node* []) { rewrite_node(&ctx->rewriter, member_types.nodes[j]) })
+                }), 1, (const char* []) { old_var->payload.var.name });
+                append_block(instructions, member_alloca);
+                new_members[j] = member_alloca->payload.let.variables.nodes[0];
+            }
+            Nodes new_members_nodes = nodes(dst_arena, member_types.count, new_members);
+            insert_dict(const Node*, Nodes, ctx->split, old_var, new_members_nodes);
+            ctx->split_count++;
+            continue;
+        }
+
+        if (is_alias_let(old) && (ptr = resolve_alias(ctx->aliases, old->payload.let.instruction)) && find_value_dict(const Node*, Nodes, ctx->split, ptr))
+            continue;
+
+        if (old->tag == Let_TAG && (old_op = get_prim_op(old, lea_op)) && (ptr = resolve_alias(ctx->aliases, old_op->operands.nodes[0])) && (members = find_value_dict(const Node*, Nodes, ctx->split, ptr))) {
+            const Node* member = members->nodes[extract_int_literal_value(old_op->operands.nodes[2], false)];
+            // deeper selectors still apply, to the member on its own
+            if (old_op->operands.count > 3) {
+                Nodes selectors = nodes(dst_arena, old_op->operands.count - 3, &old_op->operands.nodes[3]);
+                member = gen_lea(instructions, member, NULL, rewrite_nodes(&ctx->rewriter, selectors));
+            }
+            register_processed(&ctx->rewriter, old->payload.let.variables.nodes[0], member);
+            continue;
+        }
+
+        if (old->tag == Let_TAG && (old_op = get_prim_op(old, load_op)) && (ptr = resolve_alias(ctx->aliases, old_op->operands.nodes[0])) && (members = find_value_dict(const Node*, Nodes, ctx->split, ptr))) {
+            LARRAY(const Node*, loaded, members->count);
+            for (size_t j = 0; j < members->count; j++)
+                loaded[j] = gen_load(instructions, members->nodes[j]);
+            register_processed(&ctx->rewriter, old->payload.let.variables.nodes[0], tuple(dst_arena, nodes(dst_arena, members->count, loaded)));
+            continue;
+        }
+
+        if (old->tag == PrimOp_TAG && (old_op = get_prim_op(old, store_op)) && (ptr = resolve_alias(ctx->aliases, old_op->operands.nodes[0])) && (members = find_value_dict(const Node*, Nodes, ctx->split, ptr))) {
+            const Node* old_value = resolve_alias(ctx->aliases, old_op->operands.nodes[1]);
+            assert(old_value->tag == Tuple_TAG);
+            for (size_t j = 0; j < members->count; j++)
+                gen_store(instructions, members->nodes[j], rewrite_node(&ctx->rewriter, old_value->payload.tuple.contents.nodes[j]));
+            continue;
+        }
+
+        append_block(instructions, rewrite_node(&ctx->rewriter, old));
+    }
+
+    return finish_block(instructions, rewrite_node(&ctx->rewriter, old_block->payload.block.terminator));
+}
+
+static const Node* process_node(Context* ctx, const Node* node) {
+    if (node == NULL) return NULL;
+
+    const Node* already_done = search_processed(&ctx->rewriter, node);
+    if (already_done)
+        return already_done;
+
+    switch (node->tag) {
+        case Function_TAG: {
+            Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
+            // continuations are rewritten as part of the function they live in
+            if (node->payload.fn.atttributes.is_continuation) {
+                fun->payload.fn.block = rewrite_node(&ctx->rewriter, node->payload.fn.block);
+                return fun;
+            }
+
+            Context fn_ctx = *ctx;
+            fn_ctx.split = new_dict(const Node*, Nodes, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.aliases = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+            find_aliases(node->payload.fn.block, fn_ctx.aliases);
+
+            struct List* splittable = new_list(const Node*);
+            find_splittable_allocas(fn_ctx.aliases, node, node->payload.fn.block, splittable);
+            // the member pointers are only known once the alloca itself is rewritten
+            Nodes no_members = nodes(ctx->rewriter.dst_arena, 0, NULL);
+            for (size_t i = 0; i < entries_count_list(splittable); i++)
+                insert_dict(const Node*, Nodes, fn_ctx.split, read_list(const Node*, splittable)[i], no_members);
+            destroy_list(splittable);
+
+            fun->payload.fn.block = rewrite_node(&fn_ctx.rewriter, node->payload.fn.block);
+
+            ctx->split_count = fn_ctx.split_count;
+            destroy_dict(fn_ctx.split);
+            destroy_dict(fn_ctx.aliases);
+            return fun;
+        }
+        case GlobalVariable_TAG:
+        case Constant_TAG: {
+            Node* decl = recreate_decl_header_identity(&ctx->rewriter, node);
+            recreate_decl_body_identity(&ctx->rewriter, node, decl);
+            return decl;
+        }
+        case Block_TAG: return process_block(ctx, node);
+        case Root_TAG: error("illegal node");
+        default: return recreate_node_identity(&ctx->rewriter, node);
+    }
+}
+
+const Node* opt_sroa(SHADY_UNUSED CompilerConfig* config, IrArena* src_arena, IrArena* dst_arena, const Node* src_program) {
+    assert(src_program->tag == Root_TAG);
+    size_t total = 0;
+    const Node* program = src_program;
+    // splitting a record can leave allocas of the records nested in it behind, keep going until those are gone too
+    while (true) {
+        struct Dict* done = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+        Context ctx = {
+            .rewriter = {
+                .dst_arena = dst_arena,
+                .src_arena = src_arena,
+                .rewrite_fn = (RewriteFn) process_node,
+                .rewrite_decl_body = NULL,
+                .processed = done,
+            },
+            .split = NULL,
+            .aliases = NULL,
+            .split_count = 0,
+        };
+
+        program = recreate_node_identity(&ctx.rewriter, program);
+        destroy_dict(done);
+        total += ctx.split_count;
+        src_arena = dst_arena;
+        if (ctx.split_count == 0)
+            break;
+    }
+    info_print("opt_sroa: split %zu record allocas\n", total);
+    return program;
+}
@@ -16,12 +16,30 @@ RewritePass lower_cf_instrs;
 RewritePass lower_callc;
 /// Lowers calls to stack saves and branches, lowers returns to stack pops and joins
 RewritePass lower_callf;
+/// Turns masks into integers sized after the subgroup size of the target, and the mask primops into bit twiddling
+RewritePass lower_mask;
 /// Turns stack pushes and pops into accesses into pointer load and stores
 RewritePass lower_stack;
 /// Emulates physical pointers to certain address spaces by using integer indices into global arrays
 RewritePass lower_physical_ptrs;
 
 // Optimisation passes
+/// Pastes the bodies of small, non-recursive functions and of functions called from a single place at their callsites
+RewritePass opt_inline;
+/// Removes the declarations that can't be reached from any entry point, programs without entry points are kept whole
+RewritePass opt_dead_decls;
+/// Splits record allocas that don't escape into one alloca per member
+RewritePass opt_sroa;
+/// Turns allocas that are only ever loaded from and stored to into plain values, threaded through structured control flow
+RewritePass opt_mem2reg;
+/// Evaluates constant expressions, folds control flow on known conditions and propagates constants.
+/// The destination arena has to allow folding, that is where primops and branches get evaluated.
+RewritePass opt_fold;
+/// Reuses the results of identical pure primops computed in dominating blocks instead of recomputing them
+RewritePass opt_gvn;
+/// Hoists the pure instructions that compute the same thing on every iteration out of loops, structured or made of continuations
+RewritePass opt_licm;
+/// Merges straight-line chains of continuations, threads jumps through empty ones and collapses branches to identical targets
 RewritePass opt_simplify_cf;
 RewritePass opt_restructurize;
 
@@ -30,7 +48,7 @@ RewritePass opt_restructurize;
 RewritePass lower_tailcalls;
 /// Emulates uniform jumps within functions using a loop
 RewritePass lower_jumps_loop;
-/// Emulates uniform jumps within functions by applying a structuring transformation
+/// Recovers structured ifs and loops from uniform jumps using the dominator and post-dominator trees
 RewritePass lower_jumps_structure;
 
 #define SHADY_PASSES_H
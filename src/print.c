@@ -332,6 +332,15 @@ static void print_node_impl(struct PrinterCtx* ctx, const Node* node) {
         case False_TAG:
             printf("false");
             break;
+        case Tuple_TAG:
+            printf("(");
+            for (size_t i = 0; i < node->payload.tuple.contents.count; i++) {
+                print_node(node->payload.tuple.contents.nodes[i]);
+                if (i + 1 < node->payload.tuple.contents.count)
+                    printf(", ");
+            }
+            printf(")");
+            break;
         // ----------------- INSTRUCTIONS
         case Let_TAG:
             if (node->payload.let.variables.count > 0) {
@@ -146,6 +146,7 @@ const Node* recreate_node_identity(Rewriter* rewriter, const Node* node) {
         case IntLiteral_TAG:    return int_literal(rewriter->dst_arena, node->payload.int_literal);
         case True_TAG:          return true_lit(rewriter->dst_arena);
         case False_TAG:         return false_lit(rewriter->dst_arena);
+        case Tuple_TAG:         return tuple(rewriter->dst_arena, rewrite_nodes(rewriter, node->payload.tuple.contents));
         case Variable_TAG:      error("We expect variables to be available for us in the `processed` set");
         case Let_TAG:           {
             const Node* ninstruction = rewrite_node(rewriter, node->payload.let.instruction);
@@ -238,7 +239,13 @@ const Node* recreate_node_identity(Rewriter* rewriter, const Node* node) {
             .desired_mask = rewrite_node(rewriter, node->payload.join.desired_mask),
             .args = rewrite_nodes(rewriter, node->payload.join.args)
         });
-        case Return_TAG:        return fn_ret(rewriter->dst_arena, (Return) {
+        case Callc_TAG:         return callc(rewriter->dst_arena, (Callc) {
+            .is_return_indirect = node->payload.callc.is_return_indirect,
+            .ret_cont = rewrite_node(rewriter, node->payload.callc.ret_cont),
+            .callee = rewrite_node(rewriter, node->payload.callc.callee),
+            .args = rewrite_nodes(rewriter, node->payload.callc.args)
+        });
+        case Return_TAG:       return fn_ret(rewriter->dst_arena, (Return) {
             .fn = rewrite_node(rewriter, node->payload.fn_ret.fn),
             .values = rewrite_nodes(rewriter, node->payload.fn_ret.values)
         });
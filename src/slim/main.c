@@ -2,14 +2,27 @@
 
 #include "../log.h"
 #include "../passes/passes.h"
+#include "../builtin/builtins.h"
 #include "parser.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
-const char* input_filename = NULL;
+#include <pthread.h>
+#include <unistd.h>
+
+const char** input_filenames = NULL;
+size_t input_filenames_count = 0;
 const char* output_filename = "out.spv";
+const char* output_dir = NULL;
+size_t jobs_count = 0;
+bool streaming_emission = false;
+bool clustered_dispatcher = false;
+uint32_t subgroup_size = 0;
+SchedulingPolicy scheduling_policy = SchedulerRoundRobin;
 
 const char* cfg_output = NULL;
 
@@ -20,12 +33,20 @@ enum SlimErrorCodes {
     InputFileDoesNotExist,
     IncorrectLogLevel,
     MoreThanOneFilename,
-    MissingDumpCfgArg
+    MissingDumpCfgArg,
+    MissingOutputDirArg,
+    IncorrectJobsCount,
+    IncorrectSubgroupSize,
+    IncorrectSchedulingPolicy,
+    IncompatibleArguments,
+    CompilationFailed,
+    CannotOpenOutput,
 };
 
 char* read_file(const char* filename);
 
 static void process_arguments(int argc, const char** argv) {
+    input_filenames = malloc(sizeof(const char*) * argc);
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--log-level") == 0) {
             i++;
@@ -53,6 +74,50 @@ static void process_arguments(int argc, const char** argv) {
                 exit(MissingOutputArg);
             }
             output_filename = argv[i];
+        } else if (strcmp(argv[i], "--output-dir") == 0) {
+            i++;
+            if (i == argc) {
+                error_print("--output-dir must be followed with a directory");
+                exit(MissingOutputDirArg);
+            }
+            output_dir = argv[i];
+        } else if (strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) {
+            i++;
+            int parsed = i == argc ? 0 : atoi(argv[i]);
+            if (parsed <= 0) {
+                error_print("--jobs must be followed with a positive number");
+                exit(IncorrectJobsCount);
+            }
+            jobs_count = (size_t) parsed;
+        } else if (strcmp(argv[i], "--subgroup-size") == 0) {
+            i++;
+            int parsed = i == argc ? 0 : atoi(argv[i]);
+            if (parsed <= 0 || parsed > 64 || (parsed & (parsed - 1)) != 0) {
+                error_print("--subgroup-size must be followed with a power of two no bigger than 64");
+                exit(IncorrectSubgroupSize);
+            }
+            subgroup_size = (uint32_t) parsed;
+        } else if (strcmp(argv[i], "--scheduling-policy") == 0) {
+            i++;
+            if (i == argc)
+                goto incorrect_scheduling_policy;
+            if (strcmp(argv[i], "round-robin") == 0)
+                scheduling_policy = SchedulerRoundRobin;
+            else if (strcmp(argv[i], "min-fn-id") == 0)
+                scheduling_policy = SchedulerMinFnId;
+            else if (strcmp(argv[i], "join-priority") == 0)
+                scheduling_policy = SchedulerJoinPriority;
+            else {
+                incorrect_scheduling_policy:
+                error_print("--scheduling-policy argument takes one of: ");
+                error_print("round-robin, min-fn-id, join-priority");
+                error_print("\n");
+                exit(IncorrectSchedulingPolicy);
+            }
+        } else if (strcmp(argv[i], "--streaming-emission") == 0) {
+            streaming_emission = true;
+        } else if (strcmp(argv[i], "--clustered-dispatcher") == 0) {
+            clustered_dispatcher = true;
         } else if (strcmp(argv[i], "--dump-cfg") == 0) {
             i++;
             if (i == argc) {
@@ -61,58 +126,110 @@ static void process_arguments(int argc, const char** argv) {
             }
             cfg_output = argv[i];
         } else {
-            // assume it is the filename
-            if (input_filename) {
-                error_print("We only supporting compiling from one file at the moment");
-                exit(MoreThanOneFilename);
-            }
-            input_filename = argv[i];
+            // assume it is a filename
+            input_filenames[input_filenames_count++] = argv[i];
         }
     }
 
-    if (input_filename == NULL) {
+    if (input_filenames_count == 0) {
         error_print("Usage: slim source.slim\n");
+        error_print("       slim --output-dir dir sources.slim...\n");
         error_print("Available arguments: \n");
         error_print("  --log-level [debug, info, warn, error]\n");
         error_print("  --output output_filename\n");
+        error_print("  --output-dir output_directory\n");
+        error_print("  --jobs number_of_threads\n");
+        error_print("  --subgroup-size size\n");
+        error_print("  --scheduling-policy round-robin|min-fn-id|join-priority\n");
+        error_print("  --streaming-emission\n");
+        error_print("  --clustered-dispatcher\n");
         error_print("  --dump-cfg\n");
         exit(MissingInputArg);
     }
+
+    if (input_filenames_count > 1 && !output_dir) {
+        error_print("Compiling more than one file requires --output-dir\n");
+        exit(MoreThanOneFilename);
+    }
+
+    if (output_dir && cfg_output) {
+        error_print("--dump-cfg can only be used when compiling a single file without --output-dir\n");
+        exit(IncompatibleArguments);
+    }
 }
 
-int main(int argc, const char** argv) {
-    IrArena* arena = new_arena((ArenaConfig) {
-        .check_types = false
-    });
+typedef struct {
+    const char* input_filename;
+    char* output_filename;
+    enum SlimErrorCodes result;
+    double time_ms;
+} SlimJob;
 
-    CompilerConfig config = default_compiler_config();
+/// Output files go in the output directory and take the name of their source, with the extension swapped for .spv
+static char* make_output_filename(const char* input_filename) {
+    const char* base = strrchr(input_filename, '/');
+    base = base ? base + 1 : input_filename;
+    const char* extension = strrchr(base, '.');
+    size_t stem_len = extension ? (size_t) (extension - base) : strlen(base);
 
-    process_arguments(argc, argv);
+    size_t len = strlen(output_dir) + 1 + stem_len + strlen(".spv") + 1;
+    char* filename = malloc(len);
+    snprintf(filename, len, "%s/%.*s.spv", output_dir, (int) stem_len, base);
+    return filename;
+}
+
+static double elapsed_ms(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start.tv_sec) * 1000.0 + (double) (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
 
-    info_print("compiling %s\n", input_filename);
+typedef struct {
+    CompilerConfig* config;
+    IrArena* arena;
     const Node* program;
+    FILE* output;
+} EmitJob;
+
+static void run_emit_job(EmitJob* job) {
+    emit_spirv(job->config, job->arena, job->program, job->output);
+}
+
+static void compile_job(CompilerConfig config, SlimJob* job) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    info_print("compiling %s\n", job->input_filename);
 
-    char* contents = read_file(input_filename);
+    char* contents = read_file(job->input_filename);
     if ((void*)contents == NULL) {
-        error_print("file does not exist\n");
-        exit(InputFileDoesNotExist);
-    } else {
-        info_print("Parsing: \n%s\n", contents);
-        ParserConfig pconfig = {
-            .front_end = true
-        };
-        program = parse(pconfig, contents, arena);
+        error_print("file %s does not exist\n", job->input_filename);
+        job->result = InputFileDoesNotExist;
+        return;
     }
 
-    free(contents);
-
-    info_print("Parsed program successfully: \n");
-    print_node(program);
+    // Each job owns its arenas, the builtin module is the only IR they share and they only read it
+    IrArena* arena = new_arena((ArenaConfig) {
+        .check_types = false
+    });
 
-    CompilationResult result = run_compiler_passes(&config, &arena, &program);
+    info_print("Parsing: \n%s\n", contents);
+    ParserConfig pconfig = {
+        .front_end = true
+    };
+    const Node* program = NULL;
+    CompilationResult result = parse_recoverable(pconfig, contents, arena, &program);
+    free(contents);
+    if (result == CompilationNoError) {
+        info_print("Parsed program successfully: \n");
+        info_node(program);
+        result = run_compiler_passes(&config, &arena, &program);
+    }
     if (result != CompilationNoError) {
-        error_print("Compilation pipeline failed, errcode=%d\n", (int) result);
-        exit(result);
+        error_print("Compilation pipeline failed for %s, errcode=%d\n", job->input_filename, (int) result);
+        job->result = CompilationFailed;
+        destroy_arena(arena);
+        return;
     }
 
     if (cfg_output) {
@@ -123,11 +240,133 @@ int main(int argc, const char** argv) {
     }
 
     info_print("Emitting final result ... \n");
-    FILE *output = fopen(output_filename, "wb");
-    emit_spirv(&config, arena, program, output);
-    fclose(output);
-    info_print("Done\n");
+    FILE *output = fopen(job->output_filename, "wb");
+    if (!output) {
+        error_print("could not open %s for writing\n", job->output_filename);
+        job->result = CannotOpenOutput;
+    } else {
+        EmitJob emit_job = {
+            .config = &config,
+            .arena = arena,
+            .program = program,
+            .output = output,
+        };
+        if (!run_recoverable((void (*)(void*)) run_emit_job, &emit_job)) {
+            error_print("Emission failed for %s\n", job->input_filename);
+            job->result = CompilationFailed;
+        }
+        fclose(output);
+    }
 
     destroy_arena(arena);
-    return NoError;
+    job->time_ms = elapsed_ms(start);
+}
+
+typedef struct {
+    CompilerConfig config;
+    SlimJob* jobs;
+    size_t jobs_count;
+
+    pthread_mutex_t queue_lock;
+    size_t next;
+} JobQueue;
+
+static void* jobs_worker(JobQueue* queue) {
+    while (true) {
+        pthread_mutex_lock(&queue->queue_lock);
+        size_t i = queue->next++;
+        pthread_mutex_unlock(&queue->queue_lock);
+        if (i >= queue->jobs_count)
+            return NULL;
+        compile_job(queue->config, &queue->jobs[i]);
+    }
+}
+
+static enum SlimErrorCodes compile_batch(CompilerConfig config) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    JobQueue queue = {
+        .config = config,
+        .jobs = calloc(input_filenames_count, sizeof(SlimJob)),
+        .jobs_count = input_filenames_count,
+        .next = 0,
+    };
+    // Files are already compiled concurrently, don't spawn threads inside each of them too
+    queue.config.emission_threads = 1;
+    // The jobs only read it, each of them imports the declarations into its own arena
+    BuiltinModule* builtins = prepare_builtins(&queue.config);
+    queue.config.builtins = builtins;
+
+    for (size_t i = 0; i < input_filenames_count; i++) {
+        queue.jobs[i] = (SlimJob) {
+            .input_filename = input_filenames[i],
+            .output_filename = make_output_filename(input_filenames[i]),
+            .result = NoError,
+        };
+    }
+
+    size_t threads_count = jobs_count;
+    if (threads_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = cores > 0 ? (size_t) cores : 1;
+    }
+    if (threads_count > input_filenames_count)
+        threads_count = input_filenames_count;
+
+    pthread_mutex_init(&queue.queue_lock, NULL);
+    pthread_t* threads = malloc(sizeof(pthread_t) * threads_count);
+    for (size_t i = 0; i < threads_count; i++)
+        if (pthread_create(&threads[i], NULL, (void*(*)(void*)) jobs_worker, &queue) != 0)
+            error("failed to start a compilation thread");
+    for (size_t i = 0; i < threads_count; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&queue.queue_lock);
+    destroy_builtins(builtins);
+
+    enum SlimErrorCodes result = NoError;
+    for (size_t i = 0; i < input_filenames_count; i++) {
+        SlimJob* job = &queue.jobs[i];
+        if (job->result == NoError)
+            printf("%8.2f ms  %s -> %s\n", job->time_ms, job->input_filename, job->output_filename);
+        else {
+            printf("  failed     %s\n", job->input_filename);
+            result = job->result;
+        }
+        free(job->output_filename);
+    }
+    printf("%8.2f ms  total for %zu files on %zu threads\n", elapsed_ms(start), input_filenames_count, threads_count);
+
+    free(queue.jobs);
+    return result;
+}
+
+int main(int argc, const char** argv) {
+    CompilerConfig config = default_compiler_config();
+
+    process_arguments(argc, argv);
+    config.streaming_emission = streaming_emission;
+    config.use_clustered_dispatcher = clustered_dispatcher;
+    if (subgroup_size)
+        config.subgroup_size = subgroup_size;
+    config.scheduling_policy = scheduling_policy;
+
+    enum SlimErrorCodes result;
+    if (output_dir) {
+        result = compile_batch(config);
+    } else {
+        SlimJob job = {
+            .input_filename = input_filenames[0],
+            .output_filename = (char*) output_filename,
+            .result = NoError,
+        };
+        compile_job(config, &job);
+        result = job.result;
+    }
+
+    free(input_filenames);
+    if (result == NoError)
+        info_print("Done\n");
+    return result;
 }
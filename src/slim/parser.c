@@ -49,7 +49,7 @@ INFIX_OPERATORS()
 static void expect_impl(bool condition, const char* err) {
     if (!condition) {
         error_print("expected to parse: %s\n", err);
-        exit(-4);
+        error_die();
     }
 }
 
@@ -852,7 +852,7 @@ const Node* parse(ParserConfig config, char* contents, IrArena* arena) {
         }
 
         error_print("No idea what to parse here... (tok=(tag = %s, pos = %zu))\n", token_tags[token.tag], token.start);
-        exit(-3);
+        error_die();
     }
 
     size_t count = declarations->elements_count;
@@ -866,3 +866,26 @@ const Node* parse(ParserConfig config, char* contents, IrArena* arena) {
 
     return n;
 }
+
+typedef struct {
+    ParserConfig config;
+    char* contents;
+    IrArena* arena;
+    const Node* program;
+} ParseJob;
+
+static void run_parse_job(ParseJob* job) {
+    job->program = parse(job->config, job->contents, job->arena);
+}
+
+CompilationResult parse_recoverable(ParserConfig config, char* contents, IrArena* arena, const Node** program) {
+    ParseJob job = {
+        .config = config,
+        .contents = contents,
+        .arena = arena,
+    };
+    if (!run_recoverable((void (*)(void*)) run_parse_job, &job))
+        return CompilationParseFailed;
+    *program = job.program;
+    return CompilationNoError;
+}
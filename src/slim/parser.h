@@ -34,5 +34,7 @@ INFIX_OPERATORS()
 } InfixOperators;
 
 const Node* parse(ParserConfig config, char* contents, IrArena* arena);
+/// Same as parse, but reports invalid sources instead of ending the process
+CompilationResult parse_recoverable(ParserConfig config, char* contents, IrArena* arena, const Node** program);
 
 #endif
\ No newline at end of file
@@ -7,6 +7,8 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #define PRIMOP(has_side_effects, name) TEXT_TOKEN(name)
 
 static const char* token_strings[] = {
@@ -24,7 +26,8 @@ const char* token_tags[] = {
 #undef PRIMOP
 
 static size_t token_strings_size[LIST_END_tok];
-static bool constants_initialized = false;
+// slim compiles several files at once in batch mode, the tables have to be filled exactly once
+static pthread_once_t constants_initialized = PTHREAD_ONCE_INIT;
 
 static void init_tokenizer_constants() {
     for (int i = 0; i < LIST_END_tok; i++) {
@@ -40,10 +43,7 @@ struct Tokenizer {
 };
 
 struct Tokenizer* new_tokenizer(char* str) {
-    if (!constants_initialized) {
-        init_tokenizer_constants();
-        constants_initialized = true;
-    }
+    pthread_once(&constants_initialized, init_tokenizer_constants);
 
     struct Tokenizer* tokenizer = (struct Tokenizer*) malloc(sizeof(struct Tokenizer));
     *tokenizer = (struct Tokenizer) {
@@ -146,7 +146,7 @@ struct Token next_token(struct Tokenizer* tokenizer) {
     }
 
     error_print("We don't know how to tokenize %.16s...\n", slice);
-    exit(-2);
+    error_die();
 
     parsed_successfully:
     token.end = token.start + token_size;
@@ -3,6 +3,9 @@
 
 #include "../log.h"
 #include "../block_builder.h"
+#include "../portability.h"
+
+#include <assert.h>
 
 TypeMemLayout get_mem_layout(const CompilerConfig* config, IrArena* arena, const Type* type) {
     switch (type->tag) {
@@ -11,11 +14,12 @@ TypeMemLayout get_mem_layout(const CompilerConfig* config, IrArena* arena, const
             case AsProgramCode: return get_mem_layout(config, arena, int32_type(arena));
             default: error("unhandled")
         }
-        // case MaskType_TAG: return get_mem_layout(config, arena, int_type(arena));
+        case MaskType_TAG: return get_mem_layout(config, arena, get_mask_int_type(config, arena));
+        // narrower integers still take a whole cell
         case Int_TAG:     return (TypeMemLayout) {
             .type = type,
-            .size_in_bytes = 4,
-            .size_in_cells = 1,
+            .size_in_bytes = type->payload.int_type.width == IntTy64 ? 8 : 4,
+            .size_in_cells = type->payload.int_type.width == IntTy64 ? 2 : 1,
         };
         case Float_TAG:   return (TypeMemLayout) {
             .type = type,
@@ -28,12 +32,86 @@ TypeMemLayout get_mem_layout(const CompilerConfig* config, IrArena* arena, const
             .size_in_cells = 1,
         };
         case QualifiedType_TAG: return get_mem_layout(config, arena, type->payload.qualified_type.type);
-        case RecordType_TAG: error("TODO");
+        case RecordType_TAG: {
+            TypeMemLayout layout = {
+                .type = type,
+                .size_in_bytes = 0,
+                .size_in_cells = 0,
+            };
+            // members are packed one after the other, cells are all 4 bytes so there is no padding to care about
+            Nodes members = type->payload.record_type.members;
+            for (size_t i = 0; i < members.count; i++) {
+                TypeMemLayout member_layout = get_mem_layout(config, arena, members.nodes[i]);
+                layout.size_in_bytes += member_layout.size_in_bytes;
+                layout.size_in_cells += member_layout.size_in_cells;
+            }
+            return layout;
+        }
+        case ArrType_TAG: {
+            const Node* size = type->payload.arr_type.size;
+            assert(size && size->tag == IntLiteral_TAG && "only arrays of known size have a layout");
+            size_t count = extract_int_literal_value(size, false);
+            TypeMemLayout element_layout = get_mem_layout(config, arena, type->payload.arr_type.element_type);
+            return (TypeMemLayout) {
+                .type = type,
+                .size_in_bytes = element_layout.size_in_bytes * count,
+                .size_in_cells = element_layout.size_in_cells * count,
+            };
+        }
         default: error("not a known type");
     }
 }
 
-const Node* gen_deserialisation(BlockBuilder* instructions, const Type* element_type, const Node* arr, const Node* base_offset) {
+const Type* get_mask_int_type(const CompilerConfig* config, IrArena* arena) {
+    assert(config->subgroup_size > 0 && config->subgroup_size <= 64 && (config->subgroup_size & (config->subgroup_size - 1)) == 0);
+    return int_type(arena, (Int) { .width = config->subgroup_size <= 32 ? IntTy32 : IntTy64 });
+}
+
+size_t get_record_member_offset_in_cells(const CompilerConfig* config, IrArena* arena, const Type* record_type, size_t member) {
+    assert(record_type->tag == RecordType_TAG);
+    Nodes members = record_type->payload.record_type.members;
+    assert(member < members.count);
+    size_t offset = 0;
+    for (size_t i = 0; i < member; i++)
+        offset += get_mem_layout(config, arena, members.nodes[i]).size_in_cells;
+    return offset;
+}
+
+static const Node* gen_offset(BlockBuilder* instructions, const Node* base_offset, size_t offset) {
+    if (offset == 0)
+        return base_offset;
+    if (base_offset->tag == IntLiteral_TAG)
+        return int_literal(instructions->arena, (IntLiteral) { .value_i32 = extract_int_literal_value(base_offset, true) + offset, .width = IntTy32 });
+    const Node* offset_val = int_literal(instructions->arena, (IntLiteral) { .value_i32 = offset, .width = IntTy32 });
+    return gen_primop(instructions, (PrimOp) {
+        .op = add_op,
+        .operands = nodes(instructions->arena, 2, (const Node* []) { base_offset, offset_val })
+    }).nodes[0];
+}
+
+static const Node* gen_member_offset(const CompilerConfig* config, BlockBuilder* instructions, const Type* record_type, size_t member, const Node* base_offset) {
+    return gen_offset(instructions, base_offset, get_record_member_offset_in_cells(config, instructions->arena, record_type, member));
+}
+
+/// Tuples are taken apart directly, other record values get their members extracted
+static const Node* gen_member_value(BlockBuilder* instructions, const Node* value, size_t member) {
+    if (value->tag == Tuple_TAG)
+        return value->payload.tuple.contents.nodes[member];
+    const Node* index = int_literal(instructions->arena, (IntLiteral) { .value_i32 = member, .width = IntTy32 });
+    return gen_primop(instructions, (PrimOp) {
+        .op = extract_op,
+        .operands = nodes(instructions->arena, 2, (const Node* []) { value, index })
+    }).nodes[0];
+}
+
+static const Node* gen_cell_op(BlockBuilder* instructions, Op op, const Node* a, const Node* b) {
+    return gen_primop(instructions, (PrimOp) {
+        .op = op,
+        .operands = nodes(instructions->arena, 2, (const Node* []) { a, b })
+    }).nodes[0];
+}
+
+const Node* gen_deserialisation(const CompilerConfig* config, BlockBuilder* instructions, const Type* element_type, const Node* arr, const Node* base_offset) {
     switch (element_type->tag) {
         case Bool_TAG: {
             const Node* logical_ptr = gen_primop(instructions, (PrimOp) {
@@ -41,7 +119,7 @@ const Node* gen_deserialisation(BlockBuilder* instructions, const Type* element_
                 .operands = nodes(instructions->arena, 3, (const Node* []) { arr, NULL, base_offset})
             }).nodes[0];
             const Node* value = gen_load(instructions, logical_ptr);
-            const Node* zero = int_literal(instructions->arena, (IntLiteral) { .value_i8 = 0, .width = IntTy8 });
+            const Node* zero = int_literal(instructions->arena, (IntLiteral) { .value_i32 = 0, .width = IntTy32 });
             return gen_primop(instructions, (PrimOp) {
                 .op = neq_op,
                 .operands = nodes(instructions->arena, 2, (const Node*[]) {value, zero})
@@ -51,8 +129,20 @@ const Node* gen_deserialisation(BlockBuilder* instructions, const Type* element_
             case AsProgramCode: goto ser_int;
             default: error("TODO")
         }
-        // case MaskType_TAG:
+        case MaskType_TAG: return gen_deserialisation(config, instructions, get_mask_int_type(config, instructions->arena), arr, base_offset);
         case Int_TAG: ser_int: {
+            if (element_type->tag == Int_TAG && element_type->payload.int_type.width == IntTy64) {
+                // two cells, low half first
+                IrArena* arena = instructions->arena;
+                const Node* low = gen_deserialisation(config, instructions, int32_type(arena), arr, base_offset);
+                const Node* high = gen_deserialisation(config, instructions, int32_type(arena), arr, gen_offset(instructions, base_offset, 1));
+                low = gen_cell_op(instructions, convert_op, element_type, low);
+                high = gen_cell_op(instructions, convert_op, element_type, high);
+                // the low half was sign-extended
+                low = gen_cell_op(instructions, and_op, low, int_literal(arena, (IntLiteral) { .value_i64 = 0xFFFFFFFF, .width = IntTy64 }));
+                high = gen_cell_op(instructions, lshift_logical_op, high, int_literal(arena, (IntLiteral) { .value_i64 = 32, .width = IntTy64 }));
+                return gen_cell_op(instructions, or_op, high, low);
+            }
             // TODO handle the cases where int size != arr element_t
             const Node* logical_ptr = gen_primop(instructions, (PrimOp) {
                 .op = lea_op,
@@ -63,19 +153,28 @@ const Node* gen_deserialisation(BlockBuilder* instructions, const Type* element_
             value = gen_primop(instructions, (PrimOp) {.op = reinterpret_op, .operands = nodes(instructions->arena, 2, (const Node* []){ element_type, value})}).nodes[0];
             return value;
         }
+        case RecordType_TAG: {
+            Nodes members = element_type->payload.record_type.members;
+            LARRAY(const Node*, loaded, members.count);
+            for (size_t i = 0; i < members.count; i++) {
+                const Node* member_offset = gen_member_offset(config, instructions, element_type, i, base_offset);
+                loaded[i] = gen_deserialisation(config, instructions, members.nodes[i], arr, member_offset);
+            }
+            return tuple(instructions->arena, nodes(instructions->arena, members.count, loaded));
+        }
         default: error("TODO");
     }
 }
 
-void gen_serialisation(BlockBuilder* instructions, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value) {
+void gen_serialisation(const CompilerConfig* config, BlockBuilder* instructions, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value) {
     switch (element_type->tag) {
         case Bool_TAG: {
             const Node* logical_ptr = gen_primop(instructions, (PrimOp) {
                 .op = lea_op,
                 .operands = nodes(instructions->arena, 3, (const Node* []) { arr, NULL, base_offset})
             }).nodes[0];
-            const Node* zero = int_literal(instructions->arena, (IntLiteral) { .value_i8 = 0, .width = IntTy8 });
-            const Node* one = int_literal(instructions->arena, (IntLiteral) { .value_i8 = 1, .width = IntTy8 });
+            const Node* zero = int_literal(instructions->arena, (IntLiteral) { .value_i32 = 0, .width = IntTy32 });
+            const Node* one = int_literal(instructions->arena, (IntLiteral) { .value_i32 = 1, .width = IntTy32 });
             const Node* int_value = gen_primop(instructions, (PrimOp) {
                 .op = select_op,
                 .operands = nodes(instructions->arena, 3, (const Node*[]) { value, zero, one })
@@ -84,11 +183,23 @@ void gen_serialisation(BlockBuilder* instructions, const Type* element_type, con
             return;
         }
         case PtrType_TAG: switch (element_type->payload.ptr_type.address_space) {
-            case AsProgramCode: goto des_int;
+            case AsProgramCode: {
+                value = gen_primop(instructions, (PrimOp) {.op = reinterpret_op, .operands = nodes(instructions->arena, 2, (const Node* []){ int32_type(instructions->arena), value})}).nodes[0];
+                goto des_int;
+            }
             default: error("TODO")
         }
-        // case MaskType_TAG:
+        case MaskType_TAG: gen_serialisation(config, instructions, get_mask_int_type(config, instructions->arena), arr, base_offset, value); return;
         case Int_TAG: des_int: {
+            if (element_type->tag == Int_TAG && element_type->payload.int_type.width == IntTy64) {
+                IrArena* arena = instructions->arena;
+                const Node* low = gen_cell_op(instructions, convert_op, int32_type(arena), value);
+                const Node* high = gen_cell_op(instructions, rshift_op, value, int_literal(arena, (IntLiteral) { .value_i64 = 32, .width = IntTy64 }));
+                high = gen_cell_op(instructions, convert_op, int32_type(arena), high);
+                gen_serialisation(config, instructions, int32_type(arena), arr, base_offset, low);
+                gen_serialisation(config, instructions, int32_type(arena), arr, gen_offset(instructions, base_offset, 1), high);
+                return;
+            }
             // note: folding gets rid of identity casts
             // value = gen_primop(instructions, (PrimOp) {.op = reinterpret_op, .operands = nodes(instructions->arena, 2, (const Node* []){ int_type(instructions->arena), value})}).nodes[0];
             const Node* logical_ptr = gen_primop(instructions, (PrimOp) {
@@ -98,6 +209,14 @@ void gen_serialisation(BlockBuilder* instructions, const Type* element_type, con
             gen_store(instructions, logical_ptr, value);
             return;
         }
+        case RecordType_TAG: {
+            Nodes members = element_type->payload.record_type.members;
+            for (size_t i = 0; i < members.count; i++) {
+                const Node* member_offset = gen_member_offset(config, instructions, element_type, i, base_offset);
+                gen_serialisation(config, instructions, members.nodes[i], arr, member_offset, gen_member_value(instructions, value, i));
+            }
+            return;
+        }
         default: error("TODO");
     }
 }
@@ -14,8 +14,12 @@ typedef struct {
 } TypeMemLayout;
 
 TypeMemLayout get_mem_layout(const CompilerConfig*, IrArena*, const Type*);
+/// The integer type masks are represented with, sized after the subgroup size in the config
+const Type* get_mask_int_type(const CompilerConfig*, IrArena*);
+/// Where a member of a record starts, relative to the start of the record
+size_t get_record_member_offset_in_cells(const CompilerConfig*, IrArena*, const Type* record_type, size_t member);
 
-const Node* gen_deserialisation(BlockBuilder*, const Type* element_type, const Node* arr, const Node* base_offset);
-void gen_serialisation(BlockBuilder*, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value);
+const Node* gen_deserialisation(const CompilerConfig*, BlockBuilder*, const Type* element_type, const Node* arr, const Node* base_offset);
+void gen_serialisation(const CompilerConfig*, BlockBuilder*, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value);
 
 #endif
@@ -67,6 +67,7 @@ bool is_subtype(const Type* supertype, const Type* type) {
                 return false;
             return is_subtype(supertype->payload.ptr_type.pointed_type, type->payload.ptr_type.pointed_type);
         }
+        case Int_TAG: return supertype->payload.int_type.width == type->payload.int_type.width;
         // simple types without a payload
         default: return true;
     }
@@ -136,6 +137,7 @@ static bool is_mem_access_uniform(AddressSpace as) {
     switch (as) {
         case AsGeneric:         return false;
         case AsPrivateLogical:  return false;
+        case AsFunctionLogical: return false;
         case AsSubgroupPhysical: return true;
         case AsPrivatePhysical: return false;
         case AsSharedLogical:    return true;
@@ -187,10 +189,21 @@ const Type* check_type_true_lit(IrArena* arena) { return qualified_type(arena, (
 const Type* check_type_false_lit(IrArena* arena) { return qualified_type(arena, (QualifiedType) { .type = bool_type(arena), .is_uniform = true }); }
 
 const Type* check_type_tuple(IrArena* arena, Tuple tuple) {
-    return record_type(arena, (RecordType) {
-        .members = extract_types(arena, tuple.contents),
-        .must_be_deconstructed = false,
-        .names = strings(arena, 0, NULL)
+    // like any other value, the tuple is qualified as a whole, and it is only uniform if all of its contents are
+    bool uniform = true;
+    LARRAY(const Type*, members, tuple.contents.count);
+    for (size_t i = 0; i < tuple.contents.count; i++) {
+        const Type* member_type = tuple.contents.nodes[i]->type;
+        uniform &= get_qualifier(member_type) == Uniform;
+        members[i] = without_qualifier(member_type);
+    }
+    return qualified_type(arena, (QualifiedType) {
+        .is_uniform = uniform,
+        .type = record_type(arena, (RecordType) {
+            .members = nodes(arena, tuple.contents.count, members),
+            .must_be_deconstructed = false,
+            .names = strings(arena, 0, NULL)
+        })
     });
 }
 
@@ -357,15 +370,17 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
             assert(is_subtype(val_expected_type, val->type));
             return unit_type(arena);
         }
-        case alloca_op: {
+        case alloca_op:
+        case alloca_logical_op: {
             assert(prim_op.operands.count == 1);
             const Type* elem_type = prim_op.operands.nodes[0];
             assert(is_type(elem_type));
+            // alloca_logical makes the function variables control flow lowering needs, lower_physical_ptrs leaves them alone
             return qualified_type(arena, (QualifiedType) {
                 .is_uniform = true,
                 .type = ptr_type(arena, (PtrType) {
                     .pointed_type = elem_type,
-                    .address_space = AsPrivatePhysical
+                    .address_space = prim_op.op == alloca_op ? AsPrivatePhysical : AsFunctionLogical
                 })
             });
         }
@@ -394,6 +409,7 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
                 if (i >= prim_op.operands.count) break;
                 const Node* selector = prim_op.operands.nodes[i];
                 assert(without_qualifier(selector->type)->tag == Int_TAG && "selectors must be integers");
+                uniform &= get_qualifier(selector->type) == Uniform;
                 const Type* pointee_type = unqual_ptr_type->payload.ptr_type.pointed_type;
                 assert(get_qualifier(pointee_type) == Unknown);
                 switch (pointee_type->tag) {
@@ -405,7 +421,18 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
                         i++;
                         continue;
                     }
-                    case RecordType_TAG: error("TODO"); // also remember to assert literals for the selectors !
+                    case RecordType_TAG: {
+                        assert(selector->tag == IntLiteral_TAG && "selectors for records must be literals");
+                        size_t member = extract_int_literal_value(selector, false);
+                        Nodes members = pointee_type->payload.record_type.members;
+                        assert(member < members.count);
+                        curr_ptr_type = ptr_type(arena, (PtrType) {
+                            .pointed_type = members.nodes[member],
+                            .address_space = unqual_ptr_type->payload.ptr_type.address_space
+                        });
+                        i++;
+                        continue;
+                    }
                     default: error("lea selectors can only work on pointers to arrays or records")
                 }
             }
@@ -415,6 +442,50 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
                 .type = without_qualifier(curr_ptr_type)
             });
         }
+        // like lea, but on the value of an array or a record rather than on a pointer to it
+        case extract_op: {
+            assert(prim_op.operands.count >= 2);
+            DivergenceQualifier qual;
+            const Type* t = strip_qualifier(prim_op.operands.nodes[0]->type, &qual);
+            assert(qual != Unknown);
+            for (size_t i = 1; i < prim_op.operands.count; i++) {
+                const Node* selector = prim_op.operands.nodes[i];
+                assert(selector->tag == IntLiteral_TAG && "extract selectors must be literals");
+                size_t index = extract_int_literal_value(selector, false);
+                switch (t->tag) {
+                    case ArrType_TAG: t = t->payload.arr_type.element_type; break;
+                    case RecordType_TAG: {
+                        Nodes members = t->payload.record_type.members;
+                        assert(index < members.count);
+                        t = members.nodes[index];
+                        break;
+                    }
+                    default: error("extract selectors can only work on arrays or records")
+                }
+            }
+            return qualified_type(arena, (QualifiedType) {
+                .is_uniform = qual == Uniform,
+                .type = t
+            });
+        }
+        case not_op:
+        case and_op:
+        case or_op:
+        case xor_op: {
+            assert(prim_op.operands.count == (prim_op.op == not_op ? 1 : 2));
+            bool is_result_uniform = true;
+            const Type* first_type = without_qualifier(prim_op.operands.nodes[0]->type);
+            assert((first_type->tag == Int_TAG || first_type->tag == Bool_TAG) && "bitwise operations work on integers and booleans");
+            for (size_t i = 0; i < prim_op.operands.count; i++) {
+                DivergenceQualifier op_div;
+                const Type* arg_actual_type = strip_qualifier(prim_op.operands.nodes[i]->type, &op_div);
+                assert(op_div != Unknown);
+                is_result_uniform &= op_div == Uniform;
+                assert(arg_actual_type == first_type && "bitwise operations expect both operands to have the same type");
+            }
+            return qualified_type(arena, (QualifiedType) { .is_uniform = is_result_uniform, .type = first_type });
+        }
+        case convert_op:
         case reinterpret_op: {
             assert(prim_op.operands.count == 2);
             const Node* source = prim_op.operands.nodes[1];
@@ -443,19 +514,26 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
                 .type = without_qualifier(prim_op.operands.nodes[2]->type)
             });
         }
-        case empty_mask_op:
-        case subgroup_active_mask_op: {
+        case empty_mask_op: {
             assert(prim_op.operands.count == 0);
             return qualified_type(arena, (QualifiedType) {
                 .is_uniform = true,
                 .type = mask_type(arena)
             });
         }
+        // once masks are lowered, these take the integer type the mask is held in as an extra first operand
+        case subgroup_active_mask_op:
         case subgroup_ballot_op: {
-            assert(prim_op.operands.count == 1);
+            size_t mask_operands = prim_op.op == subgroup_ballot_op ? 1 : 0;
+            const Type* result_type = mask_type(arena);
+            if (prim_op.operands.count == mask_operands + 1) {
+                result_type = prim_op.operands.nodes[0];
+                assert(is_type(result_type) && result_type->tag == Int_TAG);
+            } else
+                assert(prim_op.operands.count == mask_operands);
             return qualified_type(arena, (QualifiedType) {
                 .is_uniform = true,
-                .type = mask_type(arena)
+                .type = result_type
             });
         }
         case subgroup_elect_first_op: {
@@ -588,6 +666,7 @@ const Type* check_type_branch(IrArena* arena, Branch branch) {
                 check_known_target_helper(branches[i]);
                 check_callsite_helper(branches[i]->type, extract_types(arena, branch.args));
             }
+            break;
         }
         case BrSwitch: error("TODO")
     }
@@ -1,5 +1,9 @@
+#include "log.h"
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <setjmp.h>
+#include <signal.h>
 
 char* read_file(const char* filename) {
     FILE *f = fopen(filename, "rb");
@@ -18,6 +22,35 @@ char* read_file(const char* filename) {
     return string;
 }
 
+static _Thread_local sigjmp_buf* recovery_point = NULL;
+
 void error_die() {
+    if (recovery_point)
+        siglongjmp(*recovery_point, 1);
     abort();
 }
+
+/// assert() ends up in abort(), which leaves the process only if this returns
+static void recover_from_abort(int sig) {
+    (void) sig;
+    if (recovery_point)
+        siglongjmp(*recovery_point, 1);
+}
+
+bool run_recoverable(void (*fn)(void*), void* arg) {
+    struct sigaction action = { .sa_handler = recover_from_abort };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGABRT, &action, NULL);
+
+    sigjmp_buf here;
+    sigjmp_buf* outer = recovery_point;
+    recovery_point = &here;
+    // the signal mask is saved too, SIGABRT is blocked while its handler runs
+    if (sigsetjmp(here, 1)) {
+        recovery_point = outer;
+        return false;
+    }
+    fn(arg);
+    recovery_point = outer;
+    return true;
+}
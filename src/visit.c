@@ -8,7 +8,9 @@
 
 static void visit_nodes(Visitor* visitor, Nodes nodes) {
     for (size_t i = 0; i < nodes.count; i++) {
-        visitor->visit_fn(visitor, nodes.nodes[i]);
+        // operands can be left out, for instance the offset of a lea
+        if (nodes.nodes[i])
+            visitor->visit_fn(visitor, nodes.nodes[i]);
     }
 }
 
@@ -123,6 +125,7 @@ void visit_children(Visitor* visitor, const Node* node) {
             visit_nodes(visitor, node->payload.branch.args);
             break;
         }
+        case Unreachable_TAG: break;
         case MergeConstruct_TAG: {
             visit_nodes(visitor, node->payload.merge_construct.args);
             break;
@@ -135,6 +138,53 @@ void visit_children(Visitor* visitor, const Node* node) {
             visit_nodes(visitor, node->payload.callc.args);
             break;
         }
+        case GlobalVariable_TAG: {
+            visit(node->payload.global_variable.type);
+            visit(node->payload.global_variable.init);
+            break;
+        }
+        case Tuple_TAG: {
+            visit_nodes(visitor, node->payload.tuple.contents);
+            break;
+        }
+        case FnAddr_TAG: {
+            visit(node->payload.fn_addr.fn);
+            break;
+        }
+        case Variable_TAG:
+        case Unbound_TAG:
+        case UntypedNumber_TAG:
+        case IntLiteral_TAG:
+        case True_TAG:
+        case False_TAG: break;
+        case RecordType_TAG: {
+            visit_nodes(visitor, node->payload.record_type.members);
+            break;
+        }
+        case FnType_TAG: {
+            visit_nodes(visitor, node->payload.fn_type.param_types);
+            visit_nodes(visitor, node->payload.fn_type.return_types);
+            break;
+        }
+        case PtrType_TAG: {
+            visit(node->payload.ptr_type.pointed_type);
+            break;
+        }
+        case QualifiedType_TAG: {
+            visit(node->payload.qualified_type.type);
+            break;
+        }
+        case ArrType_TAG: {
+            visit(node->payload.arr_type.element_type);
+            visit(node->payload.arr_type.size);
+            break;
+        }
+        case MaskType_TAG:
+        case NoRet_TAG:
+        case Unit_TAG:
+        case Int_TAG:
+        case Float_TAG:
+        case Bool_TAG: break;
         default: error("implement me");
     }
 }